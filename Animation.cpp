@@ -0,0 +1,283 @@
+#include "stdafx.h"
+#include "Animation.h"
+#include "ImageLoader.h"
+#include "Trace.h"
+#include <algorithm>
+#include <cstring>
+
+namespace DIVE
+{
+	static const size_t kRingBudget = 256 << 20;		// bytes of decoded frames kept ahead
+	static const UINT kGifDefaultDelay = 100;			// ms, for frames that ask for 0 or 10 ms, as browsers do
+
+	static UINT ReadMetadataUInt(IWICMetadataQueryReader* pReader, const wchar_t* wszName, UINT nDefault)
+	{
+		UINT nValue = nDefault;
+		PROPVARIANT value;
+		PropVariantInit(&value);
+		if (pReader && SUCCEEDED(pReader->GetMetadataByName(wszName, &value)))
+		{
+			if (value.vt == VT_UI1)
+				nValue = value.bVal;
+			else if (value.vt == VT_UI2)
+				nValue = value.uiVal;
+			else if (value.vt == VT_UI4)
+				nValue = value.ulVal;
+		}
+		PropVariantClear(&value);
+		return nValue;
+	}
+
+	// Premultiplied source-over of a frame onto the canvas, clipped to it
+	static void Blend(const BYTE* pFrame, UINT nFrameWidth, UINT nFrameHeight, BYTE* pCanvas, UINT nWidth, UINT nHeight, UINT nLeft, UINT nTop)
+	{
+		UINT nRight = std::min(nWidth, nLeft + nFrameWidth);
+		UINT nBottom = std::min(nHeight, nTop + nFrameHeight);
+		for (UINT y = nTop; y < nBottom; ++y)
+		{
+			const BYTE* pIn = pFrame + static_cast<size_t>(y - nTop) * nFrameWidth * 4;
+			BYTE* pOut = pCanvas + (static_cast<size_t>(y) * nWidth + nLeft) * 4;
+			for (UINT x = nLeft; x < nRight; ++x, pIn += 4, pOut += 4)
+			{
+				UINT nInverse = 255 - pIn[3];
+				if (nInverse == 255)
+					continue;
+				for (int c = 0; c < 4; ++c)
+					pOut[c] = static_cast<BYTE>(pIn[c] + (pOut[c] * nInverse + 127) / 255);
+			}
+		}
+	}
+
+	static void Clear(BYTE* pCanvas, UINT nWidth, UINT nHeight, const RECT& rc)
+	{
+		UINT nRight = std::min<UINT>(nWidth, rc.right);
+		UINT nBottom = std::min<UINT>(nHeight, rc.bottom);
+		for (UINT y = rc.top; y < nBottom && static_cast<UINT>(rc.left) < nRight; ++y)
+			memset(pCanvas + (static_cast<size_t>(y) * nWidth + rc.left) * 4, 0, (nRight - rc.left) * 4);
+	}
+
+	Animation::Animation()
+		: m_nSlots(8)
+		, m_bStop(false)
+		, m_nFrames(0)
+		, m_bTimed(false)
+		, m_nDecodeMicros(0)
+	{
+		wchar_t wszValue[32];
+		if (GetEnvironmentVariableW(L"DIVE_FRAME_RING", wszValue, 32) && _wtoi(wszValue) > 1)
+			m_nSlots = _wtoi(wszValue);
+	}
+
+	Animation::~Animation()
+	{
+		Stop();
+	}
+
+	bool Animation::MayHaveFrames(const wchar_t* wszFileName)
+	{
+		static const wchar_t* const s_extensions[] = { L".gif", L".tif", L".tiff", L".ico" };
+
+		const wchar_t* wszExtension = wcsrchr(wszFileName, L'.');
+		if (!wszExtension)
+			return false;
+		for (const wchar_t* wszKnown : s_extensions)
+		{
+			if (_wcsicmp(wszExtension, wszKnown) == 0)
+				return true;
+		}
+		return false;
+	}
+
+	void Animation::Start(const std::wstring& strFileName, UINT nFirstFrame)
+	{
+		Stop();
+
+		m_ring.Reset(m_nSlots);
+		m_bStop = false;
+		m_nFrames = 0;
+		m_bTimed = false;
+		m_thread = std::thread(&Animation::Run, this, strFileName, nFirstFrame);
+	}
+
+	void Animation::Stop()
+	{
+		if (!m_thread.joinable())
+			return;
+
+		// The worker checks between strips of a frame, so this waits for one strip at most
+		m_bStop = true;
+		m_ring.Stop();
+		m_thread.join();
+	}
+
+	bool Animation::IsStopping(const void* pContext)
+	{
+		return static_cast<const Animation*>(pContext)->m_bStop;
+	}
+
+	void Animation::Run(const std::wstring& strFileName, UINT nFirstFrame)
+	{
+		DIVE_TRACE_THREAD("Animation");
+		CoInitializeEx(NULL, COINIT_MULTITHREADED);
+		{
+			ImageLoader loader;
+			CComPtr<IWICBitmapDecoder> pDecoder;
+			GUID guidContainer = GUID_NULL;
+			UINT nFrames = 0;
+
+			HRESULT hr = loader.OpenFrames(strFileName.c_str(), &pDecoder);
+			if (SUCCEEDED(hr))
+				hr = pDecoder->GetFrameCount(&nFrames);
+			if (SUCCEEDED(hr))
+				hr = pDecoder->GetContainerFormat(&guidContainer);
+
+			if (SUCCEEDED(hr) && nFrames > 1)
+			{
+				m_bTimed = guidContainer == GUID_ContainerFormatGif;
+				m_nFrames = nFrames;
+				if (m_bTimed)
+					DecodeGif(loader, pDecoder, nFrames, std::min(nFirstFrame, nFrames - 1));
+				else
+					DecodePages(loader, pDecoder, nFrames, std::min(nFirstFrame, nFrames - 1));
+			}
+			else
+			{
+				m_nFrames = 1;
+			}
+		}
+		CoUninitialize();
+	}
+
+	void Animation::LimitRing(size_t cbFrame)
+	{
+		m_ring.Limit(std::max<size_t>(2, kRingBudget / std::max<size_t>(1, cbFrame)));
+	}
+
+	void Animation::RecordDecode(std::chrono::steady_clock::time_point tStart)
+	{
+		int nMicros = static_cast<int>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tStart).count());
+		m_nDecodeMicros = m_nDecodeMicros ? (m_nDecodeMicros * 7 + nMicros) / 8 : nMicros;
+		DIVE_TRACE_COUNTER("Frame Decode ms", nMicros / 1000.0);
+		DIVE_TRACE_COUNTER("Frames Ready", m_ring.Ready());
+	}
+
+	// Pages stand alone: each is decoded straight into its slot, once, and the worker stops
+	// after the last one
+	void Animation::DecodePages(ImageLoader& loader, IWICBitmapDecoder* pDecoder, UINT nFrames, UINT nFirstFrame)
+	{
+		CancelToken cancel(IsStopping, this);
+		for (UINT nFrame = nFirstFrame; nFrame < nFrames && !m_bStop; ++nFrame)
+		{
+			uint64_t nSequence;
+			Frame* pFrame;
+			if (!m_ring.Claim(nSequence, pFrame))
+				return;
+
+			auto tStart = std::chrono::steady_clock::now();
+			CComPtr<IWICBitmapFrameDecode> pPage;
+			UINT nWidth = 0, nHeight = 0;
+			HRESULT hr = pDecoder->GetFrame(nFrame, &pPage);
+			if (SUCCEEDED(hr))
+				hr = pPage->GetSize(&nWidth, &nHeight);
+			if (SUCCEEDED(hr))
+			{
+				if (nFrame == nFirstFrame)
+					LimitRing(static_cast<size_t>(nWidth) * nHeight * 4);
+				if (pFrame->pixels.size() < static_cast<size_t>(nWidth) * nHeight * 4)
+					pFrame->pixels.resize(static_cast<size_t>(nWidth) * nHeight * 4);
+				hr = loader.CopyFrame(pPage, pFrame->pixels.data(), cancel);
+			}
+			pFrame->nFrame = nFrame;
+			pFrame->nWidth = SUCCEEDED(hr) ? nWidth : 0;
+			pFrame->nHeight = SUCCEEDED(hr) ? nHeight : 0;
+			pFrame->delay = std::chrono::milliseconds(0);
+			RecordDecode(tStart);
+			m_ring.Fill(nSequence);
+		}
+	}
+
+	// GIF frames are patches over the previous picture, so they are composed in order onto
+	// a canvas of the logical screen size, honouring each frame's disposal, and the whole
+	// canvas goes into the ring. Playback loops, which keeps the worker running until stopped.
+	void Animation::DecodeGif(ImageLoader& loader, IWICBitmapDecoder* pDecoder, UINT nFrames, UINT nFirstFrame)
+	{
+		CComPtr<IWICMetadataQueryReader> pGlobal;
+		pDecoder->GetMetadataQueryReader(&pGlobal);
+		UINT nWidth = ReadMetadataUInt(pGlobal, L"/logscrdesc/Width", 0);
+		UINT nHeight = ReadMetadataUInt(pGlobal, L"/logscrdesc/Height", 0);
+		if (!nWidth || !nHeight)
+		{
+			CComPtr<IWICBitmapFrameDecode> pFirst;
+			if (FAILED(pDecoder->GetFrame(0, &pFirst)) || FAILED(pFirst->GetSize(&nWidth, &nHeight)))
+				return;
+		}
+		LimitRing(static_cast<size_t>(nWidth) * nHeight * 4);
+
+		CancelToken cancel(IsStopping, this);
+		std::vector<BYTE> vecCanvas(static_cast<size_t>(nWidth) * nHeight * 4);
+		std::vector<BYTE> vecSaved;
+		std::vector<BYTE> vecPatch;
+		RECT rcPrevious = {};
+		UINT nPreviousDisposal = 0;
+		bool bEmit = nFirstFrame == 0;
+
+		for (UINT nFrame = 0; !m_bStop; nFrame = (nFrame + 1) % nFrames)
+		{
+			auto tStart = std::chrono::steady_clock::now();
+
+			// Disposal of the frame before: 2 clears its rectangle, 3 restores what was under it
+			if (nFrame == 0)
+				std::fill(vecCanvas.begin(), vecCanvas.end(), static_cast<BYTE>(0));
+			else if (nPreviousDisposal == 2)
+				Clear(vecCanvas.data(), nWidth, nHeight, rcPrevious);
+			else if (nPreviousDisposal == 3 && vecSaved.size() == vecCanvas.size())
+				vecCanvas.swap(vecSaved);
+
+			CComPtr<IWICBitmapFrameDecode> pPatch;
+			CComPtr<IWICMetadataQueryReader> pReader;
+			UINT nPatchWidth = 0, nPatchHeight = 0;
+			HRESULT hr = pDecoder->GetFrame(nFrame, &pPatch);
+			if (SUCCEEDED(hr))
+				hr = pPatch->GetSize(&nPatchWidth, &nPatchHeight);
+			if (SUCCEEDED(hr))
+				pPatch->GetMetadataQueryReader(&pReader);
+
+			UINT nLeft = ReadMetadataUInt(pReader, L"/imgdesc/Left", 0);
+			UINT nTop = ReadMetadataUInt(pReader, L"/imgdesc/Top", 0);
+			UINT nDisposal = ReadMetadataUInt(pReader, L"/grctlext/Disposal", 0);
+			UINT nDelay = ReadMetadataUInt(pReader, L"/grctlext/Delay", 0) * 10;
+
+			if (SUCCEEDED(hr))
+			{
+				vecPatch.resize(static_cast<size_t>(nPatchWidth) * nPatchHeight * 4);
+				hr = loader.CopyFrame(pPatch, vecPatch.data(), cancel);
+			}
+			if (SUCCEEDED(hr))
+			{
+				if (nDisposal == 3)
+					vecSaved = vecCanvas;
+				Blend(vecPatch.data(), nPatchWidth, nPatchHeight, vecCanvas.data(), nWidth, nHeight, nLeft, nTop);
+			}
+			rcPrevious = RECT{ static_cast<LONG>(nLeft), static_cast<LONG>(nTop), static_cast<LONG>(nLeft + nPatchWidth), static_cast<LONG>(nTop + nPatchHeight) };
+			nPreviousDisposal = SUCCEEDED(hr) ? nDisposal : 0;
+			RecordDecode(tStart);
+
+			// Frames before the first one asked for only build up the canvas
+			bEmit = bEmit || nFrame == nFirstFrame;
+			if (!bEmit)
+				continue;
+
+			uint64_t nSequence;
+			Frame* pFrame;
+			if (!m_ring.Claim(nSequence, pFrame))
+				return;
+			if (SUCCEEDED(hr))
+				pFrame->pixels.assign(vecCanvas.begin(), vecCanvas.end());
+			pFrame->nFrame = nFrame;
+			pFrame->nWidth = SUCCEEDED(hr) ? nWidth : 0;
+			pFrame->nHeight = SUCCEEDED(hr) ? nHeight : 0;
+			pFrame->delay = std::chrono::milliseconds(nDelay > 10 ? nDelay : kGifDefaultDelay);
+			m_ring.Fill(nSequence);
+		}
+	}
+}
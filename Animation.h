@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include "FrameRing.h"
+
+namespace DIVE
+{
+	class ImageLoader;
+
+	// Decodes the frames of an animated GIF or a multi-page TIFF/ICO ahead of display on a
+	// worker thread. GIF frames are composed onto the logical screen and loop with their own
+	// delays; pages are independent and untimed. The worker stays at most a ring's worth of
+	// frames ahead of the viewer, so a long animation costs a fixed amount of memory.
+	class Animation
+	{
+	public:
+		Animation();
+		~Animation();
+
+		// Extensions whose containers can hold more than one frame
+		static bool MayHaveFrames(const wchar_t* szFileName);
+
+		// Restarts decoding at nFirstFrame; frames before it in a GIF are still composed
+		void Start(const std::wstring& strFileName, UINT nFirstFrame);
+		void Stop();
+
+		bool IsRunning() const { return m_thread.joinable(); }
+		UINT Frames() const { return m_nFrames; }		// 0 until the file has been opened
+		bool IsTimed() const { return m_bTimed; }
+		int DecodeMicros() const { return m_nDecodeMicros; }
+		FrameRing& Ring() { return m_ring; }
+
+	private:
+		void Run(const std::wstring& strFileName, UINT nFirstFrame);
+		void DecodePages(ImageLoader& loader, IWICBitmapDecoder* pDecoder, UINT nFrames, UINT nFirstFrame);
+		void DecodeGif(ImageLoader& loader, IWICBitmapDecoder* pDecoder, UINT nFrames, UINT nFirstFrame);
+		void LimitRing(size_t cbFrame);
+		void RecordDecode(std::chrono::steady_clock::time_point tStart);
+		static bool IsStopping(const void* pContext);
+
+		std::thread m_thread;
+		FrameRing m_ring;
+		size_t m_nSlots;
+		std::atomic<bool> m_bStop;
+		std::atomic<UINT> m_nFrames;
+		std::atomic<bool> m_bTimed;
+		std::atomic<int> m_nDecodeMicros;		// moving average per frame
+	};
+}
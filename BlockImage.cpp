@@ -0,0 +1,871 @@
+#include "stdafx.h"
+#include "BlockImage.h"
+#include "ImageLoader.h"
+#include <tmmintrin.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+namespace DIVE
+{
+	UINT BlockBytes(DXGI_FORMAT format)
+	{
+		switch (format)
+		{
+		case DXGI_FORMAT_BC1_TYPELESS:
+		case DXGI_FORMAT_BC1_UNORM:
+		case DXGI_FORMAT_BC1_UNORM_SRGB:
+		case DXGI_FORMAT_BC4_TYPELESS:
+		case DXGI_FORMAT_BC4_UNORM:
+		case DXGI_FORMAT_BC4_SNORM:
+			return 8;
+
+		case DXGI_FORMAT_BC2_TYPELESS:
+		case DXGI_FORMAT_BC2_UNORM:
+		case DXGI_FORMAT_BC2_UNORM_SRGB:
+		case DXGI_FORMAT_BC3_TYPELESS:
+		case DXGI_FORMAT_BC3_UNORM:
+		case DXGI_FORMAT_BC3_UNORM_SRGB:
+		case DXGI_FORMAT_BC5_TYPELESS:
+		case DXGI_FORMAT_BC5_UNORM:
+		case DXGI_FORMAT_BC5_SNORM:
+		case DXGI_FORMAT_BC6H_TYPELESS:
+		case DXGI_FORMAT_BC6H_UF16:
+		case DXGI_FORMAT_BC6H_SF16:
+		case DXGI_FORMAT_BC7_TYPELESS:
+		case DXGI_FORMAT_BC7_UNORM:
+		case DXGI_FORMAT_BC7_UNORM_SRGB:
+			return 16;
+
+		default:
+			return 0;
+		}
+	}
+
+	// pshufb controls that expand one row of four 2-bit palette indices into four BGRA pixels
+	struct RowMasks
+	{
+		__m128i masks[256];
+
+		RowMasks()
+		{
+			for (int i = 0; i < 256; ++i)
+			{
+				alignas(16) BYTE control[16];
+				for (int x = 0; x < 4; ++x)
+				{
+					for (int c = 0; c < 4; ++c)
+						control[x * 4 + c] = static_cast<BYTE>(((i >> (x * 2)) & 3) * 4 + c);
+				}
+				masks[i] = _mm_load_si128(reinterpret_cast<const __m128i*>(control));
+			}
+		}
+	};
+
+	static const RowMasks& GetRowMasks()
+	{
+		static const RowMasks s_masks;
+		return s_masks;
+	}
+
+	// BC1 colour block into 16 BGRA pixels. The four-entry palette is built in one register
+	// and every row of the block is a single shuffle from it.
+	static void DecodeColorBlock(const BYTE* pBlock, uint32_t* pTile, bool bFourColor)
+	{
+		uint32_t c0 = pBlock[0] | (pBlock[1] << 8);
+		uint32_t c1 = pBlock[2] | (pBlock[3] << 8);
+
+		short b0 = static_cast<short>(((c0 & 0x1f) << 3) | ((c0 & 0x1f) >> 2));
+		short g0 = static_cast<short>((((c0 >> 5) & 0x3f) << 2) | (((c0 >> 5) & 0x3f) >> 4));
+		short r0 = static_cast<short>(((c0 >> 11) << 3) | ((c0 >> 11) >> 2));
+		short b1 = static_cast<short>(((c1 & 0x1f) << 3) | ((c1 & 0x1f) >> 2));
+		short g1 = static_cast<short>((((c1 >> 5) & 0x3f) << 2) | (((c1 >> 5) & 0x3f) >> 4));
+		short r1 = static_cast<short>(((c1 >> 11) << 3) | ((c1 >> 11) >> 2));
+
+		__m128i v01 = _mm_setr_epi16(b0, g0, r0, 255, b1, g1, r1, 255);
+		__m128i v10 = _mm_setr_epi16(b1, g1, r1, 255, b0, g0, r0, 255);
+		__m128i v23;
+
+		if (bFourColor || c0 > c1)
+		{
+			// (2 * a + b + 1) / 3; the multiply-high by 21846 is exact for the 0..766 range
+			__m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_add_epi16(v01, v01), v10), _mm_set1_epi16(1));
+			v23 = _mm_mulhi_epu16(sum, _mm_set1_epi16(21846));
+		}
+		else
+		{
+			// Three colours plus transparent black
+			__m128i avg = _mm_srli_epi16(_mm_add_epi16(v01, v10), 1);
+			v23 = _mm_unpacklo_epi64(avg, _mm_setzero_si128());
+		}
+
+		__m128i palette = _mm_packus_epi16(v01, v23);
+
+		const RowMasks& rows = GetRowMasks();
+		uint32_t nIndices = pBlock[4] | (pBlock[5] << 8) | (pBlock[6] << 16) | (static_cast<uint32_t>(pBlock[7]) << 24);
+		for (int y = 0; y < 4; ++y)
+		{
+			__m128i row = _mm_shuffle_epi8(palette, rows.masks[(nIndices >> (y * 8)) & 0xff]);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(pTile + y * 4), row);
+		}
+	}
+
+	// BC3 alpha / BC4 / BC5 channel block: two endpoints and 3-bit indices
+	static void DecodeChannelBlock(const BYTE* pBlock, BYTE* pValues)
+	{
+		UINT a0 = pBlock[0];
+		UINT a1 = pBlock[1];
+
+		BYTE palette[8];
+		palette[0] = static_cast<BYTE>(a0);
+		palette[1] = static_cast<BYTE>(a1);
+		if (a0 > a1)
+		{
+			for (UINT i = 1; i < 7; ++i)
+				palette[i + 1] = static_cast<BYTE>(((7 - i) * a0 + i * a1 + 3) / 7);
+		}
+		else
+		{
+			for (UINT i = 1; i < 5; ++i)
+				palette[i + 1] = static_cast<BYTE>(((5 - i) * a0 + i * a1 + 2) / 5);
+			palette[6] = 0;
+			palette[7] = 255;
+		}
+
+		uint64_t ullIndices = 0;
+		for (int i = 0; i < 6; ++i)
+			ullIndices |= static_cast<uint64_t>(pBlock[2 + i]) << (i * 8);
+		for (int i = 0; i < 16; ++i)
+			pValues[i] = palette[(ullIndices >> (i * 3)) & 7];
+	}
+
+	static void SetAlpha(uint32_t* pTile, const BYTE* pAlpha)
+	{
+		for (int i = 0; i < 16; ++i)
+			pTile[i] = (pTile[i] & 0x00ffffff) | (static_cast<uint32_t>(pAlpha[i]) << 24);
+	}
+
+	// BC7 (see the D3D11 functional specification, "BC7 Format")
+	struct BC7Mode
+	{
+		BYTE nSubsets;
+		BYTE nPartitionBits;
+		BYTE nRotationBits;
+		BYTE nIndexSelectionBits;
+		BYTE nColorBits;
+		BYTE nAlphaBits;
+		BYTE nEndpointPBits;
+		BYTE nSharedPBits;
+		BYTE nIndexBits;
+		BYTE nIndexBits2;
+	};
+
+	static const BC7Mode s_bc7Modes[8] =
+	{
+		{ 3, 4, 0, 0, 4, 0, 1, 0, 3, 0 },
+		{ 2, 6, 0, 0, 6, 0, 0, 1, 3, 0 },
+		{ 3, 6, 0, 0, 5, 0, 0, 0, 2, 0 },
+		{ 2, 6, 0, 0, 7, 0, 1, 0, 2, 0 },
+		{ 1, 0, 2, 1, 5, 6, 0, 0, 2, 3 },
+		{ 1, 0, 2, 0, 7, 8, 0, 0, 2, 2 },
+		{ 1, 0, 0, 0, 7, 7, 1, 0, 4, 0 },
+		{ 2, 6, 0, 0, 5, 5, 1, 0, 2, 0 },
+	};
+
+	// Bit i set: pixel i belongs to the second subset
+	static const uint16_t s_partitions2[64] =
+	{
+		0xcccc, 0x8888, 0xeeee, 0xecc8, 0xc880, 0xfeec, 0xfec8, 0xec80,
+		0xc800, 0xffec, 0xfe80, 0xe800, 0xffe8, 0xff00, 0xfff0, 0xf000,
+		0xf710, 0x008e, 0x7100, 0x08ce, 0x008c, 0x7310, 0x3100, 0x8cce,
+		0x088c, 0x3110, 0x6666, 0x366c, 0x17e8, 0x0ff0, 0x718e, 0x399c,
+		0xaaaa, 0xf0f0, 0x5a5a, 0x33cc, 0x3c3c, 0x55aa, 0x9696, 0xa55a,
+		0x73ce, 0x13c8, 0x324c, 0x3bdc, 0x6996, 0xc33c, 0x9966, 0x0660,
+		0x0272, 0x04e4, 0x4e40, 0x2720, 0xc936, 0x936c, 0x39c6, 0x639c,
+		0x9336, 0x9cc6, 0x817e, 0xe718, 0xccf0, 0x0fcc, 0x7744, 0xee22,
+	};
+
+	static const BYTE s_partitions3[64][16] =
+	{
+		{ 0,0,1,1, 0,0,1,1, 0,2,2,1, 2,2,2,2 }, { 0,0,0,1, 0,0,1,1, 2,2,1,1, 2,2,2,1 },
+		{ 0,0,0,0, 2,0,0,1, 2,2,1,1, 2,2,1,1 }, { 0,2,2,2, 0,0,2,2, 0,0,1,1, 0,1,1,1 },
+		{ 0,0,0,0, 0,0,0,0, 1,1,2,2, 1,1,2,2 }, { 0,0,1,1, 0,0,1,1, 0,0,2,2, 0,0,2,2 },
+		{ 0,0,2,2, 0,0,2,2, 1,1,1,1, 1,1,1,1 }, { 0,0,1,1, 0,0,1,1, 2,2,1,1, 2,2,1,1 },
+		{ 0,0,0,0, 0,0,0,0, 1,1,1,1, 2,2,2,2 }, { 0,0,0,0, 1,1,1,1, 1,1,1,1, 2,2,2,2 },
+		{ 0,0,0,0, 1,1,1,1, 2,2,2,2, 2,2,2,2 }, { 0,0,1,2, 0,0,1,2, 0,0,1,2, 0,0,1,2 },
+		{ 0,1,1,2, 0,1,1,2, 0,1,1,2, 0,1,1,2 }, { 0,1,2,2, 0,1,2,2, 0,1,2,2, 0,1,2,2 },
+		{ 0,0,1,1, 0,1,1,2, 1,1,2,2, 1,2,2,2 }, { 0,0,1,1, 2,0,0,1, 2,2,0,0, 2,2,2,0 },
+		{ 0,0,0,1, 0,0,1,1, 0,1,1,2, 1,1,2,2 }, { 0,1,1,1, 0,0,1,1, 2,0,0,1, 2,2,0,0 },
+		{ 0,0,0,0, 1,1,2,2, 1,1,2,2, 1,1,2,2 }, { 0,0,2,2, 0,0,2,2, 0,0,2,2, 1,1,1,1 },
+		{ 0,1,1,1, 0,1,1,1, 0,2,2,2, 0,2,2,2 }, { 0,0,0,1, 0,0,0,1, 2,2,2,1, 2,2,2,1 },
+		{ 0,0,0,0, 0,0,1,1, 0,1,2,2, 0,1,2,2 }, { 0,0,0,0, 1,1,0,0, 2,2,1,0, 2,2,1,0 },
+		{ 0,1,2,2, 0,1,2,2, 0,0,1,1, 0,0,0,0 }, { 0,0,1,2, 0,0,1,2, 1,1,2,2, 2,2,2,2 },
+		{ 0,1,1,0, 1,2,2,1, 1,2,2,1, 0,1,1,0 }, { 0,0,0,0, 0,1,1,0, 1,2,2,1, 1,2,2,1 },
+		{ 0,0,2,2, 1,1,0,2, 1,1,0,2, 0,0,2,2 }, { 0,1,1,0, 0,1,1,0, 2,0,0,2, 2,2,2,2 },
+		{ 0,0,1,1, 0,1,2,2, 0,1,2,2, 0,0,1,1 }, { 0,0,0,0, 2,0,0,0, 2,2,1,1, 2,2,2,1 },
+		{ 0,0,0,0, 0,0,0,2, 1,1,2,2, 1,2,2,2 }, { 0,2,2,2, 0,0,2,2, 0,0,1,2, 0,0,1,1 },
+		{ 0,0,1,1, 0,0,1,2, 0,0,2,2, 0,2,2,2 }, { 0,1,2,0, 0,1,2,0, 0,1,2,0, 0,1,2,0 },
+		{ 0,0,0,0, 1,1,1,1, 2,2,2,2, 0,0,0,0 }, { 0,1,2,0, 1,2,0,1, 2,0,1,2, 0,1,2,0 },
+		{ 0,1,2,0, 2,0,1,2, 1,2,0,1, 0,1,2,0 }, { 0,0,1,1, 2,2,0,0, 1,1,2,2, 0,0,1,1 },
+		{ 0,0,1,1, 1,1,2,2, 2,2,0,0, 0,0,1,1 }, { 0,1,0,1, 0,1,0,1, 2,2,2,2, 2,2,2,2 },
+		{ 0,0,0,0, 0,0,0,0, 2,1,2,1, 2,1,2,1 }, { 0,0,2,2, 1,1,2,2, 0,0,2,2, 1,1,2,2 },
+		{ 0,0,2,2, 0,0,1,1, 0,0,2,2, 0,0,1,1 }, { 0,2,2,0, 1,2,2,1, 0,2,2,0, 1,2,2,1 },
+		{ 0,1,0,1, 2,2,2,2, 2,2,2,2, 0,1,0,1 }, { 0,0,0,0, 2,1,2,1, 2,1,2,1, 2,1,2,1 },
+		{ 0,1,0,1, 0,1,0,1, 0,1,0,1, 2,2,2,2 }, { 0,2,2,2, 0,1,1,1, 0,2,2,2, 0,1,1,1 },
+		{ 0,0,0,2, 1,1,1,2, 0,0,0,2, 1,1,1,2 }, { 0,0,0,0, 2,1,1,2, 2,1,1,2, 2,1,1,2 },
+		{ 0,2,2,2, 0,1,1,1, 0,1,1,1, 0,2,2,2 }, { 0,0,0,2, 1,1,1,2, 1,1,1,2, 0,0,0,2 },
+		{ 0,1,1,0, 0,1,1,0, 0,1,1,0, 2,2,2,2 }, { 0,0,0,0, 0,0,0,0, 2,1,1,2, 2,1,1,2 },
+		{ 0,1,1,0, 0,1,1,0, 2,2,2,2, 2,2,2,2 }, { 0,0,2,2, 0,0,1,1, 0,0,1,1, 0,0,2,2 },
+		{ 0,0,2,2, 1,1,2,2, 1,1,2,2, 0,0,2,2 }, { 0,0,0,0, 0,0,0,0, 0,0,0,0, 2,1,1,2 },
+		{ 0,0,0,2, 0,0,0,1, 0,0,0,2, 0,0,0,1 }, { 0,2,2,2, 1,2,2,2, 0,2,2,2, 1,2,2,2 },
+		{ 0,1,0,1, 2,2,2,2, 2,2,2,2, 2,2,2,2 }, { 0,1,1,1, 2,0,1,1, 2,2,0,1, 2,2,2,0 },
+	};
+
+	static const BYTE s_anchors2[64] =
+	{
+		15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15,
+		15, 2, 8, 2, 2, 8, 8,15,  2, 8, 2, 2, 8, 8, 2, 2,
+		15,15, 6, 8, 2, 8,15,15,  2, 8, 2, 2, 2,15,15, 6,
+		 6, 2, 6, 8,15,15, 2, 2, 15,15,15,15,15, 2, 2,15,
+	};
+
+	static const BYTE s_anchors3a[64] =
+	{
+		 3, 3,15,15, 8, 3,15,15,  8, 8, 6, 6, 6, 5, 3, 3,
+		 3, 3, 8,15, 3, 3, 6,10,  5, 8, 8, 6, 8, 5,15,15,
+		 8,15, 3, 5, 6,10, 8,15, 15, 3,15, 5,15,15,15,15,
+		 3,15, 5, 5, 5, 8, 5,10,  5,10, 8,13,15,12, 3, 3,
+	};
+
+	static const BYTE s_anchors3b[64] =
+	{
+		15, 8, 8, 3,15,15, 3, 8, 15,15,15,15,15,15,15, 8,
+		15, 8,15, 3,15, 8,15, 8,  3,15, 6,10,15,15,10, 8,
+		15, 3,15,10,10, 8, 9,10,  6,15, 8,15, 3, 6, 6, 8,
+		15, 3,15,15,15,15,15,15, 15,15,15,15, 3,15,15, 8,
+	};
+
+	static const BYTE s_weights2[4] = { 0, 21, 43, 64 };
+	static const BYTE s_weights3[8] = { 0, 9, 18, 27, 37, 46, 55, 64 };
+	static const BYTE s_weights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+	class BitReader
+	{
+	public:
+		BitReader(const BYTE* pData, UINT nPos)
+			: m_pData(pData)
+			, m_nPos(nPos)
+		{
+		}
+
+		UINT Read(UINT nBits)
+		{
+			UINT nValue = 0;
+			for (UINT i = 0; i < nBits; ++i, ++m_nPos)
+				nValue |= ((m_pData[m_nPos >> 3] >> (m_nPos & 7)) & 1u) << i;
+			return nValue;
+		}
+
+	private:
+		const BYTE* m_pData;
+		UINT m_nPos;
+	};
+
+	static BYTE Interpolate(UINT e0, UINT e1, UINT nIndex, UINT nIndexBits)
+	{
+		const BYTE* pWeights = nIndexBits == 2 ? s_weights2 : nIndexBits == 3 ? s_weights3 : s_weights4;
+		UINT w = pWeights[nIndex];
+		return static_cast<BYTE>((e0 * (64 - w) + e1 * w + 32) >> 6);
+	}
+
+	static void DecodeBC7Block(const BYTE* pBlock, uint32_t* pTile)
+	{
+		UINT nMode = 0;
+		while (nMode < 8 && !(pBlock[0] & (1 << nMode)))
+			++nMode;
+		if (nMode == 8)
+		{
+			// Reserved mode: transparent black
+			std::fill(pTile, pTile + 16, 0u);
+			return;
+		}
+
+		const BC7Mode& mode = s_bc7Modes[nMode];
+		BitReader bits(pBlock, nMode + 1);
+
+		UINT nPartition = bits.Read(mode.nPartitionBits);
+		UINT nRotation = bits.Read(mode.nRotationBits);
+		UINT nIndexSelection = bits.Read(mode.nIndexSelectionBits);
+
+		UINT nEndpoints = mode.nSubsets * 2;
+		UINT endpoints[6][4];
+
+		for (UINT c = 0; c < 3; ++c)
+		{
+			for (UINT e = 0; e < nEndpoints; ++e)
+				endpoints[e][c] = bits.Read(mode.nColorBits);
+		}
+		for (UINT e = 0; e < nEndpoints; ++e)
+			endpoints[e][3] = mode.nAlphaBits ? bits.Read(mode.nAlphaBits) : 255;
+
+		UINT nColorBits = mode.nColorBits;
+		UINT nAlphaBits = mode.nAlphaBits;
+		if (mode.nEndpointPBits || mode.nSharedPBits)
+		{
+			UINT pbits[6];
+			if (mode.nEndpointPBits)
+			{
+				for (UINT e = 0; e < nEndpoints; ++e)
+					pbits[e] = bits.Read(1);
+			}
+			else
+			{
+				for (UINT s = 0; s < mode.nSubsets; ++s)
+					pbits[s * 2] = pbits[s * 2 + 1] = bits.Read(1);
+			}
+
+			for (UINT e = 0; e < nEndpoints; ++e)
+			{
+				for (UINT c = 0; c < 3; ++c)
+					endpoints[e][c] = (endpoints[e][c] << 1) | pbits[e];
+				if (mode.nAlphaBits)
+					endpoints[e][3] = (endpoints[e][3] << 1) | pbits[e];
+			}
+			++nColorBits;
+			if (nAlphaBits)
+				++nAlphaBits;
+		}
+
+		// Widen to 8 bits by replicating the high bits into the low ones
+		for (UINT e = 0; e < nEndpoints; ++e)
+		{
+			for (UINT c = 0; c < 3; ++c)
+			{
+				UINT v = endpoints[e][c] << (8 - nColorBits);
+				endpoints[e][c] = v | (v >> nColorBits);
+			}
+			if (nAlphaBits)
+			{
+				UINT v = endpoints[e][3] << (8 - nAlphaBits);
+				endpoints[e][3] = v | (v >> nAlphaBits);
+			}
+		}
+
+		BYTE subsets[16];
+		BYTE anchor1 = 0;
+		BYTE anchor2 = 0;
+		for (UINT i = 0; i < 16; ++i)
+		{
+			if (mode.nSubsets == 2)
+				subsets[i] = (s_partitions2[nPartition] >> i) & 1;
+			else if (mode.nSubsets == 3)
+				subsets[i] = s_partitions3[nPartition][i];
+			else
+				subsets[i] = 0;
+		}
+		if (mode.nSubsets == 2)
+			anchor1 = s_anchors2[nPartition];
+		else if (mode.nSubsets == 3)
+		{
+			anchor1 = s_anchors3a[nPartition];
+			anchor2 = s_anchors3b[nPartition];
+		}
+
+		// The anchor index of every subset drops its (implicitly zero) top bit
+		BYTE indices[16];
+		for (UINT i = 0; i < 16; ++i)
+		{
+			bool bAnchor = i == 0 || (mode.nSubsets > 1 && i == anchor1) || (mode.nSubsets > 2 && i == anchor2);
+			indices[i] = static_cast<BYTE>(bits.Read(bAnchor ? mode.nIndexBits - 1 : mode.nIndexBits));
+		}
+
+		BYTE indices2[16];
+		if (mode.nIndexBits2)
+		{
+			for (UINT i = 0; i < 16; ++i)
+				indices2[i] = static_cast<BYTE>(bits.Read(i == 0 ? mode.nIndexBits2 - 1 : mode.nIndexBits2));
+		}
+
+		for (UINT i = 0; i < 16; ++i)
+		{
+			const UINT* e0 = endpoints[subsets[i] * 2];
+			const UINT* e1 = endpoints[subsets[i] * 2 + 1];
+
+			UINT nColorIndex = indices[i];
+			UINT nColorIndexBits = mode.nIndexBits;
+			UINT nAlphaIndex = indices[i];
+			UINT nAlphaIndexBits = mode.nIndexBits;
+			if (mode.nIndexBits2)
+			{
+				nAlphaIndex = indices2[i];
+				nAlphaIndexBits = mode.nIndexBits2;
+				if (nIndexSelection)
+				{
+					std::swap(nColorIndex, nAlphaIndex);
+					std::swap(nColorIndexBits, nAlphaIndexBits);
+				}
+			}
+
+			BYTE r = Interpolate(e0[0], e1[0], nColorIndex, nColorIndexBits);
+			BYTE g = Interpolate(e0[1], e1[1], nColorIndex, nColorIndexBits);
+			BYTE b = Interpolate(e0[2], e1[2], nColorIndex, nColorIndexBits);
+			BYTE a = Interpolate(e0[3], e1[3], nAlphaIndex, nAlphaIndexBits);
+
+			switch (nRotation)
+			{
+			case 1: std::swap(a, r); break;
+			case 2: std::swap(a, g); break;
+			case 3: std::swap(a, b); break;
+			}
+
+			pTile[i] = b | (g << 8) | (r << 16) | (static_cast<uint32_t>(a) << 24);
+		}
+	}
+
+	static bool DecodeBlock(DXGI_FORMAT format, const BYTE* pBlock, uint32_t* pTile)
+	{
+		BYTE values[16];
+		BYTE values2[16];
+
+		switch (format)
+		{
+		case DXGI_FORMAT_BC1_TYPELESS:
+		case DXGI_FORMAT_BC1_UNORM:
+		case DXGI_FORMAT_BC1_UNORM_SRGB:
+			DecodeColorBlock(pBlock, pTile, false);
+			return true;
+
+		case DXGI_FORMAT_BC2_TYPELESS:
+		case DXGI_FORMAT_BC2_UNORM:
+		case DXGI_FORMAT_BC2_UNORM_SRGB:
+			DecodeColorBlock(pBlock + 8, pTile, true);
+			for (int i = 0; i < 16; ++i)
+				values[i] = static_cast<BYTE>(((pBlock[i / 2] >> ((i & 1) * 4)) & 0xf) * 17);
+			SetAlpha(pTile, values);
+			return true;
+
+		case DXGI_FORMAT_BC3_TYPELESS:
+		case DXGI_FORMAT_BC3_UNORM:
+		case DXGI_FORMAT_BC3_UNORM_SRGB:
+			DecodeColorBlock(pBlock + 8, pTile, true);
+			DecodeChannelBlock(pBlock, values);
+			SetAlpha(pTile, values);
+			return true;
+
+		case DXGI_FORMAT_BC4_TYPELESS:
+		case DXGI_FORMAT_BC4_UNORM:
+			// Single channel: show it as grey
+			DecodeChannelBlock(pBlock, values);
+			for (int i = 0; i < 16; ++i)
+				pTile[i] = 0xff000000 | (values[i] * 0x010101u);
+			return true;
+
+		case DXGI_FORMAT_BC5_TYPELESS:
+		case DXGI_FORMAT_BC5_UNORM:
+			DecodeChannelBlock(pBlock, values);
+			DecodeChannelBlock(pBlock + 8, values2);
+			for (int i = 0; i < 16; ++i)
+				pTile[i] = 0xff000000 | (values[i] << 16) | (values2[i] << 8);
+			return true;
+
+		case DXGI_FORMAT_BC7_TYPELESS:
+		case DXGI_FORMAT_BC7_UNORM:
+		case DXGI_FORMAT_BC7_UNORM_SRGB:
+			DecodeBC7Block(pBlock, pTile);
+			return true;
+
+		default:
+			// Signed and HDR (BC6H) payloads have no meaningful 8-bit expansion here
+			return false;
+		}
+	}
+
+	bool DecodeBlocks(const BlockImage& image, BYTE* pDest, UINT nStride)
+	{
+		UINT nBlockBytes = BlockBytes(image.format);
+		if (!nBlockBytes)
+			return false;
+
+		UINT nBlocksWide = (image.nWidth + 3) / 4;
+		UINT nBlocksHigh = (image.nHeight + 3) / 4;
+		if (image.data.size() < static_cast<size_t>(image.nPitch) * nBlocksHigh || image.nPitch < nBlocksWide * nBlockBytes)
+			return false;
+
+		alignas(16) uint32_t tile[16];
+		for (UINT by = 0; by < nBlocksHigh; ++by)
+		{
+			const BYTE* pBlock = image.data.data() + static_cast<size_t>(by) * image.nPitch;
+			for (UINT bx = 0; bx < nBlocksWide; ++bx, pBlock += nBlockBytes)
+			{
+				if (!DecodeBlock(image.format, pBlock, tile))
+					return false;
+
+				UINT nRows = std::min(4u, image.nHeight - by * 4);
+				UINT nCols = std::min(4u, image.nWidth - bx * 4);
+				for (UINT y = 0; y < nRows; ++y)
+				{
+					uint32_t* pRow = reinterpret_cast<uint32_t*>(pDest + static_cast<size_t>(by * 4 + y) * nStride) + bx * 4;
+					for (UINT x = 0; x < nCols; ++x)
+					{
+						uint32_t c = tile[y * 4 + x];
+						uint32_t a = c >> 24;
+						if (a != 255 && !image.bPremultiplied)
+						{
+							uint32_t b = ((c & 0xff) * a + 127) / 255;
+							uint32_t g = (((c >> 8) & 0xff) * a + 127) / 255;
+							uint32_t r = (((c >> 16) & 0xff) * a + 127) / 255;
+							c = b | (g << 8) | (r << 16) | (a << 24);
+						}
+						pRow[x] = c;
+					}
+				}
+			}
+		}
+		return true;
+	}
+
+	// Encoder. A bounding-box fit per block (inset, with the diagonal picked from the
+	// colour covariance) is far from optimal but runs at memory speed, which is what a
+	// background cache pass needs; the error it leaves is reported to the caller.
+
+	static uint32_t Expand565(uint32_t c)
+	{
+		uint32_t b = ((c & 0x1f) << 3) | ((c & 0x1f) >> 2);
+		uint32_t g = (((c >> 5) & 0x3f) << 2) | (((c >> 5) & 0x3f) >> 4);
+		uint32_t r = ((c >> 11) << 3) | ((c >> 11) >> 2);
+		return b | (g << 8) | (r << 16);
+	}
+
+	static uint32_t Pack565(uint32_t c)
+	{
+		return ((c >> 8) & 0xf800) | ((c >> 5) & 0x07e0) | ((c >> 3) & 0x001f);
+	}
+
+	static uint32_t Blend3(uint32_t a, uint32_t b)
+	{
+		uint32_t c = 0;
+		for (int i = 0; i < 24; i += 8)
+			c |= ((2 * ((a >> i) & 0xff) + ((b >> i) & 0xff) + 1) / 3) << i;
+		return c;
+	}
+
+	// Sum of absolute BGR differences of four pixels against one palette colour
+	static __m128i Distance(__m128i pixels, __m128i color)
+	{
+		__m128i diff = _mm_or_si128(_mm_subs_epu8(pixels, color), _mm_subs_epu8(color, pixels));
+		__m128i sums = _mm_maddubs_epi16(diff, _mm_set1_epi32(0x00010101));
+		return _mm_madd_epi16(sums, _mm_set1_epi16(1));
+	}
+
+	static uint64_t EncodeColorBlock(const uint32_t* pTile, BYTE* pBlock)
+	{
+		__m128i rows[4];
+		for (int y = 0; y < 4; ++y)
+			rows[y] = _mm_load_si128(reinterpret_cast<const __m128i*>(pTile + y * 4));
+
+		__m128i mn = _mm_min_epu8(_mm_min_epu8(rows[0], rows[1]), _mm_min_epu8(rows[2], rows[3]));
+		__m128i mx = _mm_max_epu8(_mm_max_epu8(rows[0], rows[1]), _mm_max_epu8(rows[2], rows[3]));
+		mn = _mm_min_epu8(mn, _mm_shuffle_epi32(mn, _MM_SHUFFLE(1, 0, 3, 2)));
+		mx = _mm_max_epu8(mx, _mm_shuffle_epi32(mx, _MM_SHUFFLE(1, 0, 3, 2)));
+		mn = _mm_min_epu8(mn, _mm_shuffle_epi32(mn, _MM_SHUFFLE(2, 3, 0, 1)));
+		mx = _mm_max_epu8(mx, _mm_shuffle_epi32(mx, _MM_SHUFFLE(2, 3, 0, 1)));
+		uint32_t nMin = static_cast<uint32_t>(_mm_cvtsi128_si32(mn));
+		uint32_t nMax = static_cast<uint32_t>(_mm_cvtsi128_si32(mx));
+
+		// Shrink the box by 1/16 per side so the endpoints sit inside the colour cloud
+		int vMin[3], vMax[3];
+		for (int c = 0; c < 3; ++c)
+		{
+			int lo = (nMin >> (c * 8)) & 0xff;
+			int hi = (nMax >> (c * 8)) & 0xff;
+			int inset = (hi - lo) >> 4;
+			vMin[c] = lo + inset;
+			vMax[c] = hi - inset;
+		}
+
+		// The box spans four diagonals; blue and red run against green when their covariance is negative
+		int center[3] = { (vMin[0] + vMax[0]) / 2, (vMin[1] + vMax[1]) / 2, (vMin[2] + vMax[2]) / 2 };
+		int nCovBG = 0, nCovRG = 0;
+		for (int i = 0; i < 16; ++i)
+		{
+			int b = static_cast<int>(pTile[i] & 0xff) - center[0];
+			int g = static_cast<int>((pTile[i] >> 8) & 0xff) - center[1];
+			int r = static_cast<int>((pTile[i] >> 16) & 0xff) - center[2];
+			nCovBG += b * g;
+			nCovRG += r * g;
+		}
+		if (nCovBG < 0)
+			std::swap(vMin[0], vMax[0]);
+		if (nCovRG < 0)
+			std::swap(vMin[2], vMax[2]);
+
+		uint32_t c0 = Pack565(static_cast<uint32_t>(vMax[0] | (vMax[1] << 8) | (vMax[2] << 16)));
+		uint32_t c1 = Pack565(static_cast<uint32_t>(vMin[0] | (vMin[1] << 8) | (vMin[2] << 16)));
+		if (c0 < c1)
+			std::swap(c0, c1);
+
+		pBlock[0] = static_cast<BYTE>(c0);
+		pBlock[1] = static_cast<BYTE>(c0 >> 8);
+		pBlock[2] = static_cast<BYTE>(c1);
+		pBlock[3] = static_cast<BYTE>(c1 >> 8);
+
+		// Four-colour mode needs c0 > c1; a flat block uses index 0 throughout
+		uint32_t palette[4];
+		palette[0] = Expand565(c0);
+		palette[1] = Expand565(c1);
+		palette[2] = Blend3(palette[0], palette[1]);
+		palette[3] = Blend3(palette[1], palette[0]);
+		if (c0 == c1)
+			palette[1] = palette[2] = palette[3] = palette[0];
+
+		__m128i colors[4];
+		for (int i = 0; i < 4; ++i)
+			colors[i] = _mm_set1_epi32(static_cast<int>(palette[i]));
+
+		// Running argmin over the palette, four pixels at a time; distances stay in 32-bit lanes
+		// because SSSE3 has no 32-bit min, so the winner is blended in by mask
+		uint32_t nIndices = 0;
+		__m128i errors = _mm_setzero_si128();
+		for (int y = 0; y < 4; ++y)
+		{
+			__m128i best = Distance(rows[y], colors[0]);
+			__m128i index = _mm_setzero_si128();
+			for (int i = 1; i < 4; ++i)
+			{
+				__m128i d = Distance(rows[y], colors[i]);
+				__m128i closer = _mm_cmpgt_epi32(best, d);
+				best = _mm_or_si128(_mm_and_si128(closer, d), _mm_andnot_si128(closer, best));
+				index = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32(i)), _mm_andnot_si128(closer, index));
+			}
+			errors = _mm_add_epi32(errors, best);
+
+			// Gather the four 2-bit indices of the row into one byte
+			index = _mm_or_si128(index, _mm_srli_epi64(index, 30));
+			uint32_t nRow = static_cast<uint32_t>(_mm_cvtsi128_si32(index)) & 0xf;
+			nRow |= (static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_srli_si128(index, 8))) & 0xf) << 4;
+			nIndices |= nRow << (y * 8);
+		}
+		errors = _mm_add_epi32(errors, _mm_srli_si128(errors, 8));
+		errors = _mm_add_epi32(errors, _mm_srli_si128(errors, 4));
+		uint64_t ullError = static_cast<uint32_t>(_mm_cvtsi128_si32(errors));
+
+		pBlock[4] = static_cast<BYTE>(nIndices);
+		pBlock[5] = static_cast<BYTE>(nIndices >> 8);
+		pBlock[6] = static_cast<BYTE>(nIndices >> 16);
+		pBlock[7] = static_cast<BYTE>(nIndices >> 24);
+		return ullError;
+	}
+
+	// BC3 alpha in eight-value mode between the block's own min and max
+	static uint64_t EncodeAlphaBlock(const uint32_t* pTile, BYTE* pBlock)
+	{
+		UINT nMin = 255, nMax = 0;
+		for (int i = 0; i < 16; ++i)
+		{
+			UINT a = pTile[i] >> 24;
+			nMin = std::min(nMin, a);
+			nMax = std::max(nMax, a);
+		}
+
+		pBlock[0] = static_cast<BYTE>(nMax);
+		pBlock[1] = static_cast<BYTE>(nMin);
+
+		uint64_t ullIndices = 0;
+		uint64_t ullError = 0;
+		if (nMax > nMin)
+		{
+			BYTE palette[8];
+			palette[0] = static_cast<BYTE>(nMax);
+			palette[1] = static_cast<BYTE>(nMin);
+			for (UINT i = 1; i < 7; ++i)
+				palette[i + 1] = static_cast<BYTE>(((7 - i) * nMax + i * nMin + 3) / 7);
+
+			UINT nRange = nMax - nMin;
+			for (int i = 0; i < 16; ++i)
+			{
+				UINT a = pTile[i] >> 24;
+				UINT t = ((nMax - a) * 7 + nRange / 2) / nRange;
+				uint64_t index = t == 0 ? 0 : t == 7 ? 1 : t + 1;
+				ullIndices |= index << (i * 3);
+				ullError += static_cast<UINT>(std::abs(static_cast<int>(palette[index]) - static_cast<int>(a)));
+			}
+		}
+
+		for (int i = 0; i < 6; ++i)
+			pBlock[2 + i] = static_cast<BYTE>(ullIndices >> (i * 8));
+		return ullError;
+	}
+
+	static void LoadTile(const BYTE* pSource, UINT nWidth, UINT nHeight, UINT nStride, UINT bx, UINT by, uint32_t* pTile)
+	{
+		if (bx * 4 + 4 <= nWidth && by * 4 + 4 <= nHeight)
+		{
+			for (UINT y = 0; y < 4; ++y)
+			{
+				const BYTE* pRow = pSource + static_cast<size_t>(by * 4 + y) * nStride + bx * 16;
+				_mm_store_si128(reinterpret_cast<__m128i*>(pTile + y * 4), _mm_loadu_si128(reinterpret_cast<const __m128i*>(pRow)));
+			}
+			return;
+		}
+
+		// Partial edge block: repeat the last row and column
+		for (UINT y = 0; y < 4; ++y)
+		{
+			const uint32_t* pRow = reinterpret_cast<const uint32_t*>(pSource + static_cast<size_t>(std::min(by * 4 + y, nHeight - 1)) * nStride);
+			for (UINT x = 0; x < 4; ++x)
+				pTile[y * 4 + x] = pRow[std::min(bx * 4 + x, nWidth - 1)];
+		}
+	}
+
+	static bool IsOpaque(const BYTE* pSource, UINT nWidth, UINT nHeight, UINT nStride)
+	{
+		__m128i alpha = _mm_set1_epi32(static_cast<int>(0xff000000));
+		for (UINT y = 0; y < nHeight; ++y)
+		{
+			const BYTE* pRow = pSource + static_cast<size_t>(y) * nStride;
+			UINT x = 0;
+			for (; x + 4 <= nWidth; x += 4)
+			{
+				__m128i pixels = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pRow + x * 4)), alpha);
+				if (_mm_movemask_epi8(_mm_cmpeq_epi32(pixels, alpha)) != 0xffff)
+					return false;
+			}
+			for (; x < nWidth; ++x)
+			{
+				if (pRow[x * 4 + 3] != 255)
+					return false;
+			}
+		}
+		return true;
+	}
+
+	bool EncodeBlocks(const BYTE* pSource, UINT nWidth, UINT nHeight, UINT nStride, BlockImage& image, double* pMeanError)
+	{
+		if (!pSource || nWidth == 0 || nHeight == 0)
+			return false;
+
+		bool bOpaque = IsOpaque(pSource, nWidth, nHeight, nStride);
+		UINT nBlockBytes = bOpaque ? 8 : 16;
+		UINT nBlocksWide = (nWidth + 3) / 4;
+		UINT nBlocksHigh = (nHeight + 3) / 4;
+
+		image.format = bOpaque ? DXGI_FORMAT_BC1_UNORM : DXGI_FORMAT_BC3_UNORM;
+		image.nWidth = nWidth;
+		image.nHeight = nHeight;
+		image.nPitch = nBlocksWide * nBlockBytes;
+		image.bPremultiplied = true;
+		image.data.resize(static_cast<size_t>(image.nPitch) * nBlocksHigh);
+
+		// Workers take bands of block rows off a shared counter so uneven bands balance out
+		const UINT nBand = 16;
+		std::atomic<UINT> nNextRow(0);
+		std::atomic<uint64_t> ullError(0);
+		auto encode = [&]()
+		{
+			alignas(16) uint32_t tile[16];
+			uint64_t ullLocalError = 0;
+			for (UINT by0 = nNextRow.fetch_add(nBand); by0 < nBlocksHigh; by0 = nNextRow.fetch_add(nBand))
+			{
+				for (UINT by = by0; by < std::min(by0 + nBand, nBlocksHigh); ++by)
+				{
+					BYTE* pBlock = image.data.data() + static_cast<size_t>(by) * image.nPitch;
+					for (UINT bx = 0; bx < nBlocksWide; ++bx, pBlock += nBlockBytes)
+					{
+						LoadTile(pSource, nWidth, nHeight, nStride, bx, by, tile);
+						if (bOpaque)
+						{
+							ullLocalError += EncodeColorBlock(tile, pBlock);
+						}
+						else
+						{
+							ullLocalError += EncodeAlphaBlock(tile, pBlock);
+							ullLocalError += EncodeColorBlock(tile, pBlock + 8);
+						}
+					}
+				}
+			}
+			ullError += ullLocalError;
+		};
+
+		UINT nThreads = std::max(1u, std::min(std::thread::hardware_concurrency(), (nBlocksHigh + nBand - 1) / nBand));
+		std::vector<std::thread> vecThreads;
+		for (UINT i = 1; i < nThreads; ++i)
+			vecThreads.emplace_back(encode);
+		encode();
+		for (auto& thread : vecThreads)
+			thread.join();
+
+		if (pMeanError)
+		{
+			// Error is summed over the padded blocks, which is close enough for a quality trace
+			double dSamples = static_cast<double>(nBlocksWide) * nBlocksHigh * 16 * (bOpaque ? 3 : 4);
+			*pMeanError = ullError.load() / dSamples;
+		}
+		return true;
+	}
+
+	int BenchmarkBlocks(const std::wstring& strFileName)
+	{
+		static const int kRuns = 5;
+
+		ImageLoader loader;
+		std::vector<BYTE> vecPixels;
+		UINT nWidth = 0, nHeight = 0;
+		HRESULT hr = loader.LoadInto(strFileName.c_str(), vecPixels, nWidth, nHeight);
+		if (FAILED(hr) || !nWidth || !nHeight)
+		{
+			wprintf(L"%ls: cannot decode (0x%08x)\n", strFileName.c_str(), static_cast<unsigned>(hr));
+			return 1;
+		}
+		wprintf(L"%ls: %u x %u, %u threads\n", strFileName.c_str(), nWidth, nHeight, std::max(1u, std::thread::hardware_concurrency()));
+
+		// EncodeBlocks picks the format from the alpha channel, so each gets its own copy: fully
+		// opaque for BC1, and for BC3 the image as it is or, if it is opaque, faded towards the
+		// right edge and premultiplied to match
+		size_t nPixels = static_cast<size_t>(nWidth) * nHeight;
+		std::vector<BYTE> vecOpaque(vecPixels);
+		std::vector<BYTE> vecAlpha(vecPixels);
+		for (size_t i = 0; i < nPixels; ++i)
+			vecOpaque[i * 4 + 3] = 255;
+		if (vecOpaque == vecPixels)
+		{
+			for (size_t i = 0; i < nPixels; ++i)
+			{
+				UINT nAlpha = 255 - static_cast<UINT>(i % nWidth) * 191 / nWidth;
+				BYTE* pPixel = &vecAlpha[i * 4];
+				for (int c = 0; c < 3; ++c)
+					pPixel[c] = static_cast<BYTE>((pPixel[c] * nAlpha + 127) / 255);
+				pPixel[3] = static_cast<BYTE>(nAlpha);
+			}
+		}
+
+		const struct
+		{
+			const wchar_t* wszName;
+			const std::vector<BYTE>* pSource;
+		} formats[] = { { L"BC1", &vecOpaque }, { L"BC3", &vecAlpha } };
+
+		bool bOk = true;
+		for (const auto& format : formats)
+		{
+			BlockImage image;
+			double fError = 0.0;
+			double fBest = 0.0;
+			for (int i = 0; i < kRuns; ++i)
+			{
+				auto tStart = std::chrono::steady_clock::now();
+				bOk = EncodeBlocks(format.pSource->data(), nWidth, nHeight, nWidth * 4, image, &fError) && bOk;
+				double fMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tStart).count();
+				if (!i || fMs < fBest)
+					fBest = fMs;
+			}
+			wprintf(L"  %ls: %.2f ms, %.1f MPix/s, mean error %.2f per channel, %.1f MB\n", format.wszName,
+				fBest, nPixels / (fBest * 1000.0), fError, image.data.size() / 1048576.0);
+		}
+		fflush(stdout);
+		return bOk ? 0 : 1;
+	}
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <dxgiformat.h>
+
+namespace DIVE
+{
+	// Top mip of a block-compressed (BCn) image, kept exactly as stored in the file so it
+	// can be uploaded to the GPU without expanding it to 32bpp.
+	struct BlockImage
+	{
+		DXGI_FORMAT format;
+		UINT nWidth;
+		UINT nHeight;
+		UINT nPitch;		// bytes per row of 4x4 blocks
+		bool bPremultiplied;	// colour already scaled by alpha (cache re-encodes), DDS files are straight
+		std::vector<BYTE> data;
+	};
+
+	// Bytes per 4x4 block, or 0 when the format is not block compressed
+	UINT BlockBytes(DXGI_FORMAT format);
+
+	// Expands to 32bpp premultiplied BGRA. Only meant for the few places that need actual
+	// pixels (thumbnails, display fallback); returns false for formats without a CPU decoder.
+	bool DecodeBlocks(const BlockImage& image, BYTE* pDest, UINT nStride);
+
+	// Encodes 32bpp premultiplied BGRA to BC1 when every pixel is opaque and to BC3 otherwise,
+	// with the block rows spread over all cores. pMeanError receives the mean absolute error
+	// per channel (0-255).
+	bool EncodeBlocks(const BYTE* pSource, UINT nWidth, UINT nHeight, UINT nStride, BlockImage& image, double* pMeanError = nullptr);
+
+	// Headless /bc-bench mode: encodes one image to BC1 and to BC3 and prints the rate and
+	// mean error of each; returns the process exit code
+	int BenchmarkBlocks(const std::wstring& strFileName);
+}
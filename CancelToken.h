@@ -0,0 +1,33 @@
+#pragma once
+
+namespace DIVE
+{
+	// Polled by decoders between scanline strips. The check is supplied by the owner of
+	// the request so the decoders stay independent of how requests are tracked.
+	class CancelToken
+	{
+	public:
+		typedef bool (*CheckProc)(const void* pContext);
+
+		CancelToken()
+			: m_pfnCheck(nullptr)
+			, m_pContext(nullptr)
+		{
+		}
+
+		CancelToken(CheckProc pfnCheck, const void* pContext)
+			: m_pfnCheck(pfnCheck)
+			, m_pContext(pContext)
+		{
+		}
+
+		bool IsCancelled() const
+		{
+			return m_pfnCheck && m_pfnCheck(m_pContext);
+		}
+
+	private:
+		CheckProc m_pfnCheck;
+		const void* m_pContext;
+	};
+}
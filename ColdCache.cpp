@@ -0,0 +1,357 @@
+#include "stdafx.h"
+#include "ColdCache.h"
+#include "Lz4.h"
+#include "Trace.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+
+namespace DIVE
+{
+	// Runs fn(0..nCount-1) on up to one thread per core; the caller's thread takes part
+	static void ParallelFor(size_t nCount, const std::function<void(size_t)>& fn)
+	{
+		std::atomic<size_t> nNext(0);
+		auto work = [&]()
+		{
+			for (size_t i = nNext++; i < nCount; i = nNext++)
+				fn(i);
+		};
+
+		size_t nThreads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), nCount));
+		std::vector<std::thread> vecThreads;
+		for (size_t i = 1; i < nThreads; ++i)
+			vecThreads.emplace_back(work);
+		work();
+		for (auto& thread : vecThreads)
+			thread.join();
+	}
+
+	ColdCache::ColdCache(size_t nBudget)
+		: m_nBytes(0)
+		, m_nBudget(nBudget)
+		, m_nSequence(0)
+		, m_nHits(0)
+		, m_nMisses(0)
+		, m_nMaterialized(0)
+		, m_nDropped(0)
+		, m_bEnd(false)
+	{
+		wchar_t wszValue[32];
+		if (GetEnvironmentVariableW(L"DIVE_COLD_CACHE_MB", wszValue, 32))
+			m_nBudget = static_cast<size_t>(_wtoi(wszValue)) << 20;
+
+		CoCreateInstance(CLSID_WICImagingFactory, NULL,
+			CLSCTX_INPROC_SERVER, IID_IWICImagingFactory,
+			(LPVOID*)&m_pWICFactory);
+
+		m_thread = std::thread([this]() { Run(); });
+	}
+
+	ColdCache::~ColdCache()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_bEnd = true;
+		}
+		m_cvWork.notify_all();
+		m_thread.join();
+	}
+
+	void ColdCache::Put(const std::wstring& strFileName, const CachedImage& image)
+	{
+		if (!m_nBudget || strFileName.empty())
+			return;
+
+		// Until the compressed copy replaces it, the entry costs its full size
+		size_t nBytes = 0;
+		if (image.pBlocks)
+		{
+			nBytes = image.pBlocks->data.size();
+		}
+		else if (image.pBitmap)
+		{
+			UINT nWidth = 0, nHeight = 0;
+			WICPixelFormatGUID guidPixelFormat;
+			if (FAILED(image.pBitmap->GetSize(&nWidth, &nHeight)) || FAILED(image.pBitmap->GetPixelFormat(&guidPixelFormat)))
+				return;
+			nBytes = static_cast<size_t>(nWidth) * nHeight * (guidPixelFormat == GUID_WICPixelFormat64bppPRGBAHalf ? 8 : 4);
+		}
+		else
+		{
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			Entry& entry = m_mapEntries[strFileName];
+			m_nBytes -= entry.nBytes;
+
+			entry = Entry{ image, 0, 0, 0, 0, GUID_WICPixelFormat32bppPBGRA, {}, nBytes, m_nSequence++ };
+			m_nBytes += nBytes;
+			if (image.pBitmap)
+				m_vecQueued.push_back(strFileName);
+			Trim();
+			ReportHitRate();
+		}
+		m_cvWork.notify_one();
+	}
+
+	bool ColdCache::Contains(const std::wstring& strFileName)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_mapEntries.count(strFileName) != 0;
+	}
+
+	bool ColdCache::Take(const std::wstring& strFileName, CachedImage& image)
+	{
+		Entry entry;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			auto it = m_mapEntries.find(strFileName);
+			if (it == m_mapEntries.end())
+			{
+				++m_nMisses;
+				ReportHitRate();
+				return false;
+			}
+
+			entry = std::move(it->second);
+			m_nBytes -= entry.nBytes;
+			m_mapEntries.erase(it);
+			++m_nHits;
+			ReportHitRate();
+		}
+
+		// Not compressed yet, or never will be
+		if (entry.image.pBitmap || entry.image.pBlocks)
+		{
+			image = entry.image;
+			return true;
+		}
+
+		DIVE_TRACE_SPAN(span, "ColdCache::Promote");
+		auto tStart = std::chrono::steady_clock::now();
+
+		bool bOk = Expand(entry, image);
+
+		double dMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tStart).count();
+		DIVE_TRACE_BYTES(span, entry.nBytes);
+		DIVE_TRACE_COUNTER("ColdCache Promote ms", dMilliseconds);
+		return bOk;
+	}
+
+	bool ColdCache::Expand(const Entry& entry, CachedImage& image)
+	{
+		CComPtr<IWICBitmap> pBitmap;
+		CComPtr<IWICBitmapLock> pLock;
+		UINT cbBuffer = 0;
+		UINT nStride = 0;
+		BYTE* pData = nullptr;
+
+		HRESULT hr = m_pWICFactory ? S_OK : E_FAIL;
+		if (SUCCEEDED(hr))
+			hr = m_pWICFactory->CreateBitmap(entry.nWidth, entry.nHeight, entry.guidPixelFormat, WICBitmapCacheOnLoad, &pBitmap);
+		if (SUCCEEDED(hr))
+		{
+			WICRect rcLock = { 0, 0, static_cast<INT>(entry.nWidth), static_cast<INT>(entry.nHeight) };
+			hr = pBitmap->Lock(&rcLock, WICBitmapLockWrite, &pLock);
+		}
+		if (SUCCEEDED(hr))
+			hr = pLock->GetStride(&nStride);
+		if (SUCCEEDED(hr))
+			hr = pLock->GetDataPointer(&cbBuffer, &pData);
+
+		// Bands were cut at the stride the image was cached with
+		if (FAILED(hr) || nStride != entry.nStride)
+			return false;
+
+		std::atomic<bool> bOk(true);
+		ParallelFor(entry.vecBands.size(), [&](size_t i)
+		{
+			UINT y = static_cast<UINT>(i) * entry.nBandRows;
+			size_t cbBand = static_cast<size_t>(std::min(entry.nBandRows, entry.nHeight - y)) * nStride;
+			const std::vector<BYTE>& band = entry.vecBands[i];
+			if (Lz4::Decompress(band.data(), band.size(), pData + static_cast<size_t>(y) * nStride, cbBand) != cbBand)
+				bOk = false;
+		});
+		pLock.Release();
+
+		if (!bOk)
+			return false;
+
+		image = entry.image;
+		image.pBitmap = pBitmap;
+		return true;
+	}
+
+	void ColdCache::ReportHitRate()
+	{
+		if (m_nHits + m_nMisses)
+			DIVE_TRACE_COUNTER("ColdCache Hit %", 100.0 * m_nHits / (m_nHits + m_nMisses));
+		DIVE_TRACE_COUNTER("ColdCache Bytes", static_cast<double>(m_nBytes));
+		DIVE_TRACE_COUNTER("ColdCache Materialized", static_cast<double>(m_nMaterialized));
+		DIVE_TRACE_COUNTER("ColdCache Dropped", static_cast<double>(m_nDropped));
+	}
+
+	void ColdCache::SetBudget(size_t nBudget)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_nBudget = nBudget;
+		Trim();
+		DIVE_TRACE_COUNTER("ColdCache Budget MB", static_cast<double>(m_nBudget >> 20));
+	}
+
+	size_t ColdCache::Budget()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_nBudget;
+	}
+
+	void ColdCache::Trim()
+	{
+		// Oldest evictions go first, they are the furthest from the current image
+		while (m_nBytes > m_nBudget && !m_mapEntries.empty())
+		{
+			auto oldest = m_mapEntries.begin();
+			for (auto it = m_mapEntries.begin(); it != m_mapEntries.end(); ++it)
+			{
+				if (it->second.nSequence < oldest->second.nSequence)
+					oldest = it;
+			}
+
+			m_nBytes -= oldest->second.nBytes;
+			m_mapEntries.erase(oldest);
+		}
+	}
+
+	void ColdCache::Run()
+	{
+		DIVE_TRACE_THREAD("ColdCache");
+
+		std::vector<std::wstring> vecBatch;
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_cvWork.wait(lock, [this]() { return m_bEnd || !m_vecQueued.empty(); });
+				if (m_bEnd)
+					return;
+				vecBatch.swap(m_vecQueued);
+			}
+
+			for (const auto& strFileName : vecBatch)
+				Compress(strFileName);
+			vecBatch.clear();
+		}
+	}
+
+	void ColdCache::Compress(const std::wstring& strFileName)
+	{
+		CachedImage image;
+		uint64_t nSequence;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			auto it = m_mapEntries.find(strFileName);
+			if (it == m_mapEntries.end() || !it->second.image.pBitmap || m_bEnd)
+				return;
+			image = it->second.image;
+			nSequence = it->second.nSequence;
+		}
+
+		// Entries that cannot be compressed are dropped rather than left resident at full size
+		auto drop = [&]()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			auto it = m_mapEntries.find(strFileName);
+			if (it == m_mapEntries.end() || it->second.nSequence != nSequence)
+				return;
+			m_nBytes -= it->second.nBytes;
+			m_mapEntries.erase(it);
+			++m_nDropped;
+			ReportHitRate();
+		};
+
+		// Cached images are usually materialized into an IWICBitmap already, so the pixels can
+		// be read in place; any other source is copied into one here
+		CComPtr<IWICBitmap> pBitmap;
+		CComPtr<IWICBitmapLock> pLock;
+		UINT nWidth = 0, nHeight = 0;
+		WICPixelFormatGUID guidPixelFormat;
+		UINT cbBuffer = 0;
+		UINT nStride = 0;
+		BYTE* pData = nullptr;
+
+		HRESULT hr = image.pBitmap->QueryInterface(IID_IWICBitmap, (void**)&pBitmap);
+		if (FAILED(hr) && m_pWICFactory)
+		{
+			hr = m_pWICFactory->CreateBitmapFromSource(image.pBitmap, WICBitmapCacheOnLoad, &pBitmap);
+			if (SUCCEEDED(hr))
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				++m_nMaterialized;
+			}
+		}
+		if (SUCCEEDED(hr))
+			hr = pBitmap->GetSize(&nWidth, &nHeight);
+		if (SUCCEEDED(hr))
+			hr = pBitmap->GetPixelFormat(&guidPixelFormat);
+		if (SUCCEEDED(hr))
+		{
+			WICRect rcLock = { 0, 0, static_cast<INT>(nWidth), static_cast<INT>(nHeight) };
+			hr = pBitmap->Lock(&rcLock, WICBitmapLockRead, &pLock);
+		}
+		if (SUCCEEDED(hr))
+			hr = pLock->GetStride(&nStride);
+		if (SUCCEEDED(hr))
+			hr = pLock->GetDataPointer(&cbBuffer, &pData);
+		if (FAILED(hr) || nWidth == 0 || nHeight == 0)
+		{
+			pLock.Release();
+			drop();
+			return;
+		}
+
+		DIVE_TRACE_SPAN(span, "ColdCache::Compress");
+		DIVE_TRACE_BYTES(span, static_cast<uint64_t>(nStride) * nHeight);
+
+		// About 1 MB per band: enough work per task, and enough bands to spread a promotion over all cores
+		UINT nBandRows = std::max(1u, (1u << 20) / nStride);
+		std::vector<std::vector<BYTE>> vecBands((nHeight + nBandRows - 1) / nBandRows);
+		ParallelFor(vecBands.size(), [&](size_t i)
+		{
+			UINT y = static_cast<UINT>(i) * nBandRows;
+			size_t cbBand = static_cast<size_t>(std::min(nBandRows, nHeight - y)) * nStride;
+			std::vector<BYTE>& band = vecBands[i];
+			band.resize(Lz4::Bound(cbBand));
+			band.resize(Lz4::Compress(pData + static_cast<size_t>(y) * nStride, cbBand, band.data(), band.size()));
+			band.shrink_to_fit();
+		});
+		pLock.Release();
+
+		size_t nBytes = 0;
+		for (const auto& band : vecBands)
+			nBytes += band.size();
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_mapEntries.find(strFileName);
+		if (it == m_mapEntries.end() || it->second.nSequence != nSequence)
+			return;
+
+		// The bitmap itself is released with the local copy, outside the lock; the rest of
+		// the description (display-size copies) is kept for the promotion
+		Entry& entry = it->second;
+		entry.image.pBitmap.Release();
+		entry.nWidth = nWidth;
+		entry.nHeight = nHeight;
+		entry.nStride = nStride;
+		entry.nBandRows = nBandRows;
+		entry.guidPixelFormat = guidPixelFormat;
+		entry.vecBands = std::move(vecBands);
+		m_nBytes -= entry.nBytes;
+		entry.nBytes = nBytes;
+		m_nBytes += nBytes;
+		ReportHitRate();
+	}
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdint>
+#include <Wincodec.h>
+#include "ImageTable.h"
+
+namespace DIVE
+{
+	// Second cache tier for images dropped from the decode window. Evicted bitmaps are
+	// LZ4-compressed on their own thread, in bands of rows that decompress independently,
+	// so promoting one back costs a parallel memcpy-speed expansion instead of a full decode.
+	// Block-compressed images are already small and are kept as they are.
+	class ColdCache
+	{
+	public:
+		ColdCache(size_t nBudget = 512 << 20);
+		~ColdCache();
+
+		void Put(const std::wstring& strFileName, const CachedImage& image);
+		bool Contains(const std::wstring& strFileName);
+
+		// Moves the image back out of the tier; false on a miss
+		bool Take(const std::wstring& strFileName, CachedImage& image);
+
+		// Entries over a lowered budget are dropped at once, oldest first
+		void SetBudget(size_t nBudget);
+		size_t Budget();
+
+	private:
+		struct Entry
+		{
+			CachedImage image;		// until compressed, and for block-compressed images
+			UINT nWidth;
+			UINT nHeight;
+			UINT nStride;
+			UINT nBandRows;
+			WICPixelFormatGUID guidPixelFormat;
+			std::vector<std::vector<BYTE>> vecBands;
+			size_t nBytes;
+			uint64_t nSequence;
+		};
+
+		void Run();
+		void Compress(const std::wstring& strFileName);
+		bool Expand(const Entry& entry, CachedImage& image);
+		void Trim();
+		void ReportHitRate();
+
+		CComPtr<IWICImagingFactory> m_pWICFactory;
+
+		std::mutex m_mutex;
+		std::condition_variable m_cvWork;
+		std::unordered_map<std::wstring, Entry> m_mapEntries;
+		std::vector<std::wstring> m_vecQueued;
+
+		size_t m_nBytes;
+		size_t m_nBudget;
+		uint64_t m_nSequence;
+		uint64_t m_nHits;
+		uint64_t m_nMisses;
+		uint64_t m_nMaterialized;	// sources that had to be copied into a bitmap first
+		uint64_t m_nDropped;		// entries that could not be compressed at all
+		bool m_bEnd;
+
+		std::thread m_thread;
+	};
+}
@@ -4,8 +4,17 @@
 #include "stdafx.h"
 #include "DIVE.h"
 #include "ImageViewer.h"
+#include "Trace.h"
+#include "Prewarm.h"
+#include "Resample.h"
+#include "BlockImage.h"
+#include "ImageTable.h"
+#include "Startup.h"
+#include "RequestQueue.h"
+#include "Uploader.h"
 #include <stdio.h>
 #include <Objbase.h>
+#include <shellapi.h>
 
 #define MAX_LOADSTRING 100
 
@@ -31,6 +40,48 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 
 	HeapSetInformation(NULL, HeapEnableTerminationOnCorruption, NULL, 0);
 	CoInitializeEx(NULL, COINIT_MULTITHREADED);
+	DIVE_TRACE_THREAD("UI");
+
+	// DIVE /prewarm <folder>: fill the thumbnail caches of a tree and exit without a window
+	// DIVE /resample-bench <file>: time the zoom resampling kernels on one image
+	// DIVE /bc-bench <file>: BC1 and BC3 encode rate and error on one image
+	// DIVE /table-bench <count>: size and iteration speed of the file table at that many files
+	// DIVE /table-stress <seconds>: concurrent readers and writers on the file table and its reclamation
+	// DIVE /startup-bench <file>: startup phases with that first image, sequential and overlapped
+	// DIVE /queue-bench <threads>: load request queue throughput with that many producers and consumers
+	// DIVE /upload-stress <jobs>: the upload thread's queues and shutdown against a fake device
+	int nArgs = 0;
+	LPWSTR* pArgs = CommandLineToArgvW(GetCommandLineW(), &nArgs);
+	bool bPrewarm = pArgs && nArgs >= 3 && _wcsicmp(pArgs[1], L"/prewarm") == 0;
+	bool bBenchmark = pArgs && nArgs >= 3 && _wcsicmp(pArgs[1], L"/resample-bench") == 0;
+	bool bBlockBench = pArgs && nArgs >= 3 && _wcsicmp(pArgs[1], L"/bc-bench") == 0;
+	bool bTableBench = pArgs && nArgs >= 3 && _wcsicmp(pArgs[1], L"/table-bench") == 0;
+	bool bTableStress = pArgs && nArgs >= 3 && _wcsicmp(pArgs[1], L"/table-stress") == 0;
+	bool bStartupBench = pArgs && nArgs >= 3 && _wcsicmp(pArgs[1], L"/startup-bench") == 0;
+	bool bQueueBench = pArgs && nArgs >= 3 && _wcsicmp(pArgs[1], L"/queue-bench") == 0;
+	bool bUploadStress = pArgs && nArgs >= 3 && _wcsicmp(pArgs[1], L"/upload-stress") == 0;
+	if (bPrewarm || bBenchmark || bBlockBench || bTableBench || bTableStress || bStartupBench || bQueueBench || bUploadStress)
+	{
+		if (AttachConsole(ATTACH_PARENT_PROCESS))
+			_wfreopen(L"CONOUT$", L"w", stdout);
+
+		int nResult = bPrewarm ? DIVE::Prewarm(pArgs[2])
+			: bBenchmark ? DIVE::BenchmarkResample(pArgs[2])
+			: bBlockBench ? DIVE::BenchmarkBlocks(pArgs[2])
+			: bTableBench ? DIVE::BenchmarkImageTable(_wtoi(pArgs[2]))
+			: bTableStress ? DIVE::StressImageTable(_wtoi(pArgs[2]))
+			: bQueueBench ? DIVE::BenchmarkRequestQueue(_wtoi(pArgs[2]))
+			: bUploadStress ? DIVE::StressUploader(_wtoi(pArgs[2]))
+			: DIVE::BenchmarkStartup(pArgs[2]);
+		LocalFree(pArgs);
+		CoUninitialize();
+
+#if DIVE_TRACE_ENABLED
+		DIVE::Trace::ExportRequested();
+#endif
+		return nResult;
+	}
+	LocalFree(pArgs);
 
 	s_loader = new DIVE::ImageViewer;
 
@@ -66,6 +117,10 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 	delete s_loader;
 	CoUninitialize();
 
+#if DIVE_TRACE_ENABLED
+	DIVE::Trace::ExportRequested();
+#endif
+
     return (int) msg.wParam;
 }
 
@@ -111,9 +166,15 @@ BOOL InitInstance(HINSTANCE hInstance, int nCmdShow)
       return FALSE;
    }
 
-   s_loader->Initialize( hWnd );
-   s_loader->Capture(width, height);
-   s_loader->Load(L"D:\\Photos\\ ̰\\couple.jpg");
+   // The overlapped startup, or the plain sequence if it could not create the device
+   const wchar_t* wszFirst = L"D:\\Photos\\ ̰\\couple.jpg";
+   if (!s_loader->Start(hWnd, width, height, wszFirst))
+   {
+      if (!s_loader->Initialize(hWnd))
+         return FALSE;
+      s_loader->Capture(width, height);
+      s_loader->Load(wszFirst);
+   }
    
    ShowWindow(hWnd, nCmdShow);
    UpdateWindow(hWnd);
@@ -140,6 +201,27 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 			s_loader->PrevImage(); break;
 		case VK_RIGHT:
 			s_loader->NextImage(); break;
+		case VK_SPACE:
+			s_loader->ToggleSlideshow(); break;
+		case VK_PRIOR:
+			s_loader->StepFrame(-1); break;
+		case VK_NEXT:
+			s_loader->StepFrame(1); break;
+		case VK_RETURN:
+			s_loader->ToggleAnimation(); break;
+		case 'F':
+			s_loader->ToggleFlipbook(); break;
+		case 'D':
+			s_loader->ReportDecodeCost(); break;
+		case VK_OEM_PLUS:
+		case VK_ADD:
+			s_loader->AdjustExposure(1.0f / 3); break;
+		case VK_OEM_MINUS:
+		case VK_SUBTRACT:
+			s_loader->AdjustExposure(-1.0f / 3); break;
+		case '0':
+		case VK_NUMPAD0:
+			s_loader->ResetExposure(); break;
 		case VK_ESCAPE:
 			PostQuitMessage(0); break;
 		}
@@ -0,0 +1,80 @@
+#include "stdafx.h"
+#include "DecodeCost.h"
+#include <cwctype>
+#include <algorithm>
+
+namespace DIVE
+{
+	// Samples that make up most of an average; the first few count fully so it settles fast
+	static const int kWindow = 8;
+
+	std::wstring DecodeCost::Format(const wchar_t* wszFileName)
+	{
+		const wchar_t* wszExtension = wcsrchr(wszFileName, L'.');
+		std::wstring strFormat = wszExtension && !wcschr(wszExtension, L'\\') ? wszExtension + 1 : L"";
+		std::transform(strFormat.begin(), strFormat.end(), strFormat.begin(), [](wchar_t c) { return static_cast<wchar_t>(std::towlower(c)); });
+		return strFormat;
+	}
+
+	void DecodeCost::Add(Stats& stats, double fMicrosPerMegapixel, double fMegapixels)
+	{
+		stats.nSamples++;
+		double fWeight = 1.0 / std::min(stats.nSamples, kWindow);
+		stats.fMicrosPerMegapixel += (fMicrosPerMegapixel - stats.fMicrosPerMegapixel) * fWeight;
+		stats.fMegapixels += (fMegapixels - stats.fMegapixels) * fWeight;
+	}
+
+	void DecodeCost::Record(const wchar_t* wszFileName, bool bReduced, UINT nWidth, UINT nHeight, int64_t nMicros)
+	{
+		// Tiny images are all fixed cost; counting them per megapixel would inflate the rate
+		double fMegapixels = std::max(0.25, nWidth * static_cast<double>(nHeight) / 1e6);
+		double fMicrosPerMegapixel = nMicros / fMegapixels;
+		std::wstring strFormat = Format(wszFileName);
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		Add(m_mapFormats[std::make_pair(strFormat, bReduced)], fMicrosPerMegapixel, fMegapixels);
+		Add(m_all[bReduced], fMicrosPerMegapixel, fMegapixels);
+	}
+
+	double DecodeCost::Micros(const wchar_t* wszFileName, bool bReduced) const
+	{
+		std::wstring strFormat = Format(wszFileName);
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_mapFormats.find(std::make_pair(strFormat, bReduced));
+		const Stats& stats = it != m_mapFormats.end() ? it->second
+			: m_all[bReduced].nSamples ? m_all[bReduced] : m_all[!bReduced];
+		return stats.fMicrosPerMegapixel * stats.fMegapixels;
+	}
+
+	std::vector<DecodeCost::Estimate> DecodeCost::Estimates() const
+	{
+		std::vector<Estimate> vecEstimates;
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (auto& format : m_mapFormats)
+		{
+			const Stats& stats = format.second;
+			vecEstimates.push_back(Estimate{ format.first.first, format.first.second, stats.nSamples, stats.fMicrosPerMegapixel, stats.fMegapixels });
+		}
+		for (int i = 0; i < 2; ++i)
+		{
+			if (m_all[i].nSamples)
+				vecEstimates.push_back(Estimate{ L"*", i != 0, m_all[i].nSamples, m_all[i].fMicrosPerMegapixel, m_all[i].fMegapixels });
+		}
+		return vecEstimates;
+	}
+
+	std::wstring DecodeCost::Report() const
+	{
+		std::wstring strReport;
+		wchar_t wszLine[160];
+		for (const Estimate& estimate : Estimates())
+		{
+			swprintf_s(wszLine, L"Decode %-5ls %-7ls %4d samples: %6.1f ms/MP, %5.1f MP typical, %6.1f ms expected\n",
+				estimate.strFormat.c_str(), estimate.bReduced ? L"reduced" : L"full", estimate.nSamples,
+				estimate.fMicrosPerMegapixel / 1000.0, estimate.fMegapixels, estimate.fMicrosPerMegapixel * estimate.fMegapixels / 1000.0);
+			strReport += wszLine;
+		}
+		return strReport;
+	}
+}
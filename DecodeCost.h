@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <cstdint>
+
+namespace DIVE
+{
+	// Decode times learned from recent decodes, per file extension and per kind of decode
+	// (full, or reduced to fit). Each decode moves two averages: its time per megapixel of
+	// source, and the source's size. The estimate for a file not opened yet is the typical
+	// size of its format at the typical rate; formats not seen yet fall back to all formats.
+	class DecodeCost
+	{
+	public:
+		struct Estimate
+		{
+			std::wstring strFormat;		// extension without the dot, or * for all formats
+			bool bReduced;
+			int nSamples;
+			double fMicrosPerMegapixel;
+			double fMegapixels;
+		};
+
+		void Record(const wchar_t* wszFileName, bool bReduced, UINT nWidth, UINT nHeight, int64_t nMicros);
+
+		// Expected microseconds to decode the file, or 0 before anything was learned
+		double Micros(const wchar_t* wszFileName, bool bReduced) const;
+
+		std::vector<Estimate> Estimates() const;
+		std::wstring Report() const;
+
+	private:
+		struct Stats
+		{
+			int nSamples = 0;
+			double fMicrosPerMegapixel = 0.0;
+			double fMegapixels = 0.0;
+		};
+
+		static std::wstring Format(const wchar_t* wszFileName);
+		static void Add(Stats& stats, double fMicrosPerMegapixel, double fMegapixels);
+
+		mutable std::mutex m_mutex;
+		std::map<std::pair<std::wstring, bool>, Stats> m_mapFormats;
+		Stats m_all[2];			// by bReduced
+	};
+}
@@ -0,0 +1,177 @@
+#include "stdafx.h"
+#include "Epoch.h"
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <vector>
+
+namespace DIVE
+{
+	namespace Epoch
+	{
+		static const uint64_t kInactive = ~0ull;
+		static const size_t kMaxThreads = 256;
+		static const size_t kCollectBytes = 64 << 20;
+		static const size_t kCollectCount = 256;		// bounds the list when the objects are small
+
+		struct alignas(64) ThreadRecord
+		{
+			std::atomic<uint64_t> ullEpoch;
+			std::atomic<bool> bInUse;
+		};
+
+		struct Retired
+		{
+			void* p;
+			Deleter pfnDelete;
+			uint64_t ullEpoch;
+			size_t cbSize;
+		};
+
+		static ThreadRecord s_records[kMaxThreads];
+		static std::atomic<size_t> s_nRecords(0);
+		static std::atomic<uint64_t> s_ullEpoch(1);
+
+		// Objects retired by threads that exited before their grace period ended
+		static std::mutex s_mutexOrphans;
+		static std::vector<Retired> s_vecOrphans;
+
+		static size_t FreeExpired(std::vector<Retired>& vecRetired, uint64_t ullEpoch)
+		{
+			size_t nKept = 0;
+			size_t cbFreed = 0;
+			for (size_t i = 0; i < vecRetired.size(); ++i)
+			{
+				if (vecRetired[i].ullEpoch + 2 <= ullEpoch)
+				{
+					cbFreed += vecRetired[i].cbSize;
+					vecRetired[i].pfnDelete(vecRetired[i].p);
+				}
+				else
+					vecRetired[nKept++] = vecRetired[i];
+			}
+			vecRetired.resize(nKept);
+			return cbFreed;
+		}
+
+		struct OrphanReaper
+		{
+			~OrphanReaper()
+			{
+				// Process exit: no reader can be left
+				for (auto& retired : s_vecOrphans)
+					retired.pfnDelete(retired.p);
+				s_vecOrphans.clear();
+			}
+		};
+		static OrphanReaper s_reaper;
+
+		static uint64_t TryAdvance()
+		{
+			uint64_t ullEpoch = s_ullEpoch.load();
+			size_t nRecords = s_nRecords.load();
+			for (size_t i = 0; i < nRecords; ++i)
+			{
+				uint64_t ullObserved = s_records[i].ullEpoch.load();
+				if (ullObserved != kInactive && ullObserved != ullEpoch)
+					return ullEpoch;
+			}
+			if (s_ullEpoch.compare_exchange_strong(ullEpoch, ullEpoch + 1))
+				return ullEpoch + 1;
+			return ullEpoch;
+		}
+
+		struct ThreadState
+		{
+			ThreadRecord* pRecord = nullptr;
+			int nDepth = 0;
+			std::vector<Retired> vecRetired;
+			size_t cbRetired = 0;
+
+			ThreadRecord* Record()
+			{
+				if (pRecord)
+					return pRecord;
+
+				for (size_t i = 0; i < kMaxThreads; ++i)
+				{
+					bool bInUse = false;
+					if (s_records[i].bInUse.compare_exchange_strong(bInUse, true))
+					{
+						s_records[i].ullEpoch.store(kInactive);
+						pRecord = &s_records[i];
+
+						size_t nRecords = s_nRecords.load();
+						while (nRecords < i + 1 && !s_nRecords.compare_exchange_weak(nRecords, i + 1))
+							;
+						return pRecord;
+					}
+				}
+				// More threads than records: the viewer only ever runs a handful
+				std::terminate();
+			}
+
+			~ThreadState()
+			{
+				FreeExpired(vecRetired, TryAdvance());
+				if (!vecRetired.empty())
+				{
+					std::lock_guard<std::mutex> lock(s_mutexOrphans);
+					s_vecOrphans.insert(s_vecOrphans.end(), vecRetired.begin(), vecRetired.end());
+				}
+				if (pRecord)
+				{
+					pRecord->ullEpoch.store(kInactive);
+					pRecord->bInUse.store(false);
+				}
+			}
+		};
+
+		static thread_local ThreadState t_state;
+
+		Guard::Guard()
+		{
+			if (t_state.nDepth++ == 0)
+				t_state.Record()->ullEpoch.store(s_ullEpoch.load());
+		}
+
+		Guard::~Guard()
+		{
+			if (--t_state.nDepth == 0)
+				t_state.pRecord->ullEpoch.store(kInactive);
+		}
+
+		void Retire(void* p, Deleter pfnDelete, size_t cbSize)
+		{
+			t_state.vecRetired.push_back(Retired{ p, pfnDelete, s_ullEpoch.load(), cbSize });
+			t_state.cbRetired += cbSize;
+			if (t_state.cbRetired >= kCollectBytes || t_state.vecRetired.size() >= kCollectCount)
+				Collect();
+		}
+
+		size_t Collect()
+		{
+			uint64_t ullEpoch = TryAdvance();
+			size_t cbFreed = FreeExpired(t_state.vecRetired, ullEpoch);
+			t_state.cbRetired -= cbFreed;
+
+			std::unique_lock<std::mutex> lock(s_mutexOrphans, std::try_to_lock);
+			if (lock.owns_lock() && !s_vecOrphans.empty())
+				cbFreed += FreeExpired(s_vecOrphans, ullEpoch);
+			return cbFreed;
+		}
+
+		size_t Synchronize()
+		{
+			// An object retired in epoch e is free to go at e + 2
+			TryAdvance();
+			TryAdvance();
+			return Collect();
+		}
+
+		size_t Pending()
+		{
+			return t_state.cbRetired;
+		}
+	}
+}
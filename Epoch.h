@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+
+namespace DIVE
+{
+	// Epoch-based reclamation. Readers bracket their accesses with a Guard, which is two
+	// atomic stores and never blocks. Writers unlink an object first and Retire() it
+	// afterwards; it is destroyed once every reader that might still see it has left.
+	// Retired objects are freed by Collect on the retiring thread, which threads that
+	// retire large objects call on a schedule, and early once they hold too many bytes.
+	namespace Epoch
+	{
+		class Guard
+		{
+		public:
+			Guard();
+			~Guard();
+
+		private:
+			Guard(const Guard&) = delete;
+			Guard& operator=(const Guard&) = delete;
+		};
+
+		typedef void (*Deleter)(void*);
+
+		// cbSize weighs the object against the collection threshold
+		void Retire(void* p, Deleter pfnDelete, size_t cbSize = 0);
+
+		// Frees what this thread retired whose grace period is over, and the leftovers of
+		// threads that exited; returns the bytes freed
+		size_t Collect();
+
+		// Collect after moving the epoch on as far as the readers allow, which frees
+		// everything retired before the call unless a reader is still inside a Guard
+		size_t Synchronize();
+
+		// Bytes this thread retired that are not freed yet
+		size_t Pending();
+
+		template <class T>
+		void Retire(T* p, size_t cbSize = 0)
+		{
+			if (p)
+				Retire(p, [](void* q) { delete static_cast<T*>(q); }, cbSize);
+		}
+	}
+}
@@ -0,0 +1,360 @@
+#include "stdafx.h"
+#include "FileStream.h"
+#include "Trace.h"
+#include <algorithm>
+
+namespace DIVE
+{
+	static const UINT kMinChunkSize = 64 * 1024;
+	static const UINT kMaxDepth = 64;
+
+	HRESULT FileStream::Open(const wchar_t* wszFileName, const Options& options, FileStream** ppStream)
+	{
+		DIVE_TRACE_SCOPE("FileStream::Open");
+
+		*ppStream = nullptr;
+
+		HANDLE hFile = CreateFileW(wszFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+			FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+			return HRESULT_FROM_WIN32(GetLastError());
+
+		LARGE_INTEGER liSize;
+		if (!GetFileSizeEx(hFile, &liSize))
+		{
+			HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+			CloseHandle(hFile);
+			return hr;
+		}
+
+		// Reopen unbuffered; chunks are page aligned and whole multiples of 64 KB, which
+		// satisfies the sector alignment FILE_FLAG_NO_BUFFERING requires
+		bool bDirect = false;
+		if (options.ullDirectThreshold && static_cast<uint64_t>(liSize.QuadPart) >= options.ullDirectThreshold)
+		{
+			HANDLE hDirect = CreateFileW(wszFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+				FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING, NULL);
+			if (hDirect != INVALID_HANDLE_VALUE)
+			{
+				CloseHandle(hFile);
+				hFile = hDirect;
+				bDirect = true;
+				DIVE_TRACE_INSTANT("FileStream Direct", DIVE::Trace::CurrentIndex());
+			}
+		}
+
+		FileStream* pStream = new FileStream(hFile, static_cast<uint64_t>(liSize.QuadPart), bDirect, options);
+		for (auto& chunk : pStream->m_vecChunks)
+		{
+			if (!chunk.pData || !chunk.ov.hEvent)
+			{
+				pStream->Release();
+				return E_OUTOFMEMORY;
+			}
+		}
+
+		pStream->Restart(0);
+		*ppStream = pStream;
+		return S_OK;
+	}
+
+	HRESULT FileStream::Open(std::shared_ptr<const std::vector<BYTE>> bytes, FileStream** ppStream)
+	{
+		FileStream* pStream = new FileStream(INVALID_HANDLE_VALUE, bytes->size(), false, Options());
+		pStream->m_bytes = std::move(bytes);
+		*ppStream = pStream;
+		return S_OK;
+	}
+
+	FileStream::FileStream(HANDLE hFile, uint64_t ullSize, bool bDirect, const Options& options)
+		: m_nRef(1)
+		, m_hFile(hFile)
+		, m_ullSize(ullSize)
+		, m_ullPos(0)
+		, m_nHead(0)
+		, m_ullWindow(0)
+		, m_bDirect(bDirect)
+	{
+		// Round to whole 64 KB units so every read starts on a sector and allocation boundary
+		m_nChunkSize = (std::max(options.nChunkSize, kMinChunkSize) + kMinChunkSize - 1) & ~(kMinChunkSize - 1);
+
+		if (m_hFile == INVALID_HANDLE_VALUE)
+			return;
+
+		// No point queueing more chunks than the file has
+		uint64_t ullChunks = (m_ullSize + m_nChunkSize - 1) / m_nChunkSize;
+		UINT nDepth = std::min(std::max(options.nDepth, 1u), kMaxDepth);
+		nDepth = static_cast<UINT>(std::max<uint64_t>(1, std::min<uint64_t>(nDepth, ullChunks)));
+
+		m_vecChunks.resize(nDepth);
+		for (auto& chunk : m_vecChunks)
+		{
+			ZeroMemory(&chunk.ov, sizeof(chunk.ov));
+			chunk.ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+			chunk.pData = static_cast<BYTE*>(VirtualAlloc(NULL, m_nChunkSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+			chunk.ullOffset = 0;
+			chunk.cbValid = 0;
+			chunk.bPending = false;
+			chunk.bFailed = false;
+		}
+	}
+
+	FileStream::~FileStream()
+	{
+		Cancel();
+
+		for (auto& chunk : m_vecChunks)
+		{
+			if (chunk.ov.hEvent)
+				CloseHandle(chunk.ov.hEvent);
+			if (chunk.pData)
+				VirtualFree(chunk.pData, 0, MEM_RELEASE);
+		}
+		if (m_hFile != INVALID_HANDLE_VALUE)
+			CloseHandle(m_hFile);
+	}
+
+	void FileStream::Issue(Chunk& chunk, uint64_t ullOffset)
+	{
+		chunk.ullOffset = ullOffset;
+		chunk.cbValid = 0;
+		chunk.bPending = false;
+		chunk.bFailed = false;
+
+		if (ullOffset >= m_ullSize)
+			return;
+
+		// Unbuffered reads must be whole sectors; the tail read simply comes back short
+		DWORD cbRead = m_bDirect ? m_nChunkSize : static_cast<DWORD>(std::min<uint64_t>(m_nChunkSize, m_ullSize - ullOffset));
+
+		chunk.ov.Offset = static_cast<DWORD>(ullOffset);
+		chunk.ov.OffsetHigh = static_cast<DWORD>(ullOffset >> 32);
+		ResetEvent(chunk.ov.hEvent);
+
+		if (ReadFile(m_hFile, chunk.pData, cbRead, NULL, &chunk.ov) || GetLastError() == ERROR_IO_PENDING)
+			chunk.bPending = true;
+		else
+			chunk.bFailed = true;
+	}
+
+	bool FileStream::Complete(Chunk& chunk)
+	{
+		if (chunk.bPending)
+		{
+			DIVE_TRACE_SPAN(span, "FileStream::Wait");
+
+			DWORD cbTransferred = 0;
+			if (GetOverlappedResult(m_hFile, &chunk.ov, &cbTransferred, TRUE))
+				chunk.cbValid = cbTransferred;
+			else
+				chunk.bFailed = GetLastError() != ERROR_HANDLE_EOF;
+			chunk.bPending = false;
+
+			DIVE_TRACE_BYTES(span, chunk.cbValid);
+		}
+		return !chunk.bFailed;
+	}
+
+	void FileStream::Cancel()
+	{
+		for (auto& chunk : m_vecChunks)
+		{
+			if (chunk.bPending)
+			{
+				DWORD cbTransferred = 0;
+				CancelIoEx(m_hFile, &chunk.ov);
+				GetOverlappedResult(m_hFile, &chunk.ov, &cbTransferred, TRUE);
+				chunk.bPending = false;
+			}
+		}
+	}
+
+	void FileStream::Restart(uint64_t ullOffset)
+	{
+		Cancel();
+
+		m_nHead = 0;
+		m_ullWindow = ullOffset - ullOffset % m_nChunkSize;
+		for (size_t i = 0; i < m_vecChunks.size(); ++i)
+			Issue(m_vecChunks[i], m_ullWindow + i * m_nChunkSize);
+	}
+
+	FileStream::Chunk* FileStream::Locate(uint64_t ullOffset)
+	{
+		uint64_t ullEnd = m_ullWindow + m_vecChunks.size() * m_nChunkSize;
+		if (ullOffset < m_ullWindow || ullOffset >= ullEnd + m_nChunkSize)
+		{
+			Restart(ullOffset);
+		}
+		else
+		{
+			// Sequential progress: hand the consumed head chunks back to the ring as reads further ahead
+			while (ullOffset >= m_ullWindow + m_nChunkSize)
+			{
+				Chunk& head = m_vecChunks[m_nHead];
+				Complete(head);
+				Issue(head, m_ullWindow + m_vecChunks.size() * m_nChunkSize);
+
+				m_nHead = (m_nHead + 1) % m_vecChunks.size();
+				m_ullWindow += m_nChunkSize;
+			}
+		}
+
+		size_t nIndex = (m_nHead + static_cast<size_t>((ullOffset - m_ullWindow) / m_nChunkSize)) % m_vecChunks.size();
+		Chunk& chunk = m_vecChunks[nIndex];
+		return Complete(chunk) ? &chunk : nullptr;
+	}
+
+	size_t FileStream::ReadBytes(void* pv, size_t cb)
+	{
+		BYTE* pDest = static_cast<BYTE*>(pv);
+		size_t cbDone = 0;
+
+		if (m_bytes)
+		{
+			if (m_ullPos < m_ullSize)
+			{
+				cbDone = static_cast<size_t>(std::min<uint64_t>(cb, m_ullSize - m_ullPos));
+				memcpy(pDest, m_bytes->data() + m_ullPos, cbDone);
+				m_ullPos += cbDone;
+			}
+			return cbDone;
+		}
+
+		while (cbDone < cb && m_ullPos < m_ullSize)
+		{
+			Chunk* pChunk = Locate(m_ullPos);
+			if (!pChunk)
+				break;
+
+			size_t nOffset = static_cast<size_t>(m_ullPos - pChunk->ullOffset);
+			if (nOffset >= pChunk->cbValid)
+				break;
+
+			size_t n = std::min<size_t>(cb - cbDone, pChunk->cbValid - nOffset);
+			memcpy(pDest + cbDone, pChunk->pData + nOffset, n);
+			cbDone += n;
+			m_ullPos += n;
+		}
+		return cbDone;
+	}
+
+	bool FileStream::SeekTo(int64_t llOffset, DWORD dwOrigin)
+	{
+		int64_t llBase = 0;
+		switch (dwOrigin)
+		{
+		case STREAM_SEEK_SET: llBase = 0; break;
+		case STREAM_SEEK_CUR: llBase = static_cast<int64_t>(m_ullPos); break;
+		case STREAM_SEEK_END: llBase = static_cast<int64_t>(m_ullSize); break;
+		default: return false;
+		}
+		if (llBase + llOffset < 0)
+			return false;
+
+		// The ring follows lazily on the next read
+		m_ullPos = static_cast<uint64_t>(llBase + llOffset);
+		return true;
+	}
+
+	STDMETHODIMP FileStream::QueryInterface(REFIID riid, void** ppv)
+	{
+		if (!ppv)
+			return E_POINTER;
+
+		if (riid == __uuidof(IUnknown) || riid == __uuidof(ISequentialStream) || riid == __uuidof(IStream))
+		{
+			*ppv = static_cast<IStream*>(this);
+			AddRef();
+			return S_OK;
+		}
+		*ppv = nullptr;
+		return E_NOINTERFACE;
+	}
+
+	STDMETHODIMP_(ULONG) FileStream::AddRef()
+	{
+		return ++m_nRef;
+	}
+
+	STDMETHODIMP_(ULONG) FileStream::Release()
+	{
+		ULONG nRef = --m_nRef;
+		if (nRef == 0)
+			delete this;
+		return nRef;
+	}
+
+	STDMETHODIMP FileStream::Read(void* pv, ULONG cb, ULONG* pcbRead)
+	{
+		if (!pv)
+			return STG_E_INVALIDPOINTER;
+
+		ULONG cbRead = static_cast<ULONG>(ReadBytes(pv, cb));
+		if (pcbRead)
+			*pcbRead = cbRead;
+		return cbRead == cb ? S_OK : S_FALSE;
+	}
+
+	STDMETHODIMP FileStream::Write(const void*, ULONG, ULONG*)
+	{
+		return STG_E_ACCESSDENIED;
+	}
+
+	STDMETHODIMP FileStream::Seek(LARGE_INTEGER dlibMove, DWORD dwOrigin, ULARGE_INTEGER* plibNewPosition)
+	{
+		if (!SeekTo(dlibMove.QuadPart, dwOrigin))
+			return STG_E_INVALIDFUNCTION;
+
+		if (plibNewPosition)
+			plibNewPosition->QuadPart = m_ullPos;
+		return S_OK;
+	}
+
+	STDMETHODIMP FileStream::SetSize(ULARGE_INTEGER)
+	{
+		return STG_E_ACCESSDENIED;
+	}
+
+	STDMETHODIMP FileStream::CopyTo(IStream*, ULARGE_INTEGER, ULARGE_INTEGER*, ULARGE_INTEGER*)
+	{
+		return E_NOTIMPL;
+	}
+
+	STDMETHODIMP FileStream::Commit(DWORD)
+	{
+		return S_OK;
+	}
+
+	STDMETHODIMP FileStream::Revert()
+	{
+		return S_OK;
+	}
+
+	STDMETHODIMP FileStream::LockRegion(ULARGE_INTEGER, ULARGE_INTEGER, DWORD)
+	{
+		return STG_E_INVALIDFUNCTION;
+	}
+
+	STDMETHODIMP FileStream::UnlockRegion(ULARGE_INTEGER, ULARGE_INTEGER, DWORD)
+	{
+		return STG_E_INVALIDFUNCTION;
+	}
+
+	STDMETHODIMP FileStream::Stat(STATSTG* pstatstg, DWORD)
+	{
+		if (!pstatstg)
+			return STG_E_INVALIDPOINTER;
+
+		ZeroMemory(pstatstg, sizeof(*pstatstg));
+		pstatstg->type = STGTY_STREAM;
+		pstatstg->cbSize.QuadPart = m_ullSize;
+		pstatstg->grfMode = STGM_READ;
+		return S_OK;
+	}
+
+	STDMETHODIMP FileStream::Clone(IStream**)
+	{
+		return E_NOTIMPL;
+	}
+}
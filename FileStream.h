@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+namespace DIVE
+{
+	// Read-only IStream over a file that keeps a ring of overlapped reads running ahead of
+	// the consumer. The decoder works on the first chunk while the following ones are still
+	// in flight; a seek outside the ring restarts it at the new position. A stream can also
+	// be opened over bytes that were already read, in which case no I/O is issued.
+	class FileStream : public IStream
+	{
+	public:
+		struct Options
+		{
+			UINT nChunkSize;
+			UINT nDepth;
+
+			// Files at least this large bypass the system file cache (0 = never). Their bytes
+			// end up in our own image cache anyway and would only evict everyone else's pages.
+			uint64_t ullDirectThreshold;
+
+			Options()
+				: nChunkSize(1 << 20)
+				, nDepth(4)
+				, ullDirectThreshold(64ull << 20)
+			{
+			}
+		};
+
+		static HRESULT Open(const wchar_t* wszFileName, const Options& options, FileStream** ppStream);
+		static HRESULT Open(std::shared_ptr<const std::vector<BYTE>> bytes, FileStream** ppStream);
+
+		// Plain byte access for readers that are not COM clients (libtga)
+		size_t ReadBytes(void* pv, size_t cb);
+		bool SeekTo(int64_t llOffset, DWORD dwOrigin);
+		uint64_t Position() const { return m_ullPos; }
+		uint64_t Size() const { return m_ullSize; }
+
+		// IUnknown
+		STDMETHOD(QueryInterface)(REFIID riid, void** ppv) override;
+		STDMETHOD_(ULONG, AddRef)() override;
+		STDMETHOD_(ULONG, Release)() override;
+
+		// ISequentialStream
+		STDMETHOD(Read)(void* pv, ULONG cb, ULONG* pcbRead) override;
+		STDMETHOD(Write)(const void* pv, ULONG cb, ULONG* pcbWritten) override;
+
+		// IStream
+		STDMETHOD(Seek)(LARGE_INTEGER dlibMove, DWORD dwOrigin, ULARGE_INTEGER* plibNewPosition) override;
+		STDMETHOD(SetSize)(ULARGE_INTEGER libNewSize) override;
+		STDMETHOD(CopyTo)(IStream* pstm, ULARGE_INTEGER cb, ULARGE_INTEGER* pcbRead, ULARGE_INTEGER* pcbWritten) override;
+		STDMETHOD(Commit)(DWORD grfCommitFlags) override;
+		STDMETHOD(Revert)() override;
+		STDMETHOD(LockRegion)(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType) override;
+		STDMETHOD(UnlockRegion)(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType) override;
+		STDMETHOD(Stat)(STATSTG* pstatstg, DWORD grfStatFlag) override;
+		STDMETHOD(Clone)(IStream** ppstm) override;
+
+	private:
+		struct Chunk
+		{
+			OVERLAPPED ov;
+			BYTE* pData;
+			uint64_t ullOffset;
+			DWORD cbValid;
+			bool bPending;
+			bool bFailed;
+		};
+
+		FileStream(HANDLE hFile, uint64_t ullSize, bool bDirect, const Options& options);
+		~FileStream();
+
+		void Issue(Chunk& chunk, uint64_t ullOffset);
+		bool Complete(Chunk& chunk);
+		void Cancel();
+		void Restart(uint64_t ullOffset);
+		Chunk* Locate(uint64_t ullOffset);
+
+		std::atomic<ULONG> m_nRef;
+		HANDLE m_hFile;
+		std::shared_ptr<const std::vector<BYTE>> m_bytes;
+		uint64_t m_ullSize;
+		uint64_t m_ullPos;
+
+		// m_vecChunks[m_nHead] covers m_ullWindow, the next ones follow contiguously
+		std::vector<Chunk> m_vecChunks;
+		size_t m_nHead;
+		uint64_t m_ullWindow;
+		UINT m_nChunkSize;
+		bool m_bDirect;
+	};
+}
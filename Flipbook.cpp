@@ -0,0 +1,139 @@
+#include "stdafx.h"
+#include "Flipbook.h"
+#include "ImageLoader.h"
+#include "Trace.h"
+#include <algorithm>
+
+namespace DIVE
+{
+	static const size_t kRingBudget = 512 << 20;		// bytes of decoded frames kept ahead
+
+	Flipbook::Flipbook()
+		: m_nFirst(0)
+		, m_nSlots(8)
+		, m_bStop(false)
+		, m_bLimited(false)
+		, m_nClockStart(0)
+		, m_nDecodeMicros(0)
+	{
+		int nFps = 24;
+		wchar_t wszValue[32];
+		if (GetEnvironmentVariableW(L"DIVE_FLIPBOOK_FPS", wszValue, 32) && _wtoi(wszValue) > 0)
+			nFps = _wtoi(wszValue);
+		m_interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / nFps));
+
+		// A few frames per decoder absorb the files that take longer than average
+		m_nSlots = std::max<size_t>(8, 3 * std::max(1u, std::thread::hardware_concurrency()));
+	}
+
+	Flipbook::~Flipbook()
+	{
+		Stop();
+	}
+
+	void Flipbook::Start(std::vector<std::wstring>&& vecFiles, UINT nFirst)
+	{
+		Stop();
+		if (vecFiles.empty())
+			return;
+
+		m_vecFiles = std::move(vecFiles);
+		m_nFirst = nFirst % m_vecFiles.size();
+		m_ring.Reset(m_nSlots);
+		m_bStop = false;
+		m_bLimited = false;
+		m_nClockStart = 0;
+
+		// The UI thread presents; every other core decodes
+		UINT nThreads = std::max(1u, std::thread::hardware_concurrency() - 1);
+		for (UINT i = 0; i < nThreads; ++i)
+			m_vecThreads.emplace_back(&Flipbook::Run, this);
+	}
+
+	void Flipbook::Stop()
+	{
+		if (m_vecThreads.empty())
+			return;
+
+		m_bStop = true;
+		m_ring.Stop();
+		for (auto& thread : m_vecThreads)
+			thread.join();
+		m_vecThreads.clear();
+	}
+
+	bool Flipbook::IsStopping(const void* pContext)
+	{
+		return static_cast<const Flipbook*>(pContext)->m_bStop;
+	}
+
+	bool Flipbook::Prime()
+	{
+		if (m_nClockStart)
+			return true;
+		if (m_ring.Ready() < std::min<size_t>(m_vecFiles.size(), m_ring.Capacity()))
+			return false;
+
+		m_nClockStart = Clock::now().time_since_epoch().count();
+		DIVE_TRACE_INSTANT("Flipbook Primed", -1);
+		return true;
+	}
+
+	uint64_t Flipbook::Due() const
+	{
+		Clock::rep nStart = m_nClockStart;
+		if (!nStart)
+			return 0;
+		return static_cast<uint64_t>((Clock::now() - Clock::time_point(Clock::duration(nStart))) / m_interval);
+	}
+
+	// A frame is late once the frame after it is due; nothing would ever show it
+	bool Flipbook::IsLate(uint64_t nSequence) const
+	{
+		return m_nClockStart && nSequence < Due();
+	}
+
+	void Flipbook::Run()
+	{
+		DIVE_TRACE_THREAD("Flipbook");
+		CoInitializeEx(NULL, COINIT_MULTITHREADED);
+		{
+			ImageLoader loader;
+			CancelToken cancel(IsStopping, this);
+			uint64_t nSequence;
+			Frame* pFrame;
+
+			while (m_ring.Claim(nSequence, pFrame))
+			{
+				UINT nFrame = static_cast<UINT>((m_nFirst + nSequence) % m_vecFiles.size());
+				pFrame->nFrame = nFrame;
+				pFrame->delay = std::chrono::milliseconds(0);
+
+				if (IsLate(nSequence))
+				{
+					pFrame->nWidth = pFrame->nHeight = 0;
+					DIVE_TRACE_INSTANT("Flipbook Skip", nFrame);
+				}
+				else
+				{
+					DIVE_TRACE_CONTEXT(nFrame);
+					auto tStart = Clock::now();
+					HRESULT hr = loader.LoadInto(m_vecFiles[nFrame].c_str(), pFrame->pixels, pFrame->nWidth, pFrame->nHeight, cancel);
+					if (FAILED(hr))
+						pFrame->nWidth = pFrame->nHeight = 0;
+					else if (!m_bLimited.exchange(true))
+						m_ring.Limit(std::max<size_t>(2, kRingBudget / (static_cast<size_t>(pFrame->nWidth) * pFrame->nHeight * 4)));
+
+					// Every decoder folds into the one average
+					int nMicros = static_cast<int>(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - tStart).count());
+					int nAverage = m_nDecodeMicros.load(std::memory_order_relaxed);
+					while (!m_nDecodeMicros.compare_exchange_weak(nAverage, nAverage ? (nAverage * 7 + nMicros) / 8 : nMicros, std::memory_order_relaxed))
+						;
+					DIVE_TRACE_COUNTER("Flipbook Decode ms", nMicros / 1000.0);
+				}
+				m_ring.Fill(nSequence);
+			}
+		}
+		CoUninitialize();
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include "FrameRing.h"
+
+namespace DIVE
+{
+	// Plays a numbered image sequence (shot_0001.tga ... shot_2400.tga) at a fixed frame rate.
+	// Several decoders fill a shared FrameRing, whose buffers are reused frame after frame;
+	// the clock starts once the ring is full. A decoder that claims a frame whose time has
+	// already passed skips it rather than decoding it, so a sequence that decodes too slowly
+	// drops frames and stays in time instead of slowing down. The sequence loops.
+	class Flipbook
+	{
+	public:
+		typedef std::chrono::steady_clock Clock;
+
+		Flipbook();
+		~Flipbook();
+
+		// Frame n of the ring shows vecFiles[(nFirst + n) % size]
+		void Start(std::vector<std::wstring>&& vecFiles, UINT nFirst);
+		void Stop();
+
+		bool IsRunning() const { return !m_vecThreads.empty(); }
+		UINT Frames() const { return static_cast<UINT>(m_vecFiles.size()); }
+		Clock::duration Interval() const { return m_interval; }
+		int DecodeMicros() const { return m_nDecodeMicros; }
+		FrameRing& Ring() { return m_ring; }
+
+		// Viewer side: starts the clock once the ring is full, then tells which frame is due
+		bool Prime();
+		uint64_t Due() const;
+
+	private:
+		void Run();
+		bool IsLate(uint64_t nSequence) const;
+		static bool IsStopping(const void* pContext);
+
+		std::vector<std::wstring> m_vecFiles;
+		UINT m_nFirst;
+		std::vector<std::thread> m_vecThreads;
+		FrameRing m_ring;
+		size_t m_nSlots;
+		Clock::duration m_interval;
+		std::atomic<bool> m_bStop;
+		std::atomic<bool> m_bLimited;
+		std::atomic<Clock::rep> m_nClockStart;		// ticks of frame 0, or 0 until primed
+		std::atomic<int> m_nDecodeMicros;
+	};
+}
@@ -0,0 +1,141 @@
+#include "stdafx.h"
+#include "FrameRing.h"
+#include <algorithm>
+
+namespace DIVE
+{
+	FrameRing::FrameRing()
+		: m_vecSlots(1)
+		, m_nLimit(1)
+		, m_nClaimed(0)
+		, m_nConsumed(0)
+		, m_bStopped(false)
+	{
+	}
+
+	void FrameRing::Reset(size_t nSlots)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		// Buffers survive a restart on the same file, so seeking does not reallocate
+		m_vecSlots.resize(std::max<size_t>(1, nSlots));
+		m_nLimit = m_vecSlots.size();
+		for (Slot& slot : m_vecSlots)
+		{
+			slot.bClaimed = false;
+			slot.bReady = false;
+		}
+		m_nClaimed = 0;
+		m_nConsumed = 0;
+		m_bStopped = false;
+	}
+
+	FrameRing::Slot* FrameRing::Find(uint64_t nSequence)
+	{
+		for (Slot& slot : m_vecSlots)
+		{
+			if (slot.bClaimed && slot.nSequence == nSequence)
+				return &slot;
+		}
+		return nullptr;
+	}
+
+	void FrameRing::Release(size_t nSlot)
+	{
+		std::vector<BYTE>().swap(m_vecSlots[nSlot].frame.pixels);
+	}
+
+	bool FrameRing::Claim(uint64_t& nSequence, Frame*& pFrame)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_cvFree.wait(lock, [this]() { return m_bStopped || m_nClaimed < m_nConsumed + m_nLimit; });
+		if (m_bStopped)
+			return false;
+
+		// Fewer than m_nLimit frames are in flight, so one of the slots below it is free even
+		// when frames claimed before the limit dropped still sit above it
+		Slot* pSlot = nullptr;
+		for (size_t i = 0; i < m_nLimit && !pSlot; ++i)
+		{
+			if (!m_vecSlots[i].bClaimed)
+				pSlot = &m_vecSlots[i];
+		}
+
+		nSequence = m_nClaimed++;
+		pSlot->nSequence = nSequence;
+		pSlot->bClaimed = true;
+		pFrame = &pSlot->frame;
+		return true;
+	}
+
+	void FrameRing::Fill(uint64_t nSequence)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (Slot* pSlot = Find(nSequence))
+			pSlot->bReady = true;
+	}
+
+	void FrameRing::Stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_bStopped = true;
+		}
+		m_cvFree.notify_all();
+	}
+
+	void FrameRing::Limit(size_t nSlots)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_nLimit = std::max<size_t>(1, std::min(nSlots, m_vecSlots.size()));
+		for (size_t i = m_nLimit; i < m_vecSlots.size(); ++i)
+		{
+			if (!m_vecSlots[i].bClaimed)
+				Release(i);
+		}
+	}
+
+	const Frame* FrameRing::Front()
+	{
+		// The slot is not claimed again until Pop, so the frame can be read without the lock
+		std::lock_guard<std::mutex> lock(m_mutex);
+		const Slot* pSlot = Find(m_nConsumed);
+		return pSlot && pSlot->bReady ? &pSlot->frame : nullptr;
+	}
+
+	void FrameRing::Pop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			Slot* pSlot = Find(m_nConsumed);
+			if (!pSlot || !pSlot->bReady)
+				return;
+			pSlot->bClaimed = false;
+			pSlot->bReady = false;
+			if (static_cast<size_t>(pSlot - m_vecSlots.data()) >= m_nLimit)
+				Release(pSlot - m_vecSlots.data());
+			++m_nConsumed;
+		}
+		m_cvFree.notify_all();
+	}
+
+	size_t FrameRing::Capacity()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_nLimit;
+	}
+
+	size_t FrameRing::Ready()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		size_t nReady = 0;
+		for (uint64_t n = m_nConsumed; n < m_nClaimed; ++n)
+		{
+			const Slot* pSlot = Find(n);
+			if (!pSlot || !pSlot->bReady)
+				break;
+			++nReady;
+		}
+		return nReady;
+	}
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+
+namespace DIVE
+{
+	// One decoded frame, 32bpp premultiplied BGRA with no row padding. The buffer may be
+	// larger than the frame when it held a bigger one before. A frame of width 0 stands for
+	// one that failed to decode or was skipped; its buffer is kept for the next use.
+	struct Frame
+	{
+		UINT nFrame = 0;
+		UINT nWidth = 0;
+		UINT nHeight = 0;
+		std::chrono::milliseconds delay{ 0 };	// time on screen when playing, 0 when untimed
+		std::vector<BYTE> pixels;				// capacity is kept when the slot is reused
+	};
+
+	// A fixed number of frame buffers between decoder threads and the UI thread. Frames are
+	// numbered in display order and each is decoded into a free slot below the limit, so
+	// memory stays at that many frames however long the sequence and buffers are reused
+	// rather than reallocated. Decoders may finish out of order; the viewer always takes
+	// frames in order and never waits.
+	class FrameRing
+	{
+	public:
+		FrameRing();
+
+		// Drops every frame and starts numbering from zero again with nSlots buffers. Only
+		// while no decoder is running.
+		void Reset(size_t nSlots);
+
+		// Decoder side. Claim blocks until the slot of the next number is free and returns
+		// false once the ring is stopped; Fill hands the frame over.
+		bool Claim(uint64_t& nSequence, Frame*& pFrame);
+		void Fill(uint64_t nSequence);
+		void Stop();
+
+		// Keeps decoders at most nSlots frames ahead, for frames too large to fill every slot.
+		// Slots past the limit give their buffers back as soon as they are free.
+		void Limit(size_t nSlots);
+
+		// Viewer side. Front is the next frame in order once it is decoded, or null.
+		const Frame* Front();
+		void Pop();
+
+		// Decoded frames waiting, and how many decoders may run ahead
+		size_t Ready();
+		size_t Capacity();
+		size_t Slots() const { return m_vecSlots.size(); }
+
+	private:
+		struct Slot
+		{
+			Frame frame;
+			uint64_t nSequence = 0;
+			bool bClaimed = false;
+			bool bReady = false;
+		};
+
+		Slot* Find(uint64_t nSequence);
+		void Release(size_t nSlot);
+
+		std::mutex m_mutex;
+		std::condition_variable m_cvFree;
+		std::vector<Slot> m_vecSlots;
+		size_t m_nLimit;
+		uint64_t m_nClaimed;	// next number handed to a decoder
+		uint64_t m_nConsumed;	// next number the viewer takes
+		bool m_bStopped;
+	};
+}
@@ -0,0 +1,123 @@
+#include "stdafx.h"
+#include "GpuUploadDevice.h"
+#include "BlockImage.h"
+
+namespace DIVE
+{
+	GpuUploadDevice::GpuUploadDevice(ID2D1RenderTarget* pRenderTarget, ID3D11Device* pDevice)
+		: m_pRenderTarget(pRenderTarget)
+		, m_pDevice(pDevice)
+	{
+	}
+
+	void GpuUploadDevice::BeginThread()
+	{
+		// WIC sources are read on this thread by the jobs' fill steps
+		CoInitializeEx(NULL, COINIT_MULTITHREADED);
+		if (m_pDevice)
+			m_pDevice->CreateDeferredContext(0, &m_pDeferred);
+	}
+
+	void GpuUploadDevice::EndThread()
+	{
+		m_pDeferred.Release();
+		CoUninitialize();
+	}
+
+	HRESULT GpuUploadDevice::Create(const UploadJob& job, const BYTE* pData, std::unique_ptr<UploadResource>& pResource)
+	{
+		std::unique_ptr<GpuUpload> pUpload(new GpuUpload);
+		HRESULT hr = S_OK;
+		if (job.nFlags & kUploadBitmap)
+			hr = CreateBitmap(job, pData, *pUpload);
+		// Only the bitmap is drawn; an image without its texture still goes on screen
+		if (SUCCEEDED(hr) && (job.nFlags & kUploadTexture) && pData && FAILED(CreateTexture(job, pData, *pUpload)))
+		{
+			pUpload->pTexture.Release();
+			pUpload->pCommands.Release();
+		}
+		if (SUCCEEDED(hr))
+			pResource = std::move(pUpload);
+		return hr;
+	}
+
+	// Direct2D takes BC1-BC3 natively through the device context
+	HRESULT GpuUploadDevice::CreateBitmap(const UploadJob& job, const BYTE* pData, GpuUpload& upload)
+	{
+		DXGI_FORMAT format = static_cast<DXGI_FORMAT>(job.nFormat);
+		if (BlockBytes(format))
+		{
+			CComPtr<ID2D1DeviceContext> pContext;
+			HRESULT hr = m_pRenderTarget->QueryInterface(&pContext);
+			ID2D1Bitmap1* pBitmap = nullptr;
+			if (SUCCEEDED(hr))
+				hr = pContext->CreateBitmap(
+					D2D1::SizeU(job.nWidth, job.nHeight),
+					pData,
+					job.nPitch,
+					D2D1::BitmapProperties1(D2D1_BITMAP_OPTIONS_NONE, D2D1::PixelFormat(format, D2D1_ALPHA_MODE_PREMULTIPLIED)),
+					&pBitmap
+				);
+			if (SUCCEEDED(hr))
+				upload.pBitmap.Attach(pBitmap);
+			return hr;
+		}
+
+		return m_pRenderTarget->CreateBitmap(
+			D2D1::SizeU(job.nWidth, job.nHeight),
+			pData,
+			job.nPitch,
+			D2D1::BitmapProperties(D2D1::PixelFormat(format, D2D1_ALPHA_MODE_PREMULTIPLIED)),
+			&upload.pBitmap
+		);
+	}
+
+	// BC textures cannot be render targets, so they are immutable with the one level; others
+	// get their mip chain generated on the GPU
+	HRESULT GpuUploadDevice::CreateTexture(const UploadJob& job, const BYTE* pData, GpuUpload& upload)
+	{
+		DXGI_FORMAT format = static_cast<DXGI_FORMAT>(job.nFormat);
+		bool bBlocks = BlockBytes(format) != 0;
+		if (!bBlocks && !m_pDeferred)
+			return E_FAIL;
+
+		D3D11_TEXTURE2D_DESC desc;
+		desc.Width = job.nWidth;
+		desc.Height = job.nHeight;
+		desc.MipLevels = bBlocks ? 1 : 0;
+		desc.ArraySize = 1;
+		desc.Format = format;
+		desc.SampleDesc.Count = 1;
+		desc.SampleDesc.Quality = 0;
+		desc.Usage = bBlocks ? D3D11_USAGE_IMMUTABLE : D3D11_USAGE_DEFAULT;
+		desc.BindFlags = bBlocks ? D3D11_BIND_SHADER_RESOURCE : D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET;
+		desc.CPUAccessFlags = 0;
+		desc.MiscFlags = bBlocks ? 0 : D3D11_RESOURCE_MISC_GENERATE_MIPS;
+
+		D3D11_SUBRESOURCE_DATA initData;
+		initData.pSysMem = pData;
+		initData.SysMemPitch = job.nPitch;
+		initData.SysMemSlicePitch = job.nPitch * job.nRows;
+
+		CComPtr<ID3D11Texture2D> pTexture;
+		HRESULT hr = m_pDevice->CreateTexture2D(&desc, bBlocks ? &initData : nullptr, &pTexture);
+		if (SUCCEEDED(hr) && bBlocks)
+			return m_pDevice->CreateShaderResourceView(pTexture, nullptr, &upload.pTexture);
+
+		D3D11_SHADER_RESOURCE_VIEW_DESC SRVDesc;
+		memset(&SRVDesc, 0, sizeof(SRVDesc));
+		SRVDesc.Format = format;
+		SRVDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+		SRVDesc.Texture2D.MipLevels = -1;
+
+		if (SUCCEEDED(hr))
+			hr = m_pDevice->CreateShaderResourceView(pTexture, &SRVDesc, &upload.pTexture);
+		if (SUCCEEDED(hr))
+		{
+			m_pDeferred->UpdateSubresource(pTexture, 0, nullptr, pData, job.nPitch, job.nPitch * job.nRows);
+			m_pDeferred->GenerateMips(upload.pTexture);
+			hr = m_pDeferred->FinishCommandList(FALSE, &upload.pCommands);
+		}
+		return hr;
+	}
+}
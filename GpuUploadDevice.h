@@ -0,0 +1,38 @@
+#pragma once
+
+#include <d3d11_1.h>
+#include "Uploader.h"
+
+namespace DIVE
+{
+	// What an upload made for the render thread: the Direct2D bitmap, the texture, and the
+	// commands that fill in the texture, to be run on the immediate context
+	class GpuUpload : public UploadResource
+	{
+	public:
+		CComPtr<ID2D1Bitmap> pBitmap;
+		CComPtr<ID3D11ShaderResourceView> pTexture;
+		CComPtr<ID3D11CommandList> pCommands;
+	};
+
+	// Creates bitmaps through the render target (its factory is multithreaded, so this only
+	// contends with drawing for the factory lock) and records texture contents and mip
+	// generation on a deferred context, so the immediate context stays with the render thread.
+	class GpuUploadDevice : public UploadDevice
+	{
+	public:
+		GpuUploadDevice(ID2D1RenderTarget* pRenderTarget, ID3D11Device* pDevice);
+
+		void BeginThread() override;
+		void EndThread() override;
+		HRESULT Create(const UploadJob& job, const BYTE* pData, std::unique_ptr<UploadResource>& pResource) override;
+
+	private:
+		HRESULT CreateBitmap(const UploadJob& job, const BYTE* pData, GpuUpload& upload);
+		HRESULT CreateTexture(const UploadJob& job, const BYTE* pData, GpuUpload& upload);
+
+		CComPtr<ID2D1RenderTarget> m_pRenderTarget;
+		CComPtr<ID3D11Device> m_pDevice;
+		CComPtr<ID3D11DeviceContext> m_pDeferred;
+	};
+}
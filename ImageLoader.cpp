@@ -1,23 +1,37 @@
 #include "stdafx.h"
 #include "ImageLoader.h"
 #include "tga.h"
+#include "Trace.h"
+#include "FileStream.h"
+#include "PixelFormat.h"
 #include <dwrite.h>
 #include <d2d1helper.h>
 #include <d2d1effects.h>
 #include <string>
 #include <algorithm>
+#include <memory>
+#include <chrono>
 
 namespace DIVE
 {
 
 	ImageLoader::ImageLoader()
+		: m_pReadAhead(nullptr)
 	{
 		HRESULT hr;
 
 		hr = CoCreateInstance(CLSID_WICImagingFactory, NULL,
 			CLSCTX_INPROC_SERVER, IID_IWICImagingFactory,
 			(LPVOID*)&m_pWICFactory);
-		
+
+		// Read-ahead tuning for slow network shares
+		wchar_t wszValue[32];
+		if (GetEnvironmentVariableW(L"DIVE_IO_CHUNK_KB", wszValue, 32))
+			m_streamOptions.nChunkSize = _wtoi(wszValue) * 1024;
+		if (GetEnvironmentVariableW(L"DIVE_IO_DEPTH", wszValue, 32))
+			m_streamOptions.nDepth = _wtoi(wszValue);
+		if (GetEnvironmentVariableW(L"DIVE_IO_DIRECT_MB", wszValue, 32))
+			m_streamOptions.ullDirectThreshold = static_cast<uint64_t>(_wtoi(wszValue)) << 20;
 	}
 	ImageLoader::~ImageLoader()
 	{
@@ -32,6 +46,25 @@ namespace DIVE
 		return std::string( szTemp );
 	}
 
+	// Layout of uncompressed true-colour and greyscale TGA rows as libtga hands them out
+	// with TGA_BGR; colour-mapped images are left to libtga
+	static const PixelFormatInfo* TGAPixelFormat(const TGA* pTGA)
+	{
+		if (TGA_IS_MAPPED(pTGA))
+			return nullptr;
+
+		switch (pTGA->hdr.depth)
+		{
+		case 8:
+			return (pTGA->hdr.img_t & 7) == 3 ? FindPixelFormat(GUID_WICPixelFormat8bppGray) : nullptr;
+		case 24:
+			return FindPixelFormat(GUID_WICPixelFormat24bppBGR);
+		case 32:
+			return FindPixelFormat(GUID_WICPixelFormat32bppBGRA);
+		}
+		return nullptr;
+	}
+
 	static HRESULT TGA2BitmapSource(TGA* pTGA, TGAData* pTGAData, IWICImagingFactory *factory, IWICBitmapSource **bitmapSource)
 	{
 		HRESULT result = S_OK;
@@ -39,7 +72,7 @@ namespace DIVE
 		IWICBitmap *bitmap = NULL;
 		IWICBitmapLock *bitmapLock = NULL;
 
-		WICPixelFormatGUID pixelFormat = { 0 };
+		const PixelFormatInfo* pFormat = nullptr;
 		UINT srcStride = 0;
 		UINT destStride = 0;
 		UINT cbBufferSize = 0;
@@ -49,27 +82,19 @@ namespace DIVE
 		{
 			result = E_INVALIDARG;
 		}
-
-		if (pTGA->hdr.depth == 32)
-		{
-			pixelFormat = GUID_WICPixelFormat32bppBGRA;
-			srcStride = pTGA->hdr.width * 4;
-		}
-		else if (pTGA->hdr.depth == 24)
+		else if ((pFormat = TGAPixelFormat(pTGA)) != nullptr)
 		{
-			pixelFormat = GUID_WICPixelFormat24bppBGR;
-			srcStride = pTGA->hdr.width * 3;
+			srcStride = pTGA->hdr.width * pFormat->nBitsPerPixel / 8;
 		}
 		else
 		{
-			MessageBox(NULL, L"Pixel Format Error", L"FIC", MB_OK);
-			result = E_INVALIDARG;
+			result = WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT;
 		}
 
 		// Create the bitmap
 		if (SUCCEEDED(result))
 		{
-			result = factory->CreateBitmap(pTGA->hdr.width, pTGA->hdr.height, pixelFormat, WICBitmapCacheOnLoad, &bitmap);
+			result = factory->CreateBitmap(pTGA->hdr.width, pTGA->hdr.height, *pFormat->pGuid, WICBitmapCacheOnLoad, &bitmap);
 		}
 
 		// Set the resolution
@@ -145,92 +170,834 @@ namespace DIVE
 		return result;
 	}
 
-	IWICBitmapSource* ImageLoader::Load(const wchar_t* wszFileName)
+	static uint64_t GetFileBytes(const wchar_t* wszFileName)
 	{
-		wchar_t wszTemp[256];
+		WIN32_FILE_ATTRIBUTE_DATA fad;
+		if (!GetFileAttributesEx(wszFileName, GetFileExInfoStandard, &fad))
+			return 0;
+		return (static_cast<uint64_t>(fad.nFileSizeHigh) << 32) | fad.nFileSizeLow;
+	}
 
-		wcscpy(wszTemp, wszFileName);
-		wcslwr(wszTemp);
-		
+	// Rows decoded between two cancellation checks, roughly 1 MB of output each
+	static UINT StripRows(UINT nStride)
+	{
+		return std::max<UINT>(1, (1u << 20) / std::max<UINT>(1, nStride));
+	}
 
-		HRESULT hr = S_OK;
+	HRESULT ImageLoader::OpenStream(const wchar_t* wszFileName, FileStream** ppStream)
+	{
+		// Bytes already fetched by the read-ahead stage need no further I/O
+		if (m_pReadAhead)
+		{
+			if (ReadAhead::Bytes bytes = m_pReadAhead->Take(wszFileName))
+				return FileStream::Open(std::move(bytes), ppStream);
+		}
+		return FileStream::Open(wszFileName, m_streamOptions, ppStream);
+	}
+
+	// libtga I/O callbacks routing every read through the read-ahead stream
+	static int TGAStreamGetc(TGA* pTGA)
+	{
+		BYTE b;
+		return static_cast<FileStream*>(pTGA->fd)->ReadBytes(&b, 1) == 1 ? b : EOF;
+	}
+
+	static size_t TGAStreamRead(TGA* pTGA, void* pBuffer, size_t nSize, size_t nCount)
+	{
+		if (nSize == 0)
+			return 0;
+		return static_cast<FileStream*>(pTGA->fd)->ReadBytes(pBuffer, nSize * nCount) / nSize;
+	}
+
+	static int TGAStreamPutc(TGA*, int)
+	{
+		return EOF;
+	}
+
+	static size_t TGAStreamWrite(TGA*, const void*, size_t, size_t)
+	{
+		return 0;
+	}
+
+	static void TGAStreamSeek(TGA* pTGA, long nOffset, int nOrigin)
+	{
+		DWORD dwOrigin = (nOrigin == SEEK_CUR) ? STREAM_SEEK_CUR : (nOrigin == SEEK_END) ? STREAM_SEEK_END : STREAM_SEEK_SET;
+		static_cast<FileStream*>(pTGA->fd)->SeekTo(nOffset, dwOrigin);
+	}
 
-		IWICBitmapSource* pWICBitmap;
+	static long TGAStreamTell(TGA* pTGA)
+	{
+		return static_cast<long>(static_cast<FileStream*>(pTGA->fd)->Position());
+	}
+
+	// Uncompressed true-colour and greyscale rows, read strip by strip and converted in place
+	static bool IsDirectTGA(const TGA* pTGA)
+	{
+		return !TGA_IS_ENCODED(pTGA) && TGAPixelFormat(pTGA) && TGAPixelFormat(pTGA)->pfnToPBGRA;
+	}
+
+	static HRESULT ReadTGARows(TGA* pTGA, BYTE* pData, UINT nDestStride, const CancelToken& cancel)
+	{
+		ConvertRowFn pfnConvert = TGAPixelFormat(pTGA)->pfnToPBGRA;
+		UINT nWidth = pTGA->hdr.width;
+		UINT nHeight = pTGA->hdr.height;
+		UINT nSrcStride = TGA_SCANLINE_SIZE(pTGA);
+
+		UINT nRows = StripRows(nSrcStride);
+		std::unique_ptr<BYTE[]> strip(new BYTE[nSrcStride * nRows]);
+
+		for (UINT y = 0; y < nHeight; y += nRows)
+		{
+			if (cancel.IsCancelled())
+				return E_ABORT;
+
+			UINT n = std::min(nRows, nHeight - y);
+			if (TGAReadScanlines(pTGA, strip.get(), y, n, TGA_BGR) != n)
+				return E_FAIL;
+			for (UINT i = 0; i < n; ++i)
+			{
+				UINT nRow = (pTGA->hdr.vert == TGA_BOTTOM) ? nHeight - 1 - (y + i) : y + i;
+				pfnConvert(strip.get() + i * nSrcStride, pData + static_cast<size_t>(nRow) * nDestStride, nWidth);
+			}
+		}
+		return S_OK;
+	}
+
+	// Header read, positioned on the image data; null on a malformed file
+	static TGA* OpenTGA(FileStream* pStream)
+	{
+		TGA* pTGA = TGAOpenUserDef(pStream,
+			TGAStreamGetc, TGAStreamRead, TGAStreamPutc, TGAStreamWrite, TGAStreamSeek, TGAStreamTell);
+		if (pTGA && TGAReadHeader(pTGA) != TGA_OK)
+		{
+			TGAClose(pTGA);
+			pTGA = nullptr;
+		}
+		return pTGA;
+	}
+
+	HRESULT ImageLoader::LoadTGA(const wchar_t* wszFileName, const CancelToken& cancel, IWICBitmapSource** ppSource)
+	{
+		CComPtr<FileStream> pStream;
+		HRESULT hr = OpenStream(wszFileName, &pStream);
+		if (FAILED(hr))
+			return hr;
+
+		TGA* pTGA = OpenTGA(pStream);
+		if (!pTGA)
+			return E_FAIL;
+
+		if (IsDirectTGA(pTGA))
+		{
+			// Straight into the cached bitmap
+			UINT nWidth = pTGA->hdr.width;
+			UINT nHeight = pTGA->hdr.height;
+
+			CComPtr<IWICBitmap> pBitmap;
+			CComPtr<IWICBitmapLock> pLock;
+			UINT cbBuffer = 0;
+			UINT nDestStride = 0;
+			BYTE* pData = nullptr;
+
+			hr = m_pWICFactory->CreateBitmap(nWidth, nHeight, GUID_WICPixelFormat32bppPBGRA, WICBitmapCacheOnLoad, &pBitmap);
+			if (SUCCEEDED(hr))
+			{
+				WICRect rcLock = { 0, 0, static_cast<INT>(nWidth), static_cast<INT>(nHeight) };
+				hr = pBitmap->Lock(&rcLock, WICBitmapLockWrite, &pLock);
+			}
+			if (SUCCEEDED(hr))
+				hr = pLock->GetStride(&nDestStride);
+			if (SUCCEEDED(hr))
+				hr = pLock->GetDataPointer(&cbBuffer, &pData);
+			if (SUCCEEDED(hr))
+				hr = ReadTGARows(pTGA, pData, nDestStride, cancel);
+			pLock.Release();
 
-		if (wcsstr(wszTemp, L".tga"))
+			if (SUCCEEDED(hr))
+				hr = pBitmap->QueryInterface(IID_IWICBitmapSource, (void**)ppSource);
+		}
+		else if (cancel.IsCancelled())
+		{
+			hr = E_ABORT;
+		}
+		else
 		{
-			TGA* pTGA = TGAOpen((char *)UTF16toMBCS(wszFileName).c_str(), "rb");
-			TGAData tga_data;
+			// RLE and colour-mapped images are expanded by libtga in one piece
+			TGAData tga_data = { 0 };
 			tga_data.flags = TGA_IMAGE_DATA | TGA_FLIP_VERTICAL;
 
 			TGAReadImage(pTGA, &tga_data);
-			hr = TGA2BitmapSource(pTGA, &tga_data, m_pWICFactory, &pWICBitmap);
+			hr = TGA2BitmapSource(pTGA, &tga_data, m_pWICFactory, ppSource);
 
 			free(tga_data.img_data);
-			TGAClose(pTGA);
 		}
-		else
+
+		TGAClose(pTGA);
+		return hr;
+	}
+
+	// DDS file layout, see "DDS_HEADER" in the DirectX documentation
+#pragma pack(push, 1)
+	struct DDSPixelFormat
+	{
+		uint32_t dwSize;
+		uint32_t dwFlags;
+		uint32_t dwFourCC;
+		uint32_t dwRGBBitCount;
+		uint32_t dwRBitMask;
+		uint32_t dwGBitMask;
+		uint32_t dwBBitMask;
+		uint32_t dwABitMask;
+	};
+
+	struct DDSHeader
+	{
+		uint32_t dwMagic;
+		uint32_t dwSize;
+		uint32_t dwFlags;
+		uint32_t dwHeight;
+		uint32_t dwWidth;
+		uint32_t dwPitchOrLinearSize;
+		uint32_t dwDepth;
+		uint32_t dwMipMapCount;
+		uint32_t dwReserved1[11];
+		DDSPixelFormat ddspf;
+		uint32_t dwCaps;
+		uint32_t dwCaps2;
+		uint32_t dwCaps3;
+		uint32_t dwCaps4;
+		uint32_t dwReserved2;
+	};
+
+	struct DDSHeaderDXT10
+	{
+		uint32_t dxgiFormat;
+		uint32_t resourceDimension;
+		uint32_t miscFlag;
+		uint32_t arraySize;
+		uint32_t miscFlags2;
+	};
+#pragma pack(pop)
+
+	static const uint32_t kDDSFourCCFlag = 0x4;
+
+	static uint32_t FourCC(char a, char b, char c, char d)
+	{
+		return static_cast<uint32_t>(a) | (static_cast<uint32_t>(b) << 8) | (static_cast<uint32_t>(c) << 16) | (static_cast<uint32_t>(d) << 24);
+	}
+
+	static DXGI_FORMAT FormatFromFourCC(uint32_t dwFourCC)
+	{
+		if (dwFourCC == FourCC('D', 'X', 'T', '1'))
+			return DXGI_FORMAT_BC1_UNORM;
+		if (dwFourCC == FourCC('D', 'X', 'T', '2') || dwFourCC == FourCC('D', 'X', 'T', '3'))
+			return DXGI_FORMAT_BC2_UNORM;
+		if (dwFourCC == FourCC('D', 'X', 'T', '4') || dwFourCC == FourCC('D', 'X', 'T', '5'))
+			return DXGI_FORMAT_BC3_UNORM;
+		if (dwFourCC == FourCC('A', 'T', 'I', '1') || dwFourCC == FourCC('B', 'C', '4', 'U'))
+			return DXGI_FORMAT_BC4_UNORM;
+		if (dwFourCC == FourCC('B', 'C', '4', 'S'))
+			return DXGI_FORMAT_BC4_SNORM;
+		if (dwFourCC == FourCC('A', 'T', 'I', '2') || dwFourCC == FourCC('B', 'C', '5', 'U'))
+			return DXGI_FORMAT_BC5_UNORM;
+		if (dwFourCC == FourCC('B', 'C', '5', 'S'))
+			return DXGI_FORMAT_BC5_SNORM;
+		return DXGI_FORMAT_UNKNOWN;
+	}
+
+	static bool HasExtension(const wchar_t* wszFileName, const wchar_t* wszExtension)
+	{
+		size_t nLength = wcslen(wszFileName);
+		size_t nExtension = wcslen(wszExtension);
+		return nLength >= nExtension && _wcsicmp(wszFileName + nLength - nExtension, wszExtension) == 0;
+	}
+
+	BlockImage* ImageLoader::LoadBlocks(const wchar_t* wszFileName, const CancelToken& cancel)
+	{
+		if (!HasExtension(wszFileName, L".dds"))
+			return nullptr;
+
+		CComPtr<FileStream> pStream;
+		if (FAILED(OpenStream(wszFileName, &pStream)))
+			return nullptr;
+		return ReadBlocks(pStream, cancel);
+	}
+
+	// Reads a block-compressed DDS from the start of the stream; anything else leaves the
+	// stream somewhere past the header and returns null
+	BlockImage* ImageLoader::ReadBlocks(FileStream* pStream, const CancelToken& cancel)
+	{
+		DIVE_TRACE_SPAN(span, "ImageLoader::LoadBlocks");
+
+		DDSHeader header;
+		if (pStream->ReadBytes(&header, sizeof(header)) != sizeof(header)
+			|| header.dwMagic != FourCC('D', 'D', 'S', ' ')
+			|| header.dwSize != sizeof(header) - sizeof(header.dwMagic)
+			|| !(header.ddspf.dwFlags & kDDSFourCCFlag))
+			return nullptr;
+
+		DXGI_FORMAT format = FormatFromFourCC(header.ddspf.dwFourCC);
+		if (header.ddspf.dwFourCC == FourCC('D', 'X', '1', '0'))
 		{
-			CComPtr<IWICBitmapDecoder> pDecoder = nullptr;
-			CComPtr<IWICBitmapFrameDecode> pIDecoderFrame = nullptr;
+			DDSHeaderDXT10 header10;
+			if (pStream->ReadBytes(&header10, sizeof(header10)) != sizeof(header10))
+				return nullptr;
+			format = static_cast<DXGI_FORMAT>(header10.dxgiFormat);
+		}
 
-			hr = m_pWICFactory->CreateDecoderFromFilename(
-				wszFileName,
-				NULL,
-				GENERIC_READ,
-				WICDecodeMetadataCacheOnLoad,
-				&pDecoder
-			);
-			if (SUCCEEDED(hr))
-				hr = pDecoder->GetFrame(0, &pIDecoderFrame);
+		// Anything that is not block compressed goes through WIC as before
+		UINT nBlockBytes = BlockBytes(format);
+		if (!nBlockBytes || header.dwWidth == 0 || header.dwHeight == 0)
+			return nullptr;
+
+		// Only the top mip of the first surface is shown; it comes first in the file
+		std::unique_ptr<BlockImage> pImage(new BlockImage);
+		pImage->format = format;
+		pImage->nWidth = header.dwWidth;
+		pImage->nHeight = header.dwHeight;
+		pImage->nPitch = (header.dwWidth + 3) / 4 * nBlockBytes;
+		pImage->bPremultiplied = false;
+
+		UINT nBlockRows = (header.dwHeight + 3) / 4;
+		uint64_t ullSize = static_cast<uint64_t>(pImage->nPitch) * nBlockRows;
+		if (ullSize > pStream->Size() - pStream->Position())
+			return nullptr;
+
+		pImage->data.resize(static_cast<size_t>(ullSize));
+		DIVE_TRACE_BYTES(span, ullSize);
+
+		UINT nRows = StripRows(pImage->nPitch);
+		for (UINT y = 0; y < nBlockRows; y += nRows)
+		{
+			if (cancel.IsCancelled())
+			{
+				DIVE_TRACE_INSTANT("Decode Cancelled", DIVE::Trace::CurrentIndex());
+				return nullptr;
+			}
+
+			size_t cbStrip = static_cast<size_t>(std::min(nRows, nBlockRows - y)) * pImage->nPitch;
+			if (pStream->ReadBytes(pImage->data.data() + static_cast<size_t>(y) * pImage->nPitch, cbStrip) != cbStrip)
+				return nullptr;
+		}
+		return pImage.release();
+	}
+
+	// Opens the file once: a block-compressed DDS comes back in pBlocks, anything else as the
+	// first frame of its WIC decoder over the same stream, read-ahead bytes and all
+	HRESULT ImageLoader::OpenImage(const wchar_t* wszFileName, const CancelToken& cancel, std::unique_ptr<BlockImage>& pBlocks, IWICBitmapSource** ppFrame)
+	{
+		CComPtr<FileStream> pStream;
+		HRESULT hr = OpenStream(wszFileName, &pStream);
+		if (FAILED(hr))
+			return hr;
+
+		if (HasExtension(wszFileName, L".dds"))
+		{
+			pBlocks.reset(ReadBlocks(pStream, cancel));
+			if (pBlocks)
+				return S_OK;
+			if (cancel.IsCancelled())
+				return E_ABORT;
+			if (!pStream->SeekTo(0, STREAM_SEEK_SET))
+				return E_FAIL;
+		}
+
+		CComPtr<IWICBitmapDecoder> pDecoder;
+		CComPtr<IWICBitmapFrameDecode> pFrame;
+		hr = m_pWICFactory->CreateDecoderFromStream(pStream, NULL, WICDecodeMetadataCacheOnLoad, &pDecoder);
+		if (SUCCEEDED(hr))
+			hr = pDecoder->GetFrame(0, &pFrame);
+		if (SUCCEEDED(hr))
+			hr = pFrame->QueryInterface(IID_IWICBitmapSource, (void **)ppFrame);
+		return hr;
+	}
+
+	HRESULT ImageLoader::ExpandBlocks(const BlockImage& image, IWICBitmapSource** ppSource)
+	{
+		DIVE_TRACE_SCOPE("ExpandBlocks");
+
+		CComPtr<IWICBitmap> pBitmap;
+		CComPtr<IWICBitmapLock> pLock;
+		UINT cbBuffer = 0;
+		UINT nStride = 0;
+		BYTE* pData = nullptr;
+
+		HRESULT hr = m_pWICFactory->CreateBitmap(image.nWidth, image.nHeight, GUID_WICPixelFormat32bppPBGRA, WICBitmapCacheOnLoad, &pBitmap);
+		if (SUCCEEDED(hr))
+		{
+			WICRect rcLock = { 0, 0, static_cast<INT>(image.nWidth), static_cast<INT>(image.nHeight) };
+			hr = pBitmap->Lock(&rcLock, WICBitmapLockWrite, &pLock);
+		}
+		if (SUCCEEDED(hr))
+			hr = pLock->GetStride(&nStride);
+		if (SUCCEEDED(hr))
+			hr = pLock->GetDataPointer(&cbBuffer, &pData);
+		if (SUCCEEDED(hr) && !DecodeBlocks(image, pData, nStride))
+			hr = WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT;
+		pLock.Release();
+
+		if (SUCCEEDED(hr))
+			hr = pBitmap->QueryInterface(IID_IWICBitmapSource, (void**)ppSource);
+		return hr;
+	}
+
+	// Pulls every pixel through the decoder into an in-memory bitmap, so the decode happens
+	// on the calling worker instead of lazily on whichever thread first draws the image.
+	// With pfnConvert the rows are converted to PBGRA on the way, strip by strip.
+	HRESULT ImageLoader::Materialize(IWICBitmapSource* pSource, ConvertRowFn pfnConvert, const CancelToken& cancel, IWICBitmap** ppBitmap)
+	{
+		DIVE_TRACE_SPAN(span, "Decode");
+
+		UINT nWidth = 0;
+		UINT nHeight = 0;
+		WICPixelFormatGUID guidPixelFormat;
+		const PixelFormatInfo* pFormat = nullptr;
+		HRESULT hr = pSource->GetSize(&nWidth, &nHeight);
+		if (SUCCEEDED(hr))
+			hr = pSource->GetPixelFormat(&guidPixelFormat);
+		if (SUCCEEDED(hr) && pfnConvert)
+		{
+			pFormat = FindPixelFormat(guidPixelFormat);
+			if (!pFormat)
+				hr = WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT;
+			guidPixelFormat = GUID_WICPixelFormat32bppPBGRA;
+		}
+
+		CComPtr<IWICBitmap> pBitmap;
+		CComPtr<IWICBitmapLock> pLock;
+		UINT cbBuffer = 0;
+		UINT nStride = 0;
+		BYTE* pData = nullptr;
+
+		if (SUCCEEDED(hr))
+			hr = m_pWICFactory->CreateBitmap(nWidth, nHeight, guidPixelFormat, WICBitmapCacheOnLoad, &pBitmap);
+		if (SUCCEEDED(hr))
+		{
+			WICRect rcLock = { 0, 0, static_cast<INT>(nWidth), static_cast<INT>(nHeight) };
+			hr = pBitmap->Lock(&rcLock, WICBitmapLockWrite, &pLock);
+		}
+		if (SUCCEEDED(hr))
+			hr = pLock->GetStride(&nStride);
+		if (SUCCEEDED(hr))
+			hr = pLock->GetDataPointer(&cbBuffer, &pData);
+
+		DIVE_TRACE_BYTES(span, cbBuffer);
+
+		UINT nSourceStride = pFormat ? (nWidth * pFormat->nBitsPerPixel + 7) / 8 : nStride;
+		UINT nRows = StripRows(nSourceStride);
+		std::unique_ptr<BYTE[]> strip(pfnConvert ? new BYTE[static_cast<size_t>(nSourceStride) * nRows] : nullptr);
+
+		for (UINT y = 0; SUCCEEDED(hr) && y < nHeight; y += nRows)
+		{
+			if (cancel.IsCancelled())
+			{
+				hr = E_ABORT;
+				break;
+			}
+
+			UINT n = std::min(nRows, nHeight - y);
+			WICRect rc = { 0, static_cast<INT>(y), static_cast<INT>(nWidth), static_cast<INT>(n) };
+			if (!pfnConvert)
+			{
+				hr = pSource->CopyPixels(&rc, nStride, nStride * n, pData + y * nStride);
+				continue;
+			}
+
+			hr = pSource->CopyPixels(&rc, nSourceStride, nSourceStride * n, strip.get());
+			for (UINT i = 0; SUCCEEDED(hr) && i < n; ++i)
+				pfnConvert(strip.get() + static_cast<size_t>(i) * nSourceStride, pData + static_cast<size_t>(y + i) * nStride, nWidth);
+		}
+		pLock.Release();
+
+		if (SUCCEEDED(hr))
+			*ppBitmap = pBitmap.Detach();
+		return hr;
+	}
 
+	HRESULT ImageLoader::OpenFrames(const wchar_t* wszFileName, IWICBitmapDecoder** ppDecoder)
+	{
+		CComPtr<FileStream> pStream;
+		HRESULT hr = OpenStream(wszFileName, &pStream);
+		if (SUCCEEDED(hr))
+			hr = m_pWICFactory->CreateDecoderFromStream(pStream, NULL, WICDecodeMetadataCacheOnDemand, ppDecoder);
+		return hr;
+	}
+
+	HRESULT ImageLoader::CopyFrame(IWICBitmapSource* pFrame, BYTE* pDest, const CancelToken& cancel)
+	{
+		DIVE_TRACE_SPAN(span, "Decode Frame");
+
+		UINT nWidth = 0;
+		UINT nHeight = 0;
+		WICPixelFormatGUID guidPixelFormat;
+		HRESULT hr = pFrame->GetSize(&nWidth, &nHeight);
+		if (SUCCEEDED(hr))
+			hr = pFrame->GetPixelFormat(&guidPixelFormat);
+		if (FAILED(hr))
+			return hr;
+
+		const PixelFormatInfo* pFormat = FindPixelFormat(guidPixelFormat);
+		ConvertRowFn pfnConvert = pFormat && guidPixelFormat != GUID_WICPixelFormat32bppPBGRA ? pFormat->pfnToPBGRA : nullptr;
+
+		CComPtr<IWICBitmapSource> pSource = pFrame;
+		if (guidPixelFormat != GUID_WICPixelFormat32bppPBGRA && !pfnConvert)
+		{
+			CComPtr<IWICFormatConverter> pConverter;
+			hr = m_pWICFactory->CreateFormatConverter(&pConverter);
+			if (SUCCEEDED(hr))
+				hr = pConverter->Initialize(pFrame, GUID_WICPixelFormat32bppPBGRA, WICBitmapDitherTypeNone, NULL, 0.f, WICBitmapPaletteTypeMedianCut);
 			if (SUCCEEDED(hr))
-				hr = pIDecoderFrame->QueryInterface(IID_IWICBitmapSource, (void **)&pWICBitmap);
+			{
+				pSource.Release();
+				hr = pConverter->QueryInterface(IID_IWICBitmapSource, (void **)&pSource);
+			}
+		}
+
+		UINT nStride = nWidth * 4;
+		UINT nSourceStride = pfnConvert ? (nWidth * pFormat->nBitsPerPixel + 7) / 8 : nStride;
+		UINT nRows = StripRows(nSourceStride);
+		std::unique_ptr<BYTE[]> strip(pfnConvert ? new BYTE[static_cast<size_t>(nSourceStride) * nRows] : nullptr);
+		DIVE_TRACE_BYTES(span, static_cast<uint64_t>(nStride) * nHeight);
+
+		for (UINT y = 0; SUCCEEDED(hr) && y < nHeight; y += nRows)
+		{
+			if (cancel.IsCancelled())
+				return E_ABORT;
+
+			UINT n = std::min(nRows, nHeight - y);
+			WICRect rc = { 0, static_cast<INT>(y), static_cast<INT>(nWidth), static_cast<INT>(n) };
+			if (!pfnConvert)
+			{
+				hr = pSource->CopyPixels(&rc, nStride, nStride * n, pDest + static_cast<size_t>(y) * nStride);
+				continue;
+			}
+
+			hr = pSource->CopyPixels(&rc, nSourceStride, nSourceStride * n, strip.get());
+			for (UINT i = 0; SUCCEEDED(hr) && i < n; ++i)
+				pfnConvert(strip.get() + static_cast<size_t>(i) * nSourceStride, pDest + static_cast<size_t>(y + i) * nStride, nWidth);
+		}
+		return hr;
+	}
+
+	HRESULT ImageLoader::LoadInto(const wchar_t* wszFileName, std::vector<BYTE>& vecPixels, UINT& nWidth, UINT& nHeight, const CancelToken& cancel)
+	{
+		DIVE_TRACE_SCOPE("ImageLoader::LoadInto", DIVE::Trace::CurrentIndex(), GetFileBytes(wszFileName));
+
+		CComPtr<IWICBitmapSource> pSource;
+		HRESULT hr = S_OK;
+		const wchar_t* wszExtension = wcsrchr(wszFileName, L'.');
+
+		if (wszExtension && _wcsicmp(wszExtension, L".tga") == 0)
+		{
+			CComPtr<FileStream> pStream;
+			hr = OpenStream(wszFileName, &pStream);
+			TGA* pTGA = SUCCEEDED(hr) ? OpenTGA(pStream) : nullptr;
+			if (pTGA && IsDirectTGA(pTGA))
+			{
+				nWidth = pTGA->hdr.width;
+				nHeight = pTGA->hdr.height;
+				if (vecPixels.size() < static_cast<size_t>(nWidth) * nHeight * 4)
+					vecPixels.resize(static_cast<size_t>(nWidth) * nHeight * 4);
+				hr = ReadTGARows(pTGA, vecPixels.data(), nWidth * 4, cancel);
+				TGAClose(pTGA);
+				return hr;
+			}
+			if (pTGA)
+				TGAClose(pTGA);
+			hr = LoadTGA(wszFileName, cancel, &pSource);
+		}
+		else
+		{
+			std::unique_ptr<BlockImage> pBlocks;
+			hr = OpenImage(wszFileName, cancel, pBlocks, &pSource);
+			if (pBlocks)
+			{
+				nWidth = pBlocks->nWidth;
+				nHeight = pBlocks->nHeight;
+				if (vecPixels.size() < static_cast<size_t>(nWidth) * nHeight * 4)
+					vecPixels.resize(static_cast<size_t>(nWidth) * nHeight * 4);
+				return DecodeBlocks(*pBlocks, vecPixels.data(), nWidth * 4) ? S_OK : E_FAIL;
+			}
+		}
+
+		if (SUCCEEDED(hr))
+			hr = pSource->GetSize(&nWidth, &nHeight);
+		if (SUCCEEDED(hr))
+		{
+			if (vecPixels.size() < static_cast<size_t>(nWidth) * nHeight * 4)
+				vecPixels.resize(static_cast<size_t>(nWidth) * nHeight * 4);
+			hr = CopyFrame(pSource, vecPixels.data(), cancel);
+		}
+		return hr;
+	}
+
+	IWICBitmapSource* ImageLoader::Load(const wchar_t* wszFileName, const CancelToken& cancel)
+	{
+		return Decode(wszFileName, 0, 0, nullptr, false, true, cancel, nullptr);
+	}
+
+	IWICBitmapSource* ImageLoader::LoadNative(const wchar_t* wszFileName, const CancelToken& cancel, BlockImage** ppBlocks)
+	{
+		return Decode(wszFileName, 0, 0, nullptr, true, true, cancel, ppBlocks);
+	}
+
+	IWICBitmapSource* ImageLoader::LoadFit(const wchar_t* wszFileName, UINT nFitWidth, UINT nFitHeight, SIZE& szFull, const CancelToken& cancel, BlockImage** ppBlocks)
+	{
+		return Decode(wszFileName, nFitWidth, nFitHeight, &szFull, false, true, cancel, ppBlocks);
+	}
+
+	IWICBitmapSource* ImageLoader::Decode(const wchar_t* wszFileName, UINT nFitWidth, UINT nFitHeight, SIZE* pFull, bool bNative, bool bRecord, const CancelToken& cancel, BlockImage** ppBlocks)
+	{
+		DIVE_TRACE_SCOPE("ImageLoader::Load", DIVE::Trace::CurrentIndex(), GetFileBytes(wszFileName));
+		auto tStart = std::chrono::steady_clock::now();
+
+		HRESULT hr = S_OK;
+
+		CComPtr<IWICBitmapSource> pSource;
+
+		if (HasExtension(wszFileName, L".tga"))
+		{
+			hr = LoadTGA(wszFileName, cancel, &pSource);
+		}
+		else
+		{
+			std::unique_ptr<BlockImage> pBlocks;
+			hr = OpenImage(wszFileName, cancel, pBlocks, &pSource);
+			if (pBlocks && ppBlocks)
+			{
+				if (pFull)
+					*pFull = SIZE{ static_cast<LONG>(pBlocks->nWidth), static_cast<LONG>(pBlocks->nHeight) };
+				*ppBlocks = pBlocks.release();
+				return nullptr;
+			}
+			if (pBlocks)
+				hr = ExpandBlocks(*pBlocks, &pSource);
 		}
+		if (FAILED(hr) || !pSource)
+			return nullptr;
+
+		// High bit depth stays half float for the tone mapper at display time; the cache
+		// pays 8 bytes per pixel for it but keeps the precision exposure changes need
 		WICPixelFormatGUID guidPixelFormat;
-		hr = pWICBitmap->GetPixelFormat(&guidPixelFormat);
-		if (guidPixelFormat != GUID_WICPixelFormat32bppPBGRA)
+		WICPixelFormatGUID guidTarget = GUID_WICPixelFormat32bppPBGRA;
+		const PixelFormatInfo* pFormat = nullptr;
+		hr = pSource->GetPixelFormat(&guidPixelFormat);
+		if (SUCCEEDED(hr))
+			pFormat = FindPixelFormat(guidPixelFormat);
+		if (pFormat && bNative && IsHighDepth(*pFormat))
+			guidTarget = GUID_WICPixelFormat64bppPRGBAHalf;
+
+		UINT nWidth = 0;
+		UINT nHeight = 0;
+		if (SUCCEEDED(hr))
+			hr = pSource->GetSize(&nWidth, &nHeight);
+		if (SUCCEEDED(hr) && pFull)
+			*pFull = SIZE{ static_cast<LONG>(nWidth), static_cast<LONG>(nHeight) };
+		bool bReduce = nFitWidth && nFitHeight && (nWidth > nFitWidth || nHeight > nFitHeight);
+
+		// The common 8-bit layouts are converted by the built-in row kernels while materializing;
+		// WIC converts the rest, and anything going into the scaler
+		ConvertRowFn pfnConvert = nullptr;
+		if (SUCCEEDED(hr) && guidPixelFormat != guidTarget && !bReduce && guidTarget == GUID_WICPixelFormat32bppPBGRA && pFormat)
+			pfnConvert = pFormat->pfnToPBGRA;
+
+		if (SUCCEEDED(hr) && guidPixelFormat != guidTarget && !pfnConvert)
 		{
+			DIVE_TRACE_SCOPE("Convert");
+
 			CComPtr<IWICFormatConverter> pConverter = NULL;
 
 			hr = m_pWICFactory->CreateFormatConverter(&pConverter);
 			if (SUCCEEDED(hr))
 				hr = pConverter->Initialize(
-					pWICBitmap,
-					GUID_WICPixelFormat32bppPBGRA,
+					pSource,
+					guidTarget,
 					WICBitmapDitherTypeNone,
 					NULL,
 					0.f,
 					WICBitmapPaletteTypeMedianCut
 				);
 			if (SUCCEEDED(hr))
-				hr = pConverter->QueryInterface(IID_IWICBitmapSource, (void **)&pWICBitmap);
+			{
+				pSource.Release();
+				hr = pConverter->QueryInterface(IID_IWICBitmapSource, (void **)&pSource);
+			}
 		}
 
+		// Scaling premultiplied pixels keeps edges against transparency clean. The scaler pulls
+		// rows through the decoder, so the full-size image is never held in memory.
+		if (SUCCEEDED(hr) && bReduce)
+		{
+			DIVE_TRACE_SCOPE("Reduce");
+
+			double dScale = std::min(static_cast<double>(nFitWidth) / nWidth, static_cast<double>(nFitHeight) / nHeight);
+			UINT nReducedWidth = std::max(1u, static_cast<UINT>(nWidth * dScale + 0.5));
+			UINT nReducedHeight = std::max(1u, static_cast<UINT>(nHeight * dScale + 0.5));
+
+			CComPtr<IWICBitmapScaler> pScaler;
+			hr = m_pWICFactory->CreateBitmapScaler(&pScaler);
+			if (SUCCEEDED(hr))
+				hr = pScaler->Initialize(pSource, nReducedWidth, nReducedHeight, WICBitmapInterpolationModeFant);
+			if (SUCCEEDED(hr))
+			{
+				pSource.Release();
+				hr = pScaler->QueryInterface(IID_IWICBitmapSource, (void **)&pSource);
+			}
+		}
+
+		CComPtr<IWICBitmap> pBitmap;
+		if (SUCCEEDED(hr) && (pfnConvert || FAILED(pSource->QueryInterface(IID_IWICBitmap, (void**)&pBitmap))))
+			hr = Materialize(pSource, pfnConvert, cancel, &pBitmap);
+
+		if (FAILED(hr))
+		{
+			if (hr == E_ABORT)
+				DIVE_TRACE_INSTANT("Decode Cancelled", DIVE::Trace::CurrentIndex());
+			return nullptr;
+		}
+
+		if (bRecord)
+			m_cost.Record(wszFileName, bReduce, nWidth, nHeight,
+				std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tStart).count());
+
+		IWICBitmapSource* pWICBitmap = nullptr;
+		pBitmap->QueryInterface(IID_IWICBitmapSource, (void**)&pWICBitmap);
 		return pWICBitmap;
 	}
+
+	// Materialize to 32bpp PBGRA whatever the source format, by the row kernels when they know it
+	HRESULT ImageLoader::MaterializePBGRA(IWICBitmapSource* pSource, IWICBitmap** ppBitmap)
+	{
+		WICPixelFormatGUID guidPixelFormat;
+		HRESULT hr = pSource->GetPixelFormat(&guidPixelFormat);
+		if (FAILED(hr))
+			return hr;
+		if (guidPixelFormat == GUID_WICPixelFormat32bppPBGRA)
+			return Materialize(pSource, nullptr, CancelToken(), ppBitmap);
+
+		const PixelFormatInfo* pFormat = FindPixelFormat(guidPixelFormat);
+		if (pFormat && pFormat->pfnToPBGRA)
+			return Materialize(pSource, pFormat->pfnToPBGRA, CancelToken(), ppBitmap);
+
+		CComPtr<IWICFormatConverter> pConverter;
+		hr = m_pWICFactory->CreateFormatConverter(&pConverter);
+		if (SUCCEEDED(hr))
+			hr = pConverter->Initialize(pSource, GUID_WICPixelFormat32bppPBGRA, WICBitmapDitherTypeNone, NULL, 0.f, WICBitmapPaletteTypeMedianCut);
+		if (SUCCEEDED(hr))
+			hr = Materialize(pConverter, nullptr, CancelToken(), ppBitmap);
+		return hr;
+	}
+
+	// Below this a full decode is quick enough that a preview would only be a flash of blur
+	static const uint64_t kPreviewMinPixels = 4000000;
+
+	IWICBitmapSource* ImageLoader::LoadPreview(const wchar_t* wszFileName, SIZE& szFull)
+	{
+		DIVE_TRACE_SCOPE("ImageLoader::LoadPreview", DIVE::Trace::CurrentIndex());
+
+		CComPtr<IWICBitmapDecoder> pDecoder;
+		CComPtr<IWICBitmapFrameDecode> pFrame;
+		UINT nWidth = 0;
+		UINT nHeight = 0;
+		HRESULT hr = OpenFrames(wszFileName, &pDecoder);
+		if (SUCCEEDED(hr))
+			hr = pDecoder->GetFrame(0, &pFrame);
+		if (SUCCEEDED(hr))
+			hr = pFrame->GetSize(&nWidth, &nHeight);
+		if (FAILED(hr) || static_cast<uint64_t>(nWidth) * nHeight < kPreviewMinPixels)
+			return nullptr;
+		szFull = SIZE{ static_cast<LONG>(nWidth), static_cast<LONG>(nHeight) };
+
+		// Decoders that scale natively do it while decoding, in the format they find cheapest
+		CComPtr<IWICBitmapSource> pSource;
+		CComPtr<IWICBitmapSourceTransform> pTransform;
+		if (SUCCEEDED(pFrame->QueryInterface(IID_IWICBitmapSourceTransform, (void**)&pTransform)))
+		{
+			UINT nScaledWidth = std::max(1u, nWidth / 8);
+			UINT nScaledHeight = std::max(1u, nHeight / 8);
+			WICPixelFormatGUID guidPixelFormat = GUID_WICPixelFormat32bppPBGRA;
+			CComPtr<IWICBitmap> pScaled;
+			CComPtr<IWICBitmapLock> pLock;
+			UINT cbBuffer = 0;
+			UINT nStride = 0;
+			BYTE* pData = nullptr;
+
+			hr = pTransform->GetClosestSize(&nScaledWidth, &nScaledHeight);
+			if (SUCCEEDED(hr) && nScaledWidth >= nWidth)
+				hr = E_FAIL;
+			if (SUCCEEDED(hr))
+				hr = pTransform->GetClosestPixelFormat(&guidPixelFormat);
+			if (SUCCEEDED(hr))
+				hr = m_pWICFactory->CreateBitmap(nScaledWidth, nScaledHeight, guidPixelFormat, WICBitmapCacheOnLoad, &pScaled);
+			if (SUCCEEDED(hr))
+			{
+				WICRect rcLock = { 0, 0, static_cast<INT>(nScaledWidth), static_cast<INT>(nScaledHeight) };
+				hr = pScaled->Lock(&rcLock, WICBitmapLockWrite, &pLock);
+			}
+			if (SUCCEEDED(hr))
+				hr = pLock->GetStride(&nStride);
+			if (SUCCEEDED(hr))
+				hr = pLock->GetDataPointer(&cbBuffer, &pData);
+			if (SUCCEEDED(hr))
+				hr = pTransform->CopyPixels(nullptr, nScaledWidth, nScaledHeight, &guidPixelFormat, WICBitmapTransformRotate0, nStride, cbBuffer, pData);
+			pLock.Release();
+			if (SUCCEEDED(hr))
+				pSource = pScaled;
+		}
+		if (!pSource)
+		{
+			CComPtr<IWICBitmapSource> pThumbnail;
+			if (SUCCEEDED(pFrame->GetThumbnail(&pThumbnail)))
+				pSource = pThumbnail;
+		}
+		if (!pSource)
+			return nullptr;
+
+		CComPtr<IWICBitmap> pBitmap;
+		if (FAILED(MaterializePBGRA(pSource, &pBitmap)))
+			return nullptr;
+
+		IWICBitmapSource* pPreview = nullptr;
+		pBitmap->QueryInterface(IID_IWICBitmapSource, (void**)&pPreview);
+		return pPreview;
+	}
+
 	IWICBitmapSource* ImageLoader::LoadThumbnail(unsigned int width, unsigned int height, const wchar_t* szFileName)
 	{
-		CComPtr<IWICBitmapSource> pWICBitmap = Load(szFileName);
+		// Reduced while decoding, so a batch of thumbnails never holds a full-size image. Left
+		// out of the decode cost model, which sizes the window of full decodes.
+		SIZE szFull;
+		CComPtr<IWICBitmapSource> pWICBitmap;
+		pWICBitmap.Attach(Decode(szFileName, width, height, &szFull, false, false, CancelToken(), nullptr));
 
 		if (pWICBitmap)
 		{
-			HRESULT hr;
-
-			IWICBitmapScaler* pWICScaler;
+			CComPtr<IWICBitmapScaler> pWICScaler;
 
-			hr = m_pWICFactory->CreateBitmapScaler(&pWICScaler);
+			HRESULT hr = m_pWICFactory->CreateBitmapScaler(&pWICScaler);
 			if (SUCCEEDED(hr))
 				hr = pWICScaler->Initialize(pWICBitmap, width, height, WICBitmapInterpolationModeNearestNeighbor);
 			if (SUCCEEDED(hr))
-				return pWICScaler;
+				return pWICScaler.Detach();
 			else
-			{
-				pWICScaler->Release();
 				return nullptr;
-			}
 		}
 		else
 			return nullptr;
 	}
+
+	bool ImageLoader::IsImageFile(const wchar_t* wszFileName)
+	{
+		static const wchar_t* const s_extensions[] = { L".tga", L".bmp", L".dds", L".png", L".tif", L".tiff", L".jpg", L".ico", L".gif" };
+
+		const wchar_t* wszExtension = wcsrchr(wszFileName, L'.');
+		if (!wszExtension)
+			return false;
+		for (const wchar_t* wszKnown : s_extensions)
+		{
+			if (_wcsicmp(wszExtension, wszKnown) == 0)
+				return true;
+		}
+		return false;
+	}
 }
\ No newline at end of file
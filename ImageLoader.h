@@ -1,9 +1,17 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <memory>
 #include <windowsx.h>
 
 #include <Wincodec.h>
+#include "CancelToken.h"
+#include "FileStream.h"
+#include "ReadAhead.h"
+#include "BlockImage.h"
+#include "PixelFormat.h"
+#include "DecodeCost.h"
 
 namespace DIVE
 {
@@ -14,11 +22,62 @@ namespace DIVE
 		ImageLoader();
 		~ImageLoader();
 
-		IWICBitmapSource* Load(const wchar_t* szFileName);
+		IWICBitmapSource* Load(const wchar_t* szFileName, const CancelToken& cancel = CancelToken());
+
+		// Like Load, but sources with more than 8 bits per channel stay 64bpp premultiplied
+		// half float (GUID_WICPixelFormat64bppPRGBAHalf) instead of being quantized
+		// With ppBlocks a block-compressed DDS comes back there, still compressed, and the
+		// result is null
+		IWICBitmapSource* LoadNative(const wchar_t* szFileName, const CancelToken& cancel = CancelToken(), BlockImage** ppBlocks = nullptr);
+
+		// Decodes reduced to fit inside nFitWidth x nFitHeight with a quality filter; szFull
+		// receives the size of the full image. Images that already fit come back unchanged.
+		IWICBitmapSource* LoadFit(const wchar_t* szFileName, UINT nFitWidth, UINT nFitHeight, SIZE& szFull, const CancelToken& cancel = CancelToken(), BlockImage** ppBlocks = nullptr);
 		IWICBitmapSource* LoadThumbnail( unsigned int width, unsigned int height, const wchar_t* szFileName);
 
+		// A stand-in to show while a large image decodes: the decoder's own 1/8 scale decode,
+		// which for JPEG comes straight from the DC coefficients, or else the thumbnail stored
+		// in the file. Null when the file has neither or is small enough to decode in full.
+		IWICBitmapSource* LoadPreview(const wchar_t* szFileName, SIZE& szFull);
+
+		// Whether the file name has one of the extensions the viewer lists
+		static bool IsImageFile(const wchar_t* szFileName);
+
+		// Decoder for stepping through the frames of animations and multi-page files
+		HRESULT OpenFrames(const wchar_t* szFileName, IWICBitmapDecoder** ppDecoder);
+
+		// Converts a frame to tightly packed 32bpp PBGRA in strips, so a large page can be abandoned
+		HRESULT CopyFrame(IWICBitmapSource* pFrame, BYTE* pDest, const CancelToken& cancel = CancelToken());
+
+		// Decodes the first frame into a caller-owned buffer as tightly packed 32bpp PBGRA. The
+		// buffer is only grown, so a reused one stops allocating once it fits the largest image.
+		// Uncompressed TGA rows go from the file straight into it.
+		HRESULT LoadInto(const wchar_t* szFileName, std::vector<BYTE>& vecPixels, UINT& nWidth, UINT& nHeight, const CancelToken& cancel = CancelToken());
+
+		// Block-compressed DDS payload as stored, or null for any other file
+		BlockImage* LoadBlocks(const wchar_t* szFileName, const CancelToken& cancel = CancelToken());
+
+		// Read-ahead used by full decodes; not synchronized, set before the loader threads start
+		void SetStreamOptions(const FileStream::Options& options) { m_streamOptions = options; }
+		void SetReadAhead(ReadAhead* pReadAhead) { m_pReadAhead = pReadAhead; }
+
+		// What this loader's decodes have cost so far; safe to read from any thread
+		const DecodeCost& Cost() const { return m_cost; }
+
 	private:
+		HRESULT OpenStream(const wchar_t* wszFileName, FileStream** ppStream);
+		HRESULT LoadTGA(const wchar_t* wszFileName, const CancelToken& cancel, IWICBitmapSource** ppSource);
+		HRESULT ExpandBlocks(const BlockImage& image, IWICBitmapSource** ppSource);
+		HRESULT Materialize(IWICBitmapSource* pSource, ConvertRowFn pfnConvert, const CancelToken& cancel, IWICBitmap** ppBitmap);
+		HRESULT MaterializePBGRA(IWICBitmapSource* pSource, IWICBitmap** ppBitmap);
+		IWICBitmapSource* Decode(const wchar_t* wszFileName, UINT nFitWidth, UINT nFitHeight, SIZE* pFull, bool bNative, bool bRecord, const CancelToken& cancel, BlockImage** ppBlocks);
+		BlockImage* ReadBlocks(FileStream* pStream, const CancelToken& cancel);
+		HRESULT OpenImage(const wchar_t* wszFileName, const CancelToken& cancel, std::unique_ptr<BlockImage>& pBlocks, IWICBitmapSource** ppFrame);
+
 		CComPtr<IWICImagingFactory> m_pWICFactory;
+		FileStream::Options m_streamOptions;
+		ReadAhead* m_pReadAhead;
+		DecodeCost m_cost;
 	};
 
 }
\ No newline at end of file
@@ -0,0 +1,553 @@
+#include "stdafx.h"
+#include "ImageTable.h"
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <stdio.h>
+
+namespace DIVE
+{
+	static void ReleaseUnknown(void* p)
+	{
+		static_cast<IUnknown*>(p)->Release();
+	}
+
+	// Roughly what freeing the image gives back, so Epoch collects by weight
+	static size_t ImageBytes(const CachedImage* pImage)
+	{
+		if (!pImage)
+			return 0;
+
+		size_t cbImage = pImage->pBlocks ? pImage->pBlocks->data.size() : 0;
+		UINT nWidth = 0;
+		UINT nHeight = 0;
+		WICPixelFormatGUID guidPixelFormat;
+		if (pImage->pBitmap && SUCCEEDED(pImage->pBitmap->GetSize(&nWidth, &nHeight)) && SUCCEEDED(pImage->pBitmap->GetPixelFormat(&guidPixelFormat)))
+			cbImage += static_cast<size_t>(nWidth) * nHeight * (guidPixelFormat == GUID_WICPixelFormat64bppPRGBAHalf ? 8 : 4);
+		return cbImage;
+	}
+
+	static void RetireImage(CachedImage* pImage)
+	{
+		Epoch::Retire(pImage, ImageBytes(pImage));
+	}
+
+	ImageTable::Files::Files(std::vector<std::wstring>&& vecFiles, uint32_t nVersion_)
+		: thumbnails(new std::atomic<ID2D1Bitmap*>[vecFiles.size()])
+		, alphas(new std::atomic<float>[vecFiles.size()])
+		, images(new std::atomic<CachedImage*>[vecFiles.size()])
+		, generations(new std::atomic<uint32_t>[vecFiles.size()])
+		, folders(new uint32_t[vecFiles.size()])
+		, leaves(new uint32_t[vecFiles.size()])
+		, cchNames(0)
+		, nSize(static_cast<int>(vecFiles.size()))
+		, nVersion(nVersion_)
+	{
+		// Sizes the arena first: every folder once, then every leaf
+		std::unordered_map<std::wstring, uint32_t> mapFolders;
+		std::vector<size_t> vecSplit(vecFiles.size());
+		for (int i = 0; i < nSize; ++i)
+		{
+			const std::wstring& strFile = vecFiles[i];
+			size_t nSplit = strFile.find_last_of(L'\\') + 1;
+			vecSplit[i] = nSplit;
+			if (mapFolders.emplace(strFile.substr(0, nSplit), 0).second)
+				cchNames += nSplit + 1;
+			cchNames += strFile.size() - nSplit + 1;
+		}
+
+		names.reset(new wchar_t[cchNames]);
+		size_t cchUsed = 0;
+		auto append = [&](const wchar_t* psz, size_t cch)
+		{
+			uint32_t nOffset = static_cast<uint32_t>(cchUsed);
+			std::copy(psz, psz + cch, &names[cchUsed]);
+			names[cchUsed + cch] = L'\0';
+			cchUsed += cch + 1;
+			return nOffset;
+		};
+		for (auto& folder : mapFolders)
+			folder.second = append(folder.first.c_str(), folder.first.size());
+
+		for (int i = 0; i < nSize; ++i)
+		{
+			std::wstring strFile = std::move(vecFiles[i]);
+			folders[i] = mapFolders[strFile.substr(0, vecSplit[i])];
+			leaves[i] = append(strFile.c_str() + vecSplit[i], strFile.size() - vecSplit[i]);
+
+			thumbnails[i].store(nullptr, std::memory_order_relaxed);
+			alphas[i].store(0.0f, std::memory_order_relaxed);
+			images[i].store(nullptr, std::memory_order_relaxed);
+			generations[i].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	ImageTable::Files::~Files()
+	{
+		// Only reached after the grace period, so nothing can still be reading the columns
+		for (int i = 0; i < nSize; ++i)
+		{
+			delete images[i].load(std::memory_order_relaxed);
+			if (ID2D1Bitmap* pThumbnail = thumbnails[i].load(std::memory_order_relaxed))
+				pThumbnail->Release();
+		}
+	}
+
+	std::wstring ImageTable::Files::Name(int nIndex) const
+	{
+		std::wstring strFileName(&names[folders[nIndex]]);
+		strFileName += &names[leaves[nIndex]];
+		return strFileName;
+	}
+
+	bool ImageTable::Files::NameEquals(int nIndex, const std::wstring& strFileName) const
+	{
+		const wchar_t* pszFolder = &names[folders[nIndex]];
+		size_t cchFolder = wcslen(pszFolder);
+		return strFileName.compare(0, cchFolder, pszFolder) == 0
+			&& wcscmp(strFileName.c_str() + cchFolder, &names[leaves[nIndex]]) == 0;
+	}
+
+	size_t ImageTable::Files::Bytes() const
+	{
+		size_t cbPerFile = sizeof(thumbnails[0]) + sizeof(alphas[0]) + sizeof(images[0]) + sizeof(generations[0])
+			+ sizeof(folders[0]) + sizeof(leaves[0]);
+		return sizeof(Files) + nSize * cbPerFile + cchNames * sizeof(wchar_t);
+	}
+
+	ImageTable::ImageTable()
+		: m_pFiles(new Files(std::vector<std::wstring>(), 0))
+	{
+	}
+
+	ImageTable::~ImageTable()
+	{
+		delete m_pFiles.load();
+	}
+
+	void ImageTable::SetFiles(std::vector<std::wstring>&& vecFiles)
+	{
+		Files* pOld = m_pFiles.load();
+		Files* pNew = new Files(std::move(vecFiles), pOld->nVersion + 1);
+
+		m_pFiles.store(pNew);
+		Epoch::Retire(pOld, pOld->Bytes());
+	}
+
+	uint32_t ImageTable::Version() const
+	{
+		Epoch::Guard guard;
+		return m_pFiles.load()->nVersion;
+	}
+
+	ImageTable::Files* ImageTable::GetFiles(int nIndex) const
+	{
+		Files* pFiles = m_pFiles.load();
+		if (nIndex < 0 || nIndex >= pFiles->nSize)
+			return nullptr;
+		return pFiles;
+	}
+
+	ImageTable::Files* ImageTable::GetFiles(int nIndex, const Ticket& ticket) const
+	{
+		Files* pFiles = m_pFiles.load();
+		if (pFiles->nVersion != ticket.nVersion || nIndex < 0 || nIndex >= pFiles->nSize)
+			return nullptr;
+		return pFiles;
+	}
+
+	int ImageTable::Size() const
+	{
+		Epoch::Guard guard;
+		return m_pFiles.load()->nSize;
+	}
+
+	int ImageTable::IndexOf(const std::wstring& strFileName) const
+	{
+		Epoch::Guard guard;
+		Files* pFiles = m_pFiles.load();
+		for (int i = 0; i < pFiles->nSize; ++i)
+		{
+			if (pFiles->NameEquals(i, strFileName))
+				return i;
+		}
+		return -1;
+	}
+
+	std::wstring ImageTable::FileName(int nIndex) const
+	{
+		Epoch::Guard guard;
+		Files* pFiles = GetFiles(nIndex);
+		return pFiles ? pFiles->Name(nIndex) : std::wstring();
+	}
+
+	size_t ImageTable::Bytes() const
+	{
+		Epoch::Guard guard;
+		return m_pFiles.load()->Bytes();
+	}
+
+	const CachedImage* ImageTable::Image(int nIndex) const
+	{
+		Files* pFiles = GetFiles(nIndex);
+		return pFiles ? pFiles->images[nIndex].load(std::memory_order_acquire) : nullptr;
+	}
+
+	ID2D1Bitmap* ImageTable::Thumbnail(int nIndex) const
+	{
+		Files* pFiles = GetFiles(nIndex);
+		return pFiles ? pFiles->thumbnails[nIndex].load(std::memory_order_acquire) : nullptr;
+	}
+
+	float ImageTable::Alpha(int nIndex) const
+	{
+		Files* pFiles = GetFiles(nIndex);
+		return pFiles ? pFiles->alphas[nIndex].load(std::memory_order_relaxed) : 0.0f;
+	}
+
+	bool ImageTable::HasImage(int nIndex) const
+	{
+		Epoch::Guard guard;
+		return Image(nIndex) != nullptr;
+	}
+
+	bool ImageTable::AcquireImage(int nIndex, CachedImage& image, Ticket* pTicket) const
+	{
+		Epoch::Guard guard;
+		Files* pFiles = GetFiles(nIndex);
+		if (!pFiles)
+			return false;
+
+		// The ticket lets a caller replace the image later unless the slot was evicted meanwhile
+		if (pTicket)
+		{
+			pTicket->nVersion = pFiles->nVersion;
+			pTicket->nGeneration = pFiles->generations[nIndex].load(std::memory_order_acquire);
+		}
+
+		const CachedImage* pImage = pFiles->images[nIndex].load(std::memory_order_acquire);
+		if (!pImage)
+			return false;
+
+		image = *pImage;
+		return true;
+	}
+
+	bool ImageTable::Request(int nIndex, Ticket& ticket, std::wstring& strFileName, bool bReplaceReduced) const
+	{
+		Epoch::Guard guard;
+		Files* pFiles = GetFiles(nIndex);
+		if (!pFiles)
+			return false;
+
+		// A display-size copy can be replaced by the full decode
+		const CachedImage* pImage = pFiles->images[nIndex].load(std::memory_order_acquire);
+		if (pImage && !(bReplaceReduced && pImage->nFullWidth))
+			return false;
+
+		ticket.nVersion = pFiles->nVersion;
+		ticket.nGeneration = pFiles->generations[nIndex].load(std::memory_order_acquire);
+		strFileName = pFiles->Name(nIndex);
+		return true;
+	}
+
+	bool ImageTable::RequestThumbnail(int nIndex, Ticket& ticket, std::wstring& strFileName) const
+	{
+		Epoch::Guard guard;
+		Files* pFiles = GetFiles(nIndex);
+		if (!pFiles || pFiles->thumbnails[nIndex].load(std::memory_order_acquire))
+			return false;
+
+		ticket.nVersion = pFiles->nVersion;
+		ticket.nGeneration = pFiles->generations[nIndex].load(std::memory_order_acquire);
+		strFileName = pFiles->Name(nIndex);
+		return true;
+	}
+
+	bool ImageTable::IsCurrent(int nIndex, const Ticket& ticket) const
+	{
+		Epoch::Guard guard;
+		Files* pFiles = GetFiles(nIndex, ticket);
+		return pFiles && pFiles->generations[nIndex].load(std::memory_order_acquire) == ticket.nGeneration;
+	}
+
+	bool ImageTable::Publish(int nIndex, const Ticket& ticket, CachedImage* pImage)
+	{
+		Epoch::Guard guard;
+		Files* pFiles = GetFiles(nIndex, ticket);
+		if (!pFiles || pFiles->generations[nIndex].load(std::memory_order_acquire) != ticket.nGeneration)
+		{
+			delete pImage;
+			return false;
+		}
+
+		RetireImage(pFiles->images[nIndex].exchange(pImage, std::memory_order_acq_rel));
+
+		// An Evict() that slipped in between the check and the exchange wins
+		if (pFiles->generations[nIndex].load(std::memory_order_acquire) != ticket.nGeneration)
+		{
+			RetireImage(pFiles->images[nIndex].exchange(nullptr, std::memory_order_acq_rel));
+			return false;
+		}
+		return true;
+	}
+
+	bool ImageTable::PublishThumbnail(int nIndex, const Ticket& ticket, ID2D1Bitmap* pThumbnail)
+	{
+		Epoch::Guard guard;
+		Files* pFiles = GetFiles(nIndex, ticket);
+		if (!pFiles)
+		{
+			if (pThumbnail)
+				pThumbnail->Release();
+			return false;
+		}
+
+		if (ID2D1Bitmap* pOld = pFiles->thumbnails[nIndex].exchange(pThumbnail, std::memory_order_acq_rel))
+			Epoch::Retire(pOld, ReleaseUnknown);
+		return true;
+	}
+
+	void ImageTable::SetAlpha(int nIndex, float fAlpha)
+	{
+		Epoch::Guard guard;
+		if (Files* pFiles = GetFiles(nIndex))
+			pFiles->alphas[nIndex].store(fAlpha, std::memory_order_relaxed);
+	}
+
+	void ImageTable::Evict(int nIndex)
+	{
+		Epoch::Guard guard;
+		Files* pFiles = GetFiles(nIndex);
+		if (!pFiles)
+			return;
+
+		pFiles->generations[nIndex].fetch_add(1, std::memory_order_acq_rel);
+		RetireImage(pFiles->images[nIndex].exchange(nullptr, std::memory_order_acq_rel));
+	}
+
+	static double MillisecondsSince(std::chrono::steady_clock::time_point tStart)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tStart).count();
+	}
+
+	int BenchmarkImageTable(int nFiles)
+	{
+		if (nFiles <= 0)
+			return 1;
+
+		// Shaped like a card dump: numbered files in a few deep folders
+		std::vector<std::wstring> vecFiles;
+		vecFiles.reserve(nFiles);
+		size_t cbPaths = 0;
+		wchar_t wszFile[MAX_PATH];
+		for (int i = 0; i < nFiles; ++i)
+		{
+			swprintf_s(wszFile, L"D:\\Photos\\2024\\Card %03d\\DCIM\\100CANON\\IMG_%07d.CR2", i / 10000, i);
+			vecFiles.push_back(wszFile);
+			cbPaths += sizeof(std::wstring) + (vecFiles.back().capacity() + 1) * sizeof(wchar_t);
+		}
+		std::wstring strLast = vecFiles.back();
+
+		auto tStart = std::chrono::steady_clock::now();
+		ImageTable table;
+		table.SetFiles(std::move(vecFiles));
+		double fBuildMs = MillisecondsSince(tStart);
+
+		wprintf(L"%d files: %.1f MB as full paths, %.1f MB in the table (%.1f bytes per file), built in %.1f ms\n",
+			nFiles, cbPaths / 1048576.0, table.Bytes() / 1048576.0, table.Bytes() / static_cast<double>(nFiles), fBuildMs);
+
+		// What Draw reads per thumbnail, over the whole list
+		double fLayoutMs = 1e30;
+		int nVisible = 0;
+		for (int nRun = 0; nRun < 5; ++nRun)
+		{
+			tStart = std::chrono::steady_clock::now();
+			Epoch::Guard guard;
+			nVisible = 0;
+			for (int i = 0; i < nFiles; ++i)
+			{
+				if (table.Thumbnail(i) || table.Alpha(i) > 0.0f)
+					++nVisible;
+			}
+			fLayoutMs = std::min(fLayoutMs, MillisecondsSince(tStart));
+		}
+		wprintf(L"  layout pass: %.2f ms, %.1f ns per file (%d visible)\n", fLayoutMs, fLayoutMs * 1e6 / nFiles, nVisible);
+
+		tStart = std::chrono::steady_clock::now();
+		int nFound = table.IndexOf(strLast);
+		wprintf(L"  IndexOf the last file: %.2f ms (%ls)\n", MillisecondsSince(tStart), nFound == nFiles - 1 ? L"found" : L"MISSING");
+
+		tStart = std::chrono::steady_clock::now();
+		size_t cchNames = 0;
+		for (int i = 0; i < nFiles; ++i)
+			cchNames += table.FileName(i).size();
+		wprintf(L"  FileName for every file: %.2f ms, %.1f chars average\n", MillisecondsSince(tStart), cchNames / static_cast<double>(nFiles));
+
+		fflush(stdout);
+		return nFound == nFiles - 1 ? 0 : 1;
+	}
+
+	// Stress images carry a payload stamped twice, and the stamp is cleared as the payload
+	// is freed, so an image reclaimed under a reader shows up as a mismatch
+	static std::atomic<int64_t> s_nStressLive(0);
+
+	static const UINT kStressKey = 0x5A5A5A5A;
+
+	static CachedImage* NewStressImage(UINT nStamp, bool bReduced)
+	{
+		BlockImage* pBlocks = new BlockImage();
+		pBlocks->nWidth = nStamp ^ kStressKey;
+		pBlocks->nHeight = nStamp;
+		pBlocks->data.resize(64 << 10);
+		++s_nStressLive;
+
+		CachedImage* pImage = new CachedImage;
+		pImage->pBlocks.reset(pBlocks, [](const BlockImage* p)
+		{
+			const_cast<BlockImage*>(p)->nWidth = 0;
+			delete p;
+			--s_nStressLive;
+		});
+		pImage->nFullWidth = bReduced ? nStamp : 0;
+		pImage->nFullHeight = pImage->nFullWidth;
+		return pImage;
+	}
+
+	static bool CheckStressImage(const CachedImage& image)
+	{
+		return image.pBlocks && image.pBlocks->nWidth == (image.pBlocks->nHeight ^ kStressKey)
+			&& (!image.nFullWidth || image.nFullWidth == image.pBlocks->nHeight);
+	}
+
+	int StressImageTable(int nSeconds)
+	{
+		if (nSeconds <= 0)
+			return 1;
+
+		const int kFiles = 4096;
+		auto MakeFiles = [](uint32_t nRound)
+		{
+			std::vector<std::wstring> vecFiles;
+			wchar_t wszFile[MAX_PATH];
+			for (int i = 0; i < kFiles; ++i)
+			{
+				swprintf_s(wszFile, L"D:\\Stress\\%u\\IMG_%05d.JPG", nRound % 4, i);
+				vecFiles.push_back(wszFile);
+			}
+			return vecFiles;
+		};
+
+		std::atomic<bool> bStop(false);
+		std::atomic<uint64_t> nReads(0), nPublished(0), nRefused(0), nEvicted(0), nSwaps(0), nBad(0);
+		std::vector<std::thread> vecThreads;
+		{
+			ImageTable table;
+			table.SetFiles(MakeFiles(0));
+
+			int nReaders = std::max(2, static_cast<int>(std::thread::hardware_concurrency()) - 3);
+			for (int t = 0; t < nReaders; ++t)
+			{
+				vecThreads.emplace_back([&, t]()
+				{
+					uint32_t nSeed = 2654435761u * (t + 1);
+					uint64_t nLocalReads = 0, nLocalBad = 0;
+					while (!bStop.load(std::memory_order_relaxed))
+					{
+						// Raw pointers under a guard, the way Draw reads
+						{
+							Epoch::Guard guard;
+							for (int i = 0; i < 64; ++i)
+							{
+								nSeed = nSeed * 1664525u + 1013904223u;
+								if (const CachedImage* pImage = table.Image(static_cast<int>(nSeed >> 8) % kFiles))
+								{
+									nLocalBad += CheckStressImage(*pImage) ? 0 : 1;
+									++nLocalReads;
+								}
+							}
+						}
+
+						// Copies that outlive the guard, the way the render thread holds them
+						nSeed = nSeed * 1664525u + 1013904223u;
+						CachedImage image;
+						if (table.AcquireImage(static_cast<int>(nSeed >> 8) % kFiles, image))
+						{
+							std::this_thread::yield();
+							nLocalBad += CheckStressImage(image) ? 0 : 1;
+							++nLocalReads;
+						}
+					}
+					nReads += nLocalReads;
+					nBad += nLocalBad;
+				});
+			}
+
+			for (int t = 0; t < 2; ++t)
+			{
+				vecThreads.emplace_back([&, t]()
+				{
+					uint32_t nSeed = 40503u * (t + 1);
+					uint64_t nLocalPublished = 0, nLocalRefused = 0, nLocalEvicted = 0;
+					for (int nStep = 1; !bStop.load(std::memory_order_relaxed); ++nStep)
+					{
+						nSeed = nSeed * 1664525u + 1013904223u;
+						int nIndex = static_cast<int>(nSeed >> 8) % kFiles;
+						if ((nSeed & 7) == 0)
+						{
+							table.Evict(nIndex);
+							++nLocalEvicted;
+						}
+						else
+						{
+							// A reduced copy half the time, so a later request replaces it
+							ImageTable::Ticket ticket;
+							std::wstring strFileName;
+							if (table.Request(nIndex, ticket, strFileName, true))
+							{
+								if (table.Publish(nIndex, ticket, NewStressImage(nSeed | 1, (nSeed & 16) != 0)))
+									++nLocalPublished;
+								else
+									++nLocalRefused;
+							}
+						}
+						if ((nStep & 63) == 0)
+							Epoch::Collect();
+					}
+					nPublished += nLocalPublished;
+					nRefused += nLocalRefused;
+					nEvicted += nLocalEvicted;
+				});
+			}
+
+			vecThreads.emplace_back([&]()
+			{
+				uint32_t nRound = 0;
+				while (!bStop.load(std::memory_order_relaxed))
+				{
+					table.SetFiles(MakeFiles(++nRound));
+					Epoch::Collect();
+					std::this_thread::sleep_for(std::chrono::milliseconds(2));
+				}
+				nSwaps = nRound;
+			});
+
+			std::this_thread::sleep_for(std::chrono::seconds(nSeconds));
+			bStop = true;
+			for (auto& thread : vecThreads)
+				thread.join();
+
+			// Everything retired by this thread and left over by the workers
+			Epoch::Synchronize();
+		}
+
+		int64_t nLeaked = s_nStressLive.load();
+		wprintf(L"%d s: %llu reads, %llu published, %llu refused, %llu evicted, %llu file lists\n",
+			nSeconds, nReads.load(), nPublished.load(), nRefused.load(), nEvicted.load(), nSwaps.load());
+		wprintf(L"  %llu bad reads, %lld images alive after the table\n", nBad.load(), nLeaked);
+
+		fflush(stdout);
+		return nBad == 0 && nLeaked == 0 ? 0 : 1;
+	}
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include "Epoch.h"
+#include "BlockImage.h"
+
+namespace DIVE
+{
+	// A decoded image as published to readers. Immutable once published. Block-compressed
+	// files keep their payload in pBlocks and leave pBitmap empty. A copy reduced to the
+	// display size records the size of the full image, which is what it is laid out at.
+	struct CachedImage
+	{
+		CComPtr<IWICBitmapSource> pBitmap;
+		std::shared_ptr<const BlockImage> pBlocks;
+		UINT nFullWidth = 0;		// 0 when the image is at full resolution
+		UINT nFullHeight = 0;
+	};
+
+	// File list plus per-file decode/thumbnail slots shared between the UI thread and
+	// the workers, kept as columns so a folder of a million files stays in tens of MB.
+	// Writers publish with an atomic exchange and retire the previous value through
+	// Epoch, so readers never lock and never observe a torn or freed image.
+	// Every slot carries a generation that Evict() bumps; a decode started under an older
+	// generation (or an older file list) is refused by Publish().
+	class ImageTable
+	{
+	public:
+		struct Ticket
+		{
+			uint32_t nVersion;
+			uint32_t nGeneration;
+		};
+
+		ImageTable();
+		~ImageTable();
+
+		void SetFiles(std::vector<std::wstring>&& vecFiles);
+		uint32_t Version() const;
+
+		int Size() const;
+		int IndexOf(const std::wstring& strFileName) const;
+		std::wstring FileName(int nIndex) const;
+		size_t Bytes() const;
+
+		// Readers. The raw accessors are only valid while an Epoch::Guard is held.
+		const CachedImage* Image(int nIndex) const;
+		ID2D1Bitmap* Thumbnail(int nIndex) const;
+		float Alpha(int nIndex) const;
+
+		bool HasImage(int nIndex) const;
+		bool AcquireImage(int nIndex, CachedImage& image, Ticket* pTicket = nullptr) const;
+
+		// Writers
+		bool Request(int nIndex, Ticket& ticket, std::wstring& strFileName, bool bReplaceReduced = false) const;
+		bool RequestThumbnail(int nIndex, Ticket& ticket, std::wstring& strFileName) const;
+		bool IsCurrent(int nIndex, const Ticket& ticket) const;
+		bool Publish(int nIndex, const Ticket& ticket, CachedImage* pImage);
+		bool PublishThumbnail(int nIndex, const Ticket& ticket, ID2D1Bitmap* pThumbnail);
+		void SetAlpha(int nIndex, float fAlpha);
+		void Evict(int nIndex);
+
+	private:
+		// One file list, a column per field. Thumbnails and alphas are read for every
+		// thumbnail drawn and sit apart from the rest. Names live in a single arena of
+		// NUL-terminated strings, each folder stored once and each file as its leaf name.
+		struct Files
+		{
+			Files(std::vector<std::wstring>&& vecFiles, uint32_t nVersion);
+			~Files();
+
+			std::wstring Name(int nIndex) const;
+			bool NameEquals(int nIndex, const std::wstring& strFileName) const;
+			size_t Bytes() const;
+
+			std::unique_ptr<std::atomic<ID2D1Bitmap*>[]> thumbnails;
+			std::unique_ptr<std::atomic<float>[]> alphas;
+
+			std::unique_ptr<std::atomic<CachedImage*>[]> images;
+			std::unique_ptr<std::atomic<uint32_t>[]> generations;
+			std::unique_ptr<uint32_t[]> folders;		// arena offsets
+			std::unique_ptr<uint32_t[]> leaves;
+			std::unique_ptr<wchar_t[]> names;
+			size_t cchNames;
+			int nSize;
+			uint32_t nVersion;
+		};
+
+		Files* GetFiles(int nIndex) const;
+		Files* GetFiles(int nIndex, const Ticket& ticket) const;
+
+		std::atomic<Files*> m_pFiles;
+	};
+
+	// Headless /table-bench mode: builds a table of nFiles synthetic paths and prints its
+	// size and the time to build, lay out and search it; returns the process exit code
+	int BenchmarkImageTable(int nFiles);
+
+	// Headless /table-stress mode: readers, publishers and a file list swapper hammer one
+	// table for nSeconds; fails if a reader sees a freed image or anything outlives the table
+	int StressImageTable(int nSeconds);
+}
@@ -2,17 +2,26 @@
 #include "ImageViewer.h"
 #include "ImageLoader.h"
 #include "tga.h"
+#include "Trace.h"
+#include "ToneMap.h"
+#include "ThumbnailCache.h"
+#include "Animation.h"
+#include "Flipbook.h"
+#include "GpuUploadDevice.h"
+#include "ShaderCache.h"
 #include <dwrite.h>
 #include <wincodec.h>
 #include <d2d1helper.h>
+#include <d2d1_1helper.h>
 #include <d2d1effects.h>
 #include <string>
 #include <algorithm>
 
 #include <directxcolors.h>
-#include <d3dcompiler.h>
 #include <chrono>
 #include <ratio>
+#include <cmath>
+#include <cwctype>
 
 
 namespace DIVE
@@ -37,38 +46,8 @@ namespace DIVE
 		DirectX::XMMATRIX mWorld;
 	};
 
-	HRESULT CompileShaderFromFile(WCHAR* szFileName, LPCSTR szEntryPoint, LPCSTR szShaderModel, ID3DBlob** ppBlobOut)
-	{
-		HRESULT hr = S_OK;
-
-		DWORD dwShaderFlags = D3DCOMPILE_ENABLE_STRICTNESS;
-#ifdef _DEBUG
-		// Set the D3DCOMPILE_DEBUG flag to embed debug information in the shaders.
-		// Setting this flag improves the shader debugging experience, but still allows 
-		// the shaders to be optimized and to run exactly the way they will run in 
-		// the release configuration of this program.
-		dwShaderFlags |= D3DCOMPILE_DEBUG;
-
-		// Disable optimizations to further improve shader debugging
-		dwShaderFlags |= D3DCOMPILE_SKIP_OPTIMIZATION;
-#endif
-
-		ID3DBlob* pErrorBlob = nullptr;
-		hr = D3DCompileFromFile(szFileName, nullptr, nullptr, szEntryPoint, szShaderModel,
-			dwShaderFlags, 0, ppBlobOut, &pErrorBlob);
-		if (FAILED(hr))
-		{
-			if (pErrorBlob)
-			{
-				OutputDebugStringA(reinterpret_cast<const char*>(pErrorBlob->GetBufferPointer()));
-				pErrorBlob->Release();
-			}
-			return hr;
-		}
-		if (pErrorBlob) pErrorBlob->Release();
-
-		return S_OK;
-	}
+	// Widest the cache window gets on either side, which is as far as a slideshow reads ahead
+	static const int kMaxCacheLimit = 40;
 
 	ImageViewer::ImageViewer()
 		: m_fScale(1.0f)
@@ -78,6 +57,8 @@ namespace DIVE
 		, m_pRenderTarget(nullptr)
 		, m_pBackground(nullptr)
 		, m_pImage(nullptr)
+		, m_rcToneMapped(D2D1::RectU())
+		, m_fExposure(1.0f)
 		, m_loader( std::make_unique<ImageLoader>() )
 		, m_pthread_scan(nullptr)
 		, m_pthread_thumbnail(nullptr)
@@ -86,7 +67,49 @@ namespace DIVE
 		, m_nPreviewIndex( -1 )
 		, m_nCacheStart( -1 )
 		, m_nCacheEnd( -1 )
+		, m_nFilesVersion( 0 )
 		, m_bEndThreads( false )
+		, m_nVisibleIndex( -1 )
+		, m_nFitWidth( 0 )
+		, m_nFitHeight( 0 )
+		, m_bCompressCache( false )
+		, m_bReduceCache( true )
+		, m_bShowingReduced( false )
+		, m_nCacheLimit( kMaxCacheLimit )
+		, m_nImagesShed( 0 )
+		, m_nColdBudget( 0 )
+		, m_bShedPending( false )
+		, m_bSlideshow( false )
+		, m_bSlideLate( false )
+		, m_nSlidesMissed( 0 )
+		, m_nSlideRequested( -1 )
+		, m_nSlideSkipFrom( -1 )
+		, m_nSlideSkipTo( -1 )
+		, m_slideInterval( std::chrono::milliseconds(3000) )
+		, m_fStepMicros( 0.0 )
+		, m_nLoadingIndex( -1 )
+		, m_pAnimation( std::make_unique<Animation>() )
+		, m_nAnimationIndex( -1 )
+		, m_nAnimationVersion( 0 )
+		, m_nFrame( 0 )
+		, m_nFrameTarget( 0 )
+		, m_bFramePaused( false )
+		, m_bFrameLate( false )
+		, m_nFrameStalls( 0 )
+		, m_pFlipbook( std::make_unique<Flipbook>() )
+		, m_nFlipSequence( 0 )
+		, m_nFlipIndex( -1 )
+		, m_nFlipShown( 0 )
+		, m_nFlipDropped( 0 )
+		, m_pResampler( std::make_unique<Resampler>() )
+		, m_nResampleImage( 0 )
+		, m_nResampleSerial( 0 )
+		, m_rcSharpView( D2D1::RectF() )
+		, m_nLevelUploads( 0 )
+		, m_nSharpTag( 0 )
+		, m_pUploader( std::make_unique<Uploader>() )
+		, m_nUploadSerial( 0 )
+		, m_nStartupSerial( 0 )
 		, m_bShowThumbs( true )
 		, m_nThumbWidth( 120 )
 		, m_nThumbHeight( 90 )
@@ -115,36 +138,52 @@ namespace DIVE
 	{
 		HRESULT hr = D2D1CreateFactory(D2D1_FACTORY_TYPE_MULTI_THREADED, &m_pDirect2dFactory);
 
+		m_hLoadEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+		m_loader->SetReadAhead(&m_readAhead);
+
+		// Re-encode idle cache entries to BC1/BC3 to fit more images in memory
+		wchar_t wszValue[32];
+		if (GetEnvironmentVariableW(L"DIVE_CACHE_COMPRESS", wszValue, 32))
+			m_bCompressCache = _wtoi(wszValue) != 0;
+
+		// Neighbours are cached at screen size unless turned off
+		if (GetEnvironmentVariableW(L"DIVE_CACHE_DISPLAY_SIZE", wszValue, 32))
+			m_bReduceCache = _wtoi(wszValue) != 0;
+
+		if (GetEnvironmentVariableW(L"DIVE_SLIDESHOW_MS", wszValue, 32) && _wtoi(wszValue) > 0)
+			m_slideInterval = std::chrono::milliseconds(_wtoi(wszValue));
+
+		m_nColdBudget = m_coldCache.Budget();
+
 		m_thread_load = std::thread([this]()
 		{
+			DIVE_TRACE_THREAD("Load");
+
 			int c;
 			while (true)
 			{
+				// Images this thread replaced are freed once readers are done with them, so
+				// it wakes for that too while any are left
+				if (WaitForSingleObject(m_hLoadEvent, Epoch::Pending() ? 100 : INFINITE) == WAIT_TIMEOUT)
 				{
-					std::unique_lock<std::mutex> lock(m_mutex);
-
-					m_condition_load.wait(lock,
-						[this]() { return m_bEndThreads || !m_deqCachesToLoad.empty(); }
-					);
+					Epoch::Collect();
+					continue;
 				}
-				OutputDebugString(L"Load Awaken\n");
-				while (true)
-				{
-					c = -1;
-					{
-						std::lock_guard<std::mutex> lock(m_mutex);
 
-						if (m_bEndThreads)
-							return;
-
-						if (m_deqCachesToLoad.empty())
-							break;
+				DIVE_TRACE_INSTANT("Load Awaken", -1);
+				while (!m_bEndThreads && m_requests.Pop(c, &m_nLoadingIndex))
+				{
+					LoadSlot(c);
+					m_nLoadingIndex = -1;
+					Epoch::Collect();
+				}
+				if (m_bEndThreads)
+					return;
 
-						c = m_deqCachesToLoad.front();
-						m_deqCachesToLoad.pop_front();
-					}
-					if (c != -1 && m_vecBitmaps[c].pBitmap == nullptr)
-						m_vecBitmaps[c].pBitmap = m_loader->Load( m_vecBitmaps[c].strFileName.c_str() );
+				if (m_bCompressCache)
+				{
+					CompressCache();
+					Epoch::Collect();
 				}
 			}
 		});
@@ -155,9 +194,10 @@ namespace DIVE
 	{
 		m_bEndThreads = true;
 
-		m_condition_load.notify_all();
+		SetEvent(m_hLoadEvent);
 
 		m_thread_load.join();
+		CloseHandle(m_hLoadEvent);
 
 		if (m_pthread_scan)
 		{
@@ -173,6 +213,11 @@ namespace DIVE
 
 	void ImageViewer::Destroy()
 	{
+		// Nothing may be created on the device from here on
+		m_pStartupTasks.reset();
+		m_pUploader->Stop();
+		m_pending = PendingImage();
+
 		if (m_pImage)
 			m_pImage->Release();
 		if (m_pImmediateContext) m_pImmediateContext->ClearState();
@@ -186,7 +231,83 @@ namespace DIVE
 		if (m_pd3dDevice1) m_pd3dDevice1->Release();
 		if (m_pd3dDevice) m_pd3dDevice->Release();
 	}
-	bool ImageViewer::Initialize(HWND hWnd)
+	// Startup with its slow parts overlapped: the first image decodes, the desktop is captured
+	// and the shaders load on threads of their own while the device is made here
+	bool ImageViewer::Start(HWND hWnd, UINT nWidth, UINT nHeight, const wchar_t* wszFileName)
+	{
+		DIVE_TRACE_SCOPE("Start");
+
+		m_pStartup.reset(new StartupTimings);
+		m_pStartupTasks.reset(new StartupTasks(*m_pStartup));
+		StartupTasks& tasks = *m_pStartupTasks;
+		tasks.DecodeFirst(*m_loader, wszFileName);
+		tasks.CaptureDesktop(nWidth, nHeight);
+		tasks.LoadShaders(L"DIVE.fx");
+
+		// Nothing is on the device yet, so the caller can still start the plain way; the
+		// tasks are joined and dropped so nothing waits on them
+		bool bInitialized;
+		{
+			StartupTimings::Phase phase(*m_pStartup, L"Device");
+			bInitialized = Initialize(hWnd, &tasks);
+		}
+		if (!bInitialized)
+		{
+			m_pStartupTasks.reset();
+			m_pStartup.reset();
+			return false;
+		}
+		{
+			std::vector<BYTE> vecDesktop;
+			bool bDesktop = tasks.TakeDesktop(vecDesktop);
+			StartupTimings::Phase phase(*m_pStartup, L"Background");
+			if (bDesktop)
+				CreateBackground(vecDesktop, nWidth, nHeight);
+		}
+
+		// A large image goes up as its preview, laid out at full size; UpdateStartup swaps the
+		// full decode in when it is done
+		CachedImage first;
+		SIZE szFull = {};
+		first.pBitmap.Attach(tasks.TakePreview(szFull));
+		if (first.pBitmap)
+		{
+			first.nFullWidth = static_cast<UINT>(szFull.cx);
+			first.nFullHeight = static_cast<UINT>(szFull.cy);
+		}
+		else
+		{
+			first.pBitmap.Attach(tasks.TakeFirst());
+			m_pStartupTasks.reset();
+		}
+
+		StartupTimings::Phase phase(*m_pStartup, L"Show");
+		bool bLoaded = Load(wszFileName, &first);
+		m_nStartupSerial = m_nUploadSerial;
+		if (!bLoaded)
+		{
+			// A decode the tasks started is never taken now; load the file here instead
+			m_pStartupTasks.reset();
+			bLoaded = Load(wszFileName);
+		}
+		return bLoaded;
+	}
+
+	// Called every frame: puts the full decode of the first image in place of its preview,
+	// unless something else has been shown since
+	void ImageViewer::UpdateStartup()
+	{
+		if (!m_pStartupTasks || !m_pStartupTasks->FirstReady())
+			return;
+
+		CachedImage image;
+		image.pBitmap.Attach(m_pStartupTasks->TakeFirst());
+		m_pStartupTasks.reset();
+		if (image.pBitmap && m_bShowingReduced && m_nUploadSerial == m_nStartupSerial)
+			ReplaceReduced(image);
+	}
+
+	bool ImageViewer::Initialize(HWND hWnd, StartupTasks* pTasks)
 	{
 		HRESULT hr = S_OK;
 		m_hWnd = hWnd;
@@ -370,9 +491,17 @@ namespace DIVE
 		vp.TopLeftY = 0;
 		m_pImmediateContext->RSSetViewports(1, &vp);
 
-		// Compile the vertex shader
-		ID3DBlob* pVSBlob = nullptr;
-		hr = CompileShaderFromFile(L"DIVE.fx", "VS", "vs_4_0", &pVSBlob);
+		// Both shaders, from an earlier run's bytecode when DIVE.fx has not changed since
+		CComPtr<ID3DBlob> pVSBlob;
+		CComPtr<ID3DBlob> pPSBlob;
+		if (pTasks)
+			hr = pTasks->TakeShaders(&pVSBlob, &pPSBlob);
+		else
+		{
+			hr = LoadShader(L"DIVE.fx", "VS", "vs_4_0", &pVSBlob);
+			if (SUCCEEDED(hr))
+				hr = LoadShader(L"DIVE.fx", "PS", "ps_4_0", &pPSBlob);
+		}
 		if (FAILED(hr))
 		{
 			MessageBox(nullptr,
@@ -383,10 +512,7 @@ namespace DIVE
 		// Create the vertex shader
 		hr = m_pd3dDevice->CreateVertexShader(pVSBlob->GetBufferPointer(), pVSBlob->GetBufferSize(), nullptr, &m_pVertexShader);
 		if (FAILED(hr))
-		{
-			pVSBlob->Release();
 			return hr;
-		}
 
 		// Define the input layout
 		D3D11_INPUT_ELEMENT_DESC layout[] =
@@ -399,26 +525,14 @@ namespace DIVE
 		// Create the input layout
 		hr = m_pd3dDevice->CreateInputLayout(layout, numElements, pVSBlob->GetBufferPointer(),
 			pVSBlob->GetBufferSize(), &m_pVertexLayout);
-		pVSBlob->Release();
 		if (FAILED(hr))
 			return hr;
 
 		// Set the input layout
 		m_pImmediateContext->IASetInputLayout(m_pVertexLayout);
 
-		// Compile the pixel shader
-		ID3DBlob* pPSBlob = nullptr;
-		hr = CompileShaderFromFile(L"DIVE.fx", "PS", "ps_4_0", &pPSBlob);
-		if (FAILED(hr))
-		{
-			MessageBox(nullptr,
-				L"The FX file cannot be compiled.  Please run this executable from the directory that contains the FX file.", L"Error", MB_OK);
-			return hr;
-		}
-
 		// Create the pixel shader
 		hr = m_pd3dDevice->CreatePixelShader(pPSBlob->GetBufferPointer(), pPSBlob->GetBufferSize(), nullptr, &m_pPixelShader);
-		pPSBlob->Release();
 		if (FAILED(hr))
 			return hr;
 
@@ -599,17 +713,14 @@ namespace DIVE
 			&m_pBlackBrush
 		);
 
+		m_pUploader->Start(std::unique_ptr<UploadDevice>(new GpuUploadDevice(m_pRenderTarget, m_pd3dDevice)));
 		return true;
 	}
 
-	inline bool ends_with(std::wstring const & value, std::wstring const & ending)
-	{
-		if (ending.size() > value.size()) return false;
-		return std::equal(ending.rbegin(), ending.rend(), value.rbegin());
-	}
-
 	void ImageViewer::Draw(HWND hWnd)
 	{
+		DIVE_TRACE_SCOPE("Draw", m_nIndex);
+
 		RECT rcClient;
 		::GetClientRect(hWnd, &rcClient);
 
@@ -626,15 +737,33 @@ namespace DIVE
 			1.0,
 			D2D1_BITMAP_INTERPOLATION_MODE_LINEAR
 		);
-		if (m_pImage)
+		if (m_pImage && m_pSharpView)
 		{
 			m_pRenderTarget->DrawBitmap(
-				m_pImage, m_rcView, 1.0,
+				m_pSharpView, m_rcSharpView, 1.0,
 				D2D1_BITMAP_INTERPOLATION_MODE_NEAREST_NEIGHBOR
 			);
 		}
+		else if (m_pImage)
+		{
+			// Magnified pixels stay sharp squares; reduced, the level nearest the zoom is filtered down
+			ID2D1Bitmap* pBitmap = m_pImage;
+			D2D1_BITMAP_INTERPOLATION_MODE mode = D2D1_BITMAP_INTERPOLATION_MODE_NEAREST_NEIGHBOR;
+			D2D1_SIZE_U szImage = m_pImage->GetPixelSize();
+			float fScale = szImage.width ? (m_rcView.right - m_rcView.left) / szImage.width : 1.0f;
+			if (fScale < 1.0f)
+			{
+				UINT nLevel = PyramidLevel(fScale, szImage.width, szImage.height);
+				if (nLevel < m_vecLevelBitmaps.size() && m_vecLevelBitmaps[nLevel])
+					pBitmap = m_vecLevelBitmaps[nLevel];
+				mode = D2D1_BITMAP_INTERPOLATION_MODE_LINEAR;
+			}
+			m_pRenderTarget->DrawBitmap(pBitmap, m_rcView, 1.0, mode);
+		}
 		if (m_bShowThumbs)
 		{
+			Epoch::Guard guard;
+
 			int nCenterPos = (rcClient.right - rcClient.left - m_nThumbWidth) / 2;
 			int nThumbsBeforeCenter =  (nCenterPos + m_nThumbWidth - 1) / (m_nThumbWidth + m_nThumbSpacing);
 			int nStartIndex = m_nIndex - nThumbsBeforeCenter;
@@ -648,26 +777,28 @@ namespace DIVE
 			if (m_nPreviewIndex >= nStartIndex && m_nPreviewIndex <= nEndIndex)
 				nX -= m_nThumbWidth;
 
-			while (nX < rcClient.right && nStartIndex < m_vecBitmaps.size())
+			int nCount = m_images.Size();
+			while (nX < rcClient.right && nStartIndex < nCount)
 			{
-				auto& bmp = m_vecBitmaps[nStartIndex];
+				ID2D1Bitmap* pThumbnail = m_images.Thumbnail(nStartIndex);
+				float fAlpha = m_images.Alpha(nStartIndex);
 
-				if (m_bShowThumbs && m_nPreviewIndex == nStartIndex && bmp.pBitmap)
+				if (m_bShowThumbs && m_nPreviewIndex == nStartIndex && pThumbnail && m_images.Image(nStartIndex))
 				{
 					m_pRenderTarget->DrawBitmap(
-						bmp.pBitmapThumbnail,
+						pThumbnail,
 						D2D1::RectF(nX, nY - m_nThumbHeight * 2, nX + m_nThumbWidth * 3, nY + m_nThumbHeight),
-						bmp.fAlpha,
+						fAlpha,
 						D2D1_BITMAP_INTERPOLATION_MODE_NEAREST_NEIGHBOR
 					);
 					nX += m_nThumbWidth * 2;
 				}
-				else if (bmp.fAlpha > 0.0f && bmp.pBitmapThumbnail)
+				else if (fAlpha > 0.0f && pThumbnail)
 				{
 					m_pRenderTarget->DrawBitmap(
-						bmp.pBitmapThumbnail,
+						pThumbnail,
 						D2D1::RectF(nX, nY, nX + m_nThumbWidth, nY + m_nThumbHeight),
-						bmp.fAlpha,
+						fAlpha,
 						D2D1_BITMAP_INTERPOLATION_MODE_NEAREST_NEIGHBOR
 					);
 					if (nStartIndex == m_nIndex)
@@ -690,100 +821,72 @@ namespace DIVE
 		m_pRenderTarget->EndDraw();
 	}
 
-	void ImageViewer::RemoveCache(int index)
+	void ImageViewer::RemoveCache(int index, bool bKeepCold)
 	{
-		OutputDebugString(L"RemoveCache\n");
-		if (index > 0 && index < m_vecBitmaps.size())
+		DIVE_TRACE_INSTANT("RemoveCache", index);
+		if (index >= 0 && index < m_images.Size())
 		{
-			{
-				std::unique_lock<std::mutex> lock(m_mutex);
+			m_requests.Remove(index);
 
-				auto it = std::find(m_deqCachesToLoad.begin(), m_deqCachesToLoad.end(), index);
-				if (it != m_deqCachesToLoad.end())
-					m_deqCachesToLoad.erase(it);
+			// Keep a compressed copy so coming back does not pay for a full decode
+			CachedImage image;
+			if (bKeepCold && m_images.AcquireImage(index, image))
+			{
+				Epoch::Guard guard;
+				m_coldCache.Put(m_images.FileName(index), image);
 			}
-			if (m_vecBitmaps[index].pBitmap)
-				m_vecBitmaps[index].pBitmap = nullptr;
+			m_images.Evict(index);
+
+			Epoch::Guard guard;
+			m_readAhead.Discard(m_images.FileName(index));
 		}
 	}
 
-	ID3D11ShaderResourceView* ImageViewer::TextureFromWICBitmap(IWICBitmapSource* pWICBitmap)
+	void ImageViewer::ReadAheadRange(int nFirst, int nLast)
 	{
-		HRESULT hr;
-
-		UINT width, height;
-		hr = pWICBitmap->GetSize(&width, &height);
-		if (FAILED(hr))
-			return nullptr;
-
-		size_t rowPitch = (width * 32 + 7) / 8;
-		size_t imageSize = rowPitch * height;
-
-		std::unique_ptr<uint8_t[]> temp(new uint8_t[imageSize]);
-
-		hr = pWICBitmap->CopyPixels(0, static_cast<UINT>(rowPitch), static_cast<UINT>(imageSize), temp.get());
-		if (FAILED(hr))
-			return nullptr;
-
-		// Create texture
-		D3D11_TEXTURE2D_DESC desc;
-		desc.Width = width;
-		desc.Height = height;
-		desc.MipLevels = 0;
-		desc.ArraySize = 1;
-		desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
-		desc.SampleDesc.Count = 1;
-		desc.SampleDesc.Quality = 0;
-		desc.Usage = D3D11_USAGE_DEFAULT;
-		desc.BindFlags = D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET;
-		desc.CPUAccessFlags = 0;
-		desc.MiscFlags = D3D11_RESOURCE_MISC_GENERATE_MIPS;
-
-		CComPtr<ID3D11Texture2D> tex = nullptr;
-		ID3D11ShaderResourceView* pTexRV = nullptr;
-
-		hr = m_pd3dDevice->CreateTexture2D(&desc, nullptr, &tex);
-		if (SUCCEEDED(hr) && tex != 0)
-		{
-			D3D11_SHADER_RESOURCE_VIEW_DESC SRVDesc;
-			memset(&SRVDesc, 0, sizeof(SRVDesc));
-			SRVDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
-			SRVDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
-			SRVDesc.Texture2D.MipLevels = -1;
-
-			hr = m_pd3dDevice->CreateShaderResourceView(tex, &SRVDesc, &pTexRV);
-			if (FAILED(hr))
-				return nullptr;
-
-			m_pImmediateContext->UpdateSubresource(tex, 0, nullptr, temp.get(), static_cast<UINT>(rowPitch), static_cast<UINT>(imageSize));
-			m_pImmediateContext->GenerateMips(pTexRV);
-			return pTexRV;
+		std::vector<std::wstring> vecFiles;
+		{
+			Epoch::Guard guard;
+			for (int i = nFirst; i <= nLast; ++i)
+			{
+				if (m_images.Image(i))
+					continue;
+				std::wstring strFileName = m_images.FileName(i);
+				if (!strFileName.empty() && !m_coldCache.Contains(strFileName))
+					vecFiles.push_back(std::move(strFileName));
+			}
 		}
-		return nullptr;
+		if (!vecFiles.empty())
+			m_readAhead.Submit(std::move(vecFiles));
 	}
 
 	void ImageViewer::UpdateCacheForward()
 	{
-		OutputDebugString(L"Cache Forward\n");
-		int nCacheStart = m_nIndex - 1;
-		int nCacheEnd = m_nIndex + 10;
+		DIVE_TRACE_INSTANT("Cache Forward", m_nIndex);
+		int nAhead = CacheAhead();
+		DIVE_TRACE_COUNTER("Cache Ahead", nAhead);
+		DIVE_TRACE_COUNTER("Decode Estimate ms", EstimateDecodeMicros(1) / 1000.0);
+
+		int nCacheStart = m_nIndex - std::min(1, m_nCacheLimit);
+		int nCacheEnd = m_nIndex + std::min(nAhead, m_nCacheLimit);
 
-		if (nCacheEnd >= m_vecBitmaps.size())
+		int nCount = m_images.Size();
+		if (nCacheEnd >= nCount)
 		{
-			nCacheStart -= nCacheEnd - m_vecBitmaps.size() + 1;
-			nCacheEnd = m_vecBitmaps.size() - 1;
+			nCacheStart -= nCacheEnd - nCount + 1;
+			nCacheEnd = nCount - 1;
 		}
 		if (nCacheStart < 0)
 			nCacheStart = 0;
 		
 		for (int i = m_nCacheStart; i < nCacheStart; ++i)
 			RemoveCache(i);
-		{
-			std::unique_lock<std::mutex> lock(m_mutex);
-			for (int i = m_nCacheEnd + 1; i <= nCacheEnd; ++i)
-				m_deqCachesToLoad.push_back(i);
-		}
-		m_condition_load.notify_one();
+		for (int i = nCacheEnd + 1; i <= m_nCacheEnd; ++i)
+			RemoveCache(i);
+		ReadAheadRange(std::max(m_nCacheEnd + 1, nCacheStart), nCacheEnd);
+		for (int i = m_nCacheEnd + 1; i <= nCacheEnd; ++i)
+			m_requests.Push(i);
+		SetEvent(m_hLoadEvent);
 
 		m_nCacheStart = nCacheStart;
 		m_nCacheEnd = nCacheEnd;
@@ -791,91 +894,795 @@ namespace DIVE
 
 	void ImageViewer::UpdateCacheBackward()
 	{
-		OutputDebugString(L"Cache Backward\n");
-		int nCacheStart = m_nIndex - 10;
-		int nCacheEnd = m_nIndex + 1;
+		DIVE_TRACE_INSTANT("Cache Backward", m_nIndex);
+		int nCacheStart = m_nIndex - std::min(CacheAhead(-1), m_nCacheLimit);
+		int nCacheEnd = m_nIndex + std::min(1, m_nCacheLimit);
 
 		if (nCacheStart < 0)
 		{
 			nCacheEnd += -nCacheStart;
 			nCacheStart = 0;
 		}
-		if (nCacheEnd >= m_vecBitmaps.size())
-			nCacheEnd = m_vecBitmaps.size() - 1;
+		if (nCacheEnd >= m_images.Size())
+			nCacheEnd = m_images.Size() - 1;
 		for (int i = nCacheEnd + 1; i <= m_nCacheEnd; ++i)
 			RemoveCache(i);
-		{
-			std::unique_lock<std::mutex> lock(m_mutex);
-			for (int i = nCacheStart; i < m_nCacheStart; ++i)
-				m_deqCachesToLoad.push_back(i);
-		}
-		m_condition_load.notify_one();
+		ReadAheadRange(nCacheStart, std::min(m_nCacheStart, nCacheEnd + 1) - 1);
+		for (int i = nCacheStart; i < m_nCacheStart; ++i)
+			m_requests.Push(i);
+		SetEvent(m_hLoadEvent);
 
 		m_nCacheStart = nCacheStart;
 		m_nCacheEnd = nCacheEnd;
 
 	}
 
-	void ImageViewer::SetFiles(std::vector <ThumbnailInfo>&& vecBitmaps)
+	// Called every frame. Low memory halves the cache window, dropping the images farthest from
+	// the one on screen first, and scales the cold tier down with it. Once memory is no longer
+	// low the window grows back a step at a time, sooner when the system reports plenty free.
+	void ImageViewer::UpdateMemoryPressure()
 	{
-		m_vecBitmaps = std::move(vecBitmaps);
+		// A shed only tells once its images are actually freed; until then the signal still
+		// reads low and would halve the window again for nothing
+		auto tNow = std::chrono::steady_clock::now();
+		if (m_bShedPending)
+		{
+			if (Epoch::Pending())
+				return;
+			m_bShedPending = false;
+			m_memory.Refresh();
+		}
 
-		int nIndex = 0;
-		for (auto& bmp : m_vecBitmaps)
+		MemoryState state = m_memory.Poll();
+		if (state == kMemoryLow)
 		{
-			if (bmp.strFileName == m_wstrFileName)
+			m_tCacheGrow = tNow + std::chrono::seconds(2);
+			if (m_nCacheLimit > 0 && tNow >= m_tCacheShed)
 			{
-				m_nIndex = nIndex;
-				m_nCacheStart = nIndex;
-				m_nCacheEnd = nIndex;
-				bmp.fAlpha = 1.0f;
-				break;
+				// Halved from what is actually cached, so the first signal already frees images
+				m_tCacheShed = tNow + std::chrono::milliseconds(500);
+				ShedCache(std::min(m_nCacheLimit, CachedExtent()) / 2);
+			}
+		}
+		else if (m_nCacheLimit < kMaxCacheLimit && tNow >= m_tCacheGrow)
+		{
+			m_tCacheGrow = tNow + (state == kMemoryHigh ? std::chrono::milliseconds(500) : std::chrono::milliseconds(2000));
+			SetCacheLimit(std::min(kMaxCacheLimit, m_nCacheLimit + std::max(2, m_nCacheLimit / 2)));
+			UpdateCacheForward();
+		}
+	}
+
+	// Distance from the current image to the furthest decoded one in the window
+	int ImageViewer::CachedExtent() const
+	{
+		int nCount = m_images.Size();
+		for (int nDistance = std::max(m_nIndex - m_nCacheStart, m_nCacheEnd - m_nIndex); nDistance > 0; --nDistance)
+		{
+			for (int i : { m_nIndex + nDistance, m_nIndex - nDistance })
+			{
+				if (i >= m_nCacheStart && i <= m_nCacheEnd && i >= 0 && i < nCount && m_images.HasImage(i))
+					return nDistance;
 			}
-			++nIndex;
 		}
+		return 0;
+	}
+
+	void ImageViewer::ShedCache(int nLimit)
+	{
+		// The forward window is shifted back at the end of the list, so it can reach past the limit
+		int nShed = 0;
+		int nCount = m_images.Size();
+		int nDistance = std::max(m_nIndex - m_nCacheStart, m_nCacheEnd - m_nIndex);
+		for (; nDistance > nLimit; --nDistance)
+		{
+			for (int i : { m_nIndex + nDistance, m_nIndex - nDistance })
+			{
+				if (i < m_nCacheStart || i > m_nCacheEnd || i < 0 || i >= nCount)
+					continue;
+				if (m_images.HasImage(i))
+					++nShed;
+				RemoveCache(i, false);
+			}
+		}
+		m_nCacheStart = std::max(m_nCacheStart, m_nIndex - nLimit);
+		m_nCacheEnd = std::min(m_nCacheEnd, m_nIndex + nLimit);
+
+		m_nImagesShed += nShed;
+		DIVE_TRACE_INSTANT("Memory Shed", m_nIndex);
+		DIVE_TRACE_COUNTER("Memory Shed Images", nShed);
+		DIVE_TRACE_COUNTER("Images Shed", m_nImagesShed);
+		SetCacheLimit(nLimit);
+
+		// Give the memory back now rather than over the next frames
+		size_t cbFreed = Epoch::Synchronize();
+		DIVE_TRACE_COUNTER("Memory Shed MB", cbFreed / 1048576.0);
+		m_bShedPending = true;
+	}
+
+	void ImageViewer::SetCacheLimit(int nLimit)
+	{
+		m_nCacheLimit = nLimit;
+		m_coldCache.SetBudget(m_nColdBudget / kMaxCacheLimit * nLimit);
+		DIVE_TRACE_COUNTER("Cache Limit", nLimit);
+	}
+
+	// Any WIC source as tightly packed 32bpp PBGRA, the layout every upload of it expects
+	static bool CopyForUpload(IWICBitmapSource* pSource, UINT nWidth, UINT nHeight, BYTE* pStaging)
+	{
+		CComPtr<IWICBitmapSource> pConverted;
+		HRESULT hr = WICConvertBitmapSource(GUID_WICPixelFormat32bppPBGRA, pSource, &pConverted);
+		if (SUCCEEDED(hr))
+			hr = pConverted->CopyPixels(nullptr, nWidth * 4, nWidth * 4 * nHeight, pStaging);
+		return SUCCEEDED(hr);
+	}
+
+	void ImageViewer::SetFiles(std::vector <std::wstring>&& vecFiles)
+	{
+		// Called from the scan thread; the UI thread picks the new list up in AdoptFiles
+		m_images.SetFiles(std::move(vecFiles));
+
 		if (!m_pthread_thumbnail)
 		{
 			m_pthread_thumbnail = new std::thread(
 				[this]()
 				{
-					for (auto& bmp : m_vecBitmaps)
+					DIVE_TRACE_THREAD("Thumbnail");
+
+					// Folders pre-warmed with /prewarm skip the decode for every unchanged file
+					ThumbnailCache cache;
+					std::wstring strCacheFolder;
+
+					for (int i = 0; i < m_images.Size(); ++i)
 					{
 						if (m_bEndThreads)
 							return;
-						if (bmp.pBitmapThumbnail == nullptr)
+
+						ImageTable::Ticket ticket;
+						std::wstring strFileName;
+						if (!m_images.RequestThumbnail(i, ticket, strFileName))
+							continue;
+
+						std::wstring strFolder = strFileName.substr(0, strFileName.find_last_of(L'\\') + 1);
+						if (strFolder != strCacheFolder)
 						{
-							HRESULT hr = S_OK;
+							strCacheFolder = strFolder;
+							cache.Open(strFolder, kThumbnailWidth, kThumbnailHeight);
+						}
 
-							IWICBitmapSource* pWICBitmap = m_loader->LoadThumbnail(120, 90, bmp.strFileName.c_str());
+						// The upload thread makes the bitmap; UpdateUploads publishes it against the ticket
+						UploadJob job;
+						job.nKind = kUploadThumbnail;
+						job.nIndex = i;
+						job.nTag = (static_cast<uint64_t>(ticket.nVersion) << 32) | ticket.nGeneration;
+						job.nFormat = DXGI_FORMAT_B8G8R8A8_UNORM;
 
-							if (SUCCEEDED(hr))
-								hr = m_pRenderTarget->CreateBitmapFromWicBitmap(
-									pWICBitmap,
-									NULL,
-									&bmp.pBitmapThumbnail
-								);
-							if (SUCCEEDED(hr))
-							{
-								bmp.fAlpha = 1.0f;
-							}
-							pWICBitmap->Release();
+						auto pPixels = std::make_shared<std::vector<BYTE>>(kThumbnailWidth * kThumbnailHeight * 4);
+						if (cache.Read(strFileName, pPixels->data()))
+						{
+							job.nWidth = kThumbnailWidth;
+							job.nHeight = kThumbnailHeight;
+							job.pData = pPixels->data();
+							job.pKeep = pPixels;
+						}
+						else
+						{
+							CComPtr<IWICBitmapSource> pWICBitmap;
+							pWICBitmap.Attach(m_loader->LoadThumbnail(kThumbnailWidth, kThumbnailHeight, strFileName.c_str()));
+							if (!pWICBitmap || FAILED(pWICBitmap->GetSize(&job.nWidth, &job.nHeight)))
+								continue;
+
+							UINT nWidth = job.nWidth, nHeight = job.nHeight;
+							job.fill = [pWICBitmap, nWidth, nHeight](BYTE* pStaging) { return CopyForUpload(pWICBitmap, nWidth, nHeight, pStaging); };
 						}
+						job.nPitch = job.nWidth * 4;
+						job.nRows = job.nHeight;
+
+						// Thumbnails can decode far faster than the device takes them
+						m_pUploader->WaitBelow(kUploadThumbnail, 64);
+						m_pUploader->Submit(std::move(job));
 					}
 				}
 			);
 		}
 	}
+
+	void ImageViewer::AdoptFiles()
+	{
+		uint32_t nVersion = m_images.Version();
+		if (nVersion == m_nFilesVersion)
+			return;
+		m_nFilesVersion = nVersion;
+
+		int nIndex = m_images.IndexOf(m_wstrFileName);
+		if (nIndex >= 0)
+		{
+			m_nIndex = nIndex;
+			m_nCacheStart = nIndex;
+			m_nCacheEnd = nIndex;
+			m_images.SetAlpha(nIndex, 1.0f);
+		}
+	}
+
+	struct LoadCancel
+	{
+		const ImageTable* pTable;
+		int nIndex;
+		ImageTable::Ticket ticket;
+		const std::atomic<bool>* pbEndThreads;
+	};
+
+	// A decode is abandoned once its slot has been evicted, the file list replaced or the viewer is shutting down
+	static bool IsLoadCancelled(const void* pContext)
+	{
+		const LoadCancel* pCancel = static_cast<const LoadCancel*>(pContext);
+		return *pCancel->pbEndThreads || !pCancel->pTable->IsCurrent(pCancel->nIndex, pCancel->ticket);
+	}
+
+	bool ImageViewer::LoadSlot(int nIndex)
+	{
+		// Only the image on screen is decoded at full resolution; it replaces a display-size
+		// copy that is already cached. Zooming past the fit scale is only possible on that
+		// image, so the neighbours never need more than the screen.
+		bool bFull = !m_bReduceCache || nIndex == m_nVisibleIndex || !m_nFitWidth || !m_nFitHeight;
+
+		LoadCancel cancel = { &m_images, nIndex, {}, &m_bEndThreads };
+		std::wstring strFileName;
+		if (!m_images.Request(nIndex, cancel.ticket, strFileName, bFull))
+			return false;
+
+		DIVE_TRACE_CONTEXT(nIndex);
+
+		// Recently evicted images come back from the second tier without touching the file. A
+		// display-size copy of the image on screen is shown at once and the full decode queued
+		// behind it, as FetchImage does.
+		std::unique_ptr<CachedImage> pImage(new CachedImage);
+		if (m_coldCache.Take(strFileName, *pImage))
+		{
+			bool bReduced = bFull && pImage->nFullWidth;
+			if (!m_images.Publish(nIndex, cancel.ticket, pImage.release()))
+				return false;
+			if (bReduced)
+			{
+				m_requests.Push(nIndex);
+				SetEvent(m_hLoadEvent);
+			}
+			return true;
+		}
+
+		// Block-compressed DDS stays compressed in the cache and is uploaded as is
+		BlockImage* pBlocks = nullptr;
+		if (bFull)
+		{
+			pImage->pBitmap.Attach(m_loader->LoadNative(strFileName.c_str(), CancelToken(IsLoadCancelled, &cancel), &pBlocks));
+			pImage->pBlocks.reset(pBlocks);
+			if (!pImage->pBitmap && !pImage->pBlocks)
+				return false;
+		}
+		else
+		{
+			SIZE szFull = {};
+			pImage->pBitmap.Attach(m_loader->LoadFit(strFileName.c_str(), m_nFitWidth, m_nFitHeight, szFull, CancelToken(IsLoadCancelled, &cancel), &pBlocks));
+			pImage->pBlocks.reset(pBlocks);
+			if (pImage->pBlocks)
+				return m_images.Publish(nIndex, cancel.ticket, pImage.release());
+			if (!pImage->pBitmap)
+				return false;
+
+			UINT nWidth = 0, nHeight = 0;
+			pImage->pBitmap->GetSize(&nWidth, &nHeight);
+			if (nWidth != static_cast<UINT>(szFull.cx) || nHeight != static_cast<UINT>(szFull.cy))
+			{
+				pImage->nFullWidth = szFull.cx;
+				pImage->nFullHeight = szFull.cy;
+			}
+		}
+		return m_images.Publish(nIndex, cancel.ticket, pImage.release());
+	}
+
+	CachedImage ImageViewer::FetchImage(int nIndex)
+	{
+		m_nVisibleIndex = nIndex;
+
+		CachedImage image;
+		if (!m_images.AcquireImage(nIndex, image))
+		{
+			m_requests.Remove(nIndex);
+			LoadSlot(nIndex);
+			m_images.AcquireImage(nIndex, image);
+		}
+
+		// Show the display-size copy now and let the load thread bring in the full decode. During
+		// a slideshow the load thread stays on the slides ahead; the full decode follows on stop.
+		if (image.nFullWidth && !m_bSlideshow)
+		{
+			m_requests.Push(nIndex);
+			SetEvent(m_hLoadEvent);
+		}
+		return image;
+	}
+
+	// Runs on the load thread once the queue is drained. The image on screen stays 32bpp;
+	// the rest of the window is re-encoded nearest first and the pass gives way as soon as
+	// new loads are queued.
+	void ImageViewer::CompressCache()
+	{
+		int nVisible = m_nVisibleIndex;
+		if (nVisible < 0)
+			return;
+
+		for (int nDistance = 1; nDistance <= 10; ++nDistance)
+		{
+			for (int nIndex : { nVisible + nDistance, nVisible - nDistance })
+			{
+				if (m_bEndThreads || !m_requests.Empty() || m_nVisibleIndex != nVisible)
+					return;
+				CompressSlot(nIndex);
+			}
+		}
+	}
+
+	bool ImageViewer::CompressSlot(int nIndex)
+	{
+		CachedImage image;
+		ImageTable::Ticket ticket;
+		if (!m_images.AcquireImage(nIndex, image, &ticket) || !image.pBitmap)
+			return false;
+
+		// Decoded images are materialized into an IWICBitmap, so the pixels can be read in place
+		CComPtr<IWICBitmap> pBitmap;
+		UINT nWidth = 0, nHeight = 0;
+		if (FAILED(image.pBitmap->QueryInterface(IID_IWICBitmap, (void**)&pBitmap)) || FAILED(pBitmap->GetSize(&nWidth, &nHeight)))
+			return false;
+
+		// Blocks that do not cover the image exactly cannot be uploaded as they are, and
+		// high bit depth images are kept for the tone mapper
+		WICPixelFormatGUID guidPixelFormat;
+		if ((nWidth % 4) != 0 || (nHeight % 4) != 0
+			|| FAILED(pBitmap->GetPixelFormat(&guidPixelFormat)) || guidPixelFormat != GUID_WICPixelFormat32bppPBGRA)
+			return false;
+
+		DIVE_TRACE_CONTEXT(nIndex);
+		DIVE_TRACE_SPAN(span, "Compress");
+
+		WICRect rc = { 0, 0, static_cast<INT>(nWidth), static_cast<INT>(nHeight) };
+		CComPtr<IWICBitmapLock> pLock;
+		UINT nStride = 0, cbBuffer = 0;
+		BYTE* pPixels = nullptr;
+		if (FAILED(pBitmap->Lock(&rc, WICBitmapLockRead, &pLock))
+			|| FAILED(pLock->GetStride(&nStride))
+			|| FAILED(pLock->GetDataPointer(&cbBuffer, &pPixels)))
+			return false;
+
+		std::shared_ptr<BlockImage> pBlocks = std::make_shared<BlockImage>();
+		double dMeanError = 0.0;
+		if (!EncodeBlocks(pPixels, nWidth, nHeight, nStride, *pBlocks, &dMeanError))
+			return false;
+		pLock.Release();
+
+		DIVE_TRACE_BYTES(span, pBlocks->data.size());
+		DIVE_TRACE_COUNTER("Compress Error", dMeanError);
+
+		std::unique_ptr<CachedImage> pCompressed(new CachedImage);
+		pCompressed->pBlocks = std::move(pBlocks);
+		pCompressed->nFullWidth = image.nFullWidth;
+		pCompressed->nFullHeight = image.nFullHeight;
+		return m_images.Publish(nIndex, ticket, pCompressed.release());
+	}
+
 	void ImageViewer::Show(IWICBitmapSource* pWICBitmap)
 	{
-		HRESULT hr;
-		hr = m_pRenderTarget->CreateBitmapFromWicBitmap(
-			pWICBitmap,
-			NULL,
-			&m_pImage
-		);
-		m_pTextureRV = TextureFromWICBitmap(pWICBitmap);
+		DIVE_TRACE_SCOPE("Show", m_nIndex);
+
+		m_bShowingReduced = false;
+		if (!pWICBitmap)
+			return;
+
+		WICPixelFormatGUID guidPixelFormat;
+		if (SUCCEEDED(pWICBitmap->GetPixelFormat(&guidPixelFormat)) && guidPixelFormat == GUID_WICPixelFormat64bppPRGBAHalf)
+		{
+			ShowToneMapped(pWICBitmap);
+			return;
+		}
+
+		UINT nWidth = 0, nHeight = 0;
+		if (FAILED(pWICBitmap->GetSize(&nWidth, &nHeight)))
+			return;
+
+		// Converted and uploaded on the upload thread; the image on screen stays until UpdateUploads swaps it
+		CComPtr<IWICBitmapSource> pSource = pWICBitmap;
+		UploadJob job;
+		job.nKind = kUploadImage;
+		job.nIndex = m_nIndex;
+		job.nTag = BeginImage();
+		job.nFlags = kUploadBitmap | kUploadTexture;
+		job.nFormat = DXGI_FORMAT_B8G8R8A8_UNORM;
+		job.nWidth = nWidth;
+		job.nHeight = nHeight;
+		job.nPitch = nWidth * 4;
+		job.nRows = nHeight;
+		job.fill = [pSource, nWidth, nHeight](BYTE* pStaging) { return CopyForUpload(pSource, nWidth, nHeight, pStaging); };
+		m_pending.pResampleSource = pWICBitmap;
+		m_pUploader->Submit(std::move(job), true);
+	}
+
+	void ImageViewer::Show(const CachedImage& image)
+	{
+		if (image.pBlocks)
+			ShowBlocks(image.pBlocks);
+		else
+			Show(image.pBitmap);
+
+		// A display-size copy is laid out at the full size, so the full decode drops in without moving the view
+		m_bShowingReduced = image.nFullWidth != 0;
+		if (m_pending.nTag && m_bShowingReduced)
+			m_pending.szLayout = SIZE{ static_cast<LONG>(image.nFullWidth), static_cast<LONG>(image.nFullHeight) };
+	}
+
+	// Called every frame: swaps the full decode in for the display-size copy on screen, keeping the zoom
+	void ImageViewer::RefreshImage()
+	{
+		if (!m_bShowingReduced)
+			return;
+
+		CachedImage image;
+		if (!m_images.AcquireImage(m_nIndex, image) || image.nFullWidth)
+			return;
+
+		ReplaceReduced(image);
+	}
+
+	// Lays the full decode out the way the display-size copy is, or is still waiting to be
+	void ImageViewer::ReplaceReduced(const CachedImage& image)
+	{
+		PendingImage reduced = m_pending;
+		Show(image);
+		if (reduced.nTag)
+		{
+			m_pending.szLayout = reduced.szLayout;
+			m_pending.bFit = reduced.bFit;
+		}
+		else
+			m_pending.bFit = false;
+	}
+
+	// Direct2D takes BC1-BC3 natively through the device context
+	static bool IsNativeBlockFormat(DXGI_FORMAT format)
+	{
+		return format == DXGI_FORMAT_BC1_UNORM || format == DXGI_FORMAT_BC2_UNORM || format == DXGI_FORMAT_BC3_UNORM;
+	}
+
+	void ImageViewer::ShowBlocks(const std::shared_ptr<const BlockImage>& pImage)
+	{
+		DIVE_TRACE_SCOPE("ShowBlocks", m_nIndex);
+
+		const BlockImage& image = *pImage;
+		UploadJob job;
+		job.nKind = kUploadImage;
+		job.nIndex = m_nIndex;
+		job.nTag = BeginImage();
+		job.nFlags = kUploadBitmap | kUploadTexture;
+		job.nWidth = image.nWidth;
+		job.nHeight = image.nHeight;
+
+		// Whole blocks go up untouched; every other format (and BC sizes that are not whole
+		// blocks) is expanded on the upload thread first
+		if ((image.nWidth % 4) == 0 && (image.nHeight % 4) == 0 && IsNativeBlockFormat(image.format))
+		{
+			job.nFormat = image.format;
+			job.nPitch = image.nPitch;
+			job.nRows = image.nHeight / 4;
+			job.pData = image.data.data();
+			job.pKeep = pImage;
+		}
+		else
+		{
+			job.nFormat = DXGI_FORMAT_B8G8R8A8_UNORM;
+			job.nPitch = image.nWidth * 4;
+			job.nRows = image.nHeight;
+			job.fill = [pImage](BYTE* pStaging) { return DecodeBlocks(*pImage, pStaging, pImage->nWidth * 4); };
+		}
+		m_pUploader->Submit(std::move(job), true);
+	}
+
+	// High bit depth images keep their half-float pixels in the cache. The Direct2D bitmap
+	// starts out empty and UpdateToneMap fills in whatever part of it is on screen.
+	void ImageViewer::ShowToneMapped(IWICBitmapSource* pWICBitmap)
+	{
+		DIVE_TRACE_SCOPE("ShowToneMapped", m_nIndex);
+
+		CComPtr<IWICBitmap> pSource;
+		UINT nWidth = 0, nHeight = 0;
+		if (FAILED(pWICBitmap->QueryInterface(IID_IWICBitmap, (void**)&pSource))
+			|| FAILED(pSource->GetSize(&nWidth, &nHeight)))
+			return;
+
+		UploadJob job;
+		job.nKind = kUploadImage;
+		job.nIndex = m_nIndex;
+		job.nTag = BeginImage();
+		job.nFormat = DXGI_FORMAT_B8G8R8A8_UNORM;
+		job.nWidth = nWidth;
+		job.nHeight = nHeight;
+		job.nPitch = nWidth * 4;
+		job.nRows = nHeight;
+		m_pending.pToneMapSource = pSource;
+		m_pUploader->Submit(std::move(job), true);
+	}
+
+	// Starts a new image on its way to the screen; whatever was on its way before is forgotten
+	uint64_t ImageViewer::BeginImage()
+	{
+		m_pending = PendingImage();
+		m_pending.nTag = ++m_nUploadSerial;
+		return m_pending.nTag;
+	}
+
+	// Called every frame before drawing: takes what the upload thread finished. Results nobody
+	// is waiting for any more are dropped here, which releases them.
+	void ImageViewer::UpdateUploads()
+	{
+		UploadResult result;
+		while (m_pUploader->Complete(result))
+		{
+			GpuUpload* pUpload = static_cast<GpuUpload*>(result.pResource.get());
+			switch (result.nKind)
+			{
+			case kUploadImage:
+				if (result.nTag == m_pending.nTag)
+					InstallImage(result);
+				break;
+
+			case kUploadView:
+				if (!pUpload)
+					break;
+				if (result.nIndex < 0 && result.nTag == m_nSharpTag)
+				{
+					m_pSharpView = pUpload->pBitmap;
+					DIVE_TRACE_INSTANT("Sharp View", m_nIndex);
+				}
+				else if (result.nIndex > 0 && result.nTag == m_nResampleImage && static_cast<size_t>(result.nIndex) < m_vecLevelBitmaps.size())
+					m_vecLevelBitmaps[result.nIndex] = pUpload->pBitmap;
+				break;
+
+			case kUploadThumbnail:
+				if (pUpload)
+				{
+					ImageTable::Ticket ticket = { static_cast<uint32_t>(result.nTag >> 32), static_cast<uint32_t>(result.nTag) };
+					if (m_images.PublishThumbnail(result.nIndex, ticket, pUpload->pBitmap.Detach()))
+						m_images.SetAlpha(result.nIndex, 1.0f);
+				}
+				break;
+			}
+		}
+	}
+
+	// Puts the uploaded image on screen and lays it out the way its Show asked for
+	void ImageViewer::InstallImage(UploadResult& result)
+	{
+		DIVE_TRACE_SCOPE("Install Image", m_nIndex);
 
-		m_szImage = SIZE{ (long)m_pImage->GetSize().width, (long)m_pImage->GetSize().height };
+		PendingImage pending = m_pending;
+		m_pending = PendingImage();
+
+		if (m_pImage)
+		{
+			m_pImage->Release();
+			m_pImage = nullptr;
+		}
+		if (m_pTextureRV)
+		{
+			m_pTextureRV->Release();
+			m_pTextureRV = nullptr;
+		}
+		m_pToneMapSource.Release();
+		ResetResampling(nullptr);
+
+		GpuUpload* pUpload = static_cast<GpuUpload*>(result.pResource.get());
+		if (FAILED(result.hr) || !pUpload || !pUpload->pBitmap)
+			return;
+
+		m_pImage = pUpload->pBitmap.Detach();
+		m_pTextureRV = pUpload->pTexture.Detach();
+		if (pUpload->pCommands)
+			m_pImmediateContext->ExecuteCommandList(pUpload->pCommands, FALSE);
+
+		m_pToneMapSource = pending.pToneMapSource;
+		m_rcToneMapped = D2D1::RectU();
+		ResetResampling(pending.pResampleSource);
+
+		if (pending.szLayout.cx)
+			FitImage(pending.szLayout);
+		else if (pending.bFit)
+			FitImage();
+	}
+
+	// Prefiltered drawing is only kept for 8-bit images; block-compressed, tone-mapped and
+	// animated ones are reduced by the GPU's linear filter
+	void ImageViewer::ResetResampling(IWICBitmapSource* pSource)
+	{
+		if (!pSource && !m_nResampleImage)
+			return;
+
+		m_vecLevelBitmaps.clear();
+		m_nLevelUploads = 0;
+		m_pSharpView.Release();
+		m_sharpView = ResampleView();
+		++m_nSharpTag;
+
+		if (pSource && !++m_nResampleSerial)
+			++m_nResampleSerial;
+		m_nResampleImage = pSource ? m_nResampleSerial : 0;
+		m_pResampler->SetImage(pSource, m_nResampleImage);
+	}
+
+	// Called every frame before drawing. While the zoom moves, the pyramid level nearest the
+	// scale is drawn; once it settles below 1x, the exact screen pixels of the view are asked
+	// for and replace it when they arrive.
+	void ImageViewer::UpdateResampling()
+	{
+		if (!m_nResampleImage || !m_pImage)
+			return;
+
+		D2D1_SIZE_U szImage = m_pImage->GetPixelSize();
+		float fViewWidth = m_rcView.right - m_rcView.left;
+		float fViewHeight = m_rcView.bottom - m_rcView.top;
+		if (!szImage.width || !szImage.height || fViewWidth <= 0 || fViewHeight <= 0)
+			return;
+
+		float fScale = fViewWidth / szImage.width;
+		UINT nLevel = PyramidLevel(fScale, szImage.width, szImage.height);
+		if (nLevel && !(m_nLevelUploads & (1u << nLevel)))
+		{
+			std::shared_ptr<const PixelPlane> pLevel = m_pResampler->Level(nLevel);
+			if (pLevel)
+			{
+				if (m_vecLevelBitmaps.size() <= nLevel)
+					m_vecLevelBitmaps.resize(nLevel + 1);
+				m_nLevelUploads |= 1u << nLevel;
+				UploadPlane(pLevel, static_cast<int>(nLevel), m_nResampleImage);
+			}
+		}
+
+		// Whole screen pixels covered by the image, and the part of the level they map to
+		ResampleView view;
+		D2D1_RECT_F rcSharp = D2D1::RectF(
+			std::floor(std::max(m_rcView.left, 0.0f)),
+			std::floor(std::max(m_rcView.top, 0.0f)),
+			std::ceil(std::min(m_rcView.right, static_cast<float>(m_szClient.cx))),
+			std::ceil(std::min(m_rcView.bottom, static_cast<float>(m_szClient.cy))));
+		if (m_fScale == m_fScaleTo && fScale < 1.0f && rcSharp.right > rcSharp.left && rcSharp.bottom > rcSharp.top)
+		{
+			UINT nLevelWidth = szImage.width;
+			UINT nLevelHeight = szImage.height;
+			PyramidSize(nLevel, nLevelWidth, nLevelHeight);
+
+			view.nImage = m_nResampleImage;
+			view.nLevel = nLevel;
+			view.fX = (rcSharp.left - m_rcView.left) * nLevelWidth / fViewWidth;
+			view.fY = (rcSharp.top - m_rcView.top) * nLevelHeight / fViewHeight;
+			view.fWidth = (rcSharp.right - rcSharp.left) * nLevelWidth / fViewWidth;
+			view.fHeight = (rcSharp.bottom - rcSharp.top) * nLevelHeight / fViewHeight;
+			view.nWidth = static_cast<UINT>(rcSharp.right - rcSharp.left);
+			view.nHeight = static_cast<UINT>(rcSharp.bottom - rcSharp.top);
+		}
+
+		if (view != m_sharpView)
+		{
+			m_pSharpView.Release();
+			m_sharpView = view;
+			m_rcSharpView = rcSharp;
+			++m_nSharpTag;
+			if (view.nImage)
+				m_pResampler->Request(view);
+		}
+		if (m_pSharpView || !m_sharpView.nImage)
+			return;
+
+		ResampleView finished;
+		std::shared_ptr<const PixelPlane> pPixels = m_pResampler->TakeView(finished);
+		if (pPixels && finished == m_sharpView)
+			UploadPlane(pPixels, -1, m_nSharpTag);
+	}
+
+	// Levels come back with their level as the index, the sharp view with -1
+	void ImageViewer::UploadPlane(const std::shared_ptr<const PixelPlane>& pPlane, int nIndex, uint64_t nTag)
+	{
+		UploadJob job;
+		job.nKind = kUploadView;
+		job.nIndex = nIndex;
+		job.nTag = nTag;
+		job.nFormat = DXGI_FORMAT_B8G8R8A8_UNORM;
+		job.nWidth = pPlane->nWidth;
+		job.nHeight = pPlane->nHeight;
+		job.nPitch = pPlane->nWidth * 4;
+		job.nRows = pPlane->nHeight;
+		job.pData = pPlane->pixels.data();
+		job.pKeep = pPlane;
+		m_pUploader->Submit(std::move(job));
+	}
+
+	// Called every frame before drawing; converts the visible part of a half-float image when it
+	// was not converted yet or the exposure changed. A margin around the view absorbs small pans.
+	void ImageViewer::UpdateToneMap()
+	{
+		if (!m_pToneMapSource || !m_pImage)
+			return;
+
+		D2D1_SIZE_U szBitmap = m_pImage->GetPixelSize();
+		float fViewWidth = m_rcView.right - m_rcView.left;
+		float fViewHeight = m_rcView.bottom - m_rcView.top;
+		if (fViewWidth <= 0 || fViewHeight <= 0)
+			return;
+
+		float fLeft = (std::max(m_rcView.left, 0.0f) - m_rcView.left) / fViewWidth * szBitmap.width;
+		float fTop = (std::max(m_rcView.top, 0.0f) - m_rcView.top) / fViewHeight * szBitmap.height;
+		float fRight = (std::min(m_rcView.right, static_cast<float>(m_szClient.cx)) - m_rcView.left) / fViewWidth * szBitmap.width;
+		float fBottom = (std::min(m_rcView.bottom, static_cast<float>(m_szClient.cy)) - m_rcView.top) / fViewHeight * szBitmap.height;
+		if (fRight <= fLeft || fBottom <= fTop)
+			return;
+
+		D2D1_RECT_U rcVisible = D2D1::RectU(
+			static_cast<UINT32>(std::max(0.0f, std::floor(fLeft))),
+			static_cast<UINT32>(std::max(0.0f, std::floor(fTop))),
+			static_cast<UINT32>(std::min(static_cast<float>(szBitmap.width), std::ceil(fRight))),
+			static_cast<UINT32>(std::min(static_cast<float>(szBitmap.height), std::ceil(fBottom))));
+		if (rcVisible.left >= m_rcToneMapped.left && rcVisible.top >= m_rcToneMapped.top &&
+			rcVisible.right <= m_rcToneMapped.right && rcVisible.bottom <= m_rcToneMapped.bottom)
+			return;
+
+		UINT32 nMarginX = (rcVisible.right - rcVisible.left) / 4;
+		UINT32 nMarginY = (rcVisible.bottom - rcVisible.top) / 4;
+		D2D1_RECT_U rc = D2D1::RectU(
+			rcVisible.left > nMarginX ? rcVisible.left - nMarginX : 0,
+			rcVisible.top > nMarginY ? rcVisible.top - nMarginY : 0,
+			std::min(szBitmap.width, rcVisible.right + nMarginX),
+			std::min(szBitmap.height, rcVisible.bottom + nMarginY));
+
+		DIVE_TRACE_SPAN(span, "ToneMap");
+
+		UINT nWidth = rc.right - rc.left;
+		UINT nHeight = rc.bottom - rc.top;
+		WICRect rcLock = { static_cast<INT>(rc.left), static_cast<INT>(rc.top), static_cast<INT>(nWidth), static_cast<INT>(nHeight) };
+		CComPtr<IWICBitmapLock> pLock;
+		UINT nStride = 0, cbBuffer = 0;
+		BYTE* pPixels = nullptr;
+		if (FAILED(m_pToneMapSource->Lock(&rcLock, WICBitmapLockRead, &pLock))
+			|| FAILED(pLock->GetStride(&nStride))
+			|| FAILED(pLock->GetDataPointer(&cbBuffer, &pPixels)))
+			return;
+
+		std::unique_ptr<BYTE[]> pixels(new BYTE[static_cast<size_t>(nWidth) * nHeight * 4]);
+		ToneMap(pPixels, nStride, pixels.get(), nWidth * 4, nWidth, nHeight, m_fExposure);
+		pLock.Release();
+
+		DIVE_TRACE_BYTES(span, static_cast<uint64_t>(nWidth) * nHeight * 8);
+
+		if (SUCCEEDED(m_pImage->CopyFromMemory(&rc, pixels.get(), nWidth * 4)))
+			m_rcToneMapped = rc;
+	}
+
+	void ImageViewer::AdjustExposure(float fStops)
+	{
+		m_fExposure *= std::pow(2.0f, fStops);
+		m_rcToneMapped = D2D1::RectU();
+		DIVE_TRACE_COUNTER("Exposure", m_fExposure);
+	}
+
+	void ImageViewer::ResetExposure()
+	{
+		m_fExposure = 1.0f;
+		m_rcToneMapped = D2D1::RectU();
+		DIVE_TRACE_COUNTER("Exposure", m_fExposure);
+	}
+
+	void ImageViewer::FitImage()
+	{
+		FitImage(SIZE{ (long)m_pImage->GetSize().width, (long)m_pImage->GetSize().height });
+	}
+
+	void ImageViewer::FitImage(SIZE szImage)
+	{
+		m_szImage = szImage;
 
 		if (m_szClient.cx < m_szImage.cx || m_szClient.cy < m_szImage.cy)
 		{
@@ -915,31 +1722,466 @@ namespace DIVE
 	}
 	void ImageViewer::PrevImage()
 	{
-		OutputDebugString(L"Prev\n");
+		if (m_pFlipbook->IsRunning())
+			ToggleFlipbook();
 		if (m_nIndex > 0)
 		{
+			NoteStep();
 			m_nIndex--;
-			if (!m_vecBitmaps[m_nIndex].pBitmap)
-				m_vecBitmaps[m_nIndex].pBitmap = m_loader->Load(m_vecBitmaps[m_nIndex].strFileName.c_str());
-			Show(m_vecBitmaps[m_nIndex].pBitmap);
+			DIVE_TRACE_CONTEXT(m_nIndex);
+			DIVE_TRACE_INSTANT("Prev", m_nIndex);
+			Show(FetchImage(m_nIndex));
 		}
 		UpdateCacheBackward();
 	}
 
 	void ImageViewer::NextImage()
 	{
-		OutputDebugString(L"Next\n");
-		if (m_nIndex < m_vecBitmaps.size() - 1 && m_nIndex >= 0)
+		if (m_pFlipbook->IsRunning())
+			ToggleFlipbook();
+		if (m_nIndex < m_images.Size() - 1 && m_nIndex >= 0)
 		{
+			NoteStep();
 			m_nIndex++;
-			if (!m_vecBitmaps[m_nIndex].pBitmap)
-				m_vecBitmaps[m_nIndex].pBitmap = m_loader->Load(m_vecBitmaps[m_nIndex].strFileName.c_str());
-			Show(m_vecBitmaps[m_nIndex].pBitmap);
+			DIVE_TRACE_CONTEXT(m_nIndex);
+			DIVE_TRACE_INSTANT("Next", m_nIndex);
+			Show(FetchImage(m_nIndex));
 		}
 		UpdateCacheForward();
 	}
 
-	bool ImageViewer::Load(const wchar_t* wszFileName)
+	// Images decoded ahead of the current one: enough that the load thread, decoding one at a
+	// time at the loader's learned cost, keeps ahead of the user's stepping rate (or of the
+	// slideshow schedule), with room for a few slow decodes. Until both are known, 10.
+	int ImageViewer::CacheAhead(int nDirection) const
+	{
+		double fInterval = m_bSlideshow ? std::chrono::duration<double, std::micro>(m_slideInterval).count() : m_fStepMicros;
+		double fDecode = EstimateDecodeMicros(nDirection);
+		if (fInterval <= 0.0 || fDecode <= 0.0)
+			return 10;
+
+		double fAhead = 2.0 + 3.0 * fDecode / fInterval;
+		return static_cast<int>(std::min(static_cast<double>(kMaxCacheLimit), std::max(3.0, std::ceil(fAhead))));
+	}
+
+	// Expected decode time of the next few images in the direction of travel, decoded the way
+	// the load thread will decode them; 0 before the loader has learned anything
+	double ImageViewer::EstimateDecodeMicros(int nDirection) const
+	{
+		const DecodeCost& cost = m_loader->Cost();
+		double fTotal = 0.0;
+		int nCounted = 0;
+		for (int i = 1; i <= 4; ++i)
+		{
+			std::wstring strFileName = m_images.FileName(m_nIndex + i * nDirection);
+			if (strFileName.empty())
+				break;
+			fTotal += cost.Micros(strFileName.c_str(), m_bReduceCache);
+			++nCounted;
+		}
+		return nCounted ? fTotal / nCounted : 0.0;
+	}
+
+	// Called on each step through the folder; a pause of more than a few seconds starts a new
+	// run of steps instead of counting as a very slow one
+	void ImageViewer::NoteStep()
+	{
+		auto tNow = std::chrono::steady_clock::now();
+		double fMicros = std::chrono::duration<double, std::micro>(tNow - m_tLastStep).count();
+		m_tLastStep = tNow;
+		if (m_bSlideshow || fMicros > 5e6)
+			return;
+		m_fStepMicros = m_fStepMicros > 0.0 ? (m_fStepMicros * 3 + fMicros) / 4 : fMicros;
+	}
+
+	void ImageViewer::ReportDecodeCost()
+	{
+		std::wstring strReport = m_loader->Cost().Report();
+		wchar_t wszLine[128];
+		swprintf_s(wszLine, L"Stepping every %.0f ms, %d images ahead\n", m_fStepMicros / 1000.0, CacheAhead());
+		strReport += wszLine;
+		OutputDebugStringW(strReport.c_str());
+	}
+
+	void ImageViewer::ToggleSlideshow()
+	{
+		m_bSlideshow = !m_bSlideshow;
+		m_bSlideLate = false;
+		m_nSlideRequested = -1;
+		m_nSlideSkipFrom = -1;
+		m_tNextSlide = std::chrono::steady_clock::now() + m_slideInterval;
+		DIVE_TRACE_INSTANT(m_bSlideshow ? "Slideshow Start" : "Slideshow Stop", m_nIndex);
+
+		UpdateCacheForward();
+
+		// Back to browsing: the image on screen may still be the display-size copy
+		CachedImage image;
+		if (!m_bSlideshow && m_images.AcquireImage(m_nIndex, image) && image.nFullWidth)
+		{
+			m_requests.Push(m_nIndex);
+			SetEvent(m_hLoadEvent);
+		}
+	}
+
+	// Called every frame. Slides advance on a fixed schedule, but only to an image that is
+	// already cached, so a transition never waits on a decode. A slide that is not ready at
+	// its deadline is reported once and shown as soon as it arrives; the schedule restarts
+	// from there instead of rushing to catch up.
+	void ImageViewer::UpdateSlideshow()
+	{
+		if (!m_bSlideshow)
+			return;
+
+		auto tNow = std::chrono::steady_clock::now();
+		if (tNow < m_tNextSlide)
+			return;
+
+		// Slides whose decode failed are passed over
+		int nNext = m_nIndex == m_nSlideSkipFrom ? m_nSlideSkipTo : m_nIndex + 1;
+		if (nNext >= m_images.Size())
+		{
+			ToggleSlideshow();
+			return;
+		}
+
+		// A slide that is not cached is queued, never decoded here. One the slideshow queued
+		// itself that is neither cached nor on its way any more failed to decode.
+		if (!m_images.HasImage(nNext))
+		{
+			bool bPending = m_requests.Contains(nNext) || m_nLoadingIndex == nNext;
+			if (!bPending && m_nSlideRequested == nNext)
+			{
+				DIVE_TRACE_INSTANT("Slideshow Skip", nNext);
+				m_nSlideRequested = -1;
+				m_nSlideSkipFrom = m_nIndex;
+				m_nSlideSkipTo = nNext + 1;
+				return;
+			}
+			if (!bPending)
+			{
+				m_nSlideRequested = nNext;
+				m_requests.Push(nNext);
+				SetEvent(m_hLoadEvent);
+			}
+
+			if (!m_bSlideLate)
+			{
+				m_bSlideLate = true;
+				++m_nSlidesMissed;
+				DIVE_TRACE_INSTANT("Slideshow Missed", nNext);
+				DIVE_TRACE_COUNTER("Slideshow Missed", m_nSlidesMissed);
+			}
+			return;
+		}
+
+		if (m_bSlideLate)
+		{
+			double dMilliseconds = std::chrono::duration<double, std::milli>(tNow - m_tNextSlide).count();
+			DIVE_TRACE_COUNTER("Slideshow Late ms", dMilliseconds);
+			m_tNextSlide = tNow;
+			m_bSlideLate = false;
+		}
+		m_tNextSlide += m_slideInterval;
+
+		// Stepping from just before the slide keeps NextImage's bookkeeping for a skip too
+		m_nSlideSkipFrom = -1;
+		m_nIndex = nNext - 1;
+		NextImage();
+	}
+
+	// Called every frame. Multi-frame files get a decoder that runs ahead of display; the
+	// first frame is already on screen from the cache. A timed frame is taken when due and
+	// only if it is decoded, so playback never waits on the decoder. A frame that is not
+	// ready in time is reported once and the schedule restarts when it arrives.
+	void ImageViewer::UpdateAnimation()
+	{
+		if (m_pFlipbook->IsRunning())
+			return;
+		if (m_nIndex != m_nAnimationIndex || m_nFilesVersion != m_nAnimationVersion)
+		{
+			m_nAnimationIndex = m_nIndex;
+			m_nAnimationVersion = m_nFilesVersion;
+			m_pAnimation->Stop();
+			m_nFrame = 0;
+			m_nFrameTarget = 0;
+			m_bFramePaused = false;
+			m_bFrameLate = true;
+
+			m_strAnimationFile.clear();
+			{
+				Epoch::Guard guard;
+				if (m_nIndex >= 0 && m_nIndex < m_images.Size())
+					m_strAnimationFile = m_images.FileName(m_nIndex);
+			}
+			if (!m_strAnimationFile.empty() && Animation::MayHaveFrames(m_strAnimationFile.c_str()))
+				m_pAnimation->Start(m_strAnimationFile, 0);
+		}
+		if (m_pAnimation->Frames() < 2)
+			return;
+
+		auto tNow = std::chrono::steady_clock::now();
+		bool bPlaying = m_pAnimation->IsTimed() && !m_bFramePaused;
+		if (bPlaying ? tNow < m_tNextFrame : m_nFrameTarget == m_nFrame)
+			return;
+
+		// Frames that failed to decode, and frames stepped past while paused, are dropped
+		FrameRing& ring = m_pAnimation->Ring();
+		const Frame* pFrame;
+		while ((pFrame = ring.Front()) && (!pFrame->nWidth || (!bPlaying && pFrame->nFrame != m_nFrameTarget)))
+			ring.Pop();
+		if (!pFrame)
+		{
+			if (bPlaying && !m_bFrameLate)
+			{
+				m_bFrameLate = true;
+				++m_nFrameStalls;
+				DIVE_TRACE_INSTANT("Frame Late", m_nIndex);
+				DIVE_TRACE_COUNTER("Frame Stalls", m_nFrameStalls);
+			}
+			return;
+		}
+
+		ShowFrame(*pFrame);
+		m_nFrame = pFrame->nFrame;
+		m_nFrameTarget = m_nFrame;
+		if (bPlaying)
+		{
+			if (m_bFrameLate)
+				m_tNextFrame = tNow;
+			m_tNextFrame += pFrame->delay;
+			m_bFrameLate = false;
+		}
+		ring.Pop();
+	}
+
+	// Frames of one file share a size, so after the first one the bitmap on screen is
+	// rewritten in place instead of reallocated. Ring slots are reused as soon as they are
+	// popped, so frames are uploaded here rather than on the upload thread.
+	void ImageViewer::ShowFrame(const Frame& frame)
+	{
+		DIVE_TRACE_SCOPE("ShowFrame", m_nIndex);
+		ResetResampling(nullptr);
+		m_pending = PendingImage();
+
+		D2D1_SIZE_U szBitmap = m_pImage ? m_pImage->GetPixelSize() : D2D1::SizeU();
+		if (m_pImage && !m_pToneMapSource && szBitmap.width == frame.nWidth && szBitmap.height == frame.nHeight)
+		{
+			m_pImage->CopyFromMemory(nullptr, frame.pixels.data(), frame.nWidth * 4);
+		}
+		else
+		{
+			if (m_pImage)
+			{
+				m_pImage->Release();
+				m_pImage = nullptr;
+			}
+			m_pToneMapSource.Release();
+
+			HRESULT hr = m_pRenderTarget->CreateBitmap(
+				D2D1::SizeU(frame.nWidth, frame.nHeight),
+				frame.pixels.data(),
+				frame.nWidth * 4,
+				D2D1::BitmapProperties(D2D1::PixelFormat(DXGI_FORMAT_B8G8R8A8_UNORM, D2D1_ALPHA_MODE_PREMULTIPLIED)),
+				&m_pImage
+			);
+			if (FAILED(hr))
+				return;
+
+			// Replacing a display-size copy keeps the view; a page of another size is fitted anew
+			if (m_szImage.cx != static_cast<LONG>(frame.nWidth) || m_szImage.cy != static_cast<LONG>(frame.nHeight))
+				FitImage();
+		}
+		m_bShowingReduced = false;
+	}
+
+	void ImageViewer::StepFrame(int nDelta)
+	{
+		int nFrames = static_cast<int>(m_pAnimation->Frames());
+		if (nFrames < 2)
+			return;
+
+		// Stepping pauses playback. GIFs wrap around, pages stop at either end.
+		m_bFramePaused = true;
+		int nTarget = static_cast<int>(m_nFrameTarget) + nDelta;
+		if (m_pAnimation->IsTimed())
+			nTarget = (nTarget % nFrames + nFrames) % nFrames;
+		else
+			nTarget = std::max(0, std::min(nTarget, nFrames - 1));
+		if (static_cast<UINT>(nTarget) == m_nFrameTarget)
+			return;
+
+		// The decoder only runs forward, so going back restarts it at the target
+		if (nDelta < 0)
+			m_pAnimation->Start(m_strAnimationFile, nTarget);
+		m_nFrameTarget = nTarget;
+		DIVE_TRACE_INSTANT("Step Frame", m_nIndex);
+	}
+
+	void ImageViewer::ToggleAnimation()
+	{
+		if (m_pAnimation->Frames() < 2 || !m_pAnimation->IsTimed())
+			return;
+
+		// Resuming shows the next frame as soon as it is there and schedules from it
+		m_bFramePaused = !m_bFramePaused;
+		m_bFrameLate = true;
+	}
+
+	// "shot_0042.tga" -> "shot_", 42, ".tga"; false without digits right before the extension
+	static bool SplitFrameNumber(const std::wstring& strFileName, std::wstring& strPrefix, std::wstring& strSuffix, unsigned long long& nNumber)
+	{
+		size_t nDot = strFileName.find_last_of(L'.');
+		size_t nSlash = strFileName.find_last_of(L"\\/");
+		if (nDot == std::wstring::npos || (nSlash != std::wstring::npos && nDot < nSlash))
+			return false;
+
+		size_t nDigits = nDot;
+		while (nDigits > 0 && nDot - nDigits < 18 && std::iswdigit(strFileName[nDigits - 1]))
+			--nDigits;
+		if (nDigits == nDot)
+			return false;
+
+		strPrefix = strFileName.substr(0, nDigits);
+		strSuffix = strFileName.substr(nDot);
+		nNumber = std::stoull(strFileName.substr(nDigits, nDot - nDigits));
+		return true;
+	}
+
+	// Plays the numbered sequence the current file belongs to: the run of neighbouring files
+	// that differ only in the number, in numeric order. Toggling off (or browsing) goes back
+	// to the file of the frame on screen.
+	void ImageViewer::ToggleFlipbook()
+	{
+		if (m_pFlipbook->IsRunning())
+		{
+			m_pFlipbook->Stop();
+			DIVE_TRACE_INSTANT("Flipbook Stop", m_nFlipIndex);
+
+			wchar_t wszReport[128];
+			swprintf_s(wszReport, L"Flipbook: %d frames shown, %d dropped, %.1f fps sustained, %.1f ms per decode\n",
+				m_nFlipShown, m_nFlipDropped, FlipbookRate(), m_pFlipbook->DecodeMicros() / 1000.0);
+			OutputDebugStringW(wszReport);
+			SetWindowTextW(m_hWnd, m_strWindowTitle.c_str());
+
+			m_nAnimationIndex = -1;
+			if (m_nFlipIndex >= 0 && m_nFlipIndex != m_nIndex && m_nFlipIndex < m_images.Size())
+			{
+				m_nIndex = m_nFlipIndex;
+				Show(FetchImage(m_nIndex));
+				UpdateCacheForward();
+			}
+			return;
+		}
+
+		std::vector<std::pair<unsigned long long, int>> vecRun;
+		std::vector<std::wstring> vecFiles;
+		{
+			Epoch::Guard guard;
+			std::wstring strPrefix, strSuffix, strOtherPrefix, strOtherSuffix;
+			unsigned long long nNumber = 0;
+			if (m_nIndex < 0 || m_nIndex >= m_images.Size() || !SplitFrameNumber(m_images.FileName(m_nIndex), strPrefix, strSuffix, nNumber))
+				return;
+
+			int nFirst = m_nIndex;
+			int nLast = m_nIndex;
+			while (nFirst > 0 && SplitFrameNumber(m_images.FileName(nFirst - 1), strOtherPrefix, strOtherSuffix, nNumber)
+				&& strOtherPrefix == strPrefix && strOtherSuffix == strSuffix)
+				--nFirst;
+			while (nLast + 1 < m_images.Size() && SplitFrameNumber(m_images.FileName(nLast + 1), strOtherPrefix, strOtherSuffix, nNumber)
+				&& strOtherPrefix == strPrefix && strOtherSuffix == strSuffix)
+				++nLast;
+			if (nFirst == nLast)
+				return;
+
+			// Unpadded numbers list as 1, 10, 100, 11, ...
+			for (int i = nFirst; i <= nLast; ++i)
+			{
+				SplitFrameNumber(m_images.FileName(i), strOtherPrefix, strOtherSuffix, nNumber);
+				vecRun.emplace_back(nNumber, i);
+			}
+			std::sort(vecRun.begin(), vecRun.end());
+			for (auto& frame : vecRun)
+				vecFiles.push_back(m_images.FileName(frame.second));
+		}
+
+		if (m_bSlideshow)
+			ToggleSlideshow();
+		m_pAnimation->Stop();
+
+		UINT nStart = 0;
+		m_vecFlipIndices.clear();
+		for (auto& frame : vecRun)
+		{
+			if (frame.second == m_nIndex)
+				nStart = static_cast<UINT>(m_vecFlipIndices.size());
+			m_vecFlipIndices.push_back(frame.second);
+		}
+
+		m_nFlipSequence = 0;
+		m_nFlipIndex = m_nIndex;
+		m_nFlipShown = 0;
+		m_nFlipDropped = 0;
+		m_tFlipTitle = std::chrono::steady_clock::now();
+
+		wchar_t wszTitle[256] = {};
+		GetWindowTextW(m_hWnd, wszTitle, 256);
+		m_strWindowTitle = wszTitle;
+		m_pFlipbook->Start(std::move(vecFiles), nStart);
+		DIVE_TRACE_INSTANT("Flipbook Start", m_nIndex);
+	}
+
+	// Called every frame. Shows the frame the flipbook clock says is due, if it is decoded.
+	// Frames whose turn passed without being shown, or that were skipped or failed, count as
+	// dropped; the clock never waits, so playback stays at the frame rate.
+	void ImageViewer::UpdateFlipbook()
+	{
+		if (!m_pFlipbook->IsRunning() || !m_pFlipbook->Prime())
+			return;
+
+		FrameRing& ring = m_pFlipbook->Ring();
+		uint64_t nDue = m_pFlipbook->Due();
+		const Frame* pFrame;
+		while (m_nFlipSequence <= nDue && (pFrame = ring.Front()) != nullptr)
+		{
+			if (m_nFlipSequence == nDue && pFrame->nWidth)
+			{
+				if (!m_nFlipShown)
+					m_tFlipStart = std::chrono::steady_clock::now();
+				ShowFrame(*pFrame);
+				m_nFlipIndex = m_vecFlipIndices[pFrame->nFrame];
+				++m_nFlipShown;
+			}
+			else
+			{
+				++m_nFlipDropped;
+				DIVE_TRACE_INSTANT("Flipbook Drop", m_vecFlipIndices[pFrame->nFrame]);
+				DIVE_TRACE_COUNTER("Flipbook Dropped", m_nFlipDropped);
+			}
+			ring.Pop();
+			++m_nFlipSequence;
+		}
+
+		// The rate actually sustained goes in the title bar, once a second
+		auto tNow = std::chrono::steady_clock::now();
+		if (tNow >= m_tFlipTitle && m_nFlipShown)
+		{
+			m_tFlipTitle = tNow + std::chrono::seconds(1);
+			wchar_t wszTitle[256];
+			swprintf_s(wszTitle, L"%ls - flipbook %.1f fps (%.0f target), %d dropped", m_strWindowTitle.c_str(),
+				FlipbookRate(), 1.0 / std::chrono::duration<double>(m_pFlipbook->Interval()).count(), m_nFlipDropped);
+			SetWindowTextW(m_hWnd, wszTitle);
+		}
+	}
+
+	// Frames shown per second since the first one
+	double ImageViewer::FlipbookRate() const
+	{
+		double fSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_tFlipStart).count();
+		return m_nFlipShown > 1 && fSeconds > 0.0 ? (m_nFlipShown - 1) / fSeconds : 0.0;
+	}
+
+	// pFirst is the file already decoded, or its preview, as Start does off the UI thread
+	bool ImageViewer::Load(const wchar_t* wszFileName, const CachedImage* pFirst)
 	{
 		wchar_t wszTemp[256];
 
@@ -961,19 +2203,13 @@ namespace DIVE
 		
 		m_fScale = m_fScaleFrom = m_fScaleTo = 1.0f;
 
+		if (pFirst)
+			Show(*pFirst);
+		else
 		{
-			HRESULT hr;
-			CComPtr<IWICBitmapSource> pWICBitmap = m_loader->Load(wszFileName);
+			CComPtr<IWICBitmapSource> pWICBitmap;
+			pWICBitmap.Attach(m_loader->Load(wszFileName));
 
-			if (pWICBitmap)
-			{
-				hr = m_pRenderTarget->CreateBitmapFromWicBitmap(
-					pWICBitmap,
-					NULL,
-					&m_pImage
-				);
-				m_pTextureRV = TextureFromWICBitmap(pWICBitmap);
-			}
 			Show( pWICBitmap );
 		}
 
@@ -983,9 +2219,11 @@ namespace DIVE
 			m_pthread_scan = new std::thread(
 				[this](const std::wstring& strPath)
 				{
+					DIVE_TRACE_THREAD("Scan");
+
 					std::wstring strFiles = strPath + L"\\*.*";
 					WIN32_FIND_DATA findData;
-					std::vector <ThumbnailInfo> vecFiles;
+					std::vector <std::wstring> vecFiles;
 
 					auto hFind = FindFirstFile(strFiles.c_str(), &findData);
 					if (hFind)
@@ -997,19 +2235,8 @@ namespace DIVE
 								return;
 							if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != FILE_ATTRIBUTE_DIRECTORY)
 							{
-								wchar_t wszTemp[256];
-
-								wcscpy(wszTemp, findData.cFileName );
-								wcslwr(wszTemp);
-
-								if (ends_with( wszTemp, L".tga" ) ||
-									ends_with( wszTemp, L".bmp" ) ||
-									ends_with( wszTemp, L".dds" ) ||
-									ends_with( wszTemp, L".png" ) ||
-									ends_with( wszTemp, L".tif" ) ||
-									ends_with( wszTemp, L".jpg") ||
-									ends_with( wszTemp, L".ico" ))
-									vecFiles.push_back({ strPath + findData.cFileName });
+								if (ImageLoader::IsImageFile(findData.cFileName))
+									vecFiles.push_back(strPath + findData.cFileName);
 							}
 							bFind = FindNextFile(hFind, &findData);
 						}
@@ -1041,10 +2268,10 @@ namespace DIVE
 		int nCenterPos = (rcClient.right - rcClient.left - m_nThumbWidth) / 2;
 		int nIndex = (m_ptDown.x - nCenterPos + m_nIndex * (m_nThumbWidth + m_nThumbSpacing)) / (m_nThumbWidth + m_nThumbSpacing);
 
-		if (m_bShowThumbs && nIndex >= 0 && nIndex < m_vecBitmaps.size())
+		if (m_bShowThumbs && nIndex >= 0 && nIndex < m_images.Size())
 		{
 			m_nIndex = nIndex;
-			Show(m_vecBitmaps[m_nIndex].pBitmap);
+			Show(FetchImage(m_nIndex));
 		}
 		else
 			SetCursor(LoadCursor(NULL, IDC_HAND));
@@ -1092,17 +2319,15 @@ namespace DIVE
 				int nCenterPos = (rcClient.right - rcClient.left - m_nThumbWidth) / 2;
 				int nIndex = (ptMove.x - nCenterPos + m_nIndex * (m_nThumbWidth + m_nThumbSpacing)) / (m_nThumbWidth + m_nThumbSpacing) ;
 
-				if (nIndex >= 0 && nIndex < m_vecBitmaps.size() && ptMove.y >= rcClient.bottom - m_nThumbHeight)
+				if (nIndex >= 0 && nIndex < m_images.Size() && ptMove.y >= rcClient.bottom - m_nThumbHeight)
 				{
-					if (m_vecBitmaps[nIndex].pBitmap)
+					if (m_images.HasImage(nIndex))
 					{
 						m_nPreviewIndex = nIndex;
 					}
-					else
+					else if (m_requests.Push(nIndex))
 					{
-						std::unique_lock<std::mutex> lock(m_mutex);
-						m_deqCachesToLoad.push_back(nIndex);
-						m_condition_load.notify_one();
+						SetEvent(m_hLoadEvent);
 					}
 				}
 				else
@@ -1123,10 +2348,7 @@ namespace DIVE
 
 		auto wheel = zDelta / WHEEL_DELTA;
 
-		char szTemp[1024];
-
-		sprintf(szTemp, "MouseWheel - ScaleFrom = %f, Scale = %f, ScaleTo = %f, Wheel = %d\n", m_fScaleFrom, m_fScale, m_fScaleTo, wheel);
-		OutputDebugStringA(szTemp);
+		DIVE_TRACE_INSTANT("MouseWheel", m_nIndex);
 
 		auto fScaleDiff = m_fScaleTo - m_fScaleFrom;
 		if (fScaleDiff == 0 || wheel * fScaleDiff < 0)
@@ -1142,9 +2364,6 @@ namespace DIVE
 		if ( fMin != fMax )
 			fDelta *= fMax / fMin * 5;
 
-		sprintf(szTemp, "Delta = %f\n", fDelta);
-		OutputDebugStringA(szTemp);
-
 		float fDeltaRatio;
 		fDeltaRatio = m_fScaleTo * fScaleRatio * fDelta / 100;
 
@@ -1155,6 +2374,8 @@ namespace DIVE
 		else if (m_fScaleTo >= 64.0f)
 			m_fScaleTo = 64.0f;
 
+		DIVE_TRACE_COUNTER("ScaleTo", m_fScaleTo);
+
 		m_fWheelU = 0.5f;
 		m_fWheelV = 0.5f;
 
@@ -1173,69 +2394,27 @@ namespace DIVE
 
 	void ImageViewer::Capture(size_t width, size_t height)
 	{
-		HWND hDesktopWnd = GetDesktopWindow();
-		HDC hDesktopDC = GetDC(hDesktopWnd);
-		HDC hCaptureDC = CreateCompatibleDC(hDesktopDC);
-
-		BITMAPINFO bmi;
-
-		bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-		bmi.bmiHeader.biWidth = width;
-		bmi.bmiHeader.biHeight = -height;
-		bmi.bmiHeader.biPlanes = 1;
-		bmi.bmiHeader.biBitCount = 32;
-		bmi.bmiHeader.biCompression = BI_RGB;
-		bmi.bmiHeader.biSizeImage = 0;
-
-		void* pBackground;
-		auto hBackground = CreateDIBSection(hDesktopDC, &bmi, DIB_RGB_COLORS, &pBackground, NULL, 0);
-		auto hOld = SelectObject(hCaptureDC, hBackground);
-		BitBlt(hCaptureDC, 0, 0, width, height, hDesktopDC, 0, 0, SRCCOPY | CAPTUREBLT);
-		ReleaseDC(hDesktopWnd, hDesktopDC);
-		SelectObject(hCaptureDC, hOld);
-		DeleteDC(hCaptureDC);
-
-		unsigned int bright;
-		size_t count = width * height;
-		unsigned int* pPixels = (unsigned int *)pBackground;
-
-		BYTE r, g, b;
-		float fr, fg, fb, aver;
-		for (int i = 0; i < count; ++i)
-		{
-			r = ((*pPixels >> 16) & 0xff);
-			g = ((*pPixels >> 8) & 0xff);
-			b = ((*pPixels >> 0) & 0xff);
-			aver = (r * 0.25 + g * 0.7 + b * 0.15);
-
-			fr = (r + aver * 2) / 4.0f;
-			if (fr > 255.0f)
-				fr = 255;
-			fg = (g + aver * 2) / 4.0f;
-			if (fg > 255.0f)
-				fg = 255;
-			fb = (b + aver * 2) / 4.0f;
-			if (fb > 255.0f)
-				fb = 255;
-			r = (BYTE)fr;
-			g = (BYTE)fg;
-			b = (BYTE)fb;
-			bright = (r << 16) | (g << 8) | b;
-			*pPixels = bright;
-			++pPixels;
-		}
+		std::vector<BYTE> vecPixels;
+		if (CaptureDesktop(static_cast<UINT>(width), static_cast<UINT>(height), vecPixels))
+			CreateBackground(vecPixels, static_cast<UINT>(width), static_cast<UINT>(height));
+	}
 
+	// The captured desktop, tinted, drawn behind everything
+	void ImageViewer::CreateBackground(const std::vector<BYTE>& vecPixels, UINT nWidth, UINT nHeight)
+	{
 		D2D1_BITMAP_PROPERTIES bp;
 		bp.dpiX = 72.0f;
 		bp.dpiY = 72.0f;
 		bp.pixelFormat.format = DXGI_FORMAT_B8G8R8A8_UNORM;
 		bp.pixelFormat.alphaMode = D2D1_ALPHA_MODE_IGNORE;
 
-		D2D1_SIZE_U sz{ width,height };
-		HRESULT hr = m_pRenderTarget->CreateBitmap(sz, pBackground, width * 4, &bp, &m_pBackground);
-		DeleteObject(hBackground);
+		D2D1_SIZE_U sz{ nWidth, nHeight };
+		m_pBackground.Release();
+		HRESULT hr = m_pRenderTarget->CreateBitmap(sz, vecPixels.data(), nWidth * 4, &bp, &m_pBackground);
 
-		m_szClient = SIZE{ (long)width, (long)height };
+		m_szClient = SIZE{ (long)nWidth, (long)nHeight };
+		m_nFitWidth = static_cast<int>(nWidth);
+		m_nFitHeight = static_cast<int>(nHeight);
 	}
 
 	void ImageViewer::Render()
@@ -1249,6 +2428,20 @@ namespace DIVE
 
 		m_World = DirectX::XMMatrixRotationY(tDiffMilli);
 
+		AdoptFiles();
+		UpdateStartup();
+		UpdateUploads();
+		UpdateMemoryPressure();
+		UpdateSlideshow();
+		RefreshImage();
+		UpdateAnimation();
+		UpdateFlipbook();
+		UpdateToneMap();
+		UpdateResampling();
+
+		// Frees what this frame evicted or shed, and what other threads left behind
+		Epoch::Collect();
+
 		// m_pImmediateContext->ClearRenderTargetView(m_pRenderTargetView, DirectX::Colors::MidnightBlue);
 		m_pImmediateContext->ClearDepthStencilView(m_pDepthStencilView, D3D11_CLEAR_DEPTH, 1.0f, 0);
 		m_pImmediateContext->PSSetSamplers(0, 1, &m_pSamplerLinear);
@@ -1274,17 +2467,36 @@ namespace DIVE
 		m_pImmediateContext->DrawIndexed(36, 0, 0);
 		*/
 
-		
-		m_pSwapChain->Present(0, 0);
+		{
+			DIVE_TRACE_SCOPE("Present", m_nIndex);
+			m_pSwapChain->Present(0, 0);
+		}
+		// The startup threads time themselves into m_pStartup, so it outlives them
+		if (m_pStartup && m_pImage && !m_pending.nTag)
+		{
+			if (!m_bShowingReduced)
+			{
+				if (m_pStartup->Elapsed(L"First Image") < 0.0)
+				{
+					m_pStartup->Mark(L"First Image");
+					DIVE_TRACE_COUNTER("Time To First Image ms", m_pStartup->Elapsed(L"First Image"));
+				}
+				if (!m_pStartupTasks)
+				{
+					OutputDebugStringW((L"Startup:\n" + m_pStartup->Report()).c_str());
+					m_pStartup.reset();
+				}
+			}
+			else if (m_pStartup->Elapsed(L"First Preview") < 0.0)
+			{
+				m_pStartup->Mark(L"First Preview");
+				DIVE_TRACE_COUNTER("Time To First Preview ms", m_pStartup->Elapsed(L"First Preview"));
+			}
+		}
 
 		
 		if (m_fScale != m_fScaleTo)
 		{
-			char szTemp[1024];
-
-			sprintf(szTemp, "Render - ScaleFrom = %f, Scale = %f, ScaleTo = %f, tDiff = %lu\n", m_fScaleFrom, m_fScale, m_fScaleTo, tDiffMilli);
-			// OutputDebugStringA(szTemp);
-
 			auto fScaleDiff = m_fScaleTo - m_fScaleFrom;
 			m_fScale += fScaleDiff * tDiffMilli / 400000.0f;
 			if (fScaleDiff < 0)
@@ -1310,6 +2522,8 @@ namespace DIVE
 
 			if (m_fScale == m_fScaleTo)
 				m_fScaleFrom = m_fScaleTo;
+
+			DIVE_TRACE_COUNTER("Scale", m_fScale);
 		}
 		tPrev = t;
 	}
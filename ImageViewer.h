@@ -5,14 +5,25 @@
 #include <memory>
 #include <thread>
 #include <vector>
-#include <deque>
-#include <mutex>
+#include <atomic>
+#include <chrono>
 #include <d3d11_1.h>
 #include <DirectXMath.h>
+#include "RequestQueue.h"
+#include "ImageTable.h"
+#include "ReadAhead.h"
+#include "ColdCache.h"
+#include "Resampler.h"
+#include "Uploader.h"
+#include "MemoryPressure.h"
+#include "Startup.h"
 
 namespace DIVE
 {
 	class ImageLoader;
+	class Animation;
+	class Flipbook;
+	struct Frame;
 
 	class ImageViewer
 	{
@@ -20,15 +31,19 @@ namespace DIVE
 		ImageViewer();
 		~ImageViewer();
 
-		bool Initialize(HWND hWnd);
+		bool Start(HWND hWnd, UINT nWidth, UINT nHeight, const wchar_t* wszFileName);
+		bool Initialize(HWND hWnd, StartupTasks* pTasks = nullptr);
 		void Destroy();
 
 		void Draw(HWND hWnd);
-		bool Load(const wchar_t* szFileName);
+		bool Load(const wchar_t* szFileName, const CachedImage* pFirst = nullptr);
 		void Show(IWICBitmapSource* pImage);
+		void Show(const CachedImage& image);
+		void ShowBlocks(const std::shared_ptr<const BlockImage>& pImage);
+		void ShowToneMapped(IWICBitmapSource* pImage);
 		ID2D1Bitmap* LoadD2DBitmap(const wchar_t* wszFileName);
-		ID3D11ShaderResourceView* TextureFromWICBitmap(IWICBitmapSource* pWICBitmap);
 		void Capture(size_t width, size_t height);
+		void CreateBackground(const std::vector<BYTE>& vecPixels, UINT nWidth, UINT nHeight);
 		void Render();
 
 		void OnLBDown(HWND hWnd, LPARAM lParam);
@@ -38,24 +53,51 @@ namespace DIVE
 
 		void PrevImage();
 		void NextImage();
+		void ToggleSlideshow();
+		void StepFrame(int nDelta);
+		void ToggleAnimation();
+		void ToggleFlipbook();
+		void ReportDecodeCost();
+		void AdjustExposure(float fStops);
+		void ResetExposure();
 		void UpdateCacheForward();
 		void UpdateCacheBackward();
-		void RemoveCache(int index);
-		struct ThumbnailInfo
-		{
-			ThumbnailInfo(const std::wstring& strFileName_)
-				: strFileName( strFileName_), pBitmap(nullptr), pBitmapThumbnail( nullptr), fAlpha(0), ulBytes(0) {}
-
-			std::wstring strFileName;
-			CComPtr<IWICBitmapSource> pBitmap;
-			CComPtr<ID2D1Bitmap> pBitmapThumbnail;
-			float fAlpha;
-			unsigned long ulBytes;
-		};
-		void SetFiles(std::vector <ThumbnailInfo>&& vecBitmaps);
+		void RemoveCache(int index, bool bKeepCold = true);
+		void SetFiles(std::vector <std::wstring>&& vecFiles);
 		
 
 	private:
+		CachedImage FetchImage(int nIndex);
+		void FitImage();
+		void FitImage(SIZE szImage);
+		void RefreshImage();
+		void ReplaceReduced(const CachedImage& image);
+		void UpdateStartup();
+		void UpdateToneMap();
+		void UpdateSlideshow();
+		void UpdateAnimation();
+		void ShowFrame(const Frame& frame);
+		void UpdateFlipbook();
+		double FlipbookRate() const;
+		void ResetResampling(IWICBitmapSource* pSource);
+		void UpdateResampling();
+		void UploadPlane(const std::shared_ptr<const PixelPlane>& pPlane, int nIndex, uint64_t nTag);
+		uint64_t BeginImage();
+		void UpdateUploads();
+		void UpdateMemoryPressure();
+		void ShedCache(int nLimit);
+		int CachedExtent() const;
+		void SetCacheLimit(int nLimit);
+		void InstallImage(UploadResult& result);
+		int CacheAhead(int nDirection = 1) const;
+		double EstimateDecodeMicros(int nDirection) const;
+		void NoteStep();
+		bool LoadSlot(int nIndex);
+		void AdoptFiles();
+		void ReadAheadRange(int nFirst, int nLast);
+		void CompressCache();
+		bool CompressSlot(int nIndex);
+
 		bool m_bLBDown = false;
 		POINT m_ptDown;
 
@@ -75,6 +117,9 @@ namespace DIVE
 		CComPtr<ID2D1SolidColorBrush> m_pBlackBrush;
 		CComPtr<ID2D1Bitmap> m_pBackground;
 		ID2D1Bitmap* m_pImage;
+		CComPtr<IWICBitmap> m_pToneMapSource;	// half-float source of m_pImage, converted as it comes into view
+		D2D1_RECT_U m_rcToneMapped;
+		float m_fExposure;
 		std::wstring m_wstrPath;
 
 		std::unique_ptr<ImageLoader> m_loader;
@@ -83,18 +128,95 @@ namespace DIVE
 		std::thread* m_pthread_thumbnail;
 
 		std::thread m_thread_load;
-		std::condition_variable m_condition_load;
+		HANDLE m_hLoadEvent;
 
-		std::mutex m_mutex;
 		std::wstring m_wstrFileName;
 		int m_nIndex;
 		int m_nPreviewIndex;
 		int m_nIndexOffset;
 		int m_nCacheStart;
 		int m_nCacheEnd;
-		bool m_bEndThreads;
-		std::vector <ThumbnailInfo> m_vecBitmaps;
-		std::deque <int> m_deqCachesToLoad;
+		uint32_t m_nFilesVersion;
+		std::atomic<bool> m_bEndThreads;
+		ImageTable m_images;
+		RequestQueue m_requests;
+		ReadAhead m_readAhead;
+		ColdCache m_coldCache;
+		std::atomic<int> m_nVisibleIndex;
+		std::atomic<int> m_nFitWidth;
+		std::atomic<int> m_nFitHeight;
+		bool m_bCompressCache;
+		bool m_bReduceCache;
+		bool m_bShowingReduced;
+
+		MemoryPressure m_memory;
+		int m_nCacheLimit;					// images kept either side of the current one; low memory lowers it
+		int m_nImagesShed;
+		size_t m_nColdBudget;				// the cold tier's budget at the full limit
+		std::chrono::steady_clock::time_point m_tCacheShed;		// next time the window may halve
+		bool m_bShedPending;				// until what the last shed retired is freed
+		std::chrono::steady_clock::time_point m_tCacheGrow;		// next time it may grow back
+
+		bool m_bSlideshow;
+		bool m_bSlideLate;
+		int m_nSlidesMissed;
+		int m_nSlideRequested;				// slide the slideshow queued itself, or -1
+		int m_nSlideSkipFrom;				// from this index the next slide is m_nSlideSkipTo
+		int m_nSlideSkipTo;
+		std::chrono::steady_clock::duration m_slideInterval;
+		std::chrono::steady_clock::time_point m_tNextSlide;
+		double m_fStepMicros;				// moving average of the time between steps while browsing
+		std::chrono::steady_clock::time_point m_tLastStep;
+		std::atomic<int> m_nLoadingIndex;	// slot the load thread is decoding, or -1
+
+		std::unique_ptr<Animation> m_pAnimation;
+		std::wstring m_strAnimationFile;
+		int m_nAnimationIndex;
+		uint32_t m_nAnimationVersion;
+		UINT m_nFrame;				// frame on screen
+		UINT m_nFrameTarget;		// frame stepped to while paused
+		bool m_bFramePaused;
+		bool m_bFrameLate;			// waiting for a frame; the schedule restarts when it comes
+		int m_nFrameStalls;
+		std::chrono::steady_clock::time_point m_tNextFrame;
+
+		std::unique_ptr<Flipbook> m_pFlipbook;
+		std::vector<int> m_vecFlipIndices;	// file index of each flipbook frame
+		uint64_t m_nFlipSequence;			// next ring frame to take
+		int m_nFlipIndex;					// file index of the frame on screen
+		int m_nFlipShown;
+		int m_nFlipDropped;
+		std::chrono::steady_clock::time_point m_tFlipStart;		// first frame shown
+		std::chrono::steady_clock::time_point m_tFlipTitle;		// next title update
+		std::wstring m_strWindowTitle;		// restored when the flipbook stops
+
+		std::unique_ptr<Resampler> m_pResampler;
+		uint32_t m_nResampleImage;			// image handed to the resampler, 0 for none
+		uint32_t m_nResampleSerial;
+		std::vector<CComPtr<ID2D1Bitmap>> m_vecLevelBitmaps;	// pyramid levels uploaded so far, [0] unused
+		CComPtr<ID2D1Bitmap> m_pSharpView;	// Lanczos rendering of the settled view
+		D2D1_RECT_F m_rcSharpView;
+		ResampleView m_sharpView;			// view requested for m_pSharpView
+		uint32_t m_nLevelUploads;			// bit per pyramid level handed to the uploader
+		uint64_t m_nSharpTag;				// tags the upload of the current m_sharpView
+
+		// The image Show is waiting on, and how to put it on screen once its upload comes back
+		struct PendingImage
+		{
+			uint64_t nTag = 0;				// 0 when nothing is pending
+			CComPtr<IWICBitmapSource> pResampleSource;
+			CComPtr<IWICBitmap> pToneMapSource;
+			SIZE szLayout = {};				// size to lay out at, when not the bitmap's own
+			bool bFit = true;				// false keeps the view as it is
+		};
+
+		std::unique_ptr<Uploader> m_pUploader;
+		PendingImage m_pending;
+		uint64_t m_nUploadSerial;
+
+		std::unique_ptr<StartupTimings> m_pStartup;		// until the first image is presented
+		std::unique_ptr<StartupTasks> m_pStartupTasks;	// until the first image is decoded
+		uint64_t m_nStartupSerial;						// upload serial of the first image shown
 
 		int m_nThumbWidth;
 		int m_nThumbHeight;
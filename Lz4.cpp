@@ -0,0 +1,224 @@
+#include "stdafx.h"
+#include "Lz4.h"
+#include <intrin.h>
+#include <cstdint>
+#include <cstring>
+
+namespace DIVE
+{
+	namespace Lz4
+	{
+		static const size_t kMinMatch = 4;
+		static const size_t kLastLiterals = 5;	// the block always ends in at least this many literals
+		static const size_t kMatchLimit = 12;	// and no match starts closer than this to the end
+		static const size_t kMaxOffset = 65535;
+		static const int kHashBits = 12;
+
+		static uint32_t Read32(const BYTE* p)
+		{
+			uint32_t n;
+			memcpy(&n, p, sizeof(n));
+			return n;
+		}
+
+		static uint64_t Read64(const BYTE* p)
+		{
+			uint64_t n;
+			memcpy(&n, p, sizeof(n));
+			return n;
+		}
+
+		static uint32_t Hash(uint32_t nSequence)
+		{
+			return (nSequence * 2654435761u) >> (32 - kHashBits);
+		}
+
+		// Length of the common run at p and pMatch, comparing eight bytes at a time
+		static size_t MatchLength(const BYTE* p, const BYTE* pMatch, const BYTE* pLimit)
+		{
+			const BYTE* pStart = p;
+			while (p + 8 <= pLimit)
+			{
+				uint64_t nDiff = Read64(p) ^ Read64(pMatch);
+				if (nDiff)
+				{
+					unsigned long nBit;
+					_BitScanForward64(&nBit, nDiff);
+					return (p - pStart) + nBit / 8;
+				}
+				p += 8;
+				pMatch += 8;
+			}
+			while (p < pLimit && *p == *pMatch)
+			{
+				++p;
+				++pMatch;
+			}
+			return p - pStart;
+		}
+
+		static BYTE* WriteLength(BYTE* p, size_t nLength)
+		{
+			for (; nLength >= 255; nLength -= 255)
+				*p++ = 255;
+			*p++ = static_cast<BYTE>(nLength);
+			return p;
+		}
+
+		size_t Bound(size_t nSize)
+		{
+			return nSize + nSize / 255 + 16;
+		}
+
+		size_t Compress(const BYTE* pSource, size_t nSize, BYTE* pDest, size_t nCapacity)
+		{
+			const BYTE* ip = pSource;
+			const BYTE* pAnchor = pSource;
+			const BYTE* pEnd = pSource + nSize;
+			BYTE* op = pDest;
+			BYTE* pDestEnd = pDest + nCapacity;
+
+			if (nSize > kMatchLimit)
+			{
+				const BYTE* pMatchStartLimit = pEnd - kMatchLimit;
+				const BYTE* pMatchEndLimit = pEnd - kLastLiterals;
+
+				// Positions are stored relative to the source; an unset entry points at its start,
+				// which the content check rejects like any other stale candidate
+				uint32_t table[1 << kHashBits] = {};
+
+				++ip;
+				while (ip <= pMatchStartLimit)
+				{
+					uint32_t nSequence = Read32(ip);
+					uint32_t nHash = Hash(nSequence);
+					const BYTE* pMatch = pSource + table[nHash];
+					table[nHash] = static_cast<uint32_t>(ip - pSource);
+
+					if (pMatch >= ip || static_cast<size_t>(ip - pMatch) > kMaxOffset || Read32(pMatch) != nSequence)
+					{
+						// Step faster through data that does not compress
+						ip += 1 + ((ip - pAnchor) >> 6);
+						continue;
+					}
+
+					while (ip > pAnchor && pMatch > pSource && ip[-1] == pMatch[-1])
+					{
+						--ip;
+						--pMatch;
+					}
+
+					size_t nLiterals = ip - pAnchor;
+					size_t nMatch = kMinMatch + MatchLength(ip + kMinMatch, pMatch + kMinMatch, pMatchEndLimit);
+					if (static_cast<size_t>(pDestEnd - op) < 1 + nLiterals + nLiterals / 255 + 1 + 2 + (nMatch - kMinMatch) / 255 + 1)
+						return 0;
+
+					BYTE* pToken = op++;
+					*pToken = static_cast<BYTE>((nLiterals < 15 ? nLiterals : 15) << 4);
+					if (nLiterals >= 15)
+						op = WriteLength(op, nLiterals - 15);
+					memcpy(op, pAnchor, nLiterals);
+					op += nLiterals;
+
+					size_t nOffset = ip - pMatch;
+					*op++ = static_cast<BYTE>(nOffset);
+					*op++ = static_cast<BYTE>(nOffset >> 8);
+
+					size_t nMatchCode = nMatch - kMinMatch;
+					*pToken |= static_cast<BYTE>(nMatchCode < 15 ? nMatchCode : 15);
+					if (nMatchCode >= 15)
+						op = WriteLength(op, nMatchCode - 15);
+
+					ip += nMatch;
+					pAnchor = ip;
+
+					if (ip <= pMatchStartLimit)
+						table[Hash(Read32(ip - 2))] = static_cast<uint32_t>(ip - 2 - pSource);
+				}
+			}
+
+			size_t nLiterals = pEnd - pAnchor;
+			if (static_cast<size_t>(pDestEnd - op) < 1 + nLiterals + nLiterals / 255 + 1)
+				return 0;
+
+			*op++ = static_cast<BYTE>((nLiterals < 15 ? nLiterals : 15) << 4);
+			if (nLiterals >= 15)
+				op = WriteLength(op, nLiterals - 15);
+			memcpy(op, pAnchor, nLiterals);
+			op += nLiterals;
+
+			return op - pDest;
+		}
+
+		size_t Decompress(const BYTE* pSource, size_t nSize, BYTE* pDest, size_t nCapacity)
+		{
+			const BYTE* ip = pSource;
+			const BYTE* pEnd = pSource + nSize;
+			BYTE* op = pDest;
+			BYTE* pDestEnd = pDest + nCapacity;
+
+			while (ip < pEnd)
+			{
+				BYTE nToken = *ip++;
+
+				size_t nLiterals = nToken >> 4;
+				if (nLiterals == 15)
+				{
+					BYTE b;
+					do
+					{
+						if (ip >= pEnd)
+							return 0;
+						b = *ip++;
+						nLiterals += b;
+					} while (b == 255);
+				}
+				if (nLiterals > static_cast<size_t>(pEnd - ip) || nLiterals > static_cast<size_t>(pDestEnd - op))
+					return 0;
+
+				memcpy(op, ip, nLiterals);
+				op += nLiterals;
+				ip += nLiterals;
+
+				// The last sequence has literals only
+				if (ip == pEnd)
+					break;
+
+				if (pEnd - ip < 2)
+					return 0;
+				size_t nOffset = ip[0] | (ip[1] << 8);
+				ip += 2;
+				if (nOffset == 0 || nOffset > static_cast<size_t>(op - pDest))
+					return 0;
+
+				size_t nMatch = nToken & 15;
+				if (nMatch == 15)
+				{
+					BYTE b;
+					do
+					{
+						if (ip >= pEnd)
+							return 0;
+						b = *ip++;
+						nMatch += b;
+					} while (b == 255);
+				}
+				nMatch += kMinMatch;
+				if (nMatch > static_cast<size_t>(pDestEnd - op))
+					return 0;
+
+				// Overlapping matches repeat the last nOffset bytes, so only copy whole
+				// words when they cannot read what they are writing
+				const BYTE* pMatch = op - nOffset;
+				if (nOffset >= 8)
+				{
+					for (; nMatch >= 8; nMatch -= 8, op += 8, pMatch += 8)
+						memcpy(op, pMatch, 8);
+				}
+				while (nMatch--)
+					*op++ = *pMatch++;
+			}
+			return op - pDest;
+		}
+	}
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+
+namespace DIVE
+{
+	// LZ4 block format (no frame header or checksums), compatible with the reference
+	// LZ4_compress_default / LZ4_decompress_safe. Used for the caches, in memory and in
+	// thumbnail files, where speed matters far more than ratio.
+	namespace Lz4
+	{
+		// Worst-case compressed size of nSize input bytes
+		size_t Bound(size_t nSize);
+
+		// Returns the compressed size, or 0 if pDest is too small
+		size_t Compress(const BYTE* pSource, size_t nSize, BYTE* pDest, size_t nCapacity);
+
+		// Returns the decompressed size, or 0 on malformed input or when pDest is too small
+		size_t Decompress(const BYTE* pSource, size_t nSize, BYTE* pDest, size_t nCapacity);
+	}
+}
@@ -0,0 +1,122 @@
+#include "stdafx.h"
+#include "MemoryPressure.h"
+#include "Trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace DIVE
+{
+	static const std::chrono::milliseconds kPollInterval(250);
+
+	SystemMemorySignal::SystemMemorySignal()
+		: m_hLow(CreateMemoryResourceNotification(LowMemoryResourceNotification))
+		, m_hHigh(CreateMemoryResourceNotification(HighMemoryResourceNotification))
+		, m_dwLoadLimit(0)
+	{
+		wchar_t wszValue[32];
+		if (GetEnvironmentVariableW(L"DIVE_MEMORY_LOAD", wszValue, 32) && _wtoi(wszValue) > 0)
+			m_dwLoadLimit = static_cast<DWORD>(_wtoi(wszValue));
+	}
+
+	SystemMemorySignal::~SystemMemorySignal()
+	{
+		if (m_hLow)
+			CloseHandle(m_hLow);
+		if (m_hHigh)
+			CloseHandle(m_hHigh);
+	}
+
+	MemoryState SystemMemorySignal::Read()
+	{
+		BOOL bLow = FALSE, bHigh = FALSE;
+		if (m_hLow)
+			QueryMemoryResourceNotification(m_hLow, &bLow);
+		if (m_hHigh)
+			QueryMemoryResourceNotification(m_hHigh, &bHigh);
+
+		MEMORYSTATUSEX status = { sizeof(status) };
+		if (GlobalMemoryStatusEx(&status))
+		{
+			DIVE_TRACE_COUNTER("Memory Load %", status.dwMemoryLoad);
+			if (m_dwLoadLimit && status.dwMemoryLoad >= m_dwLoadLimit)
+				bLow = TRUE;
+			else if (m_dwLoadLimit && status.dwMemoryLoad + 10 < m_dwLoadLimit)
+				bHigh = TRUE;
+		}
+		return bLow ? kMemoryLow : bHigh ? kMemoryHigh : kMemoryNormal;
+	}
+
+	PressureStallSignal::PressureStallSignal(const std::wstring& strPath, double fLowPercent)
+		: m_strPath(strPath)
+		, m_fLowPercent(fLowPercent)
+	{
+	}
+
+	// "some avg10=1.23 avg60=0.50 avg300=0.10 total=12345\nfull avg10=..."
+	double PressureStallSignal::ParseSomeAvg10(const char* szText)
+	{
+		const char* szSome = strstr(szText, "some ");
+		if (!szSome)
+			return -1.0;
+		const char* szAvg10 = strstr(szSome, "avg10=");
+		const char* szEnd = strchr(szSome, '\n');
+		if (!szAvg10 || (szEnd && szAvg10 > szEnd))
+			return -1.0;
+		return atof(szAvg10 + 6);
+	}
+
+	MemoryState PressureStallSignal::Read()
+	{
+		// Read afresh each time; the file is regenerated on every open
+		FILE* pFile = _wfopen(m_strPath.c_str(), L"rb");
+		if (!pFile)
+			return kMemoryNormal;
+		char szText[512];
+		size_t cbRead = fread(szText, 1, sizeof(szText) - 1, pFile);
+		fclose(pFile);
+		szText[cbRead] = '\0';
+
+		double fStall = ParseSomeAvg10(szText);
+		if (fStall < 0.0)
+			return kMemoryNormal;
+		DIVE_TRACE_COUNTER("Memory Stall %", fStall);
+		return fStall >= m_fLowPercent ? kMemoryLow : fStall < m_fLowPercent / 4 ? kMemoryHigh : kMemoryNormal;
+	}
+
+	static std::unique_ptr<MemorySignal> DefaultSignal()
+	{
+		wchar_t wszPath[MAX_PATH];
+		DWORD cch = GetEnvironmentVariableW(L"DIVE_MEMORY_PRESSURE_FILE", wszPath, MAX_PATH);
+		if (!cch || cch >= MAX_PATH)
+			return std::unique_ptr<MemorySignal>(new SystemMemorySignal);
+
+		double fLowPercent = 10.0;
+		wchar_t wszValue[32];
+		if (GetEnvironmentVariableW(L"DIVE_MEMORY_PRESSURE_PCT", wszValue, 32) && _wtof(wszValue) > 0.0)
+			fLowPercent = _wtof(wszValue);
+		return std::unique_ptr<MemorySignal>(new PressureStallSignal(wszPath, fLowPercent));
+	}
+
+	MemoryPressure::MemoryPressure()
+		: MemoryPressure(DefaultSignal())
+	{
+	}
+
+	MemoryPressure::MemoryPressure(std::unique_ptr<MemorySignal> pSignal)
+		: m_pSignal(std::move(pSignal))
+		, m_state(kMemoryNormal)
+	{
+	}
+
+	MemoryState MemoryPressure::Poll()
+	{
+		auto tNow = std::chrono::steady_clock::now();
+		if (tNow < m_tNextPoll)
+			return m_state;
+		m_tNextPoll = tNow + kPollInterval;
+
+		m_state = m_pSignal ? m_pSignal->Read() : kMemoryNormal;
+		return m_state;
+	}
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+namespace DIVE
+{
+	enum MemoryState
+	{
+		kMemoryNormal,
+		kMemoryLow,		// give memory back
+		kMemoryHigh,	// plenty free; caches may grow back
+	};
+
+	// Where the memory state comes from. Read is only called from MemoryPressure::Poll.
+	class MemorySignal
+	{
+	public:
+		virtual ~MemorySignal() {}
+		virtual MemoryState Read() = 0;
+	};
+
+	// The system's low and high memory resource notifications. Machines shared with other
+	// heavy jobs can also set DIVE_MEMORY_LOAD, a percentage of physical memory in use above
+	// which memory counts as low even though Windows does not signal it yet.
+	class SystemMemorySignal : public MemorySignal
+	{
+	public:
+		SystemMemorySignal();
+		~SystemMemorySignal();
+
+		MemoryState Read() override;
+
+	private:
+		HANDLE m_hLow;
+		HANDLE m_hHigh;
+		DWORD m_dwLoadLimit;		// 0 when not set
+	};
+
+	// A pressure stall file in the Linux PSI format, such as a cgroup's memory.pressure seen
+	// through WSL or a container mount: low while the "some" avg10 share of time stalled on
+	// memory is at or above fLowPercent, high once it drops under a quarter of that
+	class PressureStallSignal : public MemorySignal
+	{
+	public:
+		PressureStallSignal(const std::wstring& strPath, double fLowPercent);
+
+		MemoryState Read() override;
+
+		// The "some avg10" value of PSI text, or -1 when it has none
+		static double ParseSomeAvg10(const char* szText);
+
+	private:
+		std::wstring m_strPath;
+		double m_fLowPercent;
+	};
+
+	// Polls a signal a few times a second. DIVE_MEMORY_PRESSURE_FILE (with the stall
+	// percentage in DIVE_MEMORY_PRESSURE_PCT, 10 by default) replaces the system signal.
+	class MemoryPressure
+	{
+	public:
+		MemoryPressure();
+		explicit MemoryPressure(std::unique_ptr<MemorySignal> pSignal);
+
+		// Cheap enough to call every frame; the signal is read a few times a second
+		MemoryState Poll();
+
+		// The next Poll reads the signal again, for after memory has been given back
+		void Refresh() { m_tNextPoll = std::chrono::steady_clock::time_point(); }
+
+	private:
+		std::unique_ptr<MemorySignal> m_pSignal;
+		MemoryState m_state;
+		std::chrono::steady_clock::time_point m_tNextPoll;
+	};
+}
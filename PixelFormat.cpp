@@ -0,0 +1,161 @@
+#include "stdafx.h"
+#include "PixelFormat.h"
+#include <cstdint>
+#include <cstring>
+
+namespace DIVE
+{
+	// One row to premultiplied BGRA for any 8-bit layout; the channel offsets are template
+	// arguments, so each layout in the table below gets its own straight-line loop
+	template <UINT nBytes, int nBlue, int nGreen, int nRed, int nAlpha, bool bPremultiplied>
+	static void ToPBGRA(const BYTE* pSource, BYTE* pDest, UINT nWidth)
+	{
+		for (UINT x = 0; x < nWidth; ++x, pSource += nBytes, pDest += 4)
+		{
+			UINT b = pSource[nBlue];
+			UINT g = pSource[nGreen];
+			UINT r = pSource[nRed];
+			UINT a = nAlpha < 0 ? 0xff : pSource[nAlpha < 0 ? 0 : nAlpha];
+			if (nAlpha >= 0 && !bPremultiplied)
+			{
+				b = (b * a + 127) / 255;
+				g = (g * a + 127) / 255;
+				r = (r * a + 127) / 255;
+			}
+			pDest[0] = static_cast<BYTE>(b);
+			pDest[1] = static_cast<BYTE>(g);
+			pDest[2] = static_cast<BYTE>(r);
+			pDest[3] = static_cast<BYTE>(a);
+		}
+	}
+
+	static void CopyRow32(const BYTE* pSource, BYTE* pDest, UINT nWidth)
+	{
+		memcpy(pDest, pSource, static_cast<size_t>(nWidth) * 4);
+	}
+
+	static constexpr ConvertRowFn kGray8 = &ToPBGRA<1, 0, 0, 0, -1, false>;
+	static constexpr ConvertRowFn kBGR24 = &ToPBGRA<3, 0, 1, 2, -1, false>;
+	static constexpr ConvertRowFn kRGB24 = &ToPBGRA<3, 2, 1, 0, -1, false>;
+	static constexpr ConvertRowFn kBGRX32 = &ToPBGRA<4, 0, 1, 2, -1, false>;
+	static constexpr ConvertRowFn kRGBX32 = &ToPBGRA<4, 2, 1, 0, -1, false>;
+	static constexpr ConvertRowFn kBGRA32 = &ToPBGRA<4, 0, 1, 2, 3, false>;
+	static constexpr ConvertRowFn kRGBA32 = &ToPBGRA<4, 2, 1, 0, 3, false>;
+	static constexpr ConvertRowFn kPRGBA32 = &ToPBGRA<4, 2, 1, 0, 3, true>;
+	static constexpr ConvertRowFn kPBGRA32 = &CopyRow32;
+
+	// Formats with a dxgiFormat upload as they are; the rest name the nearest one that does
+	static constexpr PixelFormatInfo kPixelFormats[] =
+	{
+		// GUID										bpp	ch	bpc	order					numeric						alpha	premul	texture format								upload to								to PBGRA
+		{ &GUID_WICPixelFormat128bppRGBAFloat,		128,	4,	32,	ChannelOrder::RGBA,		Numeric::Float,				true,	false,	DXGI_FORMAT_R32G32B32A32_FLOAT,				nullptr,								nullptr },
+		{ &GUID_WICPixelFormat64bppRGBAHalf,		64,	4,	16,	ChannelOrder::RGBA,		Numeric::Half,				true,	false,	DXGI_FORMAT_R16G16B16A16_FLOAT,				nullptr,								nullptr },
+		{ &GUID_WICPixelFormat64bppRGBA,			64,	4,	16,	ChannelOrder::RGBA,		Numeric::UNorm,				true,	false,	DXGI_FORMAT_R16G16B16A16_UNORM,				nullptr,								nullptr },
+		{ &GUID_WICPixelFormat32bppRGBA,			32,	4,	8,	ChannelOrder::RGBA,		Numeric::UNorm,				true,	false,	DXGI_FORMAT_R8G8B8A8_UNORM,					nullptr,								kRGBA32 },
+		{ &GUID_WICPixelFormat32bppBGRA,			32,	4,	8,	ChannelOrder::BGRA,		Numeric::UNorm,				true,	false,	DXGI_FORMAT_B8G8R8A8_UNORM,					nullptr,								kBGRA32 },
+		{ &GUID_WICPixelFormat32bppBGR,				32,	3,	8,	ChannelOrder::BGR,		Numeric::UNorm,				false,	false,	DXGI_FORMAT_B8G8R8X8_UNORM,					nullptr,								kBGRX32 },
+		{ &GUID_WICPixelFormat32bppRGBA1010102XR,	32,	4,	10,	ChannelOrder::RGBA,		Numeric::ExtendedRange,		true,	false,	DXGI_FORMAT_R10G10B10_XR_BIAS_A2_UNORM,		nullptr,								nullptr },
+		{ &GUID_WICPixelFormat32bppRGBA1010102,		32,	4,	10,	ChannelOrder::RGBA,		Numeric::UNorm,				true,	false,	DXGI_FORMAT_R10G10B10A2_UNORM,				nullptr,								nullptr },
+		{ &GUID_WICPixelFormat32bppRGBE,			32,	4,	8,	ChannelOrder::RGB,		Numeric::SharedExponent,	false,	false,	DXGI_FORMAT_R9G9B9E5_SHAREDEXP,				nullptr,								nullptr },
+#if (_WIN32_WINNT >= 0x0602 /*_WIN32_WINNT_WIN8*/)
+		{ &GUID_WICPixelFormat16bppBGRA5551,		16,	4,	5,	ChannelOrder::BGRA,		Numeric::UNorm,				true,	false,	DXGI_FORMAT_B5G5R5A1_UNORM,					nullptr,								nullptr },
+		{ &GUID_WICPixelFormat16bppBGR565,			16,	3,	6,	ChannelOrder::BGR,		Numeric::UNorm,				false,	false,	DXGI_FORMAT_B5G6R5_UNORM,					nullptr,								nullptr },
+		{ &GUID_WICPixelFormat16bppBGR555,			16,	3,	5,	ChannelOrder::BGR,		Numeric::UNorm,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat16bppBGRA5551,		nullptr },
+#else
+		{ &GUID_WICPixelFormat16bppBGRA5551,		16,	4,	5,	ChannelOrder::BGRA,		Numeric::UNorm,				true,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat32bppRGBA,			nullptr },
+		{ &GUID_WICPixelFormat16bppBGR565,			16,	3,	6,	ChannelOrder::BGR,		Numeric::UNorm,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat32bppRGBA,			nullptr },
+		{ &GUID_WICPixelFormat16bppBGR555,			16,	3,	5,	ChannelOrder::BGR,		Numeric::UNorm,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat32bppRGBA,			nullptr },
+#endif
+		{ &GUID_WICPixelFormat32bppGrayFloat,		32,	1,	32,	ChannelOrder::Gray,		Numeric::Float,				false,	false,	DXGI_FORMAT_R32_FLOAT,						nullptr,								nullptr },
+		{ &GUID_WICPixelFormat16bppGrayHalf,		16,	1,	16,	ChannelOrder::Gray,		Numeric::Half,				false,	false,	DXGI_FORMAT_R16_FLOAT,						nullptr,								nullptr },
+		{ &GUID_WICPixelFormat16bppGray,			16,	1,	16,	ChannelOrder::Gray,		Numeric::UNorm,				false,	false,	DXGI_FORMAT_R16_UNORM,						nullptr,								nullptr },
+		{ &GUID_WICPixelFormat8bppGray,				8,	1,	8,	ChannelOrder::Gray,		Numeric::UNorm,				false,	false,	DXGI_FORMAT_R8_UNORM,						nullptr,								kGray8 },
+		{ &GUID_WICPixelFormat8bppAlpha,			8,	1,	8,	ChannelOrder::Alpha,	Numeric::UNorm,				true,	false,	DXGI_FORMAT_A8_UNORM,						nullptr,								nullptr },
+
+		{ &GUID_WICPixelFormatBlackWhite,			1,	1,	1,	ChannelOrder::Gray,		Numeric::UNorm,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat8bppGray,			nullptr },
+		{ &GUID_WICPixelFormat1bppIndexed,			1,	1,	1,	ChannelOrder::Indexed,	Numeric::Index,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat32bppRGBA,			nullptr },
+		{ &GUID_WICPixelFormat2bppIndexed,			2,	1,	2,	ChannelOrder::Indexed,	Numeric::Index,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat32bppRGBA,			nullptr },
+		{ &GUID_WICPixelFormat4bppIndexed,			4,	1,	4,	ChannelOrder::Indexed,	Numeric::Index,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat32bppRGBA,			nullptr },
+		{ &GUID_WICPixelFormat8bppIndexed,			8,	1,	8,	ChannelOrder::Indexed,	Numeric::Index,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat32bppRGBA,			nullptr },
+		{ &GUID_WICPixelFormat2bppGray,				2,	1,	2,	ChannelOrder::Gray,		Numeric::UNorm,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat8bppGray,			nullptr },
+		{ &GUID_WICPixelFormat4bppGray,				4,	1,	4,	ChannelOrder::Gray,		Numeric::UNorm,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat8bppGray,			nullptr },
+		{ &GUID_WICPixelFormat16bppGrayFixedPoint,	16,	1,	16,	ChannelOrder::Gray,		Numeric::Fixed,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat16bppGrayHalf,		nullptr },
+		{ &GUID_WICPixelFormat32bppGrayFixedPoint,	32,	1,	32,	ChannelOrder::Gray,		Numeric::Fixed,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat32bppGrayFloat,		nullptr },
+		{ &GUID_WICPixelFormat32bppBGR101010,		32,	3,	10,	ChannelOrder::BGR,		Numeric::UNorm,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat32bppRGBA1010102,	nullptr },
+		{ &GUID_WICPixelFormat24bppBGR,				24,	3,	8,	ChannelOrder::BGR,		Numeric::UNorm,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat32bppRGBA,			kBGR24 },
+		{ &GUID_WICPixelFormat24bppRGB,				24,	3,	8,	ChannelOrder::RGB,		Numeric::UNorm,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat32bppRGBA,			kRGB24 },
+		{ &GUID_WICPixelFormat32bppPBGRA,			32,	4,	8,	ChannelOrder::BGRA,		Numeric::UNorm,				true,	true,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat32bppRGBA,			kPBGRA32 },
+		{ &GUID_WICPixelFormat32bppPRGBA,			32,	4,	8,	ChannelOrder::RGBA,		Numeric::UNorm,				true,	true,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat32bppRGBA,			kPRGBA32 },
+		{ &GUID_WICPixelFormat48bppRGB,				48,	3,	16,	ChannelOrder::RGB,		Numeric::UNorm,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat64bppRGBA,			nullptr },
+		{ &GUID_WICPixelFormat48bppBGR,				48,	3,	16,	ChannelOrder::BGR,		Numeric::UNorm,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat64bppRGBA,			nullptr },
+		{ &GUID_WICPixelFormat64bppBGRA,			64,	4,	16,	ChannelOrder::BGRA,		Numeric::UNorm,				true,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat64bppRGBA,			nullptr },
+		{ &GUID_WICPixelFormat64bppPRGBA,			64,	4,	16,	ChannelOrder::RGBA,		Numeric::UNorm,				true,	true,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat64bppRGBA,			nullptr },
+		{ &GUID_WICPixelFormat64bppPBGRA,			64,	4,	16,	ChannelOrder::BGRA,		Numeric::UNorm,				true,	true,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat64bppRGBA,			nullptr },
+		{ &GUID_WICPixelFormat48bppRGBFixedPoint,	48,	3,	16,	ChannelOrder::RGB,		Numeric::Fixed,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat64bppRGBAHalf,		nullptr },
+		{ &GUID_WICPixelFormat48bppBGRFixedPoint,	48,	3,	16,	ChannelOrder::BGR,		Numeric::Fixed,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat64bppRGBAHalf,		nullptr },
+		{ &GUID_WICPixelFormat64bppRGBAFixedPoint,	64,	4,	16,	ChannelOrder::RGBA,		Numeric::Fixed,				true,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat64bppRGBAHalf,		nullptr },
+		{ &GUID_WICPixelFormat64bppBGRAFixedPoint,	64,	4,	16,	ChannelOrder::BGRA,		Numeric::Fixed,				true,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat64bppRGBAHalf,		nullptr },
+		{ &GUID_WICPixelFormat64bppRGBFixedPoint,	64,	3,	16,	ChannelOrder::RGB,		Numeric::Fixed,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat64bppRGBAHalf,		nullptr },
+		{ &GUID_WICPixelFormat64bppRGBHalf,			64,	3,	16,	ChannelOrder::RGB,		Numeric::Half,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat64bppRGBAHalf,		nullptr },
+		{ &GUID_WICPixelFormat48bppRGBHalf,			48,	3,	16,	ChannelOrder::RGB,		Numeric::Half,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat64bppRGBAHalf,		nullptr },
+		{ &GUID_WICPixelFormat96bppRGBFixedPoint,	96,	3,	32,	ChannelOrder::RGB,		Numeric::Fixed,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat128bppRGBAFloat,	nullptr },
+		{ &GUID_WICPixelFormat128bppPRGBAFloat,		128,	4,	32,	ChannelOrder::RGBA,		Numeric::Float,				true,	true,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat128bppRGBAFloat,	nullptr },
+		{ &GUID_WICPixelFormat128bppRGBFloat,		128,	3,	32,	ChannelOrder::RGB,		Numeric::Float,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat128bppRGBAFloat,	nullptr },
+		{ &GUID_WICPixelFormat128bppRGBAFixedPoint,	128,	4,	32,	ChannelOrder::RGBA,		Numeric::Fixed,				true,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat128bppRGBAFloat,	nullptr },
+		{ &GUID_WICPixelFormat128bppRGBFixedPoint,	128,	3,	32,	ChannelOrder::RGB,		Numeric::Fixed,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat128bppRGBAFloat,	nullptr },
+		{ &GUID_WICPixelFormat32bppCMYK,			32,	4,	8,	ChannelOrder::CMYK,		Numeric::UNorm,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat32bppRGBA,			nullptr },
+		{ &GUID_WICPixelFormat64bppCMYK,			64,	4,	16,	ChannelOrder::CMYK,		Numeric::UNorm,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat64bppRGBA,			nullptr },
+		{ &GUID_WICPixelFormat40bppCMYKAlpha,		40,	5,	8,	ChannelOrder::CMYK,		Numeric::UNorm,				true,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat64bppRGBA,			nullptr },
+		{ &GUID_WICPixelFormat80bppCMYKAlpha,		80,	5,	16,	ChannelOrder::CMYK,		Numeric::UNorm,				true,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat64bppRGBA,			nullptr },
+#if (_WIN32_WINNT >= 0x0602 /*_WIN32_WINNT_WIN8*/)
+		{ &GUID_WICPixelFormat96bppRGBFloat,		96,	3,	32,	ChannelOrder::RGB,		Numeric::Float,				false,	false,	DXGI_FORMAT_R32G32B32_FLOAT,				nullptr,								nullptr },
+		{ &GUID_WICPixelFormat32bppRGB,				32,	3,	8,	ChannelOrder::RGB,		Numeric::UNorm,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat32bppRGBA,			kRGBX32 },
+		{ &GUID_WICPixelFormat64bppRGB,				64,	3,	16,	ChannelOrder::RGB,		Numeric::UNorm,				false,	false,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat64bppRGBA,			nullptr },
+		{ &GUID_WICPixelFormat64bppPRGBAHalf,		64,	4,	16,	ChannelOrder::RGBA,		Numeric::Half,				true,	true,	DXGI_FORMAT_UNKNOWN,						&GUID_WICPixelFormat64bppRGBAHalf,		nullptr },
+#endif
+		// n-channel formats are not supported
+	};
+
+	static const int kIndexBits = 8;
+	static_assert(_countof(kPixelFormats) * 4 <= (1 << kIndexBits), "keep the index at most a quarter full");
+
+	// Most WIC formats share one base GUID and differ only in the last byte; the others
+	// differ in Data1. Both go into the hash.
+	static uint32_t HashGuid(REFGUID guid)
+	{
+		uint32_t nHash = guid.Data1 ^ (static_cast<uint32_t>(guid.Data2) << 16 | guid.Data3) ^ (static_cast<uint32_t>(guid.Data4[7]) << 24 | guid.Data4[6]);
+		return (nHash * 2654435761u) >> (32 - kIndexBits);
+	}
+
+	// Open-addressed table of positions in kPixelFormats (plus one, so zero is empty). The
+	// GUIDs are link-time constants, so the index is built on first use.
+	struct PixelFormatIndex
+	{
+		BYTE slots[1 << kIndexBits];
+
+		PixelFormatIndex()
+		{
+			memset(slots, 0, sizeof(slots));
+			for (size_t i = 0; i < _countof(kPixelFormats); ++i)
+			{
+				uint32_t nSlot = HashGuid(*kPixelFormats[i].pGuid);
+				while (slots[nSlot])
+					nSlot = (nSlot + 1) & ((1 << kIndexBits) - 1);
+				slots[nSlot] = static_cast<BYTE>(i + 1);
+			}
+		}
+	};
+
+	const PixelFormatInfo* FindPixelFormat(REFGUID guid)
+	{
+		static const PixelFormatIndex s_index;
+
+		for (uint32_t nSlot = HashGuid(guid); s_index.slots[nSlot]; nSlot = (nSlot + 1) & ((1 << kIndexBits) - 1))
+		{
+			const PixelFormatInfo& info = kPixelFormats[s_index.slots[nSlot] - 1];
+			if (IsEqualGUID(*info.pGuid, guid))
+				return &info;
+		}
+		return nullptr;
+	}
+}
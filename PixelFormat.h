@@ -0,0 +1,57 @@
+#pragma once
+
+#include <Wincodec.h>
+#include <dxgiformat.h>
+
+namespace DIVE
+{
+	enum class ChannelOrder : BYTE
+	{
+		Indexed,
+		Gray,
+		Alpha,
+		BGR,
+		RGB,
+		BGRA,
+		RGBA,
+		CMYK,
+	};
+
+	enum class Numeric : BYTE
+	{
+		Index,
+		UNorm,
+		Fixed,
+		Half,
+		Float,
+		SharedExponent,
+		ExtendedRange,
+	};
+
+	// Converts one row of nWidth pixels to 32bpp premultiplied BGRA
+	typedef void (*ConvertRowFn)(const BYTE* pSource, BYTE* pDest, UINT nWidth);
+
+	// What the loaders need to know about a WIC pixel format, from one compile-time table
+	struct PixelFormatInfo
+	{
+		const GUID* pGuid;
+		UINT nBitsPerPixel;
+		UINT nChannels;
+		UINT nBitsPerChannel;		// widest channel
+		ChannelOrder order;
+		Numeric numeric;
+		bool bAlpha;
+		bool bPremultiplied;
+		DXGI_FORMAT dxgiFormat;		// texture format holding the pixels as they are, or UNKNOWN
+		const GUID* pUpload;		// nearest format with a texture format, when dxgiFormat is UNKNOWN
+		ConvertRowFn pfnToPBGRA;	// built-in row converter, or null to go through WIC
+	};
+
+	// Hashed lookup; null for formats the table does not know
+	const PixelFormatInfo* FindPixelFormat(REFGUID guid);
+
+	inline bool IsHighDepth(const PixelFormatInfo& info)
+	{
+		return info.nBitsPerChannel > 8;
+	}
+}
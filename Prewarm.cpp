@@ -0,0 +1,247 @@
+#include "stdafx.h"
+#include "Prewarm.h"
+#include "ImageLoader.h"
+#include "ThumbnailCache.h"
+#include "Lz4.h"
+#include "Trace.h"
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+
+namespace DIVE
+{
+	typedef std::chrono::steady_clock PrewarmClock;
+
+	struct PrewarmFolder
+	{
+		std::wstring strPath;
+		std::vector<std::wstring> vecNames;
+		std::vector<FileStamp> vecStamps;
+
+		// Opened by the first worker to reach the folder, so only the folders in flight hold handles
+		std::once_flag opened;
+		ThumbnailCache previous;
+		ThumbnailWriter writer;
+		bool bWritable;
+		PrewarmClock::time_point tStart;
+
+		std::atomic<size_t> nRemaining;
+		std::atomic<size_t> nGenerated;
+		std::atomic<size_t> nReused;
+		std::atomic<size_t> nFailed;
+		std::atomic<uint64_t> nBytes;
+	};
+
+	struct PrewarmItem
+	{
+		PrewarmFolder* pFolder;
+		size_t nFile;
+	};
+
+	static std::mutex s_outputMutex;
+
+	static double Rate(double dAmount, PrewarmClock::duration elapsed)
+	{
+		double dSeconds = std::chrono::duration<double>(elapsed).count();
+		return dSeconds > 0.0 ? dAmount / dSeconds : 0.0;
+	}
+
+	// Every folder under strRoot (ending in a separator) that holds images. Only names and
+	// stamps are kept, so even a large share costs little before decoding starts.
+	static void FindFolders(const std::wstring& strRoot, std::vector<std::unique_ptr<PrewarmFolder>>& vecFolders)
+	{
+		std::vector<std::wstring> vecPending(1, strRoot);
+		while (!vecPending.empty())
+		{
+			std::wstring strFolder = std::move(vecPending.back());
+			vecPending.pop_back();
+
+			std::unique_ptr<PrewarmFolder> pFolder(new PrewarmFolder());
+			pFolder->strPath = strFolder;
+
+			WIN32_FIND_DATA findData;
+			HANDLE hFind = FindFirstFileEx((strFolder + L"*").c_str(), FindExInfoBasic, &findData, FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+			if (hFind == INVALID_HANDLE_VALUE)
+				continue;
+			do
+			{
+				if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+				{
+					// Junctions are skipped so a link back up the tree cannot loop
+					if (wcscmp(findData.cFileName, L".") && wcscmp(findData.cFileName, L"..") && !(findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+						vecPending.push_back(strFolder + findData.cFileName + L"\\");
+				}
+				else if (ImageLoader::IsImageFile(findData.cFileName))
+				{
+					FileStamp stamp;
+					stamp.nSize = (static_cast<uint64_t>(findData.nFileSizeHigh) << 32) | findData.nFileSizeLow;
+					stamp.nLastWrite = (static_cast<uint64_t>(findData.ftLastWriteTime.dwHighDateTime) << 32) | findData.ftLastWriteTime.dwLowDateTime;
+					pFolder->vecNames.push_back(findData.cFileName);
+					pFolder->vecStamps.push_back(stamp);
+				}
+			} while (FindNextFile(hFind, &findData));
+			FindClose(hFind);
+
+			if (!pFolder->vecNames.empty())
+			{
+				pFolder->bWritable = false;
+				pFolder->nRemaining = pFolder->vecNames.size();
+				pFolder->nGenerated = 0;
+				pFolder->nReused = 0;
+				pFolder->nFailed = 0;
+				pFolder->nBytes = 0;
+				vecFolders.push_back(std::move(pFolder));
+			}
+		}
+	}
+
+	static bool MakeThumbnail(ImageLoader& loader, const std::wstring& strPath, std::vector<BYTE>& vecPixels, std::vector<BYTE>& vecPayload, size_t& cbPayload)
+	{
+		DIVE_TRACE_SCOPE("Prewarm Thumbnail");
+
+		CComPtr<IWICBitmapSource> pThumbnail;
+		pThumbnail.Attach(loader.LoadThumbnail(kThumbnailWidth, kThumbnailHeight, strPath.c_str()));
+		if (!pThumbnail)
+			return false;
+
+		// The scaler pulls the reduced decode through; the result is always 32bpp PBGRA
+		WICRect rc = { 0, 0, static_cast<INT>(kThumbnailWidth), static_cast<INT>(kThumbnailHeight) };
+		HRESULT hr = pThumbnail->CopyPixels(&rc, kThumbnailWidth * 4, static_cast<UINT>(vecPixels.size()), vecPixels.data());
+		if (FAILED(hr))
+			return false;
+
+		cbPayload = Lz4::Compress(vecPixels.data(), vecPixels.size(), vecPayload.data(), vecPayload.size());
+		return cbPayload != 0;
+	}
+
+	static void FinishFolder(PrewarmFolder& folder, std::atomic<size_t>& nFoldersFailed)
+	{
+		bool bCommitted = folder.bWritable && folder.writer.Commit();
+		if (!bCommitted)
+			++nFoldersFailed;
+
+		PrewarmClock::duration elapsed = PrewarmClock::now() - folder.tStart;
+		size_t nGenerated = folder.nGenerated;
+		std::lock_guard<std::mutex> lock(s_outputMutex);
+		wprintf(L"%ls: %zu new, %zu kept, %zu failed, %.1f images/s, %.1f MB/s%ls\n",
+			folder.strPath.c_str(), nGenerated, folder.nReused.load(), folder.nFailed.load(),
+			Rate(static_cast<double>(nGenerated), elapsed), Rate(folder.nBytes / 1048576.0, elapsed),
+			bCommitted ? L"" : L" (cache not written)");
+		fflush(stdout);
+	}
+
+	int Prewarm(const std::wstring& strRoot)
+	{
+		std::wstring strStart = strRoot;
+		if (strStart.empty() || (strStart.back() != L'\\' && strStart.back() != L'/'))
+			strStart += L'\\';
+
+		DWORD dwAttributes = GetFileAttributes(strStart.c_str());
+		if (dwAttributes == INVALID_FILE_ATTRIBUTES || !(dwAttributes & FILE_ATTRIBUTE_DIRECTORY))
+		{
+			wprintf(L"%ls: not a folder\n", strRoot.c_str());
+			return 1;
+		}
+
+		PrewarmClock::time_point tStart = PrewarmClock::now();
+
+		std::vector<std::unique_ptr<PrewarmFolder>> vecFolders;
+		FindFolders(strStart, vecFolders);
+
+		// One flat list in folder order: workers finish a folder before moving far into the
+		// next, which keeps the number of open caches near the number of workers
+		std::vector<PrewarmItem> vecItems;
+		for (auto& pFolder : vecFolders)
+		{
+			for (size_t i = 0; i < pFolder->vecNames.size(); ++i)
+				vecItems.push_back(PrewarmItem{ pFolder.get(), i });
+		}
+
+		std::atomic<size_t> nNext(0);
+		std::atomic<size_t> nFoldersFailed(0);
+
+		auto worker = [&]()
+		{
+			DIVE_TRACE_THREAD("Prewarm");
+			CoInitializeEx(NULL, COINIT_MULTITHREADED);
+			{
+				// One decode and one thumbnail per worker bounds memory regardless of the tree
+				ImageLoader loader;
+				std::vector<BYTE> vecPixels(kThumbnailWidth * kThumbnailHeight * 4);
+				std::vector<BYTE> vecPayload(Lz4::Bound(vecPixels.size()));
+				std::vector<BYTE> vecKept;
+
+				for (size_t nItem = nNext++; nItem < vecItems.size(); nItem = nNext++)
+				{
+					PrewarmFolder& folder = *vecItems[nItem].pFolder;
+					size_t nFile = vecItems[nItem].nFile;
+					std::call_once(folder.opened, [&folder]()
+					{
+						folder.tStart = PrewarmClock::now();
+						folder.previous.Open(folder.strPath, kThumbnailWidth, kThumbnailHeight);
+						folder.bWritable = folder.writer.Create(folder.strPath, kThumbnailWidth, kThumbnailHeight);
+					});
+
+					const std::wstring& strName = folder.vecNames[nFile];
+					const FileStamp& stamp = folder.vecStamps[nFile];
+					size_t cbPayload = 0;
+					if (folder.previous.ReadCompressed(strName, stamp, vecKept))
+					{
+						if (folder.bWritable)
+							folder.writer.Add(strName, stamp, vecKept.data(), vecKept.size());
+						++folder.nReused;
+					}
+					else if (folder.bWritable && MakeThumbnail(loader, folder.strPath + strName, vecPixels, vecPayload, cbPayload))
+					{
+						folder.writer.Add(strName, stamp, vecPayload.data(), cbPayload);
+						folder.nBytes += stamp.nSize;
+						++folder.nGenerated;
+					}
+					else
+					{
+						++folder.nFailed;
+					}
+
+					if (--folder.nRemaining == 0)
+					{
+						folder.previous.Close();
+						FinishFolder(folder, nFoldersFailed);
+					}
+				}
+			}
+			CoUninitialize();
+		};
+
+		UINT nThreads = std::max(1u, std::min(std::thread::hardware_concurrency(), static_cast<UINT>(vecItems.size())));
+		std::vector<std::thread> vecThreads;
+		for (UINT i = 1; i < nThreads; ++i)
+			vecThreads.emplace_back(worker);
+		worker();
+		for (auto& thread : vecThreads)
+			thread.join();
+
+		size_t nGenerated = 0;
+		size_t nReused = 0;
+		size_t nFailed = 0;
+		uint64_t nBytes = 0;
+		for (auto& pFolder : vecFolders)
+		{
+			nGenerated += pFolder->nGenerated;
+			nReused += pFolder->nReused;
+			nFailed += pFolder->nFailed;
+			nBytes += pFolder->nBytes;
+		}
+
+		PrewarmClock::duration elapsed = PrewarmClock::now() - tStart;
+		wprintf(L"%zu folders, %zu new, %zu kept, %zu failed in %.1f s on %u threads: %.1f images/s, %.1f MB/s\n",
+			vecFolders.size(), nGenerated, nReused, nFailed, std::chrono::duration<double>(elapsed).count(), nThreads,
+			Rate(static_cast<double>(nGenerated), elapsed), Rate(nBytes / 1048576.0, elapsed));
+
+		return nFoldersFailed ? 1 : 0;
+	}
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <string>
+
+namespace DIVE
+{
+	// Headless /prewarm mode: walks strRoot and writes the thumbnail cache of every folder
+	// holding images, decoding on all cores. Unchanged entries of an existing cache are kept
+	// as they are. Progress and throughput go to stdout; returns the process exit code.
+	int Prewarm(const std::wstring& strRoot);
+}
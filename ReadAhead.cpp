@@ -0,0 +1,315 @@
+#include "stdafx.h"
+#include "ReadAhead.h"
+#include "Trace.h"
+#include <winioctl.h>
+#include <algorithm>
+
+namespace DIVE
+{
+	ReadAhead::ReadAhead(size_t nBudget, uint64_t ullMaxFileSize)
+		: m_nBytes(0)
+		, m_nBudget(nBudget)
+		, m_ullMaxFileSize(ullMaxFileSize)
+		, m_nSequence(0)
+		, m_nHits(0)
+		, m_nMisses(0)
+		, m_bEnd(false)
+		, m_physicalOrder(PhysicalOrder::Auto)
+	{
+		wchar_t wszValue[8];
+		if (GetEnvironmentVariableW(L"DIVE_IO_PHYSICAL_ORDER", wszValue, 8))
+			m_physicalOrder = (_wcsicmp(wszValue, L"auto") == 0) ? PhysicalOrder::Auto : _wtoi(wszValue) ? PhysicalOrder::On : PhysicalOrder::Off;
+
+		m_thread = std::thread([this]() { Run(); });
+	}
+
+	ReadAhead::~ReadAhead()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_bEnd = true;
+		}
+		m_cvWork.notify_all();
+		m_thread.join();
+	}
+
+	void ReadAhead::Submit(std::vector<std::wstring>&& vecFiles)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (auto& strFileName : vecFiles)
+			{
+				if (m_mapEntries.count(strFileName))
+					continue;
+
+				m_mapEntries[strFileName] = Entry{ nullptr, false, m_nSequence++ };
+				m_vecQueued.push_back(std::move(strFileName));
+			}
+		}
+		m_cvWork.notify_one();
+	}
+
+	void ReadAhead::Discard(const std::wstring& strFileName)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_mapEntries.find(strFileName);
+		if (it == m_mapEntries.end())
+			return;
+
+		// An entry still in flight is dropped by the read-ahead thread when its read completes
+		if (it->second.bytes)
+			m_nBytes -= it->second.bytes->size();
+		m_mapEntries.erase(it);
+	}
+
+	ReadAhead::Bytes ReadAhead::Take(const std::wstring& strFileName)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		auto it = m_mapEntries.find(strFileName);
+		while (it != m_mapEntries.end() && !it->second.bReady)
+		{
+			DIVE_TRACE_SCOPE("ReadAhead::Wait");
+			m_cvReady.wait(lock);
+			it = m_mapEntries.find(strFileName);
+		}
+
+		Bytes bytes;
+		if (it != m_mapEntries.end())
+		{
+			bytes = std::move(it->second.bytes);
+			m_nBytes -= bytes->size();
+			m_mapEntries.erase(it);
+			++m_nHits;
+		}
+		else
+		{
+			++m_nMisses;
+		}
+		ReportHitRate();
+		return bytes;
+	}
+
+	void ReadAhead::ReportHitRate()
+	{
+		if (m_nHits + m_nMisses)
+			DIVE_TRACE_COUNTER("ReadAhead Hit %", 100.0 * m_nHits / (m_nHits + m_nMisses));
+		DIVE_TRACE_COUNTER("ReadAhead Bytes", static_cast<double>(m_nBytes));
+	}
+
+	void ReadAhead::Trim()
+	{
+		// Over budget: drop the oldest completed reads first, they are the furthest from being used
+		while (m_nBytes > m_nBudget)
+		{
+			auto oldest = m_mapEntries.end();
+			for (auto it = m_mapEntries.begin(); it != m_mapEntries.end(); ++it)
+			{
+				if (it->second.bReady && (oldest == m_mapEntries.end() || it->second.nSequence < oldest->second.nSequence))
+					oldest = it;
+			}
+			if (oldest == m_mapEntries.end())
+				return;
+
+			m_nBytes -= oldest->second.bytes->size();
+			m_mapEntries.erase(oldest);
+		}
+	}
+
+	void ReadAhead::Run()
+	{
+		DIVE_TRACE_THREAD("ReadAhead");
+
+		std::vector<std::wstring> vecBatch;
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_cvWork.wait(lock, [this]() { return m_bEnd || !m_vecQueued.empty(); });
+				if (m_bEnd)
+					return;
+				vecBatch.swap(m_vecQueued);
+			}
+
+			ReadBatch(vecBatch);
+			vecBatch.clear();
+		}
+	}
+
+	// Volumes that report a seek penalty (rotational media) get their reads issued in on-disk order
+	bool ReadAhead::IncursSeekPenalty(const std::wstring& strFileName)
+	{
+		wchar_t wszVolume[MAX_PATH];
+		if (!GetVolumePathNameW(strFileName.c_str(), wszVolume, MAX_PATH))
+			return false;
+
+		auto it = m_mapSeekPenalty.find(wszVolume);
+		if (it != m_mapSeekPenalty.end())
+			return it->second;
+
+		bool bSeekPenalty = false;
+
+		// "C:\" -> "\\.\C:"; network shares have no device to ask and stay unordered
+		std::wstring strDevice = wszVolume;
+		if (strDevice.size() >= 2 && strDevice[1] == L':')
+		{
+			strDevice = L"\\\\.\\" + strDevice.substr(0, 2);
+
+			HANDLE hDevice = CreateFileW(strDevice.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+			if (hDevice != INVALID_HANDLE_VALUE)
+			{
+				STORAGE_PROPERTY_QUERY query = {};
+				query.PropertyId = StorageDeviceSeekPenaltyProperty;
+				query.QueryType = PropertyStandardQuery;
+
+				DEVICE_SEEK_PENALTY_DESCRIPTOR descriptor = {};
+				DWORD cbReturned = 0;
+				if (DeviceIoControl(hDevice, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query), &descriptor, sizeof(descriptor), &cbReturned, NULL))
+					bSeekPenalty = descriptor.IncursSeekPenalty != FALSE;
+				CloseHandle(hDevice);
+			}
+		}
+
+		m_mapSeekPenalty[wszVolume] = bSeekPenalty;
+		return bSeekPenalty;
+	}
+
+	// Logical cluster of the first extent, or ~0 when the file has no queryable extent
+	// (resident in the MFT, compressed, or on a network share)
+	static uint64_t FirstCluster(HANDLE hFile, OVERLAPPED& ov)
+	{
+		STARTING_VCN_INPUT_BUFFER input = {};
+		RETRIEVAL_POINTERS_BUFFER output = {};
+		DWORD cbReturned = 0;
+
+		BOOL bOk = DeviceIoControl(hFile, FSCTL_GET_RETRIEVAL_POINTERS, &input, sizeof(input), &output, sizeof(output), NULL, &ov);
+		if (!bOk && (GetLastError() == ERROR_IO_PENDING || GetLastError() == ERROR_MORE_DATA))
+			bOk = GetOverlappedResult(hFile, &ov, &cbReturned, TRUE) || GetLastError() == ERROR_MORE_DATA;
+		ResetEvent(ov.hEvent);
+
+		if (!bOk || output.ExtentCount == 0 || output.Extents[0].Lcn.QuadPart < 0)
+			return ~0ull;
+		return static_cast<uint64_t>(output.Extents[0].Lcn.QuadPart);
+	}
+
+	void ReadAhead::ReadBatch(const std::vector<std::wstring>& vecFiles)
+	{
+		DIVE_TRACE_SPAN(span, "ReadAhead::Batch");
+
+		struct Request
+		{
+			HANDLE hFile;
+			OVERLAPPED ov;
+			std::shared_ptr<std::vector<BYTE>> bytes;
+			uint64_t ullCluster;
+		};
+		std::vector<Request> vecRequests(vecFiles.size());
+		std::vector<size_t> vecOrder;
+		uint64_t ullBatchBytes = 0;
+
+		bool bPhysicalOrder = m_physicalOrder == PhysicalOrder::On
+			|| (m_physicalOrder == PhysicalOrder::Auto && !vecFiles.empty() && IncursSeekPenalty(vecFiles.front()));
+
+		for (size_t i = 0; i < vecFiles.size(); ++i)
+		{
+			Request& request = vecRequests[i];
+			ZeroMemory(&request.ov, sizeof(request.ov));
+			request.ullCluster = ~0ull;
+
+			request.hFile = CreateFileW(vecFiles[i].c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+				FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+			if (request.hFile == INVALID_HANDLE_VALUE)
+				continue;
+
+			LARGE_INTEGER liSize;
+			if (GetFileSizeEx(request.hFile, &liSize) && liSize.QuadPart > 0 && static_cast<uint64_t>(liSize.QuadPart) <= m_ullMaxFileSize)
+			{
+				request.ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+				if (request.ov.hEvent)
+				{
+					request.bytes = std::make_shared<std::vector<BYTE>>(static_cast<size_t>(liSize.QuadPart));
+					if (bPhysicalOrder)
+						request.ullCluster = FirstCluster(request.hFile, request.ov);
+					vecOrder.push_back(i);
+					continue;
+				}
+			}
+
+			// Too large (the streaming reader handles those) or no event to wait on
+			CloseHandle(request.hFile);
+			request.hFile = INVALID_HANDLE_VALUE;
+		}
+
+		// Within the batch, sweep the platter once instead of seeking back and forth.
+		// Files without a known extent keep their window order at the end.
+		if (bPhysicalOrder)
+		{
+			std::stable_sort(vecOrder.begin(), vecOrder.end(), [&vecRequests](size_t a, size_t b)
+			{
+				return vecRequests[a].ullCluster < vecRequests[b].ullCluster;
+			});
+		}
+
+		// Issue everything before waiting on anything
+		for (size_t i : vecOrder)
+		{
+			Request& request = vecRequests[i];
+			DWORD cbSize = static_cast<DWORD>(request.bytes->size());
+			if (ReadFile(request.hFile, request.bytes->data(), cbSize, NULL, &request.ov) || GetLastError() == ERROR_IO_PENDING)
+			{
+				ullBatchBytes += cbSize;
+				continue;
+			}
+
+			request.bytes.reset();
+			CloseHandle(request.ov.hEvent);
+			CloseHandle(request.hFile);
+			request.hFile = INVALID_HANDLE_VALUE;
+		}
+
+		DIVE_TRACE_BYTES(span, ullBatchBytes);
+
+		for (size_t i = 0; i < vecFiles.size(); ++i)
+		{
+			Request& request = vecRequests[i];
+			bool bComplete = false;
+
+			if (request.hFile != INVALID_HANDLE_VALUE)
+			{
+				while (WaitForSingleObject(request.ov.hEvent, 50) == WAIT_TIMEOUT)
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					if (m_bEnd)
+						CancelIoEx(request.hFile, &request.ov);
+				}
+
+				DWORD cbRead = 0;
+				bComplete = GetOverlappedResult(request.hFile, &request.ov, &cbRead, TRUE) && cbRead == request.bytes->size();
+
+				CloseHandle(request.ov.hEvent);
+				CloseHandle(request.hFile);
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				auto it = m_mapEntries.find(vecFiles[i]);
+				if (it != m_mapEntries.end() && !it->second.bReady)
+				{
+					if (bComplete)
+					{
+						it->second.bytes = std::move(request.bytes);
+						it->second.bReady = true;
+						m_nBytes += it->second.bytes->size();
+						Trim();
+					}
+					else
+					{
+						m_mapEntries.erase(it);
+					}
+				}
+				ReportHitRate();
+			}
+			m_cvReady.notify_all();
+		}
+	}
+}
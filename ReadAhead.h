@@ -0,0 +1,76 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdint>
+
+namespace DIVE
+{
+	// Reads whole files for the upcoming cache window ahead of the decoders. Each batch is
+	// opened and issued as overlapped reads at once so the device sees the full queue, and the
+	// load thread picks the bytes up with Take() instead of paying the open/read latency itself.
+	// On rotational storage each batch can be issued in physical (first extent) order.
+	class ReadAhead
+	{
+	public:
+		typedef std::shared_ptr<const std::vector<BYTE>> Bytes;
+
+		enum class PhysicalOrder
+		{
+			Off,
+			On,
+			Auto,	// only on volumes that report a seek penalty
+		};
+
+		ReadAhead(size_t nBudget = 256 << 20, uint64_t ullMaxFileSize = 64 << 20);
+		~ReadAhead();
+
+		void Submit(std::vector<std::wstring>&& vecFiles);
+		void Discard(const std::wstring& strFileName);
+
+		// Not synchronized with the read-ahead thread; set before the first Submit()
+		void SetPhysicalOrder(PhysicalOrder order) { m_physicalOrder = order; }
+
+		// Returns the pre-read bytes, waiting if the read is still in flight, or null on a miss
+		Bytes Take(const std::wstring& strFileName);
+
+	private:
+		struct Entry
+		{
+			Bytes bytes;
+			bool bReady;
+			uint64_t nSequence;
+		};
+
+		void Run();
+		bool IncursSeekPenalty(const std::wstring& strFileName);
+		void ReadBatch(const std::vector<std::wstring>& vecFiles);
+		void Trim();
+		void ReportHitRate();
+
+		std::mutex m_mutex;
+		std::condition_variable m_cvWork;
+		std::condition_variable m_cvReady;
+		std::unordered_map<std::wstring, Entry> m_mapEntries;
+		std::vector<std::wstring> m_vecQueued;
+
+		size_t m_nBytes;
+		size_t m_nBudget;
+		uint64_t m_ullMaxFileSize;
+		uint64_t m_nSequence;
+		uint64_t m_nHits;
+		uint64_t m_nMisses;
+		bool m_bEnd;
+
+		// Used by the read-ahead thread only
+		PhysicalOrder m_physicalOrder;
+		std::unordered_map<std::wstring, bool> m_mapSeekPenalty;
+
+		std::thread m_thread;
+	};
+}
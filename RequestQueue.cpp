@@ -0,0 +1,284 @@
+#include "stdafx.h"
+#include "RequestQueue.h"
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <stdio.h>
+
+namespace DIVE
+{
+	RequestQueue::RequestQueue(size_t nCapacity)
+		: m_nMask(0)
+		, m_nEnqueuePos(0)
+		, m_nDequeuePos(0)
+	{
+		size_t nSize = 2;
+		while (nSize < nCapacity)
+			nSize <<= 1;
+
+		m_cells.reset(new Cell[nSize]);
+		m_nMask = nSize - 1;
+
+		for (size_t i = 0; i < nSize; ++i)
+			m_cells[i].nSequence.store(i, std::memory_order_relaxed);
+
+		for (auto& page : m_pages)
+			page.store(nullptr, std::memory_order_relaxed);
+	}
+
+	RequestQueue::~RequestQueue()
+	{
+		for (auto& page : m_pages)
+			delete[] page.load(std::memory_order_relaxed);
+	}
+
+	std::atomic<uint64_t>* RequestQueue::Word(int nIndex, bool bCreate) const
+	{
+		if (nIndex < 0)
+			return nullptr;
+
+		size_t nPage = static_cast<size_t>(nIndex) / kBitsPerPage;
+		if (nPage >= kMaxPages)
+			return nullptr;
+
+		std::atomic<uint64_t>* pPage = m_pages[nPage].load(std::memory_order_acquire);
+		if (!pPage)
+		{
+			if (!bCreate)
+				return nullptr;
+
+			// Pages are published once and never freed before the queue, so a losing racer
+			// simply discards its copy.
+			std::atomic<uint64_t>* pNewPage = new std::atomic<uint64_t>[kWordsPerPage];
+			for (size_t i = 0; i < kWordsPerPage; ++i)
+				pNewPage[i].store(0, std::memory_order_relaxed);
+
+			if (m_pages[nPage].compare_exchange_strong(pPage, pNewPage, std::memory_order_acq_rel))
+				pPage = pNewPage;
+			else
+				delete[] pNewPage;
+		}
+		return &pPage[(static_cast<size_t>(nIndex) % kBitsPerPage) / 64];
+	}
+
+	bool RequestQueue::Enqueue(int nIndex)
+	{
+		size_t nPos = m_nEnqueuePos.load(std::memory_order_relaxed);
+		Cell* pCell;
+		while (true)
+		{
+			pCell = &m_cells[nPos & m_nMask];
+			size_t nSequence = pCell->nSequence.load(std::memory_order_acquire);
+			intptr_t nDiff = static_cast<intptr_t>(nSequence) - static_cast<intptr_t>(nPos);
+			if (nDiff == 0)
+			{
+				if (m_nEnqueuePos.compare_exchange_weak(nPos, nPos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (nDiff < 0)
+				return false;
+			else
+				nPos = m_nEnqueuePos.load(std::memory_order_relaxed);
+		}
+		pCell->nIndex = nIndex;
+		pCell->nSequence.store(nPos + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool RequestQueue::Dequeue(int& nIndex)
+	{
+		size_t nPos = m_nDequeuePos.load(std::memory_order_relaxed);
+		Cell* pCell;
+		while (true)
+		{
+			pCell = &m_cells[nPos & m_nMask];
+			size_t nSequence = pCell->nSequence.load(std::memory_order_acquire);
+			intptr_t nDiff = static_cast<intptr_t>(nSequence) - static_cast<intptr_t>(nPos + 1);
+			if (nDiff == 0)
+			{
+				if (m_nDequeuePos.compare_exchange_weak(nPos, nPos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (nDiff < 0)
+				return false;
+			else
+				nPos = m_nDequeuePos.load(std::memory_order_relaxed);
+		}
+		nIndex = pCell->nIndex;
+		pCell->nSequence.store(nPos + m_nMask + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool RequestQueue::Push(int nIndex)
+	{
+		std::atomic<uint64_t>* pWord = Word(nIndex, true);
+		if (!pWord)
+			return false;
+
+		uint64_t ullBit = 1ull << (nIndex % 64);
+		if (pWord->fetch_or(ullBit, std::memory_order_acq_rel) & ullBit)
+			return false;
+
+		if (!Enqueue(nIndex))
+		{
+			pWord->fetch_and(~ullBit, std::memory_order_acq_rel);
+			return false;
+		}
+		return true;
+	}
+
+	bool RequestQueue::Pop(int& nIndex, std::atomic<int>* pClaim)
+	{
+		int nCandidate;
+		while (Dequeue(nCandidate))
+		{
+			std::atomic<uint64_t>* pWord = Word(nCandidate, false);
+			uint64_t ullBit = 1ull << (nCandidate % 64);
+			if (pClaim)
+				pClaim->store(nCandidate, std::memory_order_release);
+
+			// Whoever clears the bit owns the request; entries removed meanwhile are skipped
+			if (pWord && (pWord->fetch_and(~ullBit, std::memory_order_acq_rel) & ullBit))
+			{
+				nIndex = nCandidate;
+				return true;
+			}
+		}
+		if (pClaim)
+			pClaim->store(-1, std::memory_order_release);
+		return false;
+	}
+
+	bool RequestQueue::Remove(int nIndex)
+	{
+		std::atomic<uint64_t>* pWord = Word(nIndex, false);
+		if (!pWord)
+			return false;
+
+		uint64_t ullBit = 1ull << (nIndex % 64);
+		return (pWord->fetch_and(~ullBit, std::memory_order_acq_rel) & ullBit) != 0;
+	}
+
+	bool RequestQueue::Contains(int nIndex) const
+	{
+		std::atomic<uint64_t>* pWord = Word(nIndex, false);
+		if (!pWord)
+			return false;
+
+		return (pWord->load(std::memory_order_acquire) & (1ull << (nIndex % 64))) != 0;
+	}
+
+	// A hint only: entries already removed still count until Pop() skips them
+	bool RequestQueue::Empty() const
+	{
+		return m_nDequeuePos.load(std::memory_order_acquire) == m_nEnqueuePos.load(std::memory_order_acquire);
+	}
+
+	void RequestQueue::Clear()
+	{
+		int nIndex;
+		while (Pop(nIndex))
+			;
+	}
+
+	struct QueueBenchCounts
+	{
+		std::atomic<uint64_t> nPushed{ 0 };
+		std::atomic<uint64_t> nRejected{ 0 };
+		std::atomic<uint64_t> nPopped{ 0 };
+		std::atomic<uint64_t> nRemoved{ 0 };
+	};
+
+	// One round: nThreads producers over their own index span, three pushes to one remove,
+	// and nThreads consumers popping until the producers are done and the ring is drained
+	static bool RunQueueBench(int nThreads, int nOpsPerThread)
+	{
+		const int kSpan = 4096;
+
+		// Every push enqueues at most once, so a ring this size never fills and a rejected
+		// push can only be a duplicate
+		RequestQueue queue(static_cast<size_t>(nThreads) * nOpsPerThread);
+		QueueBenchCounts counts;
+		std::atomic<int> nProducing(nThreads);
+		std::atomic<bool> bGo(false);
+
+		std::vector<std::thread> vecThreads;
+		for (int t = 0; t < nThreads; ++t)
+		{
+			vecThreads.emplace_back([&, t]()
+			{
+				while (!bGo.load(std::memory_order_acquire))
+					std::this_thread::yield();
+
+				uint32_t nSeed = 2654435761u * (t + 1);
+				uint64_t nPushed = 0, nRejected = 0, nRemoved = 0;
+				for (int i = 0; i < nOpsPerThread; ++i)
+				{
+					nSeed = nSeed * 1664525u + 1013904223u;
+					int nIndex = t * kSpan + static_cast<int>((nSeed >> 8) % kSpan);
+					if ((i & 3) == 3)
+						nRemoved += queue.Remove(nIndex) ? 1 : 0;
+					else if (queue.Push(nIndex))
+						++nPushed;
+					else
+						++nRejected;
+				}
+				counts.nPushed += nPushed;
+				counts.nRejected += nRejected;
+				counts.nRemoved += nRemoved;
+				nProducing.fetch_sub(1, std::memory_order_release);
+			});
+		}
+		for (int t = 0; t < nThreads; ++t)
+		{
+			vecThreads.emplace_back([&]()
+			{
+				while (!bGo.load(std::memory_order_acquire))
+					std::this_thread::yield();
+
+				uint64_t nPopped = 0;
+				int nIndex;
+				while (true)
+				{
+					if (queue.Pop(nIndex))
+						++nPopped;
+					else if (nProducing.load(std::memory_order_acquire) == 0 && queue.Empty())
+						break;
+				}
+				counts.nPopped += nPopped;
+			});
+		}
+
+		auto tStart = std::chrono::steady_clock::now();
+		bGo.store(true, std::memory_order_release);
+		for (auto& thread : vecThreads)
+			thread.join();
+		double fSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+
+		uint64_t nPushed = counts.nPushed, nRejected = counts.nRejected, nPopped = counts.nPopped, nRemoved = counts.nRemoved;
+		uint64_t nOps = static_cast<uint64_t>(nThreads) * nOpsPerThread + nPopped;
+		bool bOk = nPopped + nRemoved == nPushed && queue.Empty();
+		wprintf(L"  %2d producers, %2d consumers: %6.1f M ops/s, %llu pushed, %llu duplicates, %llu popped, %llu removed%ls\n",
+			nThreads, nThreads, nOps / fSeconds / 1e6, nPushed, nRejected, nPopped, nRemoved, bOk ? L"" : L" MISMATCH");
+		return bOk;
+	}
+
+	int BenchmarkRequestQueue(int nThreads)
+	{
+		if (nThreads <= 0 || nThreads > 64)
+			return 1;
+
+		const int kOpsPerThread = 1 << 18;
+		bool bOk = true;
+		for (int nRound = 1; ; nRound = std::min(nRound * 2, nThreads))
+		{
+			bOk = RunQueueBench(nRound, kOpsPerThread) && bOk;
+			if (nRound == nThreads)
+				break;
+		}
+
+		fflush(stdout);
+		return bOk ? 0 : 1;
+	}
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+namespace DIVE
+{
+	// Bounded lock-free MPMC queue of file indices with a membership bitset.
+	// An index is queued at most once; Remove() only clears its bit, and Pop() skips
+	// ring entries whose bit was cleared, so dedup and removal are O(1) and no caller
+	// ever blocks on another thread.
+	class RequestQueue
+	{
+	public:
+		explicit RequestQueue(size_t nCapacity = 1024);
+		~RequestQueue();
+
+		bool Push(int nIndex);
+
+		// pClaim receives each candidate before its bit is cleared, so an index is always
+		// either Contains() or in *pClaim until the caller resets the claim
+		bool Pop(int& nIndex, std::atomic<int>* pClaim = nullptr);
+		bool Remove(int nIndex);
+		bool Contains(int nIndex) const;
+		bool Empty() const;
+		void Clear();
+
+	private:
+		RequestQueue(const RequestQueue&) = delete;
+		RequestQueue& operator=(const RequestQueue&) = delete;
+
+		struct Cell
+		{
+			std::atomic<size_t> nSequence;
+			int nIndex;
+		};
+
+		bool Enqueue(int nIndex);
+		bool Dequeue(int& nIndex);
+		std::atomic<uint64_t>* Word(int nIndex, bool bCreate) const;
+
+		static const size_t kBitsPerPage = 65536;
+		static const size_t kWordsPerPage = kBitsPerPage / 64;
+		static const size_t kMaxPages = 4096;
+
+		std::unique_ptr<Cell[]> m_cells;
+		size_t m_nMask;
+
+		alignas(64) std::atomic<size_t> m_nEnqueuePos;
+		alignas(64) std::atomic<size_t> m_nDequeuePos;
+
+		mutable std::atomic<std::atomic<uint64_t>*> m_pages[kMaxPages];
+	};
+
+	// Headless /queue-bench mode: up to nThreads producers pushing and removing against as
+	// many consumers popping, printing throughput and checking that every accepted push
+	// was popped or removed exactly once; returns the process exit code
+	int BenchmarkRequestQueue(int nThreads);
+}
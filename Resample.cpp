@@ -0,0 +1,370 @@
+#include "stdafx.h"
+#include "Resample.h"
+#include "ImageLoader.h"
+#include <tmmintrin.h>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+namespace DIVE
+{
+	static const int kWeightBits = 14;		// the taps of one output sum to 1 << kWeightBits
+	static const int kFractionBits = 6;		// precision kept between the two passes
+	static const double kLobes = 3.0;
+	static const double kPi = 3.14159265358979323846;
+
+	static double LanczosWeight(double x)
+	{
+		x = std::abs(x);
+		if (x < 1e-9)
+			return 1.0;
+		if (x >= kLobes)
+			return 0.0;
+		double px = kPi * x;
+		return kLobes * std::sin(px) * std::sin(px / kLobes) / (px * px);
+	}
+
+	// Fixed-point taps of every output position along one axis. Output o reads vecCount[o]
+	// source pixels from vecFirst[o]; taps that fall off the edge are folded onto it.
+	struct FilterTaps
+	{
+		std::vector<int> vecFirst;
+		std::vector<int> vecCount;
+		std::vector<int16_t> vecWeights;	// nStride per output
+		int nStride;
+	};
+
+	static void ComputeTaps(int nSource, double fStart, double fLength, int nDest, FilterTaps& taps)
+	{
+		double fStep = fLength / nDest;
+		double fStretch = std::max(1.0, fStep);		// widens the kernel when reducing
+		double fSupport = kLobes * fStretch;
+
+		taps.nStride = static_cast<int>(std::ceil(fSupport)) * 2 + 1;
+		taps.vecFirst.resize(nDest);
+		taps.vecCount.resize(nDest);
+		taps.vecWeights.assign(static_cast<size_t>(nDest) * taps.nStride, 0);
+		std::vector<double> vecRaw(taps.nStride);
+
+		for (int o = 0; o < nDest; ++o)
+		{
+			// Source pixel centres sit on integers
+			double fCentre = fStart + (o + 0.5) * fStep - 0.5;
+			int nLow = static_cast<int>(std::floor(fCentre - fSupport)) + 1;
+			int nHigh = static_cast<int>(std::floor(fCentre + fSupport));
+			int nFirst = std::min(std::max(nLow, 0), nSource - 1);
+			int nLast = std::min(std::max(nHigh, 0), nSource - 1);
+			int nCount = nLast - nFirst + 1;
+
+			std::fill(vecRaw.begin(), vecRaw.begin() + nCount, 0.0);
+			double fSum = 0.0;
+			for (int i = nLow; i <= nHigh; ++i)
+			{
+				double w = LanczosWeight((i - fCentre) / fStretch);
+				vecRaw[std::min(std::max(i, 0), nSource - 1) - nFirst] += w;
+				fSum += w;
+			}
+
+			// Rounding leaves the sum a little off one; the difference goes to the largest tap
+			int16_t* pWeights = &taps.vecWeights[static_cast<size_t>(o) * taps.nStride];
+			int nTotal = 0;
+			int nLargest = 0;
+			for (int k = 0; k < nCount; ++k)
+			{
+				pWeights[k] = static_cast<int16_t>(std::lround(vecRaw[k] / fSum * (1 << kWeightBits)));
+				nTotal += pWeights[k];
+				if (pWeights[k] > pWeights[nLargest])
+					nLargest = k;
+			}
+			pWeights[nLargest] = static_cast<int16_t>(pWeights[nLargest] + (1 << kWeightBits) - nTotal);
+
+			taps.vecFirst[o] = nFirst;
+			taps.vecCount[o] = nCount;
+		}
+	}
+
+	static __m128i WeightPair(const int16_t* pWeights, int k, int nCount)
+	{
+		int16_t w1 = k + 1 < nCount ? pWeights[k + 1] : 0;
+		return _mm_set1_epi32(static_cast<uint16_t>(pWeights[k]) | (static_cast<uint32_t>(static_cast<uint16_t>(w1)) << 16));
+	}
+
+	// One source row to nDest pixels of 16-bit channels with kFractionBits of fraction
+	static void FilterRow(const BYTE* pSource, const FilterTaps& taps, int nDest, int16_t* pOut)
+	{
+		// Two pixels to b0 b1 g0 g1 r0 r1 a0 a1, zero extended, for a multiply-add per pair of taps
+		const __m128i pairs = _mm_setr_epi8(0, -1, 4, -1, 1, -1, 5, -1, 2, -1, 6, -1, 3, -1, 7, -1);
+		const __m128i round = _mm_set1_epi32(1 << (kWeightBits - kFractionBits - 1));
+
+		for (int o = 0; o < nDest; ++o)
+		{
+			const BYTE* pPixels = pSource + static_cast<size_t>(taps.vecFirst[o]) * 4;
+			const int16_t* pWeights = &taps.vecWeights[static_cast<size_t>(o) * taps.nStride];
+			int nCount = taps.vecCount[o];
+
+			__m128i sum = _mm_setzero_si128();
+			int k = 0;
+			for (; k + 1 < nCount; k += 2)
+			{
+				__m128i p = _mm_shuffle_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(pPixels + k * 4)), pairs);
+				sum = _mm_add_epi32(sum, _mm_madd_epi16(p, WeightPair(pWeights, k, nCount)));
+			}
+			if (k < nCount)
+			{
+				__m128i p = _mm_shuffle_epi8(_mm_cvtsi32_si128(*reinterpret_cast<const int*>(pPixels + k * 4)), pairs);
+				sum = _mm_add_epi32(sum, _mm_madd_epi16(p, WeightPair(pWeights, k, nCount)));
+			}
+
+			sum = _mm_srai_epi32(_mm_add_epi32(sum, round), kWeightBits - kFractionBits);
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(pOut + o * 4), _mm_packs_epi32(sum, sum));
+		}
+	}
+
+	// One output row from the filtered rows its taps cover, two pixels at a time
+	static void FilterColumns(const int16_t* pRows, size_t nRowStride, const int16_t* pWeights, int nCount, int nWidth, BYTE* pOut)
+	{
+		const __m128i round = _mm_set1_epi32(1 << (kWeightBits + kFractionBits - 1));
+		const __m128i alpha = _mm_setr_epi8(3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15);
+
+		for (int x = 0; x < nWidth; x += 2)
+		{
+			bool bPair = x + 1 < nWidth;
+			__m128i sum0 = _mm_setzero_si128();
+			__m128i sum1 = _mm_setzero_si128();
+
+			for (int k = 0; k < nCount; k += 2)
+			{
+				const int16_t* p0 = pRows + k * nRowStride + x * 4;
+				__m128i r0 = bPair ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(p0)) : _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p0));
+				__m128i r1 = _mm_setzero_si128();
+				if (k + 1 < nCount)
+				{
+					const int16_t* p1 = p0 + nRowStride;
+					r1 = bPair ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(p1)) : _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p1));
+				}
+				__m128i w = WeightPair(pWeights, k, nCount);
+				sum0 = _mm_add_epi32(sum0, _mm_madd_epi16(_mm_unpacklo_epi16(r0, r1), w));
+				sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(_mm_unpackhi_epi16(r0, r1), w));
+			}
+
+			sum0 = _mm_srai_epi32(_mm_add_epi32(sum0, round), kWeightBits + kFractionBits);
+			sum1 = _mm_srai_epi32(_mm_add_epi32(sum1, round), kWeightBits + kFractionBits);
+			__m128i bgra = _mm_packus_epi16(_mm_packs_epi32(sum0, sum1), _mm_setzero_si128());
+
+			// Ringing can push colour past alpha, which premultiplied pixels cannot hold
+			bgra = _mm_min_epu8(bgra, _mm_shuffle_epi8(bgra, alpha));
+
+			if (bPair)
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(pOut + x * 4), bgra);
+			else
+				*reinterpret_cast<int*>(pOut + x * 4) = _mm_cvtsi128_si32(bgra);
+		}
+	}
+
+	// Output rows nTop to nBottom: filters the source rows they need across, then down
+	static void ResampleBand(const BYTE* pSource, UINT nSourceStride, const FilterTaps& across, const FilterTaps& down,
+		int nTop, int nBottom, BYTE* pDest, UINT nDestStride, int nDestWidth, const CancelToken& cancel)
+	{
+		int nFirstRow = down.vecFirst[nTop];
+		int nLastRow = down.vecFirst[nBottom - 1] + down.vecCount[nBottom - 1] - 1;
+		size_t nRowStride = static_cast<size_t>(nDestWidth) * 4;
+		std::vector<int16_t> vecRows(nRowStride * (nLastRow - nFirstRow + 1));
+
+		for (int y = nFirstRow; y <= nLastRow; ++y)
+		{
+			if ((y & 31) == 0 && cancel.IsCancelled())
+				return;
+			FilterRow(pSource + static_cast<size_t>(y) * nSourceStride, across, nDestWidth, &vecRows[nRowStride * (y - nFirstRow)]);
+		}
+
+		for (int y = nTop; y < nBottom; ++y)
+		{
+			if ((y & 31) == 0 && cancel.IsCancelled())
+				return;
+			FilterColumns(&vecRows[nRowStride * (down.vecFirst[y] - nFirstRow)], nRowStride,
+				&down.vecWeights[static_cast<size_t>(y) * down.nStride], down.vecCount[y],
+				nDestWidth, pDest + static_cast<size_t>(y) * nDestStride);
+		}
+	}
+
+	bool ResampleLanczos(const BYTE* pSource, UINT nSourceStride, UINT nSourceWidth, UINT nSourceHeight,
+		float fX, float fY, float fWidth, float fHeight,
+		BYTE* pDest, UINT nDestStride, UINT nDestWidth, UINT nDestHeight, const CancelToken& cancel)
+	{
+		if (!nSourceWidth || !nSourceHeight || !nDestWidth || !nDestHeight)
+			return true;
+
+		FilterTaps across, down;
+		ComputeTaps(static_cast<int>(nSourceWidth), fX, fWidth, static_cast<int>(nDestWidth), across);
+		ComputeTaps(static_cast<int>(nSourceHeight), fY, fHeight, static_cast<int>(nDestHeight), down);
+
+		// Bands share a few source rows at their edges, which both filter across
+		UINT nThreads = std::max(1u, std::min(std::thread::hardware_concurrency(), static_cast<UINT>(static_cast<uint64_t>(nDestWidth) * nDestHeight >> 16)));
+		UINT nBand = (nDestHeight + nThreads - 1) / nThreads;
+
+		std::vector<std::thread> vecThreads;
+		for (UINT y = nBand; y < nDestHeight; y += nBand)
+		{
+			UINT nBottom = std::min(y + nBand, nDestHeight);
+			vecThreads.emplace_back([&, y, nBottom]()
+			{
+				ResampleBand(pSource, nSourceStride, across, down, y, nBottom, pDest, nDestStride, nDestWidth, cancel);
+			});
+		}
+		ResampleBand(pSource, nSourceStride, across, down, 0, std::min(nBand, nDestHeight), pDest, nDestStride, nDestWidth, cancel);
+		for (auto& thread : vecThreads)
+			thread.join();
+
+		return !cancel.IsCancelled();
+	}
+
+	void HalvePlane(const BYTE* pSource, UINT nSourceStride, UINT nWidth, UINT nHeight, PixelPlane& dest)
+	{
+		dest.nWidth = (nWidth + 1) / 2;
+		dest.nHeight = (nHeight + 1) / 2;
+		dest.pixels.resize(static_cast<size_t>(dest.nWidth) * dest.nHeight * 4);
+
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i round = _mm_set1_epi16(2);
+
+		for (UINT y = 0; y < dest.nHeight; ++y)
+		{
+			const BYTE* p0 = pSource + static_cast<size_t>(y) * 2 * nSourceStride;
+			const BYTE* p1 = y * 2 + 1 < nHeight ? p0 + nSourceStride : p0;
+			BYTE* pOut = dest.pixels.data() + static_cast<size_t>(y) * dest.nWidth * 4;
+
+			// Eight source pixels of each row to four
+			UINT x = 0;
+			for (; x * 2 + 8 <= nWidth; x += 4)
+			{
+				__m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p0 + x * 8));
+				__m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p0 + x * 8 + 16));
+				__m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p1 + x * 8));
+				__m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p1 + x * 8 + 16));
+
+				// Vertical pairs, two pixels per register
+				__m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+				__m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+				__m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+				__m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+
+				// Then horizontal neighbours
+				__m128i t0 = _mm_add_epi16(_mm_unpacklo_epi64(s0, s1), _mm_unpackhi_epi64(s0, s1));
+				__m128i t1 = _mm_add_epi16(_mm_unpacklo_epi64(s2, s3), _mm_unpackhi_epi64(s2, s3));
+				t0 = _mm_srli_epi16(_mm_add_epi16(t0, round), 2);
+				t1 = _mm_srli_epi16(_mm_add_epi16(t1, round), 2);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(pOut + x * 4), _mm_packus_epi16(t0, t1));
+			}
+			for (; x < dest.nWidth; ++x)
+			{
+				UINT x0 = x * 2 * 4;
+				UINT x1 = std::min(x * 2 + 1, nWidth - 1) * 4;
+				for (UINT c = 0; c < 4; ++c)
+					pOut[x * 4 + c] = static_cast<BYTE>((p0[x0 + c] + p0[x1 + c] + p1[x0 + c] + p1[x1 + c] + 2) >> 2);
+			}
+		}
+	}
+
+	void PyramidSize(UINT nLevel, UINT& nWidth, UINT& nHeight)
+	{
+		for (UINT i = 0; i < nLevel; ++i)
+		{
+			nWidth = (nWidth + 1) / 2;
+			nHeight = (nHeight + 1) / 2;
+		}
+	}
+
+	UINT PyramidLevel(float fScale, UINT nWidth, UINT nHeight)
+	{
+		UINT nLevel = 0;
+		while (fScale > 0.0f && fScale * 2.0f <= 1.0f && std::max(nWidth, nHeight) > 1)
+		{
+			fScale *= 2.0f;
+			nWidth = (nWidth + 1) / 2;
+			nHeight = (nHeight + 1) / 2;
+			++nLevel;
+		}
+		return nLevel;
+	}
+
+	typedef std::chrono::steady_clock BenchmarkClock;
+
+	// Best of a few runs, in milliseconds
+	template <typename F>
+	static double BestOf(int nRuns, F f)
+	{
+		double fBest = 0.0;
+		for (int i = 0; i < nRuns; ++i)
+		{
+			BenchmarkClock::time_point tStart = BenchmarkClock::now();
+			f();
+			double fMs = std::chrono::duration<double, std::milli>(BenchmarkClock::now() - tStart).count();
+			if (!i || fMs < fBest)
+				fBest = fMs;
+		}
+		return fBest;
+	}
+
+	int BenchmarkResample(const std::wstring& strFileName)
+	{
+		static const int kRuns = 5;
+		static const UINT kViewWidth = 1920;
+		static const UINT kViewHeight = 1080;
+
+		ImageLoader loader;
+		std::vector<BYTE> vecPixels;
+		UINT nWidth = 0, nHeight = 0;
+		HRESULT hr = loader.LoadInto(strFileName.c_str(), vecPixels, nWidth, nHeight);
+		if (FAILED(hr) || !nWidth || !nHeight)
+		{
+			wprintf(L"%ls: cannot decode (0x%08x)\n", strFileName.c_str(), static_cast<unsigned>(hr));
+			return 1;
+		}
+		wprintf(L"%ls: %u x %u, %u threads\n", strFileName.c_str(), nWidth, nHeight, std::max(1u, std::thread::hardware_concurrency()));
+
+		// Every level down to a single pixel, each from the one before
+		std::vector<PixelPlane> vecLevels(1);
+		vecLevels[0].nWidth = nWidth;
+		vecLevels[0].nHeight = nHeight;
+		vecLevels[0].pixels.swap(vecPixels);
+		while (std::max(vecLevels.back().nWidth, vecLevels.back().nHeight) > 1)
+		{
+			PixelPlane level;
+			const PixelPlane& source = vecLevels.back();
+			double fMs = BestOf(kRuns, [&]() { HalvePlane(source.pixels.data(), source.nWidth * 4, source.nWidth, source.nHeight, level); });
+			wprintf(L"  halve to level %zu: %u x %u in %.2f ms, %.0f MP/s read\n", vecLevels.size(), level.nWidth, level.nHeight,
+				fMs, source.nWidth * static_cast<double>(source.nHeight) / (fMs * 1000.0));
+			vecLevels.push_back(std::move(level));
+		}
+
+		// A full screen of the image centre at a few zooms, from the level the viewer would use
+		const float scales[] = { 0.9f, 0.75f, 0.5f, 0.33f, 0.25f, 0.1f };
+		PixelPlane view;
+		for (float fScale : scales)
+		{
+			UINT nLevel = PyramidLevel(fScale, nWidth, nHeight);
+			const PixelPlane& source = vecLevels[nLevel];
+			float fLevelScale = fScale * nWidth / source.nWidth;
+
+			view.nWidth = std::max(1u, std::min(kViewWidth, static_cast<UINT>(source.nWidth * fLevelScale)));
+			view.nHeight = std::max(1u, std::min(kViewHeight, static_cast<UINT>(source.nHeight * fLevelScale)));
+			view.pixels.resize(static_cast<size_t>(view.nWidth) * view.nHeight * 4);
+			float fSourceWidth = view.nWidth / fLevelScale;
+			float fSourceHeight = view.nHeight / fLevelScale;
+
+			double fMs = BestOf(kRuns, [&]()
+			{
+				ResampleLanczos(source.pixels.data(), source.nWidth * 4, source.nWidth, source.nHeight,
+					(source.nWidth - fSourceWidth) / 2, (source.nHeight - fSourceHeight) / 2, fSourceWidth, fSourceHeight,
+					view.pixels.data(), view.nWidth * 4, view.nWidth, view.nHeight);
+			});
+			wprintf(L"  lanczos at %.2fx from level %u: %u x %u in %.2f ms, %.0f MP/s written\n", fScale, nLevel, view.nWidth, view.nHeight,
+				fMs, view.nWidth * static_cast<double>(view.nHeight) / (fMs * 1000.0));
+		}
+		fflush(stdout);
+		return 0;
+	}
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "CancelToken.h"
+
+namespace DIVE
+{
+	// Tightly packed 32bpp premultiplied BGRA
+	struct PixelPlane
+	{
+		UINT nWidth = 0;
+		UINT nHeight = 0;
+		std::vector<BYTE> pixels;
+	};
+
+	// Halves both sides, rounding up, with a 2x2 box filter; an odd last row or column is
+	// averaged with itself. Level n + 1 of a pyramid is level n halved.
+	void HalvePlane(const BYTE* pSource, UINT nSourceStride, UINT nWidth, UINT nHeight, PixelPlane& dest);
+
+	// Size of pyramid level nLevel of an nWidth x nHeight image
+	void PyramidSize(UINT nLevel, UINT& nWidth, UINT& nHeight);
+
+	// Level to draw at fScale screen pixels per image pixel: the smallest one still at least as
+	// large as the view, so it is never reduced by half or more on the way to the screen
+	UINT PyramidLevel(float fScale, UINT nWidth, UINT nHeight);
+
+	// Lanczos-3 resample of the source rectangle (fX, fY, fWidth, fHeight in source pixels) to
+	// nDestWidth x nDestHeight, split into bands of rows over all cores. Colour is kept within
+	// alpha so the result stays premultiplied. Returns false when cancelled.
+	bool ResampleLanczos(const BYTE* pSource, UINT nSourceStride, UINT nSourceWidth, UINT nSourceHeight,
+		float fX, float fY, float fWidth, float fHeight,
+		BYTE* pDest, UINT nDestStride, UINT nDestWidth, UINT nDestHeight, const CancelToken& cancel = CancelToken());
+
+	// Headless /resample-bench mode: times the pyramid and Lanczos kernels on one image and
+	// prints the rates to stdout; returns the process exit code
+	int BenchmarkResample(const std::wstring& strFileName);
+}
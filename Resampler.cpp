@@ -0,0 +1,249 @@
+#include "stdafx.h"
+#include "Resampler.h"
+#include "ImageLoader.h"
+#include "Trace.h"
+#include <algorithm>
+#include <chrono>
+
+namespace DIVE
+{
+	Resampler::Resampler()
+		: m_bStop(false)
+		, m_bNewImage(false)
+		, m_nImage(0)
+		, m_nWantLevel(0)
+		, m_bRequested(false)
+		, m_nImageGeneration(1)
+		, m_nViewGeneration(1)
+		, m_nResampleMicros(0)
+		, m_pSource(nullptr)
+		, m_nSourceStride(0)
+		, m_nSourceWidth(0)
+		, m_nSourceHeight(0)
+	{
+		m_thread = std::thread(&Resampler::Run, this);
+	}
+
+	Resampler::~Resampler()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_bStop = true;
+		}
+		m_cvWork.notify_one();
+		m_thread.join();
+	}
+
+	void Resampler::SetImage(IWICBitmapSource* pImage, uint32_t nImage)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_pNewImage = pImage;
+			m_bNewImage = true;
+			m_nImage = nImage;
+			++m_nImageGeneration;
+			m_vecLevels.clear();
+			m_nWantLevel = 0;
+			m_bRequested = false;
+			m_pFinished.reset();
+		}
+		m_cvWork.notify_one();
+	}
+
+	std::shared_ptr<const PixelPlane> Resampler::Level(UINT nLevel)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (nLevel && nLevel < m_vecLevels.size())
+			return m_vecLevels[nLevel];
+
+		if (nLevel > m_nWantLevel)
+		{
+			m_nWantLevel = nLevel;
+			m_cvWork.notify_one();
+		}
+		return nullptr;
+	}
+
+	void Resampler::Request(const ResampleView& view)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (view.nImage != m_nImage)
+				return;
+			m_request = view;
+			m_bRequested = true;
+			++m_nViewGeneration;
+			m_pFinished.reset();
+		}
+		m_cvWork.notify_one();
+	}
+
+	std::shared_ptr<const PixelPlane> Resampler::TakeView(ResampleView& view)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_pFinished)
+			return nullptr;
+		view = m_finished;
+		return std::move(m_pFinished);
+	}
+
+	bool Resampler::IsStale(const void* pContext)
+	{
+		const Job* pJob = static_cast<const Job*>(pContext);
+		const Resampler* pOwner = pJob->pOwner;
+		return pOwner->m_bStop || pJob->nImageGeneration != pOwner->m_nImageGeneration
+			|| (pJob->nViewGeneration && pJob->nViewGeneration != pOwner->m_nViewGeneration);
+	}
+
+	bool Resampler::OpenSource(ImageLoader& loader, IWICBitmapSource* pImage, const CancelToken& cancel)
+	{
+		UINT nWidth = 0;
+		UINT nHeight = 0;
+		WICPixelFormatGUID guidPixelFormat;
+		HRESULT hr = pImage->GetSize(&nWidth, &nHeight);
+		if (SUCCEEDED(hr))
+			hr = pImage->GetPixelFormat(&guidPixelFormat);
+		if (FAILED(hr) || !nWidth || !nHeight)
+			return false;
+
+		// Decoded images are in-memory PBGRA bitmaps; a read lock shares them with the renderer
+		if (guidPixelFormat == GUID_WICPixelFormat32bppPBGRA && SUCCEEDED(pImage->QueryInterface(IID_IWICBitmap, (void**)&m_pSourceBitmap)))
+		{
+			WICRect rc = { 0, 0, static_cast<INT>(nWidth), static_cast<INT>(nHeight) };
+			UINT cbBuffer = 0;
+			BYTE* pData = nullptr;
+			hr = m_pSourceBitmap->Lock(&rc, WICBitmapLockRead, &m_pSourceLock);
+			if (SUCCEEDED(hr))
+				hr = m_pSourceLock->GetStride(&m_nSourceStride);
+			if (SUCCEEDED(hr))
+				hr = m_pSourceLock->GetDataPointer(&cbBuffer, &pData);
+			if (SUCCEEDED(hr))
+			{
+				m_pSource = pData;
+				m_nSourceWidth = nWidth;
+				m_nSourceHeight = nHeight;
+				return true;
+			}
+			CloseSource();
+		}
+
+		m_vecSourceCopy.resize(static_cast<size_t>(nWidth) * nHeight * 4);
+		if (FAILED(loader.CopyFrame(pImage, m_vecSourceCopy.data(), cancel)))
+		{
+			CloseSource();
+			return false;
+		}
+		m_pSource = m_vecSourceCopy.data();
+		m_nSourceStride = nWidth * 4;
+		m_nSourceWidth = nWidth;
+		m_nSourceHeight = nHeight;
+		return true;
+	}
+
+	void Resampler::CloseSource()
+	{
+		m_pSourceLock.Release();
+		m_pSourceBitmap.Release();
+		std::vector<BYTE>().swap(m_vecSourceCopy);
+		m_pSource = nullptr;
+		m_nSourceStride = 0;
+		m_nSourceWidth = 0;
+		m_nSourceHeight = 0;
+	}
+
+	void Resampler::Run()
+	{
+		DIVE_TRACE_THREAD("Resampler");
+		CoInitializeEx(NULL, COINIT_MULTITHREADED);
+		{
+			ImageLoader loader;
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (!m_bStop)
+			{
+				if (m_bNewImage)
+				{
+					CComPtr<IWICBitmapSource> pImage;
+					pImage.Attach(m_pNewImage.Detach());
+					m_bNewImage = false;
+					Job job = { this, m_nImageGeneration, 0 };
+					lock.unlock();
+
+					CloseSource();
+					bool bOpen = pImage && OpenSource(loader, pImage, CancelToken(IsStale, &job));
+
+					lock.lock();
+					if (bOpen && job.nImageGeneration == m_nImageGeneration)
+						m_vecLevels.assign(1, nullptr);
+					continue;
+				}
+
+				// A view waits for its level; levels are built while anything asks for a deeper one
+				UINT nBuilt = m_vecLevels.empty() ? 0 : static_cast<UINT>(m_vecLevels.size() - 1);
+				if (!m_vecLevels.empty() && m_bRequested && m_request.nLevel <= nBuilt)
+				{
+					ResampleView view = m_request;
+					m_bRequested = false;
+					Job job = { this, m_nImageGeneration, m_nViewGeneration };
+					std::shared_ptr<const PixelPlane> pLevel = m_vecLevels[view.nLevel];
+					lock.unlock();
+
+					auto pView = std::make_shared<PixelPlane>();
+					pView->nWidth = view.nWidth;
+					pView->nHeight = view.nHeight;
+					pView->pixels.resize(static_cast<size_t>(view.nWidth) * view.nHeight * 4);
+
+					auto tStart = std::chrono::steady_clock::now();
+					bool bDone;
+					{
+						DIVE_TRACE_SCOPE("Resample View", -1, pView->pixels.size());
+						bDone = pLevel
+							? ResampleLanczos(pLevel->pixels.data(), pLevel->nWidth * 4, pLevel->nWidth, pLevel->nHeight, view.fX, view.fY, view.fWidth, view.fHeight,
+								pView->pixels.data(), view.nWidth * 4, view.nWidth, view.nHeight, CancelToken(IsStale, &job))
+							: ResampleLanczos(m_pSource, m_nSourceStride, m_nSourceWidth, m_nSourceHeight, view.fX, view.fY, view.fWidth, view.fHeight,
+								pView->pixels.data(), view.nWidth * 4, view.nWidth, view.nHeight, CancelToken(IsStale, &job));
+					}
+					if (bDone)
+					{
+						int nMicros = static_cast<int>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tStart).count());
+						m_nResampleMicros = m_nResampleMicros ? (m_nResampleMicros * 7 + nMicros) / 8 : nMicros;
+						DIVE_TRACE_COUNTER("Resample ms", nMicros / 1000.0);
+					}
+
+					lock.lock();
+					if (bDone && !IsStale(&job))
+					{
+						m_finished = view;
+						m_pFinished = std::move(pView);
+					}
+					continue;
+				}
+
+				UINT nWant = std::max(m_nWantLevel, m_bRequested ? m_request.nLevel : 0u);
+				if (!m_vecLevels.empty() && nBuilt < nWant)
+				{
+					std::shared_ptr<const PixelPlane> pPrevious = m_vecLevels[nBuilt];
+					Job job = { this, m_nImageGeneration, 0 };
+					lock.unlock();
+
+					auto pLevel = std::make_shared<PixelPlane>();
+					{
+						DIVE_TRACE_SCOPE("Resample Level", static_cast<int>(nBuilt + 1));
+						if (pPrevious)
+							HalvePlane(pPrevious->pixels.data(), pPrevious->nWidth * 4, pPrevious->nWidth, pPrevious->nHeight, *pLevel);
+						else
+							HalvePlane(m_pSource, m_nSourceStride, m_nSourceWidth, m_nSourceHeight, *pLevel);
+					}
+
+					lock.lock();
+					if (!IsStale(&job) && m_vecLevels.size() == nBuilt + 1)
+						m_vecLevels.push_back(std::move(pLevel));
+					continue;
+				}
+
+				m_cvWork.wait(lock);
+			}
+		}
+		CloseSource();
+		CoUninitialize();
+	}
+}
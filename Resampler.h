@@ -0,0 +1,101 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+#include "Resample.h"
+
+namespace DIVE
+{
+	class ImageLoader;
+
+	// Part of an image resampled for the screen: the rectangle fX, fY, fWidth, fHeight in pixels
+	// of pyramid level nLevel, to nWidth x nHeight
+	struct ResampleView
+	{
+		uint32_t nImage = 0;
+		UINT nLevel = 0;
+		float fX = 0.0f;
+		float fY = 0.0f;
+		float fWidth = 0.0f;
+		float fHeight = 0.0f;
+		UINT nWidth = 0;
+		UINT nHeight = 0;
+
+		bool operator==(const ResampleView& other) const
+		{
+			return nImage == other.nImage && nLevel == other.nLevel && fX == other.fX && fY == other.fY
+				&& fWidth == other.fWidth && fHeight == other.fHeight && nWidth == other.nWidth && nHeight == other.nHeight;
+		}
+		bool operator!=(const ResampleView& other) const { return !(*this == other); }
+	};
+
+	// Prefiltered copies of the image on screen, made on a worker thread. Pyramid levels are
+	// built one from the other, only as deep as the viewer has asked for, and a view request
+	// is resampled with Lanczos from the level it names. A new image or a new request abandons
+	// the work in flight. 32bpp PBGRA bitmaps are read in place; other sources are copied once.
+	class Resampler
+	{
+	public:
+		Resampler();
+		~Resampler();
+
+		// Starts over with pImage, known to the viewer as nImage; null drops the image
+		void SetImage(IWICBitmapSource* pImage, uint32_t nImage);
+
+		// Level nLevel >= 1 of the current image, or null until it is built; asking for a level
+		// builds every level down to it
+		std::shared_ptr<const PixelPlane> Level(UINT nLevel);
+
+		// Replaces the pending view request; TakeView hands each finished view over once
+		void Request(const ResampleView& view);
+		std::shared_ptr<const PixelPlane> TakeView(ResampleView& view);
+
+		int ResampleMicros() const { return m_nResampleMicros; }
+
+	private:
+		struct Job
+		{
+			const Resampler* pOwner;
+			uint32_t nImageGeneration;
+			uint32_t nViewGeneration;		// 0 while building levels, which only a new image cancels
+		};
+
+		void Run();
+		bool OpenSource(ImageLoader& loader, IWICBitmapSource* pImage, const CancelToken& cancel);
+		void CloseSource();
+		static bool IsStale(const void* pContext);
+
+		std::thread m_thread;
+		std::mutex m_mutex;
+		std::condition_variable m_cvWork;
+		std::atomic<bool> m_bStop;
+
+		// Shared with the viewer, under m_mutex
+		CComPtr<IWICBitmapSource> m_pNewImage;
+		bool m_bNewImage;
+		uint32_t m_nImage;
+		std::vector<std::shared_ptr<const PixelPlane>> m_vecLevels;		// empty until the source is open; [0] stands for it
+		UINT m_nWantLevel;
+		ResampleView m_request;
+		bool m_bRequested;
+		ResampleView m_finished;
+		std::shared_ptr<const PixelPlane> m_pFinished;
+		std::atomic<uint32_t> m_nImageGeneration;
+		std::atomic<uint32_t> m_nViewGeneration;
+		std::atomic<int> m_nResampleMicros;
+
+		// Level 0, worker thread only
+		CComPtr<IWICBitmap> m_pSourceBitmap;
+		CComPtr<IWICBitmapLock> m_pSourceLock;
+		std::vector<BYTE> m_vecSourceCopy;
+		const BYTE* m_pSource;
+		UINT m_nSourceStride;
+		UINT m_nSourceWidth;
+		UINT m_nSourceHeight;
+	};
+}
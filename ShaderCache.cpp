@@ -0,0 +1,151 @@
+#include "stdafx.h"
+#include "ShaderCache.h"
+#include "ThumbnailCache.h"
+#include "Trace.h"
+#include <d3dcompiler.h>
+#include <string>
+
+namespace DIVE
+{
+	static const uint32_t kShaderMagic = 'HSVD';		// "DVSH" in the file
+
+	struct ShaderHeader
+	{
+		uint32_t nMagic;
+		DWORD nFlags;
+		FileStamp stamp;
+	};
+
+	static DWORD CompileFlags()
+	{
+		DWORD dwShaderFlags = D3DCOMPILE_ENABLE_STRICTNESS;
+#ifdef _DEBUG
+		// Set the D3DCOMPILE_DEBUG flag to embed debug information in the shaders.
+		// Setting this flag improves the shader debugging experience, but still allows 
+		// the shaders to be optimized and to run exactly the way they will run in 
+		// the release configuration of this program.
+		dwShaderFlags |= D3DCOMPILE_DEBUG;
+
+		// Disable optimizations to further improve shader debugging
+		dwShaderFlags |= D3DCOMPILE_SKIP_OPTIMIZATION;
+#endif
+		return dwShaderFlags;
+	}
+
+	static HRESULT CompileShaderFromFile(const wchar_t* szFileName, LPCSTR szEntryPoint, LPCSTR szShaderModel, ID3DBlob** ppBlobOut)
+	{
+		DIVE_TRACE_SCOPE("Compile Shader");
+
+		ID3DBlob* pErrorBlob = nullptr;
+		HRESULT hr = D3DCompileFromFile(szFileName, nullptr, nullptr, szEntryPoint, szShaderModel,
+			CompileFlags(), 0, ppBlobOut, &pErrorBlob);
+		if (FAILED(hr))
+		{
+			if (pErrorBlob)
+			{
+				OutputDebugStringA(reinterpret_cast<const char*>(pErrorBlob->GetBufferPointer()));
+				pErrorBlob->Release();
+			}
+			return hr;
+		}
+		if (pErrorBlob) pErrorBlob->Release();
+
+		return S_OK;
+	}
+
+	// Empty when there is nowhere to keep the cache
+	static std::wstring CachePath(const wchar_t* wszFxFile, LPCSTR szEntryPoint, LPCSTR szShaderModel)
+	{
+		wchar_t wszAppData[MAX_PATH];
+		DWORD cch = GetEnvironmentVariableW(L"LOCALAPPDATA", wszAppData, MAX_PATH);
+		if (!cch || cch >= MAX_PATH)
+			return std::wstring();
+
+		std::wstring strFolder = wszAppData;
+		strFolder += L"\\DIVE";
+		CreateDirectoryW(strFolder.c_str(), nullptr);
+		strFolder += L"\\Shaders";
+		CreateDirectoryW(strFolder.c_str(), nullptr);
+
+		const wchar_t* wszName = wcsrchr(wszFxFile, L'\\');
+		std::wstring strPath = strFolder + L"\\" + (wszName ? wszName + 1 : wszFxFile);
+		for (LPCSTR sz : { szEntryPoint, szShaderModel })
+		{
+			strPath += L'.';
+			while (*sz)
+				strPath += static_cast<wchar_t>(*sz++);
+		}
+		return strPath + L".cso";
+	}
+
+	static HRESULT ReadCached(const std::wstring& strPath, const ShaderHeader& expected, ID3DBlob** ppBlob)
+	{
+		HANDLE hFile = CreateFileW(strPath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (hFile == INVALID_HANDLE_VALUE)
+			return HRESULT_FROM_WIN32(GetLastError());
+
+		ShaderHeader header = {};
+		LARGE_INTEGER liSize = {};
+		DWORD cbRead = 0;
+		HRESULT hr = GetFileSizeEx(hFile, &liSize) && liSize.QuadPart > static_cast<LONGLONG>(sizeof(header)) && liSize.QuadPart < (16 << 20)
+			&& ReadFile(hFile, &header, sizeof(header), &cbRead, nullptr) && cbRead == sizeof(header) ? S_OK : E_FAIL;
+		if (SUCCEEDED(hr) && (header.nMagic != expected.nMagic || header.nFlags != expected.nFlags || !(header.stamp == expected.stamp)))
+			hr = E_FAIL;
+
+		CComPtr<ID3DBlob> pBlob;
+		DWORD cbCode = static_cast<DWORD>(liSize.QuadPart - sizeof(header));
+		if (SUCCEEDED(hr))
+			hr = D3DCreateBlob(cbCode, &pBlob);
+		if (SUCCEEDED(hr) && !(ReadFile(hFile, pBlob->GetBufferPointer(), cbCode, &cbRead, nullptr) && cbRead == cbCode))
+			hr = E_FAIL;
+		CloseHandle(hFile);
+
+		if (SUCCEEDED(hr))
+			*ppBlob = pBlob.Detach();
+		return hr;
+	}
+
+	// Written to a temporary file and renamed, so a second instance never reads half an entry
+	static void WriteCached(const std::wstring& strPath, const ShaderHeader& header, ID3DBlob* pBlob)
+	{
+		std::wstring strTemp = strPath + L".tmp";
+		HANDLE hFile = CreateFileW(strTemp.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (hFile == INVALID_HANDLE_VALUE)
+			return;
+
+		DWORD cbWritten = 0;
+		DWORD cbCode = static_cast<DWORD>(pBlob->GetBufferSize());
+		bool bWritten = WriteFile(hFile, &header, sizeof(header), &cbWritten, nullptr) && cbWritten == sizeof(header)
+			&& WriteFile(hFile, pBlob->GetBufferPointer(), cbCode, &cbWritten, nullptr) && cbWritten == cbCode;
+		CloseHandle(hFile);
+
+		if (!bWritten || !MoveFileExW(strTemp.c_str(), strPath.c_str(), MOVEFILE_REPLACE_EXISTING))
+			DeleteFileW(strTemp.c_str());
+	}
+
+	HRESULT LoadShader(const wchar_t* wszFxFile, LPCSTR szEntryPoint, LPCSTR szShaderModel, ID3DBlob** ppBlob, bool* pbCached)
+	{
+		DIVE_TRACE_SCOPE("LoadShader");
+
+		if (pbCached)
+			*pbCached = false;
+
+		ShaderHeader header = { kShaderMagic, CompileFlags(), {} };
+		std::wstring strPath;
+		if (GetFileStamp(wszFxFile, header.stamp))
+		{
+			strPath = CachePath(wszFxFile, szEntryPoint, szShaderModel);
+			if (!strPath.empty() && SUCCEEDED(ReadCached(strPath, header, ppBlob)))
+			{
+				if (pbCached)
+					*pbCached = true;
+				return S_OK;
+			}
+		}
+
+		HRESULT hr = CompileShaderFromFile(wszFxFile, szEntryPoint, szShaderModel, ppBlob);
+		if (SUCCEEDED(hr) && !strPath.empty())
+			WriteCached(strPath, header, *ppBlob);
+		return hr;
+	}
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <d3dcommon.h>
+
+namespace DIVE
+{
+	// Compiles a shader from its .fx file, or loads the bytecode compiled on an earlier run.
+	// Bytecode is kept under %LOCALAPPDATA%\DIVE\Shaders, one file per entry point and target,
+	// and goes stale when the source's size or write time or the compile flags change.
+	//
+	// Layout: header { 'DVSH', compile flags, source size, source write time }, then the bytecode.
+	HRESULT LoadShader(const wchar_t* wszFxFile, LPCSTR szEntryPoint, LPCSTR szShaderModel, ID3DBlob** ppBlob, bool* pbCached = nullptr);
+}
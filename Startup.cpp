@@ -0,0 +1,386 @@
+#include "stdafx.h"
+#include "Startup.h"
+#include "ImageLoader.h"
+#include "ShaderCache.h"
+#include "Trace.h"
+#include <algorithm>
+
+namespace DIVE
+{
+	StartupTimings::StartupTimings(bool bFromLaunch)
+		: m_tOrigin(std::chrono::steady_clock::now())
+		, m_fLaunch(0.0)
+	{
+		FILETIME ftCreate, ftExit, ftKernel, ftUser, ftNow;
+		if (bFromLaunch && GetProcessTimes(GetCurrentProcess(), &ftCreate, &ftExit, &ftKernel, &ftUser))
+		{
+			GetSystemTimePreciseAsFileTime(&ftNow);
+			ULARGE_INTEGER create = { ftCreate.dwLowDateTime, ftCreate.dwHighDateTime };
+			ULARGE_INTEGER now = { ftNow.dwLowDateTime, ftNow.dwHighDateTime };
+			if (now.QuadPart > create.QuadPart)
+				m_fLaunch = (now.QuadPart - create.QuadPart) / 10000.0;
+		}
+	}
+
+	StartupTimings::Phase::Phase(StartupTimings& timings, const wchar_t* wszName)
+		: m_timings(timings)
+		, m_strName(wszName)
+		, m_fStart(timings.Now())
+	{
+	}
+
+	StartupTimings::Phase::~Phase()
+	{
+		m_timings.Add(m_strName, m_fStart, m_timings.Now());
+	}
+
+	void StartupTimings::Mark(const wchar_t* wszName)
+	{
+		double fNow = Now();
+		Add(wszName, fNow, fNow);
+	}
+
+	double StartupTimings::Now() const
+	{
+		return m_fLaunch + std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_tOrigin).count();
+	}
+
+	double StartupTimings::Elapsed(const wchar_t* wszName) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (auto& entry : m_vecEntries)
+		{
+			if (entry.strName == wszName)
+				return entry.fEnd;
+		}
+		return -1.0;
+	}
+
+	void StartupTimings::Add(const std::wstring& strName, double fStart, double fEnd)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_vecEntries.push_back(Entry{ strName, fStart, fEnd, GetCurrentThreadId() });
+	}
+
+	// One line per phase in the order they started, from launch when that is known
+	std::wstring StartupTimings::Report() const
+	{
+		std::vector<Entry> vecEntries;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			vecEntries = m_vecEntries;
+		}
+		std::stable_sort(vecEntries.begin(), vecEntries.end(), [](const Entry& a, const Entry& b) { return a.fStart < b.fStart; });
+
+		std::wstring strReport;
+		wchar_t wszLine[256];
+		if (m_fLaunch > 0.0)
+		{
+			swprintf_s(wszLine, L"  %-24ls %8.1f ms\n", L"Launch", m_fLaunch);
+			strReport += wszLine;
+		}
+		for (auto& entry : vecEntries)
+		{
+			if (entry.fEnd > entry.fStart)
+				swprintf_s(wszLine, L"  %-24ls %8.1f ms  from %8.1f, %7.1f ms on thread %lu\n", entry.strName.c_str(), entry.fEnd, entry.fStart, entry.fEnd - entry.fStart, entry.dwThread);
+			else
+				swprintf_s(wszLine, L"  %-24ls %8.1f ms\n", entry.strName.c_str(), entry.fEnd);
+			strReport += wszLine;
+		}
+		return strReport;
+	}
+
+	bool CaptureDesktop(UINT nWidth, UINT nHeight, std::vector<BYTE>& vecPixels)
+	{
+		DIVE_TRACE_SCOPE("Capture Desktop");
+
+		HWND hDesktopWnd = GetDesktopWindow();
+		HDC hDesktopDC = GetDC(hDesktopWnd);
+		HDC hCaptureDC = CreateCompatibleDC(hDesktopDC);
+
+		BITMAPINFO bmi;
+
+		bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+		bmi.bmiHeader.biWidth = nWidth;
+		bmi.bmiHeader.biHeight = -static_cast<LONG>(nHeight);
+		bmi.bmiHeader.biPlanes = 1;
+		bmi.bmiHeader.biBitCount = 32;
+		bmi.bmiHeader.biCompression = BI_RGB;
+		bmi.bmiHeader.biSizeImage = 0;
+
+		void* pBackground = nullptr;
+		auto hBackground = CreateDIBSection(hDesktopDC, &bmi, DIB_RGB_COLORS, &pBackground, NULL, 0);
+		if (hBackground)
+		{
+			auto hOld = SelectObject(hCaptureDC, hBackground);
+			BitBlt(hCaptureDC, 0, 0, nWidth, nHeight, hDesktopDC, 0, 0, SRCCOPY | CAPTUREBLT);
+			SelectObject(hCaptureDC, hOld);
+		}
+		ReleaseDC(hDesktopWnd, hDesktopDC);
+		DeleteDC(hCaptureDC);
+		if (!hBackground)
+			return false;
+
+		size_t count = static_cast<size_t>(nWidth) * nHeight;
+		vecPixels.resize(count * 4);
+		const unsigned int* pSource = (const unsigned int*)pBackground;
+		unsigned int* pPixels = (unsigned int*)vecPixels.data();
+
+		BYTE r, g, b;
+		float fr, fg, fb, aver;
+		for (size_t i = 0; i < count; ++i)
+		{
+			r = ((*pSource >> 16) & 0xff);
+			g = ((*pSource >> 8) & 0xff);
+			b = ((*pSource >> 0) & 0xff);
+			aver = (r * 0.25f + g * 0.7f + b * 0.15f);
+
+			fr = (r + aver * 2) / 4.0f;
+			if (fr > 255.0f)
+				fr = 255;
+			fg = (g + aver * 2) / 4.0f;
+			if (fg > 255.0f)
+				fg = 255;
+			fb = (b + aver * 2) / 4.0f;
+			if (fb > 255.0f)
+				fb = 255;
+			r = (BYTE)fr;
+			g = (BYTE)fg;
+			b = (BYTE)fb;
+			*pPixels = (r << 16) | (g << 8) | b;
+			++pSource;
+			++pPixels;
+		}
+		DeleteObject(hBackground);
+		return true;
+	}
+
+	StartupTasks::StartupTasks(StartupTimings& timings)
+		: m_timings(timings)
+		, m_bPreviewDone(false)
+		, m_pPreview(nullptr)
+		, m_szFull()
+		, m_pFirst(nullptr)
+		, m_bFirstDone(false)
+		, m_bDesktop(false)
+		, m_hrShaders(E_PENDING)
+	{
+	}
+
+	StartupTasks::~StartupTasks()
+	{
+		for (std::thread* pThread : { &m_threadDecode, &m_threadCapture, &m_threadShaders })
+		{
+			if (pThread->joinable())
+				pThread->join();
+		}
+		if (m_pPreview)
+			m_pPreview->Release();
+		if (m_pFirst)
+			m_pFirst->Release();
+	}
+
+	void StartupTasks::DecodeFirst(ImageLoader& loader, const std::wstring& strFileName, bool bPreview)
+	{
+		m_threadDecode = std::thread([this, &loader, strFileName, bPreview]()
+		{
+			DIVE_TRACE_THREAD("Startup Decode");
+			CoInitializeEx(NULL, COINIT_MULTITHREADED);
+			if (bPreview)
+			{
+				StartupTimings::Phase phase(m_timings, L"Preview First");
+				SIZE szFull = {};
+				IWICBitmapSource* pPreview = loader.LoadPreview(strFileName.c_str(), szFull);
+				if (!pPreview)
+					phase.Rename(L"Preview First (none)");
+
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_pPreview = pPreview;
+				m_szFull = szFull;
+			}
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_bPreviewDone = true;
+			}
+			m_cvPreview.notify_all();
+			{
+				StartupTimings::Phase phase(m_timings, L"Decode First");
+				m_pFirst = loader.Load(strFileName.c_str());
+			}
+			m_bFirstDone = true;
+			CoUninitialize();
+		});
+	}
+
+	void StartupTasks::CaptureDesktop(UINT nWidth, UINT nHeight)
+	{
+		m_threadCapture = std::thread([this, nWidth, nHeight]()
+		{
+			DIVE_TRACE_THREAD("Startup Capture");
+			StartupTimings::Phase phase(m_timings, L"Capture Desktop");
+			m_bDesktop = DIVE::CaptureDesktop(nWidth, nHeight, m_vecDesktop);
+		});
+	}
+
+	void StartupTasks::LoadShaders(const std::wstring& strFxFile)
+	{
+		m_threadShaders = std::thread([this, strFxFile]()
+		{
+			DIVE_TRACE_THREAD("Startup Shaders");
+			StartupTimings::Phase phase(m_timings, L"Shaders");
+			bool bVertexCached = false, bPixelCached = false;
+			m_hrShaders = LoadShader(strFxFile.c_str(), "VS", "vs_4_0", &m_pVertexShader, &bVertexCached);
+			if (SUCCEEDED(m_hrShaders))
+				m_hrShaders = LoadShader(strFxFile.c_str(), "PS", "ps_4_0", &m_pPixelShader, &bPixelCached);
+			if (SUCCEEDED(m_hrShaders))
+				phase.Rename(bVertexCached && bPixelCached ? L"Shaders (cached)" : L"Shaders (compiled)");
+		});
+	}
+
+	void StartupTasks::Wait(std::thread& thread, const wchar_t* wszName)
+	{
+		if (!thread.joinable())
+			return;
+		StartupTimings::Phase phase(m_timings, wszName);
+		thread.join();
+	}
+
+	IWICBitmapSource* StartupTasks::TakePreview(SIZE& szFull)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (!m_threadDecode.joinable())
+			return nullptr;
+		if (!m_bPreviewDone)
+		{
+			StartupTimings::Phase phase(m_timings, L"Wait Preview");
+			m_cvPreview.wait(lock, [this]() { return m_bPreviewDone; });
+		}
+		IWICBitmapSource* pPreview = m_pPreview;
+		m_pPreview = nullptr;
+		szFull = m_szFull;
+		return pPreview;
+	}
+
+	IWICBitmapSource* StartupTasks::TakeFirst()
+	{
+		Wait(m_threadDecode, L"Wait Decode");
+		IWICBitmapSource* pFirst = m_pFirst;
+		m_pFirst = nullptr;
+		return pFirst;
+	}
+
+	bool StartupTasks::TakeDesktop(std::vector<BYTE>& vecPixels)
+	{
+		Wait(m_threadCapture, L"Wait Capture");
+		vecPixels.swap(m_vecDesktop);
+		return m_bDesktop;
+	}
+
+	HRESULT StartupTasks::TakeShaders(ID3DBlob** ppVertexShader, ID3DBlob** ppPixelShader)
+	{
+		Wait(m_threadShaders, L"Wait Shaders");
+		if (FAILED(m_hrShaders))
+			return m_hrShaders;
+		*ppVertexShader = m_pVertexShader.Detach();
+		*ppPixelShader = m_pPixelShader.Detach();
+		return S_OK;
+	}
+
+	static void StubDevice(StartupTimings& timings, DWORD dwDeviceMillis)
+	{
+		StartupTimings::Phase phase(timings, L"Device (stub)");
+		Sleep(dwDeviceMillis);
+	}
+
+	// The startup order of ImageViewer::Start with the device stubbed, or with bOverlap false
+	// the order it used to run in: device and shaders, desktop, then the first image
+	static double RunStartup(ImageLoader& loader, const std::wstring& strFileName, UINT nWidth, UINT nHeight, DWORD dwDeviceMillis, bool bOverlap, double& fPreview)
+	{
+		StartupTimings timings(false);
+		bool bDecoded = false;
+		{
+			StartupTasks tasks(timings);
+			std::vector<BYTE> vecDesktop;
+			CComPtr<ID3DBlob> pVertexShader, pPixelShader;
+			CComPtr<IWICBitmapSource> pFirst;
+
+			if (bOverlap)
+			{
+				tasks.DecodeFirst(loader, strFileName);
+				tasks.CaptureDesktop(nWidth, nHeight);
+				tasks.LoadShaders(L"DIVE.fx");
+				StubDevice(timings, dwDeviceMillis);
+				tasks.TakeShaders(&pVertexShader, &pPixelShader);
+				tasks.TakeDesktop(vecDesktop);
+
+				SIZE szFull;
+				CComPtr<IWICBitmapSource> pPreview;
+				pPreview.Attach(tasks.TakePreview(szFull));
+				if (pPreview)
+					timings.Mark(L"First Preview");
+			}
+			else
+			{
+				StubDevice(timings, dwDeviceMillis);
+				tasks.LoadShaders(L"DIVE.fx");
+				tasks.TakeShaders(&pVertexShader, &pPixelShader);
+				tasks.CaptureDesktop(nWidth, nHeight);
+				tasks.TakeDesktop(vecDesktop);
+				tasks.DecodeFirst(loader, strFileName, false);
+			}
+			pFirst.Attach(tasks.TakeFirst());
+			bDecoded = pFirst != nullptr;
+			timings.Mark(L"First Image");
+		}
+
+		wprintf(L"%ls:\n%ls", bOverlap ? L"overlapped" : L"sequential", timings.Report().c_str());
+		if (bOverlap)
+			fPreview = timings.Elapsed(L"First Preview");
+		return bDecoded ? timings.Elapsed(L"First Image") : -1.0;
+	}
+
+	int BenchmarkStartup(const std::wstring& strFileName)
+	{
+		DWORD dwDeviceMillis = 60;
+		wchar_t wszValue[32];
+		if (GetEnvironmentVariableW(L"DIVE_STUB_DEVICE_MS", wszValue, ARRAYSIZE(wszValue)))
+			dwDeviceMillis = static_cast<DWORD>(_wtoi(wszValue));
+
+		RECT rcWork;
+		SystemParametersInfo(SPI_GETWORKAREA, 0, &rcWork, 0);
+		UINT nWidth = static_cast<UINT>(rcWork.right - rcWork.left);
+		UINT nHeight = static_cast<UINT>(rcWork.bottom - rcWork.top);
+
+		// Once untimed, so both runs find the file and the shader cache warm
+		ImageLoader loader;
+		{
+			CComPtr<IWICBitmapSource> pImage;
+			pImage.Attach(loader.Load(strFileName.c_str()));
+			if (!pImage)
+			{
+				wprintf(L"%ls: cannot decode\n", strFileName.c_str());
+				return 1;
+			}
+			CComPtr<ID3DBlob> pShader;
+			bool bCached = false;
+			if (FAILED(LoadShader(L"DIVE.fx", "VS", "vs_4_0", &pShader, &bCached)))
+			{
+				wprintf(L"DIVE.fx: cannot compile; run from the folder that holds it\n");
+				return 1;
+			}
+			wprintf(L"%ls, %u x %u desktop, device stubbed at %lu ms, shaders %ls\n", strFileName.c_str(), nWidth, nHeight,
+				dwDeviceMillis, bCached ? L"were cached" : L"compiled now");
+		}
+
+		double fPreview = -1.0;
+		double fSequential = RunStartup(loader, strFileName, nWidth, nHeight, dwDeviceMillis, false, fPreview);
+		double fOverlapped = RunStartup(loader, strFileName, nWidth, nHeight, dwDeviceMillis, true, fPreview);
+		wprintf(L"first image after %.1f ms sequential, %.1f ms overlapped\n", fSequential, fOverlapped);
+		if (fPreview >= 0.0)
+			wprintf(L"preview on screen after %.1f ms overlapped\n", fPreview);
+		else
+			wprintf(L"no preview for this file\n");
+		fflush(stdout);
+		return fSequential < 0.0 || fOverlapped < 0.0 ? 1 : 0;
+	}
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <d3dcommon.h>
+
+namespace DIVE
+{
+	class ImageLoader;
+
+	// When each phase of startup ran, in milliseconds since the process was created, so time
+	// to first image can be followed from build to build
+	class StartupTimings
+	{
+	public:
+		// Times count from process creation, or with bFromLaunch false from construction
+		explicit StartupTimings(bool bFromLaunch = true);
+
+		// Times its own scope as one phase
+		class Phase
+		{
+		public:
+			Phase(StartupTimings& timings, const wchar_t* wszName);
+			~Phase();
+
+			// For a phase that only learns how it went once it is under way
+			void Rename(const wchar_t* wszName) { m_strName = wszName; }
+
+		private:
+			StartupTimings& m_timings;
+			std::wstring m_strName;
+			double m_fStart;
+		};
+
+		// A moment rather than a phase, such as the first image going on screen
+		void Mark(const wchar_t* wszName);
+
+		double Now() const;
+		double Elapsed(const wchar_t* wszName) const;		// end of the named phase or mark, or -1
+		std::wstring Report() const;
+
+	private:
+		struct Entry
+		{
+			std::wstring strName;
+			double fStart;
+			double fEnd;
+			DWORD dwThread;
+		};
+
+		void Add(const std::wstring& strName, double fStart, double fEnd);
+
+		std::chrono::steady_clock::time_point m_tOrigin;
+		double m_fLaunch;			// process creation to m_tOrigin
+		mutable std::mutex m_mutex;
+		std::vector<Entry> m_vecEntries;
+	};
+
+	// Blends the desktop into the tinted backdrop the viewer draws behind images, as
+	// 32bpp BGRA with nWidth * 4 bytes per row
+	bool CaptureDesktop(UINT nWidth, UINT nHeight, std::vector<BYTE>& vecPixels);
+
+	// The parts of startup that do not need the window or the device, each on its own thread.
+	// The Take calls wait for their phase; time spent waiting is timed as a phase of its own,
+	// which is what is left of it on the critical path.
+	class StartupTasks
+	{
+	public:
+		explicit StartupTasks(StartupTimings& timings);
+		~StartupTasks();
+
+		// With bPreview the file's preview, when it has one, is ready first
+		void DecodeFirst(ImageLoader& loader, const std::wstring& strFileName, bool bPreview = true);
+		void CaptureDesktop(UINT nWidth, UINT nHeight);
+		void LoadShaders(const std::wstring& strFxFile);
+
+		// The caller owns the images; null when there is no preview, or the file could not be
+		// decoded. TakePreview only waits for the preview.
+		IWICBitmapSource* TakePreview(SIZE& szFull);
+		IWICBitmapSource* TakeFirst();
+		bool FirstReady() const { return m_bFirstDone; }
+		bool TakeDesktop(std::vector<BYTE>& vecPixels);
+		HRESULT TakeShaders(ID3DBlob** ppVertexShader, ID3DBlob** ppPixelShader);
+
+	private:
+		void Wait(std::thread& thread, const wchar_t* wszName);
+
+		StartupTimings& m_timings;
+
+		std::thread m_threadDecode;
+		std::mutex m_mutex;
+		std::condition_variable m_cvPreview;
+		bool m_bPreviewDone;
+		IWICBitmapSource* m_pPreview;
+		SIZE m_szFull;
+		IWICBitmapSource* m_pFirst;
+		std::atomic<bool> m_bFirstDone;
+
+		std::thread m_threadCapture;
+		std::vector<BYTE> m_vecDesktop;
+		bool m_bDesktop;
+
+		std::thread m_threadShaders;
+		CComPtr<ID3DBlob> m_pVertexShader;
+		CComPtr<ID3DBlob> m_pPixelShader;
+		HRESULT m_hrShaders;
+	};
+
+	// Headless /startup-bench mode: runs the startup phases one after the other and then
+	// overlapped with a preview first, with device creation stubbed out by a wait of
+	// DIVE_STUB_DEVICE_MS (default 60), and prints when each ended; returns the process exit code
+	int BenchmarkStartup(const std::wstring& strFileName);
+}
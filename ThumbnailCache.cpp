@@ -0,0 +1,216 @@
+#include "stdafx.h"
+#include "ThumbnailCache.h"
+#include "Lz4.h"
+#include <algorithm>
+#include <cwctype>
+
+namespace DIVE
+{
+	static const uint32_t kMagic = 'HTVD';		// "DVTH" in the file
+	static const uint32_t kVersion = 1;
+	static const UINT kMaxNameChars = 32768;
+
+#pragma pack(push, 1)
+	struct ThumbnailFileHeader
+	{
+		uint32_t nMagic;
+		uint32_t nVersion;
+		uint32_t nWidth;
+		uint32_t nHeight;
+	};
+
+	struct ThumbnailRecordStamp
+	{
+		uint64_t nSize;
+		uint64_t nLastWrite;
+		uint32_t cbPayload;
+	};
+#pragma pack(pop)
+
+	const wchar_t* const ThumbnailCache::kFileName = L"DIVE.thumbs";
+
+	// File names compare case-insensitively, as on the file system
+	static std::wstring FoldCase(const std::wstring& strName)
+	{
+		std::wstring strFolded(strName);
+		std::transform(strFolded.begin(), strFolded.end(), strFolded.begin(), [](wchar_t c) { return static_cast<wchar_t>(std::towlower(c)); });
+		return strFolded;
+	}
+
+	static bool ReadAt(HANDLE hFile, uint64_t nOffset, void* pBuffer, DWORD cbBuffer)
+	{
+		// Positional reads, so concurrent readers never race on a shared file pointer
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = static_cast<DWORD>(nOffset);
+		overlapped.OffsetHigh = static_cast<DWORD>(nOffset >> 32);
+		DWORD cbRead = 0;
+		return ReadFile(hFile, pBuffer, cbBuffer, &cbRead, &overlapped) && cbRead == cbBuffer;
+	}
+
+	bool GetFileStamp(const std::wstring& strPath, FileStamp& stamp)
+	{
+		WIN32_FILE_ATTRIBUTE_DATA fad;
+		if (!GetFileAttributesEx(strPath.c_str(), GetFileExInfoStandard, &fad))
+			return false;
+		stamp.nSize = (static_cast<uint64_t>(fad.nFileSizeHigh) << 32) | fad.nFileSizeLow;
+		stamp.nLastWrite = (static_cast<uint64_t>(fad.ftLastWriteTime.dwHighDateTime) << 32) | fad.ftLastWriteTime.dwLowDateTime;
+		return true;
+	}
+
+	ThumbnailCache::ThumbnailCache()
+		: m_hFile(INVALID_HANDLE_VALUE)
+		, m_nWidth(0)
+		, m_nHeight(0)
+	{
+	}
+
+	ThumbnailCache::~ThumbnailCache()
+	{
+		Close();
+	}
+
+	bool ThumbnailCache::Open(const std::wstring& strFolder, UINT nWidth, UINT nHeight)
+	{
+		Close();
+
+		m_hFile = CreateFile((strFolder + kFileName).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+			nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (m_hFile == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER liSize;
+		ThumbnailFileHeader header;
+		if (!GetFileSizeEx(m_hFile, &liSize) || !ReadAt(m_hFile, 0, &header, sizeof(header))
+			|| header.nMagic != kMagic || header.nVersion != kVersion || header.nWidth != nWidth || header.nHeight != nHeight)
+		{
+			Close();
+			return false;
+		}
+		m_nWidth = nWidth;
+		m_nHeight = nHeight;
+
+		// A truncated tail (interrupted copy) just ends the index
+		uint64_t nFileSize = static_cast<uint64_t>(liSize.QuadPart);
+		uint64_t nOffset = sizeof(header);
+		std::wstring strName;
+		while (nOffset + sizeof(uint32_t) <= nFileSize)
+		{
+			uint32_t nNameChars = 0;
+			if (!ReadAt(m_hFile, nOffset, &nNameChars, sizeof(nNameChars)) || nNameChars == 0 || nNameChars > kMaxNameChars)
+				break;
+			nOffset += sizeof(nNameChars);
+
+			strName.resize(nNameChars);
+			ThumbnailRecordStamp record;
+			if (!ReadAt(m_hFile, nOffset, &strName[0], nNameChars * sizeof(wchar_t))
+				|| !ReadAt(m_hFile, nOffset + nNameChars * sizeof(wchar_t), &record, sizeof(record)))
+				break;
+			nOffset += nNameChars * sizeof(wchar_t) + sizeof(record);
+			if (nOffset + record.cbPayload > nFileSize)
+				break;
+
+			m_mapEntries[FoldCase(strName)] = Entry{ { record.nSize, record.nLastWrite }, nOffset, record.cbPayload };
+			nOffset += record.cbPayload;
+		}
+		return true;
+	}
+
+	void ThumbnailCache::Close()
+	{
+		if (m_hFile != INVALID_HANDLE_VALUE)
+			CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
+		m_mapEntries.clear();
+	}
+
+	bool ThumbnailCache::ReadCompressed(const std::wstring& strFileName, const FileStamp& stamp, std::vector<BYTE>& vecPayload) const
+	{
+		auto it = m_mapEntries.find(FoldCase(strFileName));
+		if (it == m_mapEntries.end() || !(it->second.stamp == stamp))
+			return false;
+
+		vecPayload.resize(it->second.cbPayload);
+		return ReadAt(m_hFile, it->second.nOffset, vecPayload.data(), it->second.cbPayload);
+	}
+
+	bool ThumbnailCache::Read(const std::wstring& strPath, BYTE* pPixels) const
+	{
+		if (m_hFile == INVALID_HANDLE_VALUE)
+			return false;
+
+		FileStamp stamp;
+		std::vector<BYTE> vecPayload;
+		size_t nSlash = strPath.find_last_of(L"\\/");
+		if (!GetFileStamp(strPath, stamp)
+			|| !ReadCompressed(nSlash == std::wstring::npos ? strPath : strPath.substr(nSlash + 1), stamp, vecPayload))
+			return false;
+
+		size_t cbPixels = static_cast<size_t>(m_nWidth) * m_nHeight * 4;
+		return Lz4::Decompress(vecPayload.data(), vecPayload.size(), pPixels, cbPixels) == cbPixels;
+	}
+
+	ThumbnailWriter::ThumbnailWriter()
+		: m_hFile(INVALID_HANDLE_VALUE)
+		, m_bFailed(false)
+	{
+	}
+
+	ThumbnailWriter::~ThumbnailWriter()
+	{
+		// Not committed: drop the partial file
+		if (m_hFile != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(m_hFile);
+			DeleteFile(m_strTempPath.c_str());
+		}
+	}
+
+	bool ThumbnailWriter::Create(const std::wstring& strFolder, UINT nWidth, UINT nHeight)
+	{
+		m_strPath = strFolder + ThumbnailCache::kFileName;
+		m_strTempPath = m_strPath + L".tmp";
+		m_hFile = CreateFile(m_strTempPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (m_hFile == INVALID_HANDLE_VALUE)
+			return false;
+
+		ThumbnailFileHeader header = { kMagic, kVersion, nWidth, nHeight };
+		return Write(&header, sizeof(header));
+	}
+
+	bool ThumbnailWriter::Add(const std::wstring& strFileName, const FileStamp& stamp, const BYTE* pPayload, size_t cbPayload)
+	{
+		uint32_t nNameChars = static_cast<uint32_t>(strFileName.size());
+		ThumbnailRecordStamp record = { stamp.nSize, stamp.nLastWrite, static_cast<uint32_t>(cbPayload) };
+		if (nNameChars == 0 || nNameChars > kMaxNameChars)
+			return false;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return Write(&nNameChars, sizeof(nNameChars))
+			&& Write(strFileName.data(), nNameChars * sizeof(wchar_t))
+			&& Write(&record, sizeof(record))
+			&& Write(pPayload, cbPayload);
+	}
+
+	bool ThumbnailWriter::Commit()
+	{
+		if (m_hFile == INVALID_HANDLE_VALUE)
+			return false;
+
+		CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
+		if (m_bFailed || !MoveFileEx(m_strTempPath.c_str(), m_strPath.c_str(), MOVEFILE_REPLACE_EXISTING))
+		{
+			DeleteFile(m_strTempPath.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	bool ThumbnailWriter::Write(const void* pData, size_t cbData)
+	{
+		DWORD cbWritten = 0;
+		if (m_bFailed || !WriteFile(m_hFile, pData, static_cast<DWORD>(cbData), &cbWritten, nullptr) || cbWritten != cbData)
+			m_bFailed = true;
+		return !m_bFailed;
+	}
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <cstdint>
+
+namespace DIVE
+{
+	const UINT kThumbnailWidth = 120;
+	const UINT kThumbnailHeight = 90;
+
+	// Size and last write time a cached thumbnail was made from
+	struct FileStamp
+	{
+		uint64_t nSize;
+		uint64_t nLastWrite;
+
+		bool operator==(const FileStamp& other) const { return nSize == other.nSize && nLastWrite == other.nLastWrite; }
+	};
+
+	bool GetFileStamp(const std::wstring& strPath, FileStamp& stamp);
+
+	// Thumbnails of one folder, in a single file next to the images so a share that was
+	// pre-warmed opens without decoding. Entries are keyed by file name and go stale when
+	// the file's size or write time changes. Pixels are 32bpp premultiplied BGRA, LZ4
+	// compressed per entry.
+	//
+	// Layout: header { 'DVTH', version, width, height }, then one record per image:
+	// { name length, UTF-16 name, size, last write time, compressed bytes, payload }.
+	class ThumbnailCache
+	{
+	public:
+		static const wchar_t* const kFileName;
+
+		ThumbnailCache();
+		~ThumbnailCache();
+
+		// Indexes the cache of strFolder (ending in a separator). Only the record headers are
+		// read; false when there is no cache at this thumbnail size.
+		bool Open(const std::wstring& strFolder, UINT nWidth, UINT nHeight);
+		void Close();
+
+		// Compressed payload for strFileName (no folder) when the entry matches stamp
+		bool ReadCompressed(const std::wstring& strFileName, const FileStamp& stamp, std::vector<BYTE>& vecPayload) const;
+
+		// Expands the entry for strPath into nWidth * nHeight * 4 bytes
+		bool Read(const std::wstring& strPath, BYTE* pPixels) const;
+
+	private:
+		struct Entry
+		{
+			FileStamp stamp;
+			uint64_t nOffset;
+			UINT cbPayload;
+		};
+
+		HANDLE m_hFile;
+		UINT m_nWidth;
+		UINT m_nHeight;
+		std::unordered_map<std::wstring, Entry> m_mapEntries;
+	};
+
+	// Streams records into a temporary file and replaces the folder's cache on Commit, so
+	// readers never see a half-written cache and memory stays flat however large the folder.
+	class ThumbnailWriter
+	{
+	public:
+		ThumbnailWriter();
+		~ThumbnailWriter();
+
+		bool Create(const std::wstring& strFolder, UINT nWidth, UINT nHeight);
+
+		// Thread safe
+		bool Add(const std::wstring& strFileName, const FileStamp& stamp, const BYTE* pPayload, size_t cbPayload);
+
+		bool Commit();
+
+	private:
+		bool Write(const void* pData, size_t cbData);
+
+		std::mutex m_mutex;
+		HANDLE m_hFile;
+		std::wstring m_strPath;
+		std::wstring m_strTempPath;
+		bool m_bFailed;
+	};
+}
@@ -0,0 +1,149 @@
+#include "stdafx.h"
+#include "ToneMap.h"
+#include <tmmintrin.h>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+namespace DIVE
+{
+	static const int kEncodeBits = 12;
+
+	// Linear [0, 1] in 4096 steps to the sRGB transfer curve, 0-255 as float
+	struct EncodeTable
+	{
+		float values[(1 << kEncodeBits) + 1];
+
+		EncodeTable()
+		{
+			for (int i = 0; i <= (1 << kEncodeBits); ++i)
+			{
+				double v = static_cast<double>(i) / (1 << kEncodeBits);
+				double s = v <= 0.0031308 ? v * 12.92 : 1.055 * std::pow(v, 1.0 / 2.4) - 0.055;
+				values[i] = static_cast<float>(s * 255.0);
+			}
+		}
+	};
+
+	static const EncodeTable& GetEncodeTable()
+	{
+		static const EncodeTable s_table;
+		return s_table;
+	}
+
+	// Four halves (zero-extended to 32 bits) to floats. Exact, including denormals, infinities and NaN.
+	static __m128 HalfToFloat(__m128i h)
+	{
+		const __m128i maskNoSign = _mm_set1_epi32(0x7fff);
+		const __m128 magic = _mm_castsi128_ps(_mm_set1_epi32((254 - 15) << 23));
+		const __m128i wasInfNan = _mm_set1_epi32(0x7bff);
+		const __m128i expInfNan = _mm_set1_epi32(255 << 23);
+
+		__m128i expMant = _mm_and_si128(maskNoSign, h);
+		__m128i sign = _mm_slli_epi32(_mm_xor_si128(h, expMant), 16);
+		__m128 scaled = _mm_mul_ps(_mm_castsi128_ps(_mm_slli_epi32(expMant, 13)), magic);
+		__m128i infNan = _mm_and_si128(_mm_cmpgt_epi32(expMant, wasInfNan), expInfNan);
+		return _mm_or_ps(scaled, _mm_castsi128_ps(_mm_or_si128(sign, infNan)));
+	}
+
+	// Four pixels, as RGBA floats each, to premultiplied BGRA bytes. The curve applies to
+	// straight colour, so alpha is divided out first and multiplied back after.
+	static __m128i EncodePixels(__m128 p0, __m128 p1, __m128 p2, __m128 p3, float fExposure, const EncodeTable& table)
+	{
+		_MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+		__m128 r = p0, g = p1, b = p2;
+
+		// NaN alpha compares false and ends up transparent, like zero
+		__m128 a = _mm_min_ps(p3, _mm_set1_ps(1.0f));
+		__m128 visible = _mm_cmpgt_ps(a, _mm_setzero_ps());
+		__m128 scale = _mm_and_ps(visible, _mm_div_ps(_mm_set1_ps(fExposure * (1 << kEncodeBits)), _mm_max_ps(a, _mm_set1_ps(1e-8f))));
+
+		// Straight colour in table steps, clamped to [0, 1]; max/min order sends NaN to 0
+		__m128 limit = _mm_set1_ps(static_cast<float>(1 << kEncodeBits));
+		alignas(16) int32_t ri[4], gi[4], bi[4];
+		_mm_store_si128(reinterpret_cast<__m128i*>(ri), _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(r, scale), _mm_setzero_ps()), limit)));
+		_mm_store_si128(reinterpret_cast<__m128i*>(gi), _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(g, scale), _mm_setzero_ps()), limit)));
+		_mm_store_si128(reinterpret_cast<__m128i*>(bi), _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(b, scale), _mm_setzero_ps()), limit)));
+
+		const float* pTable = table.values;
+		__m128 re = _mm_setr_ps(pTable[ri[0]], pTable[ri[1]], pTable[ri[2]], pTable[ri[3]]);
+		__m128 ge = _mm_setr_ps(pTable[gi[0]], pTable[gi[1]], pTable[gi[2]], pTable[gi[3]]);
+		__m128 be = _mm_setr_ps(pTable[bi[0]], pTable[bi[1]], pTable[bi[2]], pTable[bi[3]]);
+
+		a = _mm_and_ps(visible, a);
+		__m128i r8 = _mm_cvtps_epi32(_mm_mul_ps(re, a));
+		__m128i g8 = _mm_cvtps_epi32(_mm_mul_ps(ge, a));
+		__m128i b8 = _mm_cvtps_epi32(_mm_mul_ps(be, a));
+		__m128i a8 = _mm_cvtps_epi32(_mm_mul_ps(a, _mm_set1_ps(255.0f)));
+
+		return _mm_or_si128(_mm_or_si128(b8, _mm_slli_epi32(g8, 8)), _mm_or_si128(_mm_slli_epi32(r8, 16), _mm_slli_epi32(a8, 24)));
+	}
+
+	static void ToneMapRows(const BYTE* pSource, UINT nSourceStride, BYTE* pDest, UINT nDestStride, UINT nWidth, UINT nHeight, float fExposure)
+	{
+		const EncodeTable& table = GetEncodeTable();
+
+		for (UINT y = 0; y < nHeight; ++y)
+		{
+			const BYTE* pIn = pSource + static_cast<size_t>(y) * nSourceStride;
+			BYTE* pOut = pDest + static_cast<size_t>(y) * nDestStride;
+
+			// Four pixels (32 bytes of halves) per step; the tail goes through a padded copy
+			for (UINT x = 0; x < nWidth; x += 4)
+			{
+				UINT nCount = nWidth - x < 4 ? nWidth - x : 4;
+				alignas(16) BYTE tail[32] = {};
+				const BYTE* pPixels = pIn + x * 8;
+				if (nCount < 4)
+				{
+					memcpy(tail, pPixels, nCount * 8);
+					pPixels = tail;
+				}
+
+				__m128i h01 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pPixels));
+				__m128i h23 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pPixels + 16));
+				__m128i zero = _mm_setzero_si128();
+				__m128i bgra = EncodePixels(
+					HalfToFloat(_mm_unpacklo_epi16(h01, zero)), HalfToFloat(_mm_unpackhi_epi16(h01, zero)),
+					HalfToFloat(_mm_unpacklo_epi16(h23, zero)), HalfToFloat(_mm_unpackhi_epi16(h23, zero)),
+					fExposure, table);
+
+				if (nCount == 4)
+				{
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(pOut + x * 4), bgra);
+				}
+				else
+				{
+					alignas(16) BYTE out[16];
+					_mm_store_si128(reinterpret_cast<__m128i*>(out), bgra);
+					memcpy(pOut + x * 4, out, nCount * 4);
+				}
+			}
+		}
+	}
+
+	void ToneMap(const BYTE* pSource, UINT nSourceStride, BYTE* pDest, UINT nDestStride, UINT nWidth, UINT nHeight, float fExposure)
+	{
+		// Runs on the UI thread while the view changes, so a full-screen region is split into
+		// bands of rows over all cores
+		GetEncodeTable();
+		UINT nThreads = std::max(1u, std::min(std::thread::hardware_concurrency(), static_cast<UINT>(static_cast<uint64_t>(nWidth) * nHeight >> 18)));
+		UINT nBand = (nHeight + nThreads - 1) / nThreads;
+
+		std::vector<std::thread> vecThreads;
+		for (UINT y = nBand; y < nHeight; y += nBand)
+		{
+			UINT nRows = std::min(nBand, nHeight - y);
+			vecThreads.emplace_back([=]()
+			{
+				ToneMapRows(pSource + static_cast<size_t>(y) * nSourceStride, nSourceStride, pDest + static_cast<size_t>(y) * nDestStride, nDestStride, nWidth, nRows, fExposure);
+			});
+		}
+		ToneMapRows(pSource, nSourceStride, pDest, nDestStride, nWidth, std::min(nBand, nHeight), fExposure);
+		for (auto& thread : vecThreads)
+			thread.join();
+	}
+}
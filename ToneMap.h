@@ -0,0 +1,9 @@
+#pragma once
+
+namespace DIVE
+{
+	// Converts 64bpp premultiplied half-float RGBA (scRGB, linear light) to 32bpp premultiplied
+	// BGRA (sRGB). Colour is scaled by fExposure and clamped; alpha is kept. Only meant for the
+	// region that is actually on screen, so the cache can keep the half-float source.
+	void ToneMap(const BYTE* pSource, UINT nSourceStride, BYTE* pDest, UINT nDestStride, UINT nWidth, UINT nHeight, float fExposure);
+}
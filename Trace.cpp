@@ -0,0 +1,267 @@
+#include "stdafx.h"
+#include "Trace.h"
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <chrono>
+#include <stdio.h>
+
+namespace DIVE
+{
+	namespace Trace
+	{
+		// Each thread owns a ring of the most recent events. Recording is a plain store plus
+		// a release of the head counter, so the hot path never takes a lock or makes a syscall.
+		// A thread hands its ring back when it exits and the next new thread carries on in it,
+		// so short-lived workers share a few rings instead of using one each. The ring
+		// remembers its last few owners so Export still files older events under theirs.
+		static const size_t kEventsPerThread = 16384;
+		static const size_t kMaxThreads = 64;
+		static const size_t kOwnersPerBuffer = 64;
+
+		struct ThreadOwner
+		{
+			uint64_t ullStart;			// first event recorded by this thread
+			unsigned long ulThreadId;
+			char szName[32];
+		};
+
+		struct ThreadBuffer
+		{
+			std::atomic<bool> bInUse;
+			size_t nOwners;
+			ThreadOwner owners[kOwnersPerBuffer];
+			std::atomic<uint64_t> ullHead;
+			Event events[kEventsPerThread];
+		};
+
+		static std::mutex s_mutex;
+		static ThreadBuffer* s_buffers[kMaxThreads];
+		static size_t s_nBuffers = 0;
+		static std::atomic<uint64_t> s_ullDropped(0);
+
+		static const std::chrono::steady_clock::time_point s_tStart = std::chrono::steady_clock::now();
+
+		enum BufferState { kUnclaimed, kClaimed, kNoBuffer, kExited };
+
+		static thread_local BufferState t_nState = kUnclaimed;
+		static thread_local int t_nIndex = -1;
+
+		// Returns the ring when the thread exits; events stay in it until they are overwritten
+		struct BufferLease
+		{
+			ThreadBuffer* pBuffer = nullptr;
+
+			~BufferLease()
+			{
+				t_nState = kExited;
+				if (pBuffer)
+					pBuffer->bInUse.store(false, std::memory_order_release);
+			}
+		};
+
+		static thread_local BufferLease t_lease;
+
+		static ThreadBuffer* ClaimBuffer()
+		{
+			std::lock_guard<std::mutex> lock(s_mutex);
+
+			ThreadBuffer* pBuffer = nullptr;
+			for (size_t i = 0; i < s_nBuffers && !pBuffer; ++i)
+			{
+				if (!s_buffers[i]->bInUse.load(std::memory_order_acquire))
+					pBuffer = s_buffers[i];
+			}
+			if (!pBuffer)
+			{
+				if (s_nBuffers == kMaxThreads)
+					return nullptr;
+
+				pBuffer = new ThreadBuffer;
+				pBuffer->nOwners = 0;
+				pBuffer->ullHead.store(0, std::memory_order_relaxed);
+				s_buffers[s_nBuffers++] = pBuffer;
+			}
+
+			pBuffer->bInUse.store(true, std::memory_order_relaxed);
+			ThreadOwner& owner = pBuffer->owners[pBuffer->nOwners++ % kOwnersPerBuffer];
+			owner.ullStart = pBuffer->ullHead.load(std::memory_order_relaxed);
+			owner.ulThreadId = GetCurrentThreadId();
+			sprintf_s(owner.szName, "Thread %lu", owner.ulThreadId);
+			return pBuffer;
+		}
+
+		// Read once; the rings are not even allocated unless a trace was asked for
+		static const wchar_t* RequestedFile()
+		{
+			static const std::wstring s_strFile = []()
+			{
+				wchar_t wszFile[MAX_PATH] = {};
+				DWORD cch = GetEnvironmentVariableW(L"DIVE_TRACE_FILE", wszFile, MAX_PATH);
+				return std::wstring(cch && cch < MAX_PATH ? wszFile : L"");
+			}();
+			return s_strFile.empty() ? nullptr : s_strFile.c_str();
+		}
+
+		static ThreadBuffer* GetThreadBuffer()
+		{
+			if (t_nState == kClaimed)
+				return t_lease.pBuffer;
+			if (t_nState != kUnclaimed)
+				return nullptr;
+
+			if (!RequestedFile())
+				return nullptr;
+
+			// Tracing after the lease was destroyed must not bring it back
+			ThreadBuffer* pBuffer = ClaimBuffer();
+			t_nState = pBuffer ? kClaimed : kNoBuffer;
+			t_lease.pBuffer = pBuffer;
+			return pBuffer;
+		}
+
+		uint64_t Now()
+		{
+			return std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now() - s_tStart).count();
+		}
+
+		void Record(const Event& evt)
+		{
+			ThreadBuffer* pBuffer = GetThreadBuffer();
+			if (!pBuffer)
+			{
+				if (t_nState == kNoBuffer)
+					s_ullDropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+
+			uint64_t ullHead = pBuffer->ullHead.load(std::memory_order_relaxed);
+			pBuffer->events[ullHead % kEventsPerThread] = evt;
+			pBuffer->ullHead.store(ullHead + 1, std::memory_order_release);
+		}
+
+		void Instant(const char* szName, int nIndex, uint64_t ullBytes)
+		{
+			Record(Event{ szName, 'i', nIndex, Now(), 0, ullBytes, 0.0 });
+		}
+
+		void Counter(const char* szName, double dValue)
+		{
+			Record(Event{ szName, 'C', -1, Now(), 0, 0, dValue });
+		}
+
+		void SetThreadName(const char* szName)
+		{
+			ThreadBuffer* pBuffer = GetThreadBuffer();
+			if (pBuffer)
+				strncpy_s(pBuffer->owners[(pBuffer->nOwners - 1) % kOwnersPerBuffer].szName, szName, _TRUNCATE);
+		}
+
+		int CurrentIndex()
+		{
+			return t_nIndex;
+		}
+
+		Context::Context(int nIndex)
+			: m_nPrevIndex(t_nIndex)
+		{
+			t_nIndex = nIndex;
+		}
+
+		Context::~Context()
+		{
+			t_nIndex = m_nPrevIndex;
+		}
+
+		Span::Span(const char* szName, int nIndex, uint64_t ullBytes)
+			: m_szName(szName)
+			, m_nIndex(nIndex)
+			, m_ullBytes(ullBytes)
+			, m_ullBegin(Now())
+		{
+		}
+
+		Span::~Span()
+		{
+			Record(Event{ m_szName, 'X', m_nIndex, m_ullBegin, Now() - m_ullBegin, m_ullBytes, 0.0 });
+		}
+
+		bool ExportRequested()
+		{
+			const wchar_t* wszFile = RequestedFile();
+			return wszFile && Export(wszFile);
+		}
+
+		bool Export(const wchar_t* wszFileName)
+		{
+			FILE* fp = _wfopen(wszFileName, L"wt");
+			if (!fp)
+				return false;
+
+			unsigned long ulProcessId = GetCurrentProcessId();
+			bool bFirst = true;
+
+			fprintf(fp, "{\"traceEvents\":[\n");
+
+			std::lock_guard<std::mutex> lock(s_mutex);
+			for (size_t i = 0; i < s_nBuffers; ++i)
+			{
+				ThreadBuffer* pBuffer = s_buffers[i];
+				size_t nOldest = pBuffer->nOwners > kOwnersPerBuffer ? pBuffer->nOwners - kOwnersPerBuffer : 0;
+				for (size_t o = nOldest; o < pBuffer->nOwners; ++o)
+				{
+					const ThreadOwner& owner = pBuffer->owners[o % kOwnersPerBuffer];
+					fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":%lu,\"args\":{\"name\":\"%s\"}}",
+						bFirst ? "" : ",\n", ulProcessId, owner.ulThreadId, owner.szName);
+					bFirst = false;
+				}
+
+				uint64_t ullHead = pBuffer->ullHead.load(std::memory_order_acquire);
+				uint64_t ullTail = ullHead > kEventsPerThread ? ullHead - kEventsPerThread : 0;
+
+				// Events older than the owners still remembered are skipped
+				size_t nOwner = nOldest;
+				for (uint64_t n = ullTail; n < ullHead; ++n)
+				{
+					while (nOwner + 1 < pBuffer->nOwners && pBuffer->owners[(nOwner + 1) % kOwnersPerBuffer].ullStart <= n)
+						++nOwner;
+					if (pBuffer->owners[nOwner % kOwnersPerBuffer].ullStart > n)
+						continue;
+
+					unsigned long ulThreadId = pBuffer->owners[nOwner % kOwnersPerBuffer].ulThreadId;
+					const Event& evt = pBuffer->events[n % kEventsPerThread];
+
+					switch (evt.chPhase)
+					{
+					case 'X':
+						fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%lu,\"tid\":%lu,\"ts\":%llu,\"dur\":%llu,\"args\":{\"index\":%d,\"bytes\":%llu}}",
+							evt.szName, ulProcessId, ulThreadId, evt.ullBegin, evt.ullDuration, evt.nIndex, evt.ullBytes);
+						break;
+					case 'i':
+						fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%lu,\"tid\":%lu,\"ts\":%llu,\"args\":{\"index\":%d,\"bytes\":%llu}}",
+							evt.szName, ulProcessId, ulThreadId, evt.ullBegin, evt.nIndex, evt.ullBytes);
+						break;
+					case 'C':
+						fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"pid\":%lu,\"tid\":%lu,\"ts\":%llu,\"args\":{\"value\":%f}}",
+							evt.szName, ulProcessId, ulThreadId, evt.ullBegin, evt.dValue);
+						break;
+					}
+				}
+			}
+
+			// Threads that found every ring taken
+			uint64_t ullDropped = s_ullDropped.load(std::memory_order_relaxed);
+			if (ullDropped)
+			{
+				fprintf(fp, "%s{\"name\":\"Trace Dropped Events\",\"ph\":\"i\",\"s\":\"g\",\"pid\":%lu,\"tid\":0,\"ts\":%llu,\"args\":{\"count\":%llu}}",
+					bFirst ? "" : ",\n", ulProcessId, Now(), ullDropped);
+			}
+
+			fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+			fclose(fp);
+
+			return true;
+		}
+	}
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstdint>
+
+// Set DIVE_TRACE_ENABLED to 0 in the preprocessor definitions to compile every
+// trace macro away. Compiled in, events are only recorded when DIVE_TRACE_FILE names
+// the file ExportRequested writes them to.
+#ifndef DIVE_TRACE_ENABLED
+#define DIVE_TRACE_ENABLED 1
+#endif
+
+namespace DIVE
+{
+	namespace Trace
+	{
+		struct Event
+		{
+			const char* szName;			// must outlive the process (string literal)
+			char chPhase;				// 'X' span, 'i' instant, 'C' counter
+			int nIndex;					// file index, -1 if none
+			uint64_t ullBegin;			// microseconds since start
+			uint64_t ullDuration;
+			uint64_t ullBytes;
+			double dValue;
+		};
+
+		uint64_t Now();
+		void Record(const Event& evt);
+		void Instant(const char* szName, int nIndex, uint64_t ullBytes = 0);
+		void Counter(const char* szName, double dValue);
+		void SetThreadName(const char* szName);
+
+		// Writes every buffered event as Chrome trace-event JSON (chrome://tracing, Perfetto).
+		// Call after the worker threads have been joined.
+		bool Export(const wchar_t* wszFileName);
+
+		// Exports to DIVE_TRACE_FILE; false when it is not set
+		bool ExportRequested();
+
+		int CurrentIndex();
+
+		// Tags spans and instants recorded on this thread with a file index while in scope
+		class Context
+		{
+		public:
+			explicit Context(int nIndex);
+			~Context();
+
+		private:
+			int m_nPrevIndex;
+		};
+
+		class Span
+		{
+		public:
+			explicit Span(const char* szName, int nIndex = CurrentIndex(), uint64_t ullBytes = 0);
+			~Span();
+
+			void SetBytes(uint64_t ullBytes) { m_ullBytes = ullBytes; }
+
+		private:
+			const char* m_szName;
+			int m_nIndex;
+			uint64_t m_ullBytes;
+			uint64_t m_ullBegin;
+		};
+	}
+}
+
+#if DIVE_TRACE_ENABLED
+
+#define DIVE_TRACE_CONCAT_(a, b) a##b
+#define DIVE_TRACE_CONCAT(a, b) DIVE_TRACE_CONCAT_(a, b)
+
+#define DIVE_TRACE_SCOPE(...) DIVE::Trace::Span DIVE_TRACE_CONCAT(traceSpan_, __LINE__)(__VA_ARGS__)
+#define DIVE_TRACE_SPAN(var, ...) DIVE::Trace::Span var(__VA_ARGS__)
+#define DIVE_TRACE_BYTES(var, bytes) (var).SetBytes(bytes)
+#define DIVE_TRACE_CONTEXT(index) DIVE::Trace::Context DIVE_TRACE_CONCAT(traceContext_, __LINE__)(index)
+#define DIVE_TRACE_INSTANT(name, index) DIVE::Trace::Instant(name, index)
+#define DIVE_TRACE_COUNTER(name, value) DIVE::Trace::Counter(name, static_cast<double>(value))
+#define DIVE_TRACE_THREAD(name) DIVE::Trace::SetThreadName(name)
+
+#else
+
+#define DIVE_TRACE_SCOPE(...) ((void)0)
+#define DIVE_TRACE_SPAN(var, ...) ((void)0)
+#define DIVE_TRACE_BYTES(var, bytes) ((void)0)
+#define DIVE_TRACE_CONTEXT(index) ((void)0)
+#define DIVE_TRACE_INSTANT(name, index) ((void)0)
+#define DIVE_TRACE_COUNTER(name, value) ((void)0)
+#define DIVE_TRACE_THREAD(name) ((void)0)
+
+#endif
@@ -0,0 +1,391 @@
+#include "stdafx.h"
+#include "Uploader.h"
+#include "Trace.h"
+#include <algorithm>
+#include <stdio.h>
+
+namespace DIVE
+{
+	// Staging kept between uploads; the largest buffers are the ones worth keeping
+	static const size_t kStagingBudget = 256 << 20;
+
+	Uploader::Uploader()
+		: m_bStop(false)
+		, m_cbStaging(0)
+	{
+	}
+
+	Uploader::~Uploader()
+	{
+		Stop();
+	}
+
+	void Uploader::Start(std::unique_ptr<UploadDevice> pDevice)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_thread.joinable() || m_bStop)
+			return;
+		m_pDevice = std::move(pDevice);
+		m_thread = std::thread(&Uploader::Run, this);
+	}
+
+	void Uploader::Stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_bStop = true;
+			for (auto& queue : m_queues)
+				queue.clear();
+		}
+		m_cvWork.notify_one();
+		m_cvSpace.notify_all();
+		if (m_thread.joinable())
+			m_thread.join();
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_dequeResults.clear();
+		m_pDevice.reset();
+	}
+
+	void Uploader::Submit(UploadJob&& job, bool bReplace)
+	{
+		if (job.nKind >= kUploadKinds)
+			return;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_bStop)
+				return;
+			if (bReplace)
+				m_queues[job.nKind].clear();
+			m_queues[job.nKind].push_back(std::move(job));
+		}
+		m_cvWork.notify_one();
+	}
+
+	void Uploader::WaitBelow(UINT nKind, size_t nJobs)
+	{
+		if (nKind >= kUploadKinds)
+			return;
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_cvSpace.wait(lock, [&]() { return m_bStop || m_queues[nKind].size() < nJobs; });
+	}
+
+	bool Uploader::Complete(UploadResult& result)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_dequeResults.empty())
+				return false;
+			result = std::move(m_dequeResults.front());
+			m_dequeResults.pop_front();
+		}
+		m_cvWork.notify_one();
+		return true;
+	}
+
+	size_t Uploader::Queued()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		size_t nQueued = 0;
+		for (auto& queue : m_queues)
+			nQueued += queue.size();
+		return nQueued;
+	}
+
+	size_t Uploader::Finished()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_dequeResults.size();
+	}
+
+	size_t Uploader::StagingBytes()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_cbStaging;
+	}
+
+	// The smallest kept buffer that fits, or a new one
+	Uploader::Staging Uploader::AcquireStaging(size_t cbSize)
+	{
+		auto itBest = m_vecStaging.end();
+		for (auto it = m_vecStaging.begin(); it != m_vecStaging.end(); ++it)
+		{
+			if (it->cbSize >= cbSize && (itBest == m_vecStaging.end() || it->cbSize < itBest->cbSize))
+				itBest = it;
+		}
+		if (itBest == m_vecStaging.end())
+			return Staging{ std::unique_ptr<BYTE[]>(new BYTE[cbSize]), cbSize };
+
+		Staging staging = std::move(*itBest);
+		m_vecStaging.erase(itBest);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_cbStaging -= staging.cbSize;
+		return staging;
+	}
+
+	void Uploader::ReleaseStaging(Staging&& staging)
+	{
+		if (staging.cbSize > kStagingBudget)
+			return;
+
+		m_vecStaging.push_back(std::move(staging));
+		std::sort(m_vecStaging.begin(), m_vecStaging.end(), [](const Staging& a, const Staging& b) { return a.cbSize > b.cbSize; });
+
+		size_t cbKept = 0;
+		for (auto& kept : m_vecStaging)
+			cbKept += kept.cbSize;
+		while (cbKept > kStagingBudget)
+		{
+			cbKept -= m_vecStaging.back().cbSize;
+			m_vecStaging.pop_back();
+		}
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_cbStaging = cbKept;
+		DIVE_TRACE_COUNTER("Upload Staging MB", cbKept / 1048576.0);
+	}
+
+	UploadResult Uploader::Process(UploadJob& job)
+	{
+		DIVE_TRACE_SCOPE("Upload", job.nIndex, static_cast<uint64_t>(job.nPitch) * job.nRows);
+
+		UploadResult result;
+		result.nKind = job.nKind;
+		result.nIndex = job.nIndex;
+		result.nTag = job.nTag;
+
+		const BYTE* pData = job.pData;
+		Staging staging = {};
+		if (!pData && job.fill)
+		{
+			staging = AcquireStaging(static_cast<size_t>(job.nPitch) * job.nRows);
+			if (job.fill(staging.pBuffer.get()))
+				pData = staging.pBuffer.get();
+			else
+				result.hr = E_FAIL;
+		}
+
+		if (SUCCEEDED(result.hr))
+			result.hr = m_pDevice->Create(job, pData, result.pResource);
+
+		if (staging.pBuffer)
+			ReleaseStaging(std::move(staging));
+		return result;
+	}
+
+	void Uploader::Run()
+	{
+		DIVE_TRACE_THREAD("Upload");
+		m_pDevice->BeginThread();
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (!m_bStop)
+		{
+			if (m_dequeResults.size() >= kMaxResults)
+			{
+				m_cvWork.wait(lock);
+				continue;
+			}
+
+			std::deque<UploadJob>* pQueue = nullptr;
+			for (auto& queue : m_queues)
+			{
+				if (!queue.empty())
+				{
+					pQueue = &queue;
+					break;
+				}
+			}
+			if (!pQueue)
+			{
+				m_cvWork.wait(lock);
+				continue;
+			}
+
+			UploadJob job = std::move(pQueue->front());
+			pQueue->pop_front();
+			lock.unlock();
+			m_cvSpace.notify_all();
+
+			UploadResult result = Process(job);
+			job = UploadJob();		// lets go of the source before the result is seen
+
+			lock.lock();
+			m_dequeResults.push_back(std::move(result));
+			DIVE_TRACE_COUNTER("Uploads Waiting", m_dequeResults.size());
+		}
+
+		lock.unlock();
+		m_vecStaging.clear();
+		m_pDevice->EndThread();
+	}
+
+	FakeUploadDevice::FakeUploadDevice(std::shared_ptr<Log> pLog, std::chrono::microseconds delay)
+		: m_pLog(pLog)
+		, m_delay(delay)
+		, m_bBegun(false)
+	{
+	}
+
+	FakeUploadDevice::~FakeUploadDevice()
+	{
+		// Destroyed only once the upload thread is done with it
+		if (m_bBegun && !m_pLog->bEnded)
+			++m_pLog->nErrors;
+		m_pLog->bDestroyed = true;
+	}
+
+	void FakeUploadDevice::BeginThread()
+	{
+		m_thread = std::this_thread::get_id();
+		m_bBegun = true;
+	}
+
+	void FakeUploadDevice::EndThread()
+	{
+		if (std::this_thread::get_id() != m_thread)
+			++m_pLog->nErrors;
+		m_pLog->bEnded = true;
+	}
+
+	HRESULT FakeUploadDevice::Create(const UploadJob& job, const BYTE* pData, std::unique_ptr<UploadResource>& pResource)
+	{
+		if (!m_bBegun || m_pLog->bEnded || std::this_thread::get_id() != m_thread)
+			++m_pLog->nErrors;
+		for (UINT nRow = 0; pData && nRow < job.nRows; ++nRow)
+		{
+			if (pData[static_cast<size_t>(nRow) * job.nPitch] != static_cast<BYTE>(job.nTag))
+			{
+				++m_pLog->nErrors;
+				break;
+			}
+		}
+
+		std::this_thread::sleep_for(m_delay);
+		pResource.reset(new UploadResource);
+		++m_pLog->nCreated;
+		return S_OK;
+	}
+
+	bool FakeUploadDevice::FillPattern(const UploadJob& job, BYTE* pData)
+	{
+		for (UINT nRow = 0; nRow < job.nRows; ++nRow)
+			memset(pData + static_cast<size_t>(nRow) * job.nPitch, static_cast<BYTE>(job.nTag), job.nPitch);
+		return true;
+	}
+
+	static UploadJob MakeStressJob(UINT nKind, uint64_t nTag)
+	{
+		UploadJob job;
+		job.nKind = nKind;
+		job.nTag = nTag;
+		job.nWidth = 64;
+		job.nHeight = 64;
+		job.nPitch = 64 * 4;
+		job.nRows = 64;
+		return job;
+	}
+
+	int StressUploader(int nJobs)
+	{
+		static const size_t kThumbnailQueue = 8;
+
+		if (nJobs <= 0)
+			return 1;
+
+		// A thumbnail producer held back by WaitBelow, images replacing each other from the
+		// render thread, which takes results slower than they are made now and then
+		auto pLog = std::make_shared<FakeUploadDevice::Log>();
+		int nOrderErrors = 0;
+		size_t nMaxQueued = 0, nMaxFinished = 0;
+		int nThumbnails = 0, nImages = 0;
+		auto tStart = std::chrono::steady_clock::now();
+		{
+			Uploader uploader;
+
+			// Jobs submitted before Start wait for it
+			uploader.Submit(MakeStressJob(kUploadImage, 0));
+			uploader.Start(std::unique_ptr<UploadDevice>(new FakeUploadDevice(pLog, std::chrono::microseconds(100))));
+
+			std::atomic<size_t> nProducerMax(0);
+			std::thread producer([&]()
+			{
+				for (int i = 0; i < nJobs; ++i)
+				{
+					uploader.WaitBelow(kUploadThumbnail, kThumbnailQueue);
+					UploadJob job = MakeStressJob(kUploadThumbnail, i);
+					job.fill = [job](BYTE* pStaging) { return FakeUploadDevice::FillPattern(job, pStaging); };
+					uploader.Submit(std::move(job));
+					nProducerMax = std::max<size_t>(nProducerMax, uploader.Queued());
+				}
+			});
+
+			uint64_t nLastTag[kUploadKinds] = {};
+			bool bAny[kUploadKinds] = {};
+			std::shared_ptr<std::vector<BYTE>> pPixels;
+			for (int nFrame = 0; nThumbnails < nJobs; ++nFrame)
+			{
+				// The image on screen changes every few frames, and only the latest one counts
+				if (nFrame % 4 == 0)
+				{
+					UploadJob job = MakeStressJob(kUploadImage, nFrame + 1);
+					pPixels = std::make_shared<std::vector<BYTE>>(static_cast<size_t>(job.nPitch) * job.nRows);
+					FakeUploadDevice::FillPattern(job, pPixels->data());
+					job.pData = pPixels->data();
+					job.pKeep = pPixels;
+					uploader.Submit(std::move(job), true);
+				}
+
+				nMaxFinished = std::max(nMaxFinished, uploader.Finished());
+				UploadResult result;
+				while (uploader.Complete(result))
+				{
+					if (FAILED(result.hr) || !result.pResource || (bAny[result.nKind] && result.nTag <= nLastTag[result.nKind]))
+						++nOrderErrors;
+					bAny[result.nKind] = true;
+					nLastTag[result.nKind] = result.nTag;
+					if (result.nKind == kUploadThumbnail)
+						++nThumbnails;
+					else
+						++nImages;
+				}
+				std::this_thread::sleep_for(std::chrono::milliseconds(nFrame % 16 == 0 ? 20 : 1));
+			}
+			producer.join();
+			nMaxQueued = nProducerMax;
+		}
+		double fMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tStart).count();
+
+		// Stop with jobs queued, a resource being made and a producer blocked in WaitBelow
+		auto pStopLog = std::make_shared<FakeUploadDevice::Log>();
+		bool bStopOk = true;
+		{
+			Uploader uploader;
+			uploader.Start(std::unique_ptr<UploadDevice>(new FakeUploadDevice(pStopLog, std::chrono::milliseconds(5))));
+			std::thread producer([&]()
+			{
+				for (int i = 0; i < 1000; ++i)
+				{
+					uploader.WaitBelow(kUploadThumbnail, kThumbnailQueue);
+					uploader.Submit(MakeStressJob(kUploadThumbnail, i));
+				}
+			});
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			uploader.Stop();
+			producer.join();
+
+			uploader.Submit(MakeStressJob(kUploadImage, 0));
+			bStopOk = uploader.Queued() == 0 && uploader.Finished() == 0 && pStopLog->bEnded && pStopLog->bDestroyed;
+		}
+
+		bool bOk = nOrderErrors == 0 && pLog->nErrors == 0 && pStopLog->nErrors == 0 && bStopOk
+			&& nMaxQueued <= kThumbnailQueue + 2 && nMaxFinished <= Uploader::kMaxResults;
+		wprintf(L"%d thumbnails and %d images in %.0f ms, %d created\n", nThumbnails, nImages, fMs, pLog->nCreated.load());
+		wprintf(L"  at most %zu queued (limit %zu), %zu results waiting (limit %zu), %d out of order, %d device errors\n",
+			nMaxQueued, kThumbnailQueue + 2, nMaxFinished, Uploader::kMaxResults, nOrderErrors, pLog->nErrors.load());
+		wprintf(L"  stop under load: %d created before it, %ls\n", pStopLog->nCreated.load(), bStopOk && !pStopLog->nErrors ? L"clean" : L"FAILED");
+
+		fflush(stdout);
+		return bOk ? 0 : 1;
+	}
+}
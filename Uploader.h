@@ -0,0 +1,170 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace DIVE
+{
+	// Kinds of upload, in the order the upload thread takes them
+	enum UploadKind
+	{
+		kUploadImage,		// the image going on screen
+		kUploadView,		// pyramid levels and resampled views of it
+		kUploadThumbnail,
+		kUploadKinds
+	};
+
+	enum UploadFlags
+	{
+		kUploadBitmap = 1,		// a Direct2D bitmap for drawing
+		kUploadTexture = 2,		// a Direct3D texture with its mip chain
+	};
+
+	struct UploadJob
+	{
+		UINT nKind = kUploadImage;
+		int nIndex = -1;				// the caller's, handed back with the result
+		uint64_t nTag = 0;				// likewise
+		UINT nFlags = kUploadBitmap;
+		UINT nFormat = 0;				// DXGI_FORMAT of the pixels
+		UINT nWidth = 0;
+		UINT nHeight = 0;
+		UINT nPitch = 0;				// bytes per row, or per row of 4x4 blocks
+		UINT nRows = 0;					// rows of nPitch bytes
+
+		// Where the pixels come from: pData is uploaded as it is and kept alive by pKeep; fill
+		// writes nPitch * nRows bytes into a staging buffer on the upload thread. With neither
+		// the resource starts out empty.
+		const BYTE* pData = nullptr;
+		std::shared_ptr<const void> pKeep;
+		std::function<bool(BYTE* pStaging)> fill;
+	};
+
+	// What a device made; only the device that made it knows what it holds
+	class UploadResource
+	{
+	public:
+		virtual ~UploadResource() {}
+	};
+
+	struct UploadResult
+	{
+		UINT nKind = kUploadImage;
+		int nIndex = -1;
+		uint64_t nTag = 0;
+		HRESULT hr = S_OK;
+		std::unique_ptr<UploadResource> pResource;
+	};
+
+	// Creates GPU resources. Only ever called on the upload thread.
+	class UploadDevice
+	{
+	public:
+		virtual ~UploadDevice() {}
+
+		virtual void BeginThread() {}
+		virtual void EndThread() {}
+		virtual HRESULT Create(const UploadJob& job, const BYTE* pData, std::unique_ptr<UploadResource>& pResource) = 0;
+	};
+
+	// Stands in for the GPU in the headless /upload-stress mode and anywhere without one:
+	// takes a fixed time per resource and checks that it is called on the upload thread,
+	// between BeginThread and EndThread, with the pixels the job asked for
+	class FakeUploadDevice : public UploadDevice
+	{
+	public:
+		struct Log
+		{
+			std::atomic<int> nCreated{ 0 };
+			std::atomic<int> nErrors{ 0 };
+			std::atomic<bool> bEnded{ false };
+			std::atomic<bool> bDestroyed{ false };
+		};
+
+		FakeUploadDevice(std::shared_ptr<Log> pLog, std::chrono::microseconds delay);
+		~FakeUploadDevice() override;
+
+		void BeginThread() override;
+		void EndThread() override;
+		HRESULT Create(const UploadJob& job, const BYTE* pData, std::unique_ptr<UploadResource>& pResource) override;
+
+		// Pixels Create accepts: every row starts with the low byte of the job's tag
+		static bool FillPattern(const UploadJob& job, BYTE* pData);
+
+	private:
+		std::shared_ptr<Log> m_pLog;
+		std::chrono::microseconds m_delay;
+		std::thread::id m_thread;
+		bool m_bBegun;
+	};
+
+	// Funnels all GPU resource creation through one thread. Submit never waits for the device:
+	// jobs are queued by kind, pixels are staged in reused buffers on the upload thread, and
+	// finished resources wait in a completion queue for the render thread to take them. That
+	// queue holds at most kMaxResults; past it the upload thread waits for the render thread
+	// rather than piling up GPU memory nobody is taking.
+	class Uploader
+	{
+	public:
+		static const size_t kMaxResults = 64;
+
+		Uploader();
+		~Uploader();
+
+		// Jobs submitted before Start wait for it; after Stop they are dropped, as are queued
+		// jobs and results nobody took
+		void Start(std::unique_ptr<UploadDevice> pDevice);
+		void Stop();
+
+		// bReplace drops the jobs of the same kind that have not started yet
+		void Submit(UploadJob&& job, bool bReplace = false);
+
+		// For producers that may run far ahead, such as thumbnails; returns once fewer than
+		// nJobs of the kind are queued, or the uploader stops
+		void WaitBelow(UINT nKind, size_t nJobs);
+
+		// Render thread: the next finished upload, without waiting
+		bool Complete(UploadResult& result);
+
+		size_t Queued();
+		size_t Finished();
+		size_t StagingBytes();
+
+	private:
+		struct Staging
+		{
+			std::unique_ptr<BYTE[]> pBuffer;
+			size_t cbSize;
+		};
+
+		void Run();
+		UploadResult Process(UploadJob& job);
+		Staging AcquireStaging(size_t cbSize);
+		void ReleaseStaging(Staging&& staging);
+
+		std::mutex m_mutex;
+		std::condition_variable m_cvWork;
+		std::condition_variable m_cvSpace;
+		std::deque<UploadJob> m_queues[kUploadKinds];
+		std::deque<UploadResult> m_dequeResults;
+		bool m_bStop;
+		size_t m_cbStaging;			// read under m_mutex, written by the upload thread
+
+		std::unique_ptr<UploadDevice> m_pDevice;
+		std::thread m_thread;
+		std::vector<Staging> m_vecStaging;		// upload thread only
+	};
+
+	// Headless /upload-stress mode: nJobs uploads through a FakeUploadDevice, checking result
+	// order, back-pressure and the bounded result queue, then a Stop under load; returns the
+	// process exit code
+	int StressUploader(int nJobs);
+}